@@ -0,0 +1,498 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "compress-pool.h"
+#include "spice-bitmap-utils.h"
+
+typedef enum {
+    COMPRESS_JOB_QUEUED,
+    COMPRESS_JOB_RUNNING,
+    COMPRESS_JOB_DONE,
+} CompressJobState;
+
+struct CompressJob {
+    RingItem link;
+    CompressPool *pool;
+    CompressJobState state;
+    SpiceBitmap *src;
+    SpiceImageCompression compression;
+
+    int success;
+    uint8_t image_type;
+    RedCompressBuf *comp_buf;
+    uint32_t comp_buf_size;
+    stat_time_t compress_time; /* 0 if the probes were off */
+};
+
+typedef struct CompressThread {
+    CompressPool *pool;
+    pthread_t thread;
+
+    QuicData quic_data;
+    QuicContext *quic;
+    LzData lz_data;
+    LzContext *lz;
+#ifdef USE_LZ4
+    Lz4Data lz4_data;
+    Lz4EncoderContext *lz4;
+#endif
+} CompressThread;
+
+struct CompressPool {
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_cond; // signaled when a job is queued or on quit
+    pthread_cond_t done_cond; // signaled when a job is done
+    Ring jobs;                // queued jobs, oldest at the tail
+    int n_jobs;
+    int n_owned;              // jobs not taken or cancelled yet, in any state
+    int quit;
+
+    int n_threads;
+    CompressThread *threads;
+};
+
+static int compress_thread_quic(CompressThread *thread, CompressJob *job)
+{
+    QuicData *quic_data = &thread->quic_data;
+    SpiceBitmap *src = job->src;
+    volatile QuicImageType type;
+    int size, stride;
+
+    switch (src->format) {
+    case SPICE_BITMAP_FMT_32BIT:
+        type = QUIC_IMAGE_TYPE_RGB32;
+        break;
+    case SPICE_BITMAP_FMT_RGBA:
+        type = QUIC_IMAGE_TYPE_RGBA;
+        break;
+    case SPICE_BITMAP_FMT_16BIT:
+        type = QUIC_IMAGE_TYPE_RGB16;
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        type = QUIC_IMAGE_TYPE_RGB24;
+        break;
+    default:
+        return FALSE;
+    }
+
+    encoder_data_init(&quic_data->data, NULL);
+
+    if (setjmp(quic_data->data.jmp_env)) {
+        encoder_data_reset(&quic_data->data);
+        return FALSE;
+    }
+
+    quic_data->data.u.lines_data.chunks = src->data;
+    quic_data->data.u.lines_data.stride = src->stride;
+    if ((src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+        quic_data->data.u.lines_data.next = 0;
+        quic_data->data.u.lines_data.reverse = 0;
+        stride = src->stride;
+    } else {
+        quic_data->data.u.lines_data.next = src->data->num_chunks - 1;
+        quic_data->data.u.lines_data.reverse = 1;
+        stride = -src->stride;
+    }
+    size = quic_encode(thread->quic, type, src->x, src->y, NULL, 0, stride,
+                       quic_data->data.bufs_head->buf.words,
+                       G_N_ELEMENTS(quic_data->data.bufs_head->buf.words));
+
+    // the compressed buffer is bigger than the original data
+    if ((size << 2) > (src->y * src->stride)) {
+        longjmp(quic_data->data.jmp_env, 1);
+    }
+
+    job->image_type = SPICE_IMAGE_TYPE_QUIC;
+    job->comp_buf = quic_data->data.bufs_head;
+    job->comp_buf_size = size << 2;
+    return TRUE;
+}
+
+static int compress_thread_lz(CompressThread *thread, CompressJob *job)
+{
+    LzData *lz_data = &thread->lz_data;
+    SpiceBitmap *src = job->src;
+    LzImageType type;
+    int size;
+
+    switch (src->format) {
+    case SPICE_BITMAP_FMT_16BIT:
+        type = LZ_IMAGE_TYPE_RGB16;
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        type = LZ_IMAGE_TYPE_RGB24;
+        break;
+    case SPICE_BITMAP_FMT_32BIT:
+        type = LZ_IMAGE_TYPE_RGB32;
+        break;
+    case SPICE_BITMAP_FMT_RGBA:
+        type = LZ_IMAGE_TYPE_RGBA;
+        break;
+    default:
+        /* palette bitmaps need the client palette cache */
+        return FALSE;
+    }
+
+    encoder_data_init(&lz_data->data, NULL);
+
+    if (setjmp(lz_data->data.jmp_env)) {
+        encoder_data_reset(&lz_data->data);
+        return FALSE;
+    }
+
+    lz_data->data.u.lines_data.chunks = src->data;
+    lz_data->data.u.lines_data.stride = src->stride;
+    lz_data->data.u.lines_data.next = 0;
+    lz_data->data.u.lines_data.reverse = 0;
+
+    size = lz_encode(thread->lz, type, src->x, src->y,
+                     !!(src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN),
+                     NULL, 0, src->stride,
+                     lz_data->data.bufs_head->buf.bytes,
+                     sizeof(lz_data->data.bufs_head->buf));
+
+    // the compressed buffer is bigger than the original data
+    if (size > (src->y * src->stride)) {
+        longjmp(lz_data->data.jmp_env, 1);
+    }
+
+    job->image_type = SPICE_IMAGE_TYPE_LZ_RGB;
+    job->comp_buf = lz_data->data.bufs_head;
+    job->comp_buf_size = size;
+    return TRUE;
+}
+
+#ifdef USE_LZ4
+static int compress_thread_lz4(CompressThread *thread, CompressJob *job)
+{
+    Lz4Data *lz4_data = &thread->lz4_data;
+    SpiceBitmap *src = job->src;
+    int lz4_size;
+
+    encoder_data_init(&lz4_data->data, NULL);
+
+    if (setjmp(lz4_data->data.jmp_env)) {
+        encoder_data_reset(&lz4_data->data);
+        return FALSE;
+    }
+
+    lz4_data->data.u.lines_data.chunks = src->data;
+    lz4_data->data.u.lines_data.stride = src->stride;
+    lz4_data->data.u.lines_data.next = 0;
+    lz4_data->data.u.lines_data.reverse = 0;
+
+    lz4_size = lz4_encode(thread->lz4, src->y, src->stride, lz4_data->data.bufs_head->buf.bytes,
+                          sizeof(lz4_data->data.bufs_head->buf),
+                          src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
+
+    // the compressed buffer is bigger than the original data
+    if (lz4_size > (src->y * src->stride)) {
+        longjmp(lz4_data->data.jmp_env, 1);
+    }
+
+    job->image_type = SPICE_IMAGE_TYPE_LZ4;
+    job->comp_buf = lz4_data->data.bufs_head;
+    job->comp_buf_size = lz4_size;
+    return TRUE;
+}
+#endif
+
+static int compress_thread_run_job(CompressThread *thread, CompressJob *job)
+{
+    switch (job->compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        return compress_thread_quic(thread, job);
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        return compress_thread_lz(thread, job);
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        return compress_thread_lz4(thread, job);
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+static void *compress_thread_main(void *arg)
+{
+    CompressThread *thread = arg;
+    CompressPool *pool = thread->pool;
+    stat_time_t start_time;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        RingItem *link;
+        CompressJob *job;
+
+        while (!pool->quit && ring_is_empty(&pool->jobs)) {
+            pthread_cond_wait(&pool->jobs_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+
+        link = ring_get_tail(&pool->jobs);
+        job = SPICE_CONTAINEROF(link, CompressJob, link);
+        ring_remove(link);
+        pool->n_jobs--;
+        job->state = COMPRESS_JOB_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        start_time = stat_probes_enabled() ? stat_now(COMPRESS_POOL_STAT_CLOCK) : 0;
+        job->success = compress_thread_run_job(thread, job);
+        if (start_time) {
+            job->compress_time = MAX(stat_now(COMPRESS_POOL_STAT_CLOCK) - start_time, 1);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = COMPRESS_JOB_DONE;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void compress_thread_init(CompressThread *thread, CompressPool *pool,
+                                 RedCompressBufPool *bufs)
+{
+    thread->pool = pool;
+    thread->quic_data.data.pool = bufs;
+    thread->lz_data.data.pool = bufs;
+#ifdef USE_LZ4
+    thread->lz4_data.data.pool = bufs;
+#endif
+    thread->quic = quic_data_create_encoder(&thread->quic_data);
+    thread->lz = lz_data_create_encoder(&thread->lz_data);
+#ifdef USE_LZ4
+    thread->lz4 = lz4_data_create_encoder(&thread->lz4_data);
+#endif
+}
+
+static void compress_thread_destroy(CompressThread *thread)
+{
+    quic_destroy(thread->quic);
+    thread->quic = NULL;
+    lz_destroy(thread->lz);
+    thread->lz = NULL;
+#ifdef USE_LZ4
+    lz4_encoder_destroy(thread->lz4);
+    thread->lz4 = NULL;
+#endif
+}
+
+int compress_pool_get_n_threads(const char *env_name, int default_threads)
+{
+    const char *env_str = getenv(env_name);
+    char *end;
+    long n_threads;
+
+    if (!env_str) {
+        return default_threads;
+    }
+    n_threads = strtol(env_str, &end, 10);
+    if (end == env_str || *end != '\0' || n_threads < 0) {
+        spice_warning("invalid %s value \"%s\"", env_name, env_str);
+        return default_threads;
+    }
+    return MIN(n_threads, COMPRESS_POOL_MAX_THREADS);
+}
+
+CompressPool *compress_pool_new(int n_threads, RedCompressBufPool *bufs)
+{
+    CompressPool *pool;
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int i;
+
+    if (n_threads <= 0) {
+        return NULL;
+    }
+
+    pool = spice_new0(CompressPool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobs_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ring_init(&pool->jobs);
+    pool->threads = spice_new0(CompressThread, n_threads);
+
+    /* signals are handled by the main loop, same as for the worker thread */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    for (i = 0; i < n_threads; i++) {
+        CompressThread *thread = &pool->threads[i];
+        int r;
+
+        compress_thread_init(thread, pool, bufs);
+        if ((r = pthread_create(&thread->thread, NULL, compress_thread_main, thread))) {
+            spice_warning("create compression thread failed %d", r);
+            compress_thread_destroy(thread);
+            break;
+        }
+        pool->n_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+
+    if (pool->n_threads == 0) {
+        compress_pool_free(pool);
+        return NULL;
+    }
+    spice_debug("%d compression threads", pool->n_threads);
+    return pool;
+}
+
+void compress_pool_free(CompressPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    /* the jobs point to the pool, better leak it than free it under them */
+    if (pool->n_owned) {
+        spice_warning("%d compression jobs were not taken, pool not freed", pool->n_owned);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+        compress_thread_destroy(&pool->threads[i]);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->jobs_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+CompressJob *compress_pool_push(CompressPool *pool, SpiceBitmap *src,
+                                SpiceImageCompression compression)
+{
+    CompressJob *job;
+
+    spice_return_val_if_fail(pool != NULL, NULL);
+
+    switch (compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+    case SPICE_IMAGE_COMPRESSION_LZ:
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+#endif
+        break;
+    default:
+        return NULL;
+    }
+    /* unstable chunks are linearized in place by the synchronous path */
+    if (!bitmap_fmt_is_rgb(src->format) ||
+        (src->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_jobs >= COMPRESS_POOL_MAX_JOBS) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    job = spice_new0(CompressJob, 1);
+    job->pool = pool;
+    job->state = COMPRESS_JOB_QUEUED;
+    job->src = src;
+    job->compression = compression;
+    ring_item_init(&job->link);
+    ring_add(&pool->jobs, &job->link);
+    pool->n_jobs++;
+    pool->n_owned++;
+    pthread_cond_signal(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+int compress_job_take(CompressJob *job, uint8_t *image_type,
+                      RedCompressBuf **comp_buf, uint32_t *comp_buf_size,
+                      stat_time_t *compress_time)
+{
+    CompressPool *pool = job->pool;
+    int success;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == COMPRESS_JOB_QUEUED) {
+        /* compressing on the caller thread is faster than waiting */
+        ring_remove(&job->link);
+        pool->n_jobs--;
+        pool->n_owned--;
+        pthread_mutex_unlock(&pool->lock);
+        free(job);
+        return FALSE;
+    }
+    while (job->state != COMPRESS_JOB_DONE) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pool->n_owned--;
+    pthread_mutex_unlock(&pool->lock);
+
+    success = job->success;
+    if (success) {
+        *image_type = job->image_type;
+        *comp_buf = job->comp_buf;
+        *comp_buf_size = job->comp_buf_size;
+        *compress_time = job->compress_time;
+    }
+    free(job);
+    return success;
+}
+
+void compress_job_cancel(CompressJob *job)
+{
+    RedCompressBuf *buf;
+    uint32_t size;
+    uint8_t type;
+    stat_time_t time;
+
+    if (compress_job_take(job, &type, &buf, &size, &time)) {
+        red_compress_buf_free(buf);
+    }
+}
+
+SpiceBitmap *compress_job_get_bitmap(CompressJob *job)
+{
+    return job->src;
+}
+
+SpiceImageCompression compress_job_get_compression(CompressJob *job)
+{
+    return job->compression;
+}
@@ -0,0 +1,67 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef COMPRESS_POOL_H_
+# define COMPRESS_POOL_H_
+
+#include "dcc-encoders.h"
+
+/* Thread pool compressing bitmaps ahead of the marshaller.
+ *
+ * Only the per-image stateless codecs (QUIC, LZ and LZ4 on RGB bitmaps) are
+ * handled here; GLZ shares a dictionary with the client and JPEG depends on
+ * the lossy state at send time, so they stay on the worker thread.
+ *
+ * The worker thread owns the jobs: it pushes them when a drawable is queued
+ * to a client pipe, and later either takes the result when marshalling or
+ * cancels the job when the pipe item is released. Bitmap data must stay
+ * valid until one of those happens.
+ */
+
+#define COMPRESS_POOL_THREADS_ENV "SPICE_WORKER_COMPRESS_THREADS"
+#define COMPRESS_POOL_DEFAULT_THREADS 2
+#define COMPRESS_POOL_MAX_THREADS 16
+#define COMPRESS_POOL_MAX_JOBS 64
+/* smaller images are cheaper to compress than to hand over */
+#define COMPRESS_POOL_MIN_IMAGE_SIZE (64 * 1024)
+/* the clock of the display channel compression stats */
+#define COMPRESS_POOL_STAT_CLOCK CLOCK_THREAD_CPUTIME_ID
+
+typedef struct CompressPool CompressPool;
+typedef struct CompressJob CompressJob;
+
+/* the compressed output is allocated from @bufs */
+CompressPool *compress_pool_new(int n_threads, RedCompressBufPool *bufs);
+/* all the jobs must have been taken or cancelled */
+void          compress_pool_free(CompressPool *pool);
+int           compress_pool_get_n_threads(const char *env_name, int default_threads);
+
+/* returns NULL if the compression is not handled or the queue is full */
+CompressJob  *compress_pool_push(CompressPool *pool, SpiceBitmap *src,
+                                 SpiceImageCompression compression);
+/* Takes the result of a job and frees it.
+ * Waits if the job is being compressed, and gives up if it did not start yet.
+ * On success the caller owns the RedCompressBuf chain, and @compress_time is
+ * the time the compression thread spent on it, or 0 if the probes were off. */
+int           compress_job_take(CompressJob *job, uint8_t *image_type,
+                                RedCompressBuf **comp_buf, uint32_t *comp_buf_size,
+                                stat_time_t *compress_time);
+void          compress_job_cancel(CompressJob *job);
+SpiceBitmap  *compress_job_get_bitmap(CompressJob *job);
+SpiceImageCompression compress_job_get_compression(CompressJob *job);
+
+#endif /* COMPRESS_POOL_H_ */
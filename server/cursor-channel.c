@@ -60,7 +60,11 @@ struct CursorChannel {
     uint16_t cursor_trail_length;
     uint16_t cursor_trail_frequency;
     uint32_t mouse_mode;
+    PipeItemPool *pipe_items;
 
+#ifdef RED_WORKER_STAT
+    uint32_t process_count;
+#endif
 #ifdef RED_STATISTICS
     StatNodeRef stat;
 #endif
@@ -134,7 +138,8 @@ static void cursor_set_item(CursorChannel *cursor, CursorItem *item)
 
 static PipeItem *new_cursor_pipe_item(RedChannelClient *rcc, void *data, int num)
 {
-    CursorPipeItem *item = spice_malloc0(sizeof(CursorPipeItem));
+    CursorChannel *cursor = SPICE_CONTAINEROF(rcc->channel, CursorChannel, common.base);
+    CursorPipeItem *item = pipe_item_pool_alloc(cursor->pipe_items);
 
     pipe_item_init(&item->base, PIPE_ITEM_TYPE_CURSOR);
     item->refs = 1;
@@ -205,6 +210,8 @@ void cursor_channel_disconnect(CursorChannel *cursor_channel)
 
 static void put_cursor_pipe_item(CursorChannelClient *ccc, CursorPipeItem *pipe_item)
 {
+    CursorChannel *cursor;
+
     spice_return_if_fail(pipe_item);
     spice_return_if_fail(pipe_item->refs > 0);
 
@@ -214,8 +221,9 @@ static void put_cursor_pipe_item(CursorChannelClient *ccc, CursorPipeItem *pipe_
 
     spice_assert(!pipe_item_is_linked(&pipe_item->base));
 
+    cursor = SPICE_CONTAINEROF(RED_CHANNEL_CLIENT(ccc)->channel, CursorChannel, common.base);
     cursor_item_unref(pipe_item->cursor_item);
-    free(pipe_item);
+    pipe_item_pool_release(cursor->pipe_items, pipe_item);
 }
 
 static void cursor_channel_client_on_disconnect(RedChannelClient *rcc)
@@ -432,10 +440,21 @@ CursorChannel* cursor_channel_new(RedWorker *worker)
     cursor_channel = (CursorChannel *)channel;
     cursor_channel->cursor_visible = TRUE;
     cursor_channel->mouse_mode = SPICE_MOUSE_MODE_SERVER;
+    cursor_channel->pipe_items = pipe_item_pool_new("cursor", sizeof(CursorPipeItem));
 
     return cursor_channel;
 }
 
+/* called by the worker thread once the clients are gone, before the channel
+ * is destroyed */
+void cursor_channel_close(CursorChannel *cursor)
+{
+    spice_return_if_fail(cursor);
+
+    pipe_item_pool_free(cursor->pipe_items);
+    cursor->pipe_items = NULL;
+}
+
 void cursor_channel_client_migrate(CursorChannelClient* client)
 {
     RedChannelClient *rcc;
@@ -517,6 +536,23 @@ void cursor_channel_process_cmd(CursorChannel *cursor, RedCursorCmd *cursor_cmd)
     }
 
     cursor_item_unref(cursor_item);
+
+#ifdef RED_WORKER_STAT
+    if ((++cursor->process_count % 100) == 0)
+        cursor_channel_print_stats(cursor);
+#endif
+}
+
+void cursor_channel_print_stats(CursorChannel *cursor)
+{
+#ifdef RED_WORKER_STAT
+    SlabStats slab_stats;
+
+    pipe_item_pool_get_stats(cursor->pipe_items, &slab_stats);
+    spice_info("cursor pipe items %u/%u (peak %u) in %u chunks",
+               slab_stats.objects, slab_stats.capacity, slab_stats.peak_objects,
+               slab_stats.chunks);
+#endif
 }
 
 void cursor_channel_reset(CursorChannel *cursor)
@@ -24,8 +24,6 @@
 #include "dcc-encoders.h"
 #include "display-channel.h"
 
-#define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
-
 static SPICE_GNUC_NORETURN SPICE_GNUC_PRINTF(2, 3) void
 quic_usr_error(QuicUsrContext *usr, const char *fmt, ...)
 {
@@ -136,22 +134,94 @@ static void glz_usr_free(GlzEncoderUsrContext *usr, void *ptr)
     free(ptr);
 }
 
+void red_compress_buf_pool_init(RedCompressBufPool *pool, uint32_t max_free)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free_bufs = NULL;
+    pool->n_free = 0;
+    pool->max_free = max_free;
+    pool->hits = pool->misses = 0;
+#ifdef RED_STATISTICS
+    pool->hits_counter = pool->misses_counter = NULL;
+#endif
+}
+
+void red_compress_buf_pool_destroy(RedCompressBufPool *pool)
+{
+    RedCompressBuf *buf;
+
+    while ((buf = pool->free_bufs)) {
+        pool->free_bufs = buf->send_next;
+        g_free(buf);
+    }
+    pool->n_free = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+RedCompressBuf *red_compress_buf_new(RedCompressBufPool *pool)
+{
+    RedCompressBuf *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    buf = pool->free_bufs;
+    if (buf) {
+        pool->free_bufs = buf->send_next;
+        pool->n_free--;
+        pool->hits++;
+        stat_inc_counter(reds, pool->hits_counter, 1);
+    } else {
+        pool->misses++;
+        stat_inc_counter(reds, pool->misses_counter, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buf) {
+        buf = g_new(RedCompressBuf, 1);
+        buf->pool = pool;
+    }
+    buf->send_next = NULL;
+    return buf;
+}
+
+void red_compress_buf_free(RedCompressBuf *buf)
+{
+    RedCompressBufPool *pool;
+    RedCompressBuf *next;
+
+    if (!buf) {
+        return;
+    }
+
+    pool = buf->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (; buf && pool->n_free < pool->max_free; buf = next) {
+        next = buf->send_next;
+        buf->send_next = pool->free_bufs;
+        pool->free_bufs = buf;
+        pool->n_free++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* over the high-water mark */
+    for (; buf; buf = next) {
+        next = buf->send_next;
+        g_free(buf);
+    }
+}
+
 void encoder_data_init(EncoderData *data, DisplayChannelClient *dcc)
 {
-    data->bufs_tail = g_new(RedCompressBuf, 1);
+    if (dcc) {
+        data->pool = &DCC_TO_DC(dcc)->compress_bufs;
+    }
+    data->bufs_tail = red_compress_buf_new(data->pool);
     data->bufs_head = data->bufs_tail;
     data->dcc = dcc;
-    data->bufs_head->send_next = NULL;
 }
 
 void encoder_data_reset(EncoderData *data)
 {
-    RedCompressBuf *buf = data->bufs_head;
-    while (buf) {
-        RedCompressBuf *next = buf->send_next;
-        g_free(buf);
-        buf = next;
-    }
+    red_compress_buf_free(data->bufs_head);
     data->bufs_head = data->bufs_tail = NULL;
 }
 
@@ -162,10 +232,9 @@ static int encoder_usr_more_space(EncoderData *enc_data, uint8_t **io_ptr)
 {
     RedCompressBuf *buf;
 
-    buf = g_new(RedCompressBuf, 1);
+    buf = red_compress_buf_new(enc_data->pool);
     enc_data->bufs_tail->send_next = buf;
     enc_data->bufs_tail = buf;
-    buf->send_next = NULL;
     *io_ptr = buf->buf.bytes;
     return sizeof(buf->buf);
 }
@@ -289,38 +358,54 @@ static int zlib_usr_more_input(ZlibEncoderUsrContext *usr, uint8_t** input)
     return buf_size;
 }
 
-static void dcc_init_quic(DisplayChannelClient *dcc)
+QuicContext *quic_data_create_encoder(QuicData *quic_data)
 {
-    dcc->quic_data.usr.error = quic_usr_error;
-    dcc->quic_data.usr.warn = quic_usr_warn;
-    dcc->quic_data.usr.info = quic_usr_warn;
-    dcc->quic_data.usr.malloc = quic_usr_malloc;
-    dcc->quic_data.usr.free = quic_usr_free;
-    dcc->quic_data.usr.more_space = quic_usr_more_space;
-    dcc->quic_data.usr.more_lines = quic_usr_more_lines;
+    QuicContext *quic;
 
-    dcc->quic = quic_create(&dcc->quic_data.usr);
+    quic_data->usr.error = quic_usr_error;
+    quic_data->usr.warn = quic_usr_warn;
+    quic_data->usr.info = quic_usr_warn;
+    quic_data->usr.malloc = quic_usr_malloc;
+    quic_data->usr.free = quic_usr_free;
+    quic_data->usr.more_space = quic_usr_more_space;
+    quic_data->usr.more_lines = quic_usr_more_lines;
 
-    if (!dcc->quic) {
+    quic = quic_create(&quic_data->usr);
+
+    if (!quic) {
         spice_critical("create quic failed");
     }
+    return quic;
 }
 
-static void dcc_init_lz(DisplayChannelClient *dcc)
+LzContext *lz_data_create_encoder(LzData *lz_data)
 {
-    dcc->lz_data.usr.error = lz_usr_error;
-    dcc->lz_data.usr.warn = lz_usr_warn;
-    dcc->lz_data.usr.info = lz_usr_warn;
-    dcc->lz_data.usr.malloc = lz_usr_malloc;
-    dcc->lz_data.usr.free = lz_usr_free;
-    dcc->lz_data.usr.more_space = lz_usr_more_space;
-    dcc->lz_data.usr.more_lines = lz_usr_more_lines;
+    LzContext *lz;
+
+    lz_data->usr.error = lz_usr_error;
+    lz_data->usr.warn = lz_usr_warn;
+    lz_data->usr.info = lz_usr_warn;
+    lz_data->usr.malloc = lz_usr_malloc;
+    lz_data->usr.free = lz_usr_free;
+    lz_data->usr.more_space = lz_usr_more_space;
+    lz_data->usr.more_lines = lz_usr_more_lines;
 
-    dcc->lz = lz_create(&dcc->lz_data.usr);
+    lz = lz_create(&lz_data->usr);
 
-    if (!dcc->lz) {
+    if (!lz) {
         spice_critical("create lz failed");
     }
+    return lz;
+}
+
+static void dcc_init_quic(DisplayChannelClient *dcc)
+{
+    dcc->quic = quic_data_create_encoder(&dcc->quic_data);
+}
+
+static void dcc_init_lz(DisplayChannelClient *dcc)
+{
+    dcc->lz = lz_data_create_encoder(&dcc->lz_data);
 }
 
 static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
@@ -346,54 +431,83 @@ static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *im
     }
 }
 
+void glz_data_init(GlzData *glz_data)
+{
+    glz_data->usr.error = glz_usr_error;
+    glz_data->usr.warn = glz_usr_warn;
+    glz_data->usr.info = glz_usr_warn;
+    glz_data->usr.malloc = glz_usr_malloc;
+    glz_data->usr.free = glz_usr_free;
+    glz_data->usr.more_space = glz_usr_more_space;
+    glz_data->usr.more_lines = glz_usr_more_lines;
+}
+
 static void dcc_init_glz_data(DisplayChannelClient *dcc)
 {
-    dcc->glz_data.usr.error = glz_usr_error;
-    dcc->glz_data.usr.warn = glz_usr_warn;
-    dcc->glz_data.usr.info = glz_usr_warn;
-    dcc->glz_data.usr.malloc = glz_usr_malloc;
-    dcc->glz_data.usr.free = glz_usr_free;
-    dcc->glz_data.usr.more_space = glz_usr_more_space;
-    dcc->glz_data.usr.more_lines = glz_usr_more_lines;
+    glz_data_init(&dcc->glz_data);
     dcc->glz_data.usr.free_image = glz_usr_free_image;
 }
 
-static void dcc_init_jpeg(DisplayChannelClient *dcc)
+JpegEncoderContext *jpeg_data_create_encoder(JpegData *jpeg_data)
 {
-    dcc->jpeg_data.usr.more_space = jpeg_usr_more_space;
-    dcc->jpeg_data.usr.more_lines = jpeg_usr_more_lines;
+    JpegEncoderContext *jpeg;
+
+    jpeg_data->usr.more_space = jpeg_usr_more_space;
+    jpeg_data->usr.more_lines = jpeg_usr_more_lines;
 
-    dcc->jpeg = jpeg_encoder_create(&dcc->jpeg_data.usr);
+    jpeg = jpeg_encoder_create(&jpeg_data->usr);
 
-    if (!dcc->jpeg) {
+    if (!jpeg) {
         spice_critical("create jpeg encoder failed");
     }
+    return jpeg;
+}
+
+static void dcc_init_jpeg(DisplayChannelClient *dcc)
+{
+    dcc->jpeg = jpeg_data_create_encoder(&dcc->jpeg_data);
 }
 
 #ifdef USE_LZ4
-static inline void dcc_init_lz4(DisplayChannelClient *dcc)
+Lz4EncoderContext *lz4_data_create_encoder(Lz4Data *lz4_data)
 {
-    dcc->lz4_data.usr.more_space = lz4_usr_more_space;
-    dcc->lz4_data.usr.more_lines = lz4_usr_more_lines;
+    Lz4EncoderContext *lz4;
+
+    lz4_data->usr.more_space = lz4_usr_more_space;
+    lz4_data->usr.more_lines = lz4_usr_more_lines;
 
-    dcc->lz4 = lz4_encoder_create(&dcc->lz4_data.usr);
+    lz4 = lz4_encoder_create(&lz4_data->usr);
 
-    if (!dcc->lz4) {
+    if (!lz4) {
         spice_critical("create lz4 encoder failed");
     }
+    return lz4;
+}
+
+static inline void dcc_init_lz4(DisplayChannelClient *dcc)
+{
+    dcc->lz4 = lz4_data_create_encoder(&dcc->lz4_data);
 }
 #endif
 
-static void dcc_init_zlib(DisplayChannelClient *dcc)
+ZlibEncoder *zlib_data_create_encoder(ZlibData *zlib_data, int level)
 {
-    dcc->zlib_data.usr.more_space = zlib_usr_more_space;
-    dcc->zlib_data.usr.more_input = zlib_usr_more_input;
+    ZlibEncoder *zlib;
+
+    zlib_data->usr.more_space = zlib_usr_more_space;
+    zlib_data->usr.more_input = zlib_usr_more_input;
 
-    dcc->zlib = zlib_encoder_create(&dcc->zlib_data.usr, ZLIB_DEFAULT_COMPRESSION_LEVEL);
+    zlib = zlib_encoder_create(&zlib_data->usr, level);
 
-    if (!dcc->zlib) {
+    if (!zlib) {
         spice_critical("create zlib encoder failed");
     }
+    return zlib;
+}
+
+static void dcc_init_zlib(DisplayChannelClient *dcc)
+{
+    dcc->zlib = zlib_data_create_encoder(&dcc->zlib_data, ZLIB_DEFAULT_COMPRESSION_LEVEL);
 }
 
 void dcc_encoders_init(DisplayChannelClient *dcc)
@@ -429,7 +543,11 @@ void dcc_encoders_free(DisplayChannelClient *dcc)
 
 static void marshaller_compress_buf_free(uint8_t *data, void *opaque)
 {
-    g_free(opaque);
+    RedCompressBuf *buf = opaque;
+
+    /* each buffer of the chain is referenced and freed on its own */
+    buf->send_next = NULL;
+    red_compress_buf_free(buf);
 }
 
 void marshaller_add_compressed(SpiceMarshaller *m,
@@ -447,6 +565,69 @@ void marshaller_add_compressed(SpiceMarshaller *m,
     } while (max);
 }
 
+RedEncodedImage *red_encoded_image_new(SpiceBitmap *src, uint64_t image_id,
+                                       SpiceImageCompression compression,
+                                       int jpeg_quality, SpiceImage *image,
+                                       RedCompressBuf *comp_buf, uint32_t comp_buf_size,
+                                       int is_lossy)
+{
+    RedEncodedImage *encoded = spice_new0(RedEncodedImage, 1);
+
+    ring_item_init(&encoded->drawable_link);
+    encoded->refs = 1;
+    encoded->src = src;
+    encoded->image_id = image_id;
+    encoded->compression = compression;
+    encoded->jpeg_quality = jpeg_quality;
+    encoded->image.descriptor.type = image->descriptor.type;
+    encoded->image.u = image->u;
+    encoded->comp_buf = comp_buf;
+    encoded->comp_buf_size = comp_buf_size;
+    encoded->is_lossy = is_lossy;
+    return encoded;
+}
+
+RedEncodedImage *red_encoded_image_ref(RedEncodedImage *encoded)
+{
+    encoded->refs++;
+    return encoded;
+}
+
+void red_encoded_image_unref(RedEncodedImage *encoded)
+{
+    if (--encoded->refs != 0) {
+        return;
+    }
+    spice_warn_if_fail(!ring_item_is_linked(&encoded->drawable_link));
+    red_compress_buf_free(encoded->comp_buf);
+    free(encoded);
+}
+
+static void marshaller_encoded_image_unref(uint8_t *data, void *opaque)
+{
+    red_encoded_image_unref(opaque);
+}
+
+/* Like marshaller_add_compressed() but the buffers stay owned by @encoded,
+ * takes over one reference of the caller */
+void marshaller_add_encoded(SpiceMarshaller *m, RedEncodedImage *encoded)
+{
+    RedCompressBuf *comp_buf = encoded->comp_buf;
+    size_t max = encoded->comp_buf_size;
+    size_t now;
+
+    do {
+        spice_return_if_fail(comp_buf);
+        now = MIN(sizeof(comp_buf->buf), max);
+        max -= now;
+        spice_marshaller_add_ref_full(m, comp_buf->buf.bytes, now,
+                                      marshaller_encoded_image_unref,
+                                      red_encoded_image_ref(encoded));
+        comp_buf = comp_buf->send_next;
+    } while (max);
+    red_encoded_image_unref(encoded);
+}
+
 /* Remove from the to_free list and the instances_list.
    When no instance is left - the RedGlzDrawable is released too. (and the qxl drawable too, if
    it is not used by Drawable).
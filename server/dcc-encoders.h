@@ -19,6 +19,7 @@
 #define DCC_ENCODERS_H_
 
 #include <setjmp.h>
+#include <pthread.h>
 #include "common/marshaller.h"
 #include "common/quic.h"
 #include "red-channel.h"
@@ -32,8 +33,10 @@
 #include "zlib-encoder.h"
 
 typedef struct RedCompressBuf RedCompressBuf;
+typedef struct RedCompressBufPool RedCompressBufPool;
 typedef struct GlzDrawableInstanceItem GlzDrawableInstanceItem;
 typedef struct RedGlzDrawable RedGlzDrawable;
+typedef struct RedEncodedImage RedEncodedImage;
 
 void             dcc_encoders_init                           (DisplayChannelClient *dcc);
 void             dcc_encoders_free                           (DisplayChannelClient *dcc);
@@ -50,6 +53,8 @@ void             dcc_release_glz                             (DisplayChannelClie
 void             marshaller_add_compressed                   (SpiceMarshaller *m,
                                                               RedCompressBuf *comp_buf,
                                                               size_t size);
+void             marshaller_add_encoded                      (SpiceMarshaller *m,
+                                                              RedEncodedImage *image);
 
 #define RED_COMPRESS_BUF_SIZE (1024 * 64)
 struct RedCompressBuf {
@@ -62,8 +67,65 @@ struct RedCompressBuf {
         uint32_t words[RED_COMPRESS_BUF_SIZE / 4];
     } buf;
     RedCompressBuf *send_next;
+    RedCompressBufPool *pool;
 };
 
+/* Buffers freed once sent are kept for the next encodings, up to
+ * @max_free of them. The encoders may run on the compression threads
+ * while the marshallers free on the worker thread, hence the lock.
+ */
+#define RED_COMPRESS_BUF_POOL_MAX_FREE 64
+
+struct RedCompressBufPool {
+    pthread_mutex_t lock;
+    RedCompressBuf *free_bufs;
+    uint32_t n_free;
+    uint32_t max_free;
+    uint64_t hits;
+    uint64_t misses;
+#ifdef RED_STATISTICS
+    uint64_t *hits_counter;
+    uint64_t *misses_counter;
+#endif
+};
+
+void             red_compress_buf_pool_init                  (RedCompressBufPool *pool,
+                                                              uint32_t max_free);
+/* the buffers must all have been freed */
+void             red_compress_buf_pool_destroy               (RedCompressBufPool *pool);
+RedCompressBuf*  red_compress_buf_new                        (RedCompressBufPool *pool);
+/* frees the whole chain starting at @buf */
+void             red_compress_buf_free                       (RedCompressBuf *buf);
+
+/* Output of one encoding of a drawable image, reused by the other clients
+ * of the display channel which would have produced the same bytes. Kept in
+ * Drawable.encoded_images until the drawable is released and referenced by
+ * the marshallers still sending it. Only used by the worker thread.
+ */
+struct RedEncodedImage {
+    RingItem drawable_link;
+    int refs;
+    /* key */
+    SpiceBitmap *src;
+    uint64_t image_id;
+    SpiceImageCompression compression;
+    int jpeg_quality; /* 0 unless encoded with jpeg */
+    /* value, descriptor.type and u of the encoded image */
+    SpiceImage image;
+    RedCompressBuf *comp_buf;
+    uint32_t comp_buf_size;
+    int is_lossy;
+};
+
+RedEncodedImage* red_encoded_image_new                       (SpiceBitmap *src, uint64_t image_id,
+                                                              SpiceImageCompression compression,
+                                                              int jpeg_quality, SpiceImage *image,
+                                                              RedCompressBuf *comp_buf,
+                                                              uint32_t comp_buf_size,
+                                                              int is_lossy);
+RedEncodedImage* red_encoded_image_ref                       (RedEncodedImage *image);
+void             red_encoded_image_unref                     (RedEncodedImage *image);
+
 typedef struct GlzSharedDictionary {
     RingItem base;
     GlzEncDictContext *dict;
@@ -82,6 +144,7 @@ GlzSharedDictionary* dcc_restore_glz_dictionary              (DisplayChannelClie
 
 typedef struct  {
     DisplayChannelClient *dcc;
+    RedCompressBufPool *pool;
     RedCompressBuf *bufs_head;
     RedCompressBuf *bufs_tail;
     jmp_buf jmp_env;
@@ -100,6 +163,7 @@ typedef struct  {
     char message_buf[512];
 } EncoderData;
 
+/* without @dcc, data->pool must have been set by the caller */
 void encoder_data_init(EncoderData *data, DisplayChannelClient *dcc);
 void encoder_data_reset(EncoderData *data);
 
@@ -125,6 +189,8 @@ typedef struct {
 } Lz4Data;
 #endif
 
+#define ZLIB_DEFAULT_COMPRESSION_LEVEL 3
+
 typedef struct {
     ZlibEncoderUsrContext usr;
     EncoderData data;
@@ -135,6 +201,18 @@ typedef struct {
     EncoderData data;
 } GlzData;
 
+/* Encoders that don't carry state across images can also be instantiated
+ * outside of a DisplayChannelClient (see compress-pool.c) */
+QuicContext*         quic_data_create_encoder                    (QuicData *quic_data);
+LzContext*           lz_data_create_encoder                      (LzData *lz_data);
+JpegEncoderContext*  jpeg_data_create_encoder                    (JpegData *jpeg_data);
+#ifdef USE_LZ4
+Lz4EncoderContext*   lz4_data_create_encoder                     (Lz4Data *lz4_data);
+#endif
+ZlibEncoder*         zlib_data_create_encoder                    (ZlibData *zlib_data, int level);
+/* sets everything but usr.free_image, which depends on what the images are */
+void                 glz_data_init                               (GlzData *glz_data);
+
 #define MAX_GLZ_DRAWABLE_INSTANCES 2
 
 /* for each qxl drawable, there may be several instances of lz drawables */
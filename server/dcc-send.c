@@ -89,6 +89,7 @@ static int is_surface_area_lossy(DisplayChannelClient *dcc, uint32_t surface_id,
                                  const SpiceRect *area, SpiceRect *out_lossy_area)
 {
     RedSurface *surface;
+    DccSurface *client_surface;
     QRegion *surface_lossy_region;
     QRegion lossy_region;
     DisplayChannel *display = DCC_TO_DC(dcc);
@@ -96,7 +97,11 @@ static int is_surface_area_lossy(DisplayChannelClient *dcc, uint32_t surface_id,
     spice_return_val_if_fail(validate_surface(display, surface_id), FALSE);
 
     surface = &display->surfaces[surface_id];
-    surface_lossy_region = &dcc->surface_client_lossy_region[surface_id];
+    client_surface = dcc_find_surface(dcc, surface_id);
+    if (!client_surface) {
+        return FALSE;
+    }
+    surface_lossy_region = &client_surface->lossy_region;
 
     if (!area) {
         if (region_is_empty(surface_lossy_region)) {
@@ -452,8 +457,12 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                  &bitmap_palette_out, &lzplt_palette_out);
             spice_assert(bitmap_palette_out == NULL);
 
-            marshaller_add_compressed(m, comp_send_data.comp_buf,
-                                      comp_send_data.comp_buf_size);
+            if (comp_send_data.encoded) {
+                marshaller_add_encoded(m, comp_send_data.encoded);
+            } else {
+                marshaller_add_compressed(m, comp_send_data.comp_buf,
+                                          comp_send_data.comp_buf_size);
+            }
 
             if (lzplt_palette_out && comp_send_data.lzplt_palette) {
                 spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -548,7 +557,7 @@ static void surface_lossy_region_update(DisplayChannelClient *dcc,
         return;
     }
 
-    surface_lossy_region = &dcc->surface_client_lossy_region[item->surface_id];
+    surface_lossy_region = &dcc_get_surface(dcc, item->surface_id)->lossy_region;
     drawable = item->red_drawable;
 
     if (drawable->clip.type == SPICE_CLIP_TYPE_RECTS ) {
@@ -1755,6 +1764,8 @@ static int red_marshall_stream_data(RedChannelClient *rcc,
         rect_debug(&stream_data.dest);
         spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
     }
+    /* stream_outbuf is reused by the next frame */
+    red_channel_client_send_data_no_zerocopy(rcc);
     spice_marshaller_add_ref(base_marshaller,
                              dcc->send_data.stream_outbuf, n);
     agent->last_send_time = time_now;
@@ -1786,27 +1797,35 @@ static void display_channel_marshall_migrate_data_surfaces(DisplayChannelClient
 {
     SpiceMarshaller *m2 = spice_marshaller_get_ptr_submarshaller(m, 0);
     uint32_t *num_surfaces_created;
-    uint32_t i;
+    uint32_t i, j;
 
     num_surfaces_created = (uint32_t *)spice_marshaller_reserve_space(m2, sizeof(uint32_t));
     *num_surfaces_created = 0;
-    for (i = 0; i < NUM_SURFACES; i++) {
-        SpiceRect lossy_rect;
+    for (i = 0; i < DCC_SURFACE_N_PAGES; i++) {
+        DccSurfacePage *page = dcc->surface_pages[i];
 
-        if (!dcc->surface_client_created[i]) {
+        if (!page) {
             continue;
         }
-        spice_marshaller_add_uint32(m2, i);
-        (*num_surfaces_created)++;
+        for (j = 0; j < DCC_SURFACE_PAGE_SIZE; j++) {
+            DccSurface *surface = &page->surfaces[j];
+            SpiceRect lossy_rect;
 
-        if (!lossy) {
-            continue;
+            if (!surface->in_use || !surface->created) {
+                continue;
+            }
+            spice_marshaller_add_uint32(m2, (i << DCC_SURFACE_PAGE_SHIFT) + j);
+            (*num_surfaces_created)++;
+
+            if (!lossy) {
+                continue;
+            }
+            region_extents(&surface->lossy_region, &lossy_rect);
+            spice_marshaller_add_int32(m2, lossy_rect.left);
+            spice_marshaller_add_int32(m2, lossy_rect.top);
+            spice_marshaller_add_int32(m2, lossy_rect.right);
+            spice_marshaller_add_int32(m2, lossy_rect.bottom);
         }
-        region_extents(&dcc->surface_client_lossy_region[i], &lossy_rect);
-        spice_marshaller_add_int32(m2, lossy_rect.left);
-        spice_marshaller_add_int32(m2, lossy_rect.top);
-        spice_marshaller_add_int32(m2, lossy_rect.right);
-        spice_marshaller_add_int32(m2, lossy_rect.bottom);
     }
 }
 
@@ -1977,7 +1996,7 @@ static void red_marshall_image(RedChannelClient *rcc, SpiceMarshaller *m, ImageI
 
     int comp_succeeded = dcc_compress_image(dcc, &red_image, &bitmap, NULL, item->can_lossy, &comp_send_data);
 
-    surface_lossy_region = &dcc->surface_client_lossy_region[item->surface_id];
+    surface_lossy_region = &dcc_get_surface(dcc, item->surface_id)->lossy_region;
     if (comp_succeeded) {
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -2236,7 +2255,7 @@ static void marshall_surface_create(RedChannelClient *rcc,
 {
     DisplayChannelClient *dcc = RCC_TO_DCC(rcc);
 
-    region_init(&dcc->surface_client_lossy_region[surface_create->surface_id]);
+    region_clear(&dcc_get_surface(dcc, surface_create->surface_id)->lossy_region);
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_SURFACE_CREATE, NULL);
 
     spice_marshall_msg_display_surface_create(base_marshaller, surface_create);
@@ -2247,8 +2266,12 @@ static void marshall_surface_destroy(RedChannelClient *rcc,
 {
     DisplayChannelClient *dcc = RCC_TO_DCC(rcc);
     SpiceMsgSurfaceDestroy surface_destroy;
+    DccSurface *client_surface = dcc_find_surface(dcc, surface_id);
 
-    region_destroy(&dcc->surface_client_lossy_region[surface_id]);
+    /* unless the surface was created again, its create message comes next */
+    if (client_surface && !client_surface->created) {
+        dcc_remove_surface(dcc, surface_id);
+    }
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_SURFACE_DESTROY, NULL);
 
     surface_destroy.surface_id = surface_id;
@@ -2357,6 +2380,7 @@ static void reset_send_data(DisplayChannelClient *dcc)
 {
     dcc->send_data.free_list.res->count = 0;
     dcc->send_data.num_pixmap_cache_items = 0;
+    dcc->send_data.compress_time = 0;
     memset(dcc->send_data.free_list.sync, 0, sizeof(dcc->send_data.free_list.sync));
 }
 
@@ -2369,7 +2393,11 @@ void dcc_send_item(DisplayChannelClient *dcc, PipeItem *pipe_item)
     switch (pipe_item->type) {
     case PIPE_ITEM_TYPE_DRAW: {
         DrawablePipeItem *dpi = SPICE_CONTAINEROF(pipe_item, DrawablePipeItem, dpi_pipe_item);
+        if (dpi->enqueue_time) {
+            dpi->send_time = spice_get_monotonic_time_ns();
+        }
         marshall_qxl_drawable(rcc, m, dpi);
+        dpi->compress_time = dcc->send_data.compress_time;
         break;
     }
     case PIPE_ITEM_TYPE_INVAL_ONE:
@@ -23,6 +23,8 @@
 #include "display-channel.h"
 
 #define DISPLAY_CLIENT_SHORT_TIMEOUT 15000000000ULL //nano
+/* copies of at least this many pixels are bulk items */
+#define DISPLAY_CLIENT_BULK_AREA (256 * 256)
 
 static SurfaceCreateItem *surface_create_item_new(RedChannel* channel,
                                                   uint32_t surface_id, uint32_t width,
@@ -134,6 +136,85 @@ int dcc_clear_surface_drawables_from_pipe(DisplayChannelClient *dcc, int surface
     return TRUE;
 }
 
+DccSurface *dcc_find_surface(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    DccSurfacePage *page;
+    DccSurface *surface;
+
+    spice_return_val_if_fail(surface_id < NUM_SURFACES, NULL);
+
+    page = dcc->surface_pages[surface_id >> DCC_SURFACE_PAGE_SHIFT];
+    if (!page) {
+        return NULL;
+    }
+    surface = &page->surfaces[surface_id & DCC_SURFACE_PAGE_MASK];
+    return surface->in_use ? surface : NULL;
+}
+
+DccSurface *dcc_get_surface(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    DccSurfacePage **page;
+    DccSurface *surface;
+
+    spice_return_val_if_fail(surface_id < NUM_SURFACES, NULL);
+
+    page = &dcc->surface_pages[surface_id >> DCC_SURFACE_PAGE_SHIFT];
+    if (!*page) {
+        *page = spice_new0(DccSurfacePage, 1);
+    }
+    surface = &(*page)->surfaces[surface_id & DCC_SURFACE_PAGE_MASK];
+    if (!surface->in_use) {
+        region_init(&surface->lossy_region);
+        surface->created = FALSE;
+        surface->in_use = TRUE;
+        (*page)->n_used++;
+    }
+    return surface;
+}
+
+void dcc_remove_surface(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    DccSurfacePage **page;
+    DccSurface *surface;
+
+    spice_return_if_fail(surface_id < NUM_SURFACES);
+
+    page = &dcc->surface_pages[surface_id >> DCC_SURFACE_PAGE_SHIFT];
+    if (!*page) {
+        return;
+    }
+    surface = &(*page)->surfaces[surface_id & DCC_SURFACE_PAGE_MASK];
+    if (!surface->in_use) {
+        return;
+    }
+    region_destroy(&surface->lossy_region);
+    surface->in_use = FALSE;
+    if (--(*page)->n_used == 0) {
+        free(*page);
+        *page = NULL;
+    }
+}
+
+static void dcc_remove_all_surfaces(DisplayChannelClient *dcc)
+{
+    int i, j;
+
+    for (i = 0; i < DCC_SURFACE_N_PAGES; i++) {
+        DccSurfacePage *page = dcc->surface_pages[i];
+
+        if (!page) {
+            continue;
+        }
+        for (j = 0; j < DCC_SURFACE_PAGE_SIZE; j++) {
+            if (page->surfaces[j].in_use) {
+                region_destroy(&page->surfaces[j].lossy_region);
+            }
+        }
+        free(page);
+        dcc->surface_pages[i] = NULL;
+    }
+}
+
 void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
 {
     DisplayChannel *display;
@@ -150,14 +231,14 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
 
     /* don't send redundant create surface commands to client */
     if (!dcc || display->common.during_target_migrate ||
-        dcc->surface_client_created[surface_id]) {
+        dcc_surface_is_created(dcc, surface_id)) {
         return;
     }
     surface = &display->surfaces[surface_id];
     create = surface_create_item_new(RED_CHANNEL_CLIENT(dcc)->channel,
                                      surface_id, surface->context.width, surface->context.height,
                                      surface->context.format, flags);
-    dcc->surface_client_created[surface_id] = TRUE;
+    dcc_get_surface(dcc, surface_id)->created = TRUE;
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &create->pipe_item);
 }
 
@@ -256,7 +337,7 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
 
         surface_id = drawable->surface_deps[x];
         if (surface_id != -1) {
-            if (dcc->surface_client_created[surface_id] == TRUE) {
+            if (dcc_surface_is_created(dcc, surface_id)) {
                 continue;
             }
             dcc_create_surface(dcc, surface_id);
@@ -265,7 +346,7 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
         }
     }
 
-    if (dcc->surface_client_created[drawable->surface_id] == TRUE) {
+    if (dcc_surface_is_created(dcc, drawable->surface_id)) {
         return;
     }
 
@@ -274,6 +355,8 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
     dcc_push_surface_image(dcc, drawable->surface_id);
 }
 
+static void dcc_push_compress_job(DisplayChannelClient *dcc, DrawablePipeItem *dpi);
+
 void drawable_pipe_item_free(PipeItem *item)
 {
     DrawablePipeItem *dpi = SPICE_CONTAINEROF(item, DrawablePipeItem, dpi_pipe_item);
@@ -283,25 +366,95 @@ void drawable_pipe_item_free(PipeItem *item)
 
     spice_warn_if_fail(!ring_item_is_linked(&item->link));
     spice_warn_if_fail(!ring_item_is_linked(&dpi->base));
+    /* the job reads the drawable bitmap, so it has to be gone first */
+    if (dpi->compress_job) {
+        compress_job_cancel(dpi->compress_job);
+        dpi->compress_job = NULL;
+    }
     display_channel_drawable_unref(display, dpi->drawable);
-    free(dpi);
+    pipe_item_pool_release(display->drawable_pipe_items, dpi);
+}
+
+static int drawable_pipe_priority(Drawable *drawable)
+{
+    SpiceRect *bbox = &drawable->red_drawable->bbox;
+
+    if (drawable->stream) {
+        return PIPE_ITEM_PRIORITY_STREAM;
+    }
+    if (drawable->red_drawable->type == QXL_DRAW_COPY &&
+        (uint64_t)(bbox->right - bbox->left) * (bbox->bottom - bbox->top) >=
+        DISPLAY_CLIENT_BULK_AREA) {
+        return PIPE_ITEM_PRIORITY_BULK;
+    }
+    return PIPE_ITEM_PRIORITY_INTERACTIVE;
 }
 
 static DrawablePipeItem *drawable_pipe_item_new(DisplayChannelClient *dcc, Drawable *drawable)
 {
     DrawablePipeItem *dpi;
 
-    dpi = spice_malloc0(sizeof(*dpi));
+    dpi = pipe_item_pool_alloc(DCC_TO_DC(dcc)->drawable_pipe_items);
     dpi->drawable = drawable;
     dpi->dcc = dcc;
     ring_item_init(&dpi->base);
     ring_add(&drawable->pipes, &dpi->base);
     pipe_item_init_full(&dpi->dpi_pipe_item, PIPE_ITEM_TYPE_DRAW,
                         (GDestroyNotify)drawable_pipe_item_free);
+    dpi->dpi_pipe_item.priority = drawable_pipe_priority(drawable);
+    if (drawable->pickup_time) {
+        dpi->enqueue_time = spice_get_monotonic_time_ns();
+    }
     drawable->refs++;
+    dcc_push_compress_job(dcc, dpi);
     return dpi;
 }
 
+/* TRUE if @b_drawable reads an area of the surface @a_drawable draws to */
+static int drawable_reads_drawable(Drawable *a_drawable, Drawable *b_drawable)
+{
+    RedDrawable *a = a_drawable->red_drawable;
+    RedDrawable *b = b_drawable->red_drawable;
+    int x;
+
+    for (x = 0; x < 3; ++x) {
+        if (b_drawable->surface_deps[x] == a_drawable->surface_id &&
+            rect_intersects(&b->surfaces_rects[x], &a->bbox)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Only drawables are reordered: a drawable can be sent before an older one
+ * if they draw to different areas, neither reads what the other draws, and
+ * it doesn't copy from its own surface. Everything else, and the items the
+ * display code positions explicitly (images, upgrades, stream and surface
+ * messages), stays in order.
+ */
+int dcc_pipe_item_can_overtake(DisplayChannelClient *dcc, PipeItem *item, PipeItem *overtaken)
+{
+    Drawable *drawable, *older;
+
+    if (item->type != PIPE_ITEM_TYPE_DRAW || overtaken->type != PIPE_ITEM_TYPE_DRAW) {
+        return FALSE;
+    }
+    drawable = SPICE_CONTAINEROF(item, DrawablePipeItem, dpi_pipe_item)->drawable;
+    older = SPICE_CONTAINEROF(overtaken, DrawablePipeItem, dpi_pipe_item)->drawable;
+
+    if (has_shadow(drawable->red_drawable) || drawable->red_drawable->self_bitmap) {
+        return FALSE;
+    }
+    if (drawable->surface_id == older->surface_id &&
+        (rect_intersects(&drawable->red_drawable->bbox, &older->red_drawable->bbox) ||
+         (drawable->stream &&
+          rect_intersects(&drawable->stream->dest_area, &older->red_drawable->bbox)))) {
+        return FALSE;
+    }
+    return !drawable_reads_drawable(older, drawable) && !drawable_reads_drawable(drawable, older);
+}
+
 void dcc_prepend_drawable(DisplayChannelClient *dcc, Drawable *drawable)
 {
     DrawablePipeItem *dpi = drawable_pipe_item_new(dcc, drawable);
@@ -345,6 +498,107 @@ static void dcc_init_stream_agents(DisplayChannelClient *dcc)
 
 #define DISPLAY_FREE_LIST_DEFAULT_SIZE 128
 
+static void dcc_init_latency_stats(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    stat_info_t *stats[] = {
+        &dcc->process_latency_stat,
+        &dcc->queue_latency_stat,
+        &dcc->compress_latency_stat,
+        &dcc->send_latency_stat,
+        &dcc->total_latency_stat,
+    };
+    const char *names[] = { "process", "queue", "compress", "send", "total" };
+    unsigned int i;
+#ifdef RED_STATISTICS
+    RedChannel *channel = RED_CHANNEL(display);
+    SpiceServer *reds = red_channel_get_server(channel);
+    char name[16];
+    StatNodeRef node;
+#endif
+
+    for (i = 0; i < SPICE_N_ELEMENTS(stats); i++) {
+        stat_init(stats[i], names[i], CLOCK_MONOTONIC);
+    }
+
+    /* nodes can't be removed from the stat tree, a new client reuses the
+     * ones of a gone one */
+    dcc->latency_slot = -1;
+    for (i = 0; i < DCC_MAX_LATENCY_SLOTS; i++) {
+        if (!(display->latency_slots & (1u << i))) {
+            break;
+        }
+    }
+    if (i == DCC_MAX_LATENCY_SLOTS) {
+        return;
+    }
+    dcc->latency_slot = i;
+    display->latency_slots |= 1u << i;
+
+#ifdef RED_STATISTICS
+    snprintf(name, sizeof(name), "client%d", dcc->latency_slot);
+    node = stat_add_node(reds, channel->stat, name, TRUE);
+    if (node == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < SPICE_N_ELEMENTS(stats); i++) {
+        stat_info_publish(reds, node, stats[i], FALSE);
+    }
+#endif
+}
+
+static void dcc_release_latency_stats(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+
+    if (dcc->latency_slot < 0) {
+        return;
+    }
+    stat_info_update_counters(&dcc->process_latency_stat);
+    stat_info_update_counters(&dcc->queue_latency_stat);
+    stat_info_update_counters(&dcc->compress_latency_stat);
+    stat_info_update_counters(&dcc->send_latency_stat);
+    stat_info_update_counters(&dcc->total_latency_stat);
+    display->latency_slots &= ~(1u << dcc->latency_slot);
+    dcc->latency_slot = -1;
+}
+
+/* Called once @dpi was written to the socket, see the latency fields of
+ * Drawable and DrawablePipeItem */
+static void dcc_trace_drawable(DisplayChannelClient *dcc, DrawablePipeItem *dpi)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
+    uint64_t now;
+
+    /* not published, or already stopped */
+    if (dcc->latency_slot < 0) {
+        return;
+    }
+    if (!drawable->pickup_time || !drawable->tree_time ||
+        !dpi->enqueue_time || !dpi->send_time) {
+        return;
+    }
+    now = spice_get_monotonic_time_ns();
+    stat_account(&dcc->process_latency_stat, drawable->tree_time - drawable->pickup_time);
+    stat_account(&dcc->queue_latency_stat, dpi->send_time - dpi->enqueue_time);
+    stat_account(&dcc->compress_latency_stat, dpi->compress_time);
+    stat_account(&dcc->send_latency_stat, now - dpi->send_time);
+    stat_account(&dcc->total_latency_stat, now - drawable->pickup_time);
+
+    if (display->trace_file && (display->trace_count++ % display->trace_sample) == 0) {
+        fprintf(display->trace_file,
+                "display %u client %p drawable %p type %u pickup %"PRIu64
+                " process %"PRIu64" queue %"PRIu64" compress %"PRIu64
+                " send %"PRIu64" total %"PRIu64"\n",
+                display->common.base.id, dcc, drawable, drawable->red_drawable->type,
+                drawable->pickup_time,
+                drawable->tree_time - drawable->pickup_time,
+                dpi->send_time - dpi->enqueue_time, dpi->compress_time,
+                now - dpi->send_time, now - drawable->pickup_time);
+    }
+}
+
 DisplayChannelClient *dcc_new(DisplayChannel *display,
                               RedClient *client, RedsStream *stream,
                               int mig_target,
@@ -386,6 +640,7 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
     dcc_init_stream_agents(dcc);
 
     dcc_encoders_init(dcc);
+    dcc_init_latency_stats(dcc);
 
     return dcc;
 }
@@ -489,6 +744,8 @@ void dcc_stop(DisplayChannelClient *dcc)
     free(dcc->send_data.free_list.res);
     dcc_destroy_stream_agents(dcc);
     dcc_encoders_free(dcc);
+    dcc_remove_all_surfaces(dcc);
+    dcc_release_latency_stats(dcc);
 
     if (dcc->gl_draw_ongoing) {
         display_channel_gl_draw_done(dc);
@@ -615,11 +872,12 @@ void dcc_destroy_surface(DisplayChannelClient *dcc, uint32_t surface_id)
     channel = RED_CHANNEL(display);
 
     if (COMMON_GRAPHICS_CHANNEL(display)->during_target_migrate ||
-        !dcc->surface_client_created[surface_id]) {
+        !dcc_surface_is_created(dcc, surface_id)) {
         return;
     }
 
-    dcc->surface_client_created[surface_id] = FALSE;
+    /* the state is dropped once the destroy message is sent */
+    dcc_find_surface(dcc, surface_id)->created = FALSE;
     destroy = surface_destroy_item_new(channel, surface_id);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &destroy->pipe_item);
 }
@@ -930,6 +1188,7 @@ static int dcc_compress_image_jpeg(DisplayChannelClient *dcc, SpiceImage *dest,
     lz_out_start_byte = lz_data->data.bufs_head->buf.bytes + comp_head_filled;
 
     lz_data->data.dcc = dcc;
+    lz_data->data.pool = jpeg_data->data.pool;
 
     lz_data->data.u.lines_data.chunks = src->data;
     lz_data->data.u.lines_data.stride = src->stride;
@@ -1172,19 +1431,175 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
-int dcc_compress_image(DisplayChannelClient *dcc,
-                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                       int can_lossy,
-                       compress_send_data_t* o_comp_data)
+/* Start compressing the source bitmap of copy drawables on the compression
+ * pool, so that it is ready by the time the item is marshalled */
+static void dcc_push_compress_job(DisplayChannelClient *dcc, DrawablePipeItem *dpi)
 {
-    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    DrawablePipeItem *other;
+    RingItem *dpi_link, *dpi_next;
+    SpiceImage *image;
+    SpiceBitmap *bitmap;
     SpiceImageCompression image_compression;
+
+    if (!display->compress_pool || red_drawable->type != QXL_DRAW_COPY ||
+        drawable->stream) {
+        return;
+    }
+    image = red_drawable->u.copy.src_bitmap;
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    bitmap = &image->u.bitmap;
+    if (bitmap->y * bitmap->stride < COMPRESS_POOL_MIN_IMAGE_SIZE) {
+        return;
+    }
+    /* see fill_bits, local clients get uncompressed bitmaps */
+    if (reds_stream_get_family(RED_CHANNEL_CLIENT(dcc)->stream) == AF_UNIX) {
+        return;
+    }
+
+    image_compression = get_compression_for_bitmap(bitmap, dcc->image_compression, drawable);
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        /* might end up as jpeg, depending on the lossy state at send time */
+        if (display->enable_jpeg) {
+            return;
+        }
+        break;
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        if (!red_channel_client_test_remote_cap(&dcc->common.base,
+                                                SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        }
+        break;
+#endif
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        break;
+    default:
+        return;
+    }
+
+    /* another client of the display is going to encode the same, see
+     * dcc_compress_image_from_pool */
+    DRAWABLE_FOREACH_DPI_SAFE(drawable, dpi_link, dpi_next, other) {
+        if (other->compress_job &&
+            compress_job_get_bitmap(other->compress_job) == bitmap &&
+            compress_job_get_compression(other->compress_job) == image_compression) {
+            return;
+        }
+    }
+
+    dpi->compress_job = compress_pool_push(display->compress_pool, bitmap, image_compression);
+}
+
+/* Use the result of dcc_push_compress_job if it matches what the synchronous
+ * path would have produced */
+static int dcc_compress_image_from_pool(DisplayChannelClient *dcc,
+                                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                        SpiceImageCompression image_compression,
+                                        compress_send_data_t* o_comp_data)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    DrawablePipeItem *dpi;
+    RingItem *dpi_link, *dpi_next;
+    CompressJob *job = NULL;
+    RedCompressBuf *comp_buf;
+    uint32_t comp_buf_size;
+    uint8_t image_type;
+    stat_time_t compress_time;
+    stat_info_t *stat;
+
+#ifdef USE_LZ4
+    if (image_compression == SPICE_IMAGE_COMPRESSION_LZ4 &&
+        !red_channel_client_test_remote_cap(&dcc->common.base,
+                                            SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+        image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+    }
+#endif
+    DRAWABLE_FOREACH_DPI_SAFE(drawable, dpi_link, dpi_next, dpi) {
+        if (dpi->dcc == dcc && dpi->compress_job &&
+            compress_job_get_bitmap(dpi->compress_job) == src) {
+            job = dpi->compress_job;
+            dpi->compress_job = NULL;
+            break;
+        }
+    }
+    /* only one job is pushed per drawable bitmap and compression, the
+     * result is shared with the other clients through dcc_compress_image */
+    if (!job) {
+        DRAWABLE_FOREACH_DPI_SAFE(drawable, dpi_link, dpi_next, dpi) {
+            if (dpi->compress_job &&
+                compress_job_get_bitmap(dpi->compress_job) == src &&
+                compress_job_get_compression(dpi->compress_job) == image_compression) {
+                job = dpi->compress_job;
+                dpi->compress_job = NULL;
+                break;
+            }
+        }
+    }
+    if (!job) {
+        return FALSE;
+    }
+
+    if (compress_job_get_compression(job) != image_compression) {
+        compress_job_cancel(job);
+        stat_inc_counter(reds, display->compress_pool_misses_counter, 1);
+        return FALSE;
+    }
+    if (!compress_job_take(job, &image_type, &comp_buf, &comp_buf_size, &compress_time)) {
+        stat_inc_counter(reds, display->compress_pool_misses_counter, 1);
+        return FALSE;
+    }
+
+    dest->descriptor.type = image_type;
+    switch (image_type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        dest->u.quic.data_size = comp_buf_size;
+        stat = &display->quic_stat;
+        break;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        dest->u.lz_rgb.data_size = comp_buf_size;
+        stat = &display->lz_stat;
+        break;
+    case SPICE_IMAGE_TYPE_LZ4:
+        dest->u.lz4.data_size = comp_buf_size;
+        stat = &display->lz4_stat;
+        break;
+    default:
+        spice_error("unexpected compressed image type %u", image_type);
+        return FALSE;
+    }
+    /* the time spent by the compression thread, as the synchronous encoders
+     * account theirs */
+    stat_compress_add_time(stat, compress_time, src->stride * src->y, comp_buf_size);
+    o_comp_data->comp_buf = comp_buf;
+    o_comp_data->comp_buf_size = comp_buf_size;
+    stat_inc_counter(reds, display->compress_pool_hits_counter, 1);
+    return TRUE;
+}
+
+static int dcc_compress_image_for_client(DisplayChannelClient *dcc,
+                                         SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                                         SpiceImageCompression image_compression, int can_lossy,
+                                         compress_send_data_t* o_comp_data)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
     stat_start_time_t start_time;
+    uint64_t start_ns = stat_probes_enabled() ? spice_get_monotonic_time_ns() : 0;
     int success = FALSE;
 
     stat_start_time_init(&start_time, &display_channel->off_stat);
 
-    image_compression = get_compression_for_bitmap(src, dcc->image_compression, drawable);
+    if (drawable && !(image_compression == SPICE_IMAGE_COMPRESSION_QUIC && can_lossy &&
+                      display_channel->enable_jpeg) &&
+        dcc_compress_image_from_pool(dcc, dest, src, drawable, image_compression, o_comp_data)) {
+        success = TRUE;
+        goto end;
+    }
     switch (image_compression) {
     case SPICE_IMAGE_COMPRESSION_OFF:
         break;
@@ -1232,9 +1647,121 @@ lz_compress:
         stat_compress_add(&display_channel->off_stat, start_time, image_size, image_size);
     }
 
+end:
+    if (start_ns) {
+        dcc->send_data.compress_time += spice_get_monotonic_time_ns() - start_ns;
+    }
     return success;
 }
 
+/* Whether the output of dcc_compress_image for @src can be shared with the
+ * other clients of the display, which is not the case for the per client
+ * GLZ dictionaries and the LZ palettes, and what it depends on */
+static int dcc_get_shared_encoding(DisplayChannelClient *dcc, SpiceBitmap *src,
+                                   Drawable *drawable, SpiceImageCompression image_compression,
+                                   int can_lossy, SpiceImageCompression *o_compression,
+                                   int *o_jpeg_quality)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+
+    if (!drawable || RED_CHANNEL(display)->clients_num < 2) {
+        return FALSE;
+    }
+
+    *o_jpeg_quality = 0;
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        if (can_lossy && display->enable_jpeg &&
+            (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
+            *o_jpeg_quality = dcc->jpeg_quality;
+        }
+        break;
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        if (!red_channel_client_test_remote_cap(&dcc->common.base,
+                                                SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        }
+        break;
+#endif
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        break;
+    default:
+        return FALSE;
+    }
+    if (image_compression == SPICE_IMAGE_COMPRESSION_LZ && !bitmap_fmt_is_rgb(src->format)) {
+        return FALSE;
+    }
+
+    *o_compression = image_compression;
+    return TRUE;
+}
+
+static RedEncodedImage *drawable_find_encoded_image(Drawable *drawable, SpiceBitmap *src,
+                                                    uint64_t image_id,
+                                                    SpiceImageCompression compression,
+                                                    int jpeg_quality)
+{
+    RingItem *item;
+
+    RING_FOREACH(item, &drawable->encoded_images) {
+        RedEncodedImage *encoded = SPICE_CONTAINEROF(item, RedEncodedImage, drawable_link);
+
+        if (encoded->src == src && encoded->image_id == image_id &&
+            encoded->compression == compression && encoded->jpeg_quality == jpeg_quality) {
+            return encoded;
+        }
+    }
+    return NULL;
+}
+
+/* The clients of a display channel get the same drawables, so the first one
+ * sending an image encodes it for the others. */
+int dcc_compress_image(DisplayChannelClient *dcc,
+                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
+                       int can_lossy,
+                       compress_send_data_t* o_comp_data)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    SpiceImageCompression image_compression, shared_compression;
+    RedEncodedImage *encoded;
+    int jpeg_quality;
+
+    image_compression = get_compression_for_bitmap(src, dcc->image_compression, drawable);
+    if (!dcc_get_shared_encoding(dcc, src, drawable, image_compression, can_lossy,
+                                 &shared_compression, &jpeg_quality)) {
+        return dcc_compress_image_for_client(dcc, dest, src, drawable, image_compression,
+                                             can_lossy, o_comp_data);
+    }
+
+    encoded = drawable_find_encoded_image(drawable, src, dest->descriptor.id,
+                                          shared_compression, jpeg_quality);
+    if (encoded) {
+        dest->descriptor.type = encoded->image.descriptor.type;
+        dest->u = encoded->image.u;
+        o_comp_data->comp_buf = encoded->comp_buf;
+        o_comp_data->comp_buf_size = encoded->comp_buf_size;
+        o_comp_data->is_lossy = encoded->is_lossy;
+        o_comp_data->encoded = red_encoded_image_ref(encoded);
+        stat_inc_counter(reds, display->shared_encode_hits_counter, 1);
+        return TRUE;
+    }
+    stat_inc_counter(reds, display->shared_encode_misses_counter, 1);
+
+    if (!dcc_compress_image_for_client(dcc, dest, src, drawable, image_compression,
+                                       can_lossy, o_comp_data)) {
+        return FALSE;
+    }
+    spice_return_val_if_fail(o_comp_data->lzplt_palette == NULL, TRUE);
+
+    encoded = red_encoded_image_new(src, dest->descriptor.id, shared_compression, jpeg_quality,
+                                    dest, o_comp_data->comp_buf, o_comp_data->comp_buf_size,
+                                    o_comp_data->is_lossy);
+    ring_add(&drawable->encoded_images, &encoded->drawable_link);
+    o_comp_data->encoded = red_encoded_image_ref(encoded);
+    return TRUE;
+}
+
 #define CLIENT_PALETTE_CACHE
 #include "cache-item.tmpl.c"
 #undef CLIENT_PALETTE_CACHE
@@ -1474,11 +2001,15 @@ static int restore_surface(DisplayChannelClient *dcc, uint32_t surface_id)
 {
     /* we don't process commands till we receive the migration data, thus,
      * we should have not sent any surface to the client. */
-    if (dcc->surface_client_created[surface_id]) {
+    if (surface_id >= NUM_SURFACES) {
+        spice_warning("invalid surface %u", surface_id);
+        return FALSE;
+    }
+    if (dcc_surface_is_created(dcc, surface_id)) {
         spice_warning("surface %u is already marked as client_created", surface_id);
         return FALSE;
     }
-    dcc->surface_client_created[surface_id] = TRUE;
+    dcc_get_surface(dcc, surface_id)->created = TRUE;
     return TRUE;
 }
 
@@ -1516,8 +2047,7 @@ static int restore_surfaces_lossy(DisplayChannelClient *dcc,
         lossy_rect.top = mig_lossy_rect->top;
         lossy_rect.right = mig_lossy_rect->right;
         lossy_rect.bottom = mig_lossy_rect->bottom;
-        region_init(&dcc->surface_client_lossy_region[surface_id]);
-        region_add(&dcc->surface_client_lossy_region[surface_id], &lossy_rect);
+        region_add(&dcc_find_surface(dcc, surface_id)->lossy_region, &lossy_rect);
     }
     return TRUE;
 }
@@ -1607,6 +2137,9 @@ static void release_item_after_push(DisplayChannelClient *dcc, PipeItem *item)
 
     switch (item->type) {
     case PIPE_ITEM_TYPE_DRAW:
+        dcc_trace_drawable(dcc, SPICE_CONTAINEROF(item, DrawablePipeItem, dpi_pipe_item));
+        pipe_item_unref(item);
+        break;
     case PIPE_ITEM_TYPE_IMAGE:
     case PIPE_ITEM_TYPE_STREAM_CLIP:
     case PIPE_ITEM_TYPE_MONITORS_CONFIG:
@@ -1649,11 +2182,11 @@ static void release_item_before_push(DisplayChannelClient *dcc, PipeItem *item)
         stream_agent_unref(display, agent);
         break;
     }
-    case PIPE_ITEM_TYPE_STREAM_CLIP:
     case PIPE_ITEM_TYPE_UPGRADE:
         upgrade_item_unref(display, (UpgradeItem *)item);
         break;
     case PIPE_ITEM_TYPE_IMAGE:
+    case PIPE_ITEM_TYPE_STREAM_CLIP:
     case PIPE_ITEM_TYPE_MONITORS_CONFIG:
         pipe_item_unref(item);
         break;
@@ -22,6 +22,7 @@
 #include "pixmap-cache.h"
 #include "cache-item.h"
 #include "dcc-encoders.h"
+#include "compress-pool.h"
 #include "stream.h"
 #include "display-limits.h"
 
@@ -47,6 +48,24 @@ typedef struct WaitForChannels {
     SpiceWaitForChannel buf[MAX_CACHE_CLIENTS];
 } WaitForChannels;
 
+/* The client state of the surfaces is kept in pages allocated on demand,
+ * guests only use a few of the NUM_SURFACES ids */
+#define DCC_SURFACE_PAGE_SHIFT 6
+#define DCC_SURFACE_PAGE_SIZE (1 << DCC_SURFACE_PAGE_SHIFT)
+#define DCC_SURFACE_PAGE_MASK (DCC_SURFACE_PAGE_SIZE - 1)
+#define DCC_SURFACE_N_PAGES ((NUM_SURFACES + DCC_SURFACE_PAGE_SIZE - 1) / DCC_SURFACE_PAGE_SIZE)
+
+typedef struct DccSurface {
+    QRegion lossy_region;
+    uint8_t created;  // a create message was queued, and no destroy since
+    uint8_t in_use;
+} DccSurface;
+
+typedef struct DccSurfacePage {
+    DccSurface surfaces[DCC_SURFACE_PAGE_SIZE];
+    uint32_t n_used;
+} DccSurfacePage;
+
 typedef struct FreeList {
     int res_size;
     SpiceResourceList *res;
@@ -94,6 +113,7 @@ struct DisplayChannelClient {
         FreeList free_list;
         uint64_t pixmap_cache_items[MAX_DRAWABLE_PIXMAP_CACHE_ITEMS];
         int num_pixmap_cache_items;
+        uint64_t compress_time; /* for the item being marshalled */
     } send_data;
 
     /* global lz encoding entities */
@@ -105,16 +125,26 @@ struct DisplayChannelClient {
     Ring glz_drawables_inst_to_free;               // list of instances to be freed
     pthread_mutex_t glz_drawables_inst_to_free_lock;
 
-    uint8_t surface_client_created[NUM_SURFACES];
-    QRegion surface_client_lossy_region[NUM_SURFACES];
+    DccSurfacePage *surface_pages[DCC_SURFACE_N_PAGES];
 
     StreamAgent stream_agents[NUM_STREAMS];
     int use_mjpeg_encoder_rate_control;
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
     bool gl_draw_ongoing;
+
+    /* drawable latencies from the QXL ring to the socket, published under
+     * client<latency_slot> if there was room */
+    int latency_slot;
+    stat_info_t process_latency_stat;
+    stat_info_t queue_latency_stat;
+    stat_info_t compress_latency_stat;
+    stat_info_t send_latency_stat;
+    stat_info_t total_latency_stat;
 };
 
+#define DCC_MAX_LATENCY_SLOTS 32
+
 #define DCC_TO_WORKER(dcc)                                              \
     (SPICE_CONTAINEROF((dcc)->common.base.channel, CommonGraphicsChannel, base)->worker)
 #define DCC_TO_DC(dcc)                                                  \
@@ -154,7 +184,12 @@ typedef struct DrawablePipeItem {
     PipeItem dpi_pipe_item; /* link for the client's pipe itself */
     Drawable *drawable;
     DisplayChannelClient *dcc;
+    CompressJob *compress_job; /* copy bitmap being compressed ahead of sending */
     uint8_t refs;
+    /* see the latency times of Drawable */
+    uint64_t enqueue_time;
+    uint64_t send_time;
+    uint64_t compress_time; /* spent encoding, not a time */
 } DrawablePipeItem;
 
 DisplayChannelClient*      dcc_new                                   (DisplayChannel *display,
@@ -204,6 +239,9 @@ void                       dcc_append_drawable                       (DisplayCha
 void                       dcc_add_drawable_after                    (DisplayChannelClient *dcc,
                                                                       Drawable *drawable,
                                                                       PipeItem *pos);
+int                        dcc_pipe_item_can_overtake                (DisplayChannelClient *dcc,
+                                                                      PipeItem *item,
+                                                                      PipeItem *overtaken);
 void                       dcc_release_item                          (DisplayChannelClient *dcc,
                                                                       PipeItem *item,
                                                                       int item_pushed);
@@ -218,12 +256,28 @@ PipeItem *                 dcc_gl_scanout_item_new                   (RedChannel
                                                                       void *data, int num);
 PipeItem *                 dcc_gl_draw_item_new                      (RedChannelClient *rcc,
                                                                       void *data, int num);
+/* NULL if the client has no state for @surface_id */
+DccSurface *               dcc_find_surface                          (DisplayChannelClient *dcc,
+                                                                      uint32_t surface_id);
+/* adds an empty state if there is none */
+DccSurface *               dcc_get_surface                           (DisplayChannelClient *dcc,
+                                                                      uint32_t surface_id);
+void                       dcc_remove_surface                        (DisplayChannelClient *dcc,
+                                                                      uint32_t surface_id);
+
+static inline int dcc_surface_is_created(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    DccSurface *surface = dcc_find_surface(dcc, surface_id);
+
+    return surface && surface->created;
+}
 
 typedef struct compress_send_data_t {
     void*    comp_buf;
     uint32_t comp_buf_size;
     SpicePalette *lzplt_palette;
     int is_lossy;
+    RedEncodedImage *encoded; /* owns comp_buf when set */
 } compress_send_data_t;
 
 int                        dcc_compress_image                        (DisplayChannelClient *dcc,
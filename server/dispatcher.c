@@ -24,7 +24,9 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <poll.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #define SPICE_LOG_DOMAIN "SpiceDispatcher"
 
@@ -42,11 +44,26 @@ G_DEFINE_TYPE(Dispatcher, dispatcher, G_TYPE_OBJECT)
 
 #define DISPATCHER_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), TYPE_DISPATCHER, DispatcherPrivate))
 
+/* Messages are passed through a single producer / single consumer ring in
+ * memory, senders being serialized by 'lock'. The file descriptors are only
+ * used to wake the receiver up when the ring goes from empty to non empty.
+ * Each message is stored as its type followed by its payload. */
+#define DISPATCHER_RING_SIZE (64 * 1024)
+#define DISPATCHER_RING_MASK (DISPATCHER_RING_SIZE - 1)
+
 struct DispatcherPrivate {
     int recv_fd;
     int send_fd;
     pthread_t self;
     pthread_mutex_t lock;
+    uint8_t *ring;
+    volatile guint ring_head; /* written by the sender */
+    volatile guint ring_tail; /* written by the receiver */
+    pthread_mutex_t ring_lock; /* protects the waits below */
+    pthread_cond_t ring_cond;
+    int space_waiters;
+    guint acks;
+    volatile gint closed; /* set by the receiver, see dispatcher_close() */
     DispatcherMessage *messages;
     int stage;  /* message parser stage - sender has no stages */
     guint max_message_type;
@@ -110,9 +127,14 @@ dispatcher_finalize(GObject *object)
 {
     Dispatcher *self = DISPATCHER(object);
     g_free(self->priv->messages);
-    close(self->priv->send_fd);
+    if (self->priv->send_fd != self->priv->recv_fd) {
+        close(self->priv->send_fd);
+    }
     close(self->priv->recv_fd);
     pthread_mutex_destroy(&self->priv->lock);
+    pthread_cond_destroy(&self->priv->ring_cond);
+    pthread_mutex_destroy(&self->priv->ring_lock);
+    g_free(self->priv->ring);
     free(self->priv->payload);
     G_OBJECT_CLASS(dispatcher_parent_class)->finalize(object);
 }
@@ -127,11 +149,25 @@ static void dispatcher_constructed(GObject *object)
 #ifdef DEBUG_DISPATCHER
     setup_dummy_signal_handler();
 #endif
-    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
-        spice_error("socketpair failed %s", strerror(errno));
-        return;
+#ifdef HAVE_SYS_EVENTFD_H
+    channels[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channels[0] != -1) {
+        channels[1] = channels[0];
+    } else
+#endif
+    {
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
+            spice_error("socketpair failed %s", strerror(errno));
+            return;
+        }
+        /* wakeups are never waited for, on either side */
+        fcntl(channels[0], F_SETFL, fcntl(channels[0], F_GETFL) | O_NONBLOCK);
+        fcntl(channels[1], F_SETFL, fcntl(channels[1], F_GETFL) | O_NONBLOCK);
     }
     pthread_mutex_init(&self->priv->lock, NULL);
+    pthread_mutex_init(&self->priv->ring_lock, NULL);
+    pthread_cond_init(&self->priv->ring_cond, NULL);
+    self->priv->ring = g_malloc(DISPATCHER_RING_SIZE);
     self->priv->recv_fd = channels[0];
     self->priv->send_fd = channels[1];
     self->priv->self = pthread_self();
@@ -188,165 +224,164 @@ dispatcher_new(size_t max_message_type, void *opaque)
 }
 
 
-#define ACK 0xffffffff
+static void dispatcher_wakeup(Dispatcher *dispatcher)
+{
+    /* eventfd needs a 64 bit counter, the socket fallback doesn't care */
+    uint64_t wakeup = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(dispatcher->priv->send_fd, &wakeup, sizeof(wakeup));
+    } while (ret == -1 && errno == EINTR);
+    /* EAGAIN means a wakeup is already pending */
+    if (ret == -1 && errno != EAGAIN) {
+        spice_printerr("error: failed to wake up dispatcher: %s", strerror(errno));
+    }
+}
 
-/*
- * read_safe
- * helper. reads until size bytes accumulated in buf, if an error other then
- * EINTR is encountered returns -1, otherwise returns 0.
- * @block if 1 the read will block (the fd is always blocking).
- *        if 0 poll first, return immediately if no bytes available, otherwise
- *         read size in blocking mode.
- */
-static int read_safe(int fd, uint8_t *buf, size_t size, int block)
+static void dispatcher_clear_wakeup(Dispatcher *dispatcher)
 {
-    int read_size = 0;
-    int ret;
-    struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    uint8_t buf[64];
+    ssize_t ret;
 
-    if (size == 0) {
-        return 0;
-    }
+    do {
+        ret = read(dispatcher->priv->recv_fd, buf, sizeof(buf));
+    } while (ret > 0 || (ret == -1 && errno == EINTR));
+}
 
-    if (!block) {
-        while ((ret = poll(&pollfd, 1, 0)) == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in poll");
-                continue;
-            }
-            spice_error("poll failed");
-            return -1;
-        }
-        if (!(pollfd.revents & POLLIN)) {
-            return 0;
-        }
-    }
-    while (read_size < size) {
-        ret = read(fd, buf + read_size, size - read_size);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in read");
-                continue;
-            }
-            return -1;
-        }
-        if (ret == 0) {
-            spice_error("broken pipe on read");
-            return -1;
-        }
-        read_size += ret;
-    }
-    return read_size;
+static void dispatcher_ring_write(DispatcherPrivate *priv, guint pos,
+                                  const void *data, size_t size)
+{
+    size_t offset = pos & DISPATCHER_RING_MASK;
+    size_t now = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(priv->ring + offset, data, now);
+    memcpy(priv->ring, (const uint8_t *)data + now, size - now);
 }
 
-/*
- * write_safe
- * @return -1 for error, otherwise number of written bytes. may be zero.
- */
-static int write_safe(int fd, uint8_t *buf, size_t size)
+static void dispatcher_ring_read(DispatcherPrivate *priv, guint pos,
+                                 void *data, size_t size)
 {
-    int written_size = 0;
-    int ret;
-
-    while (written_size < size) {
-        ret = write(fd, buf + written_size, size - written_size);
-        if (ret == -1) {
-            if (errno != EINTR) {
-                spice_debug("EINTR in write");
-                return -1;
-            }
-            continue;
-        }
-        written_size += ret;
-    }
-    return written_size;
+    size_t offset = pos & DISPATCHER_RING_MASK;
+    size_t now = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(data, priv->ring + offset, now);
+    memcpy((uint8_t *)data + now, priv->ring, size - now);
 }
 
 static int dispatcher_handle_single_read(Dispatcher *dispatcher)
 {
-    int ret;
+    DispatcherPrivate *priv = dispatcher->priv;
     uint32_t type;
     DispatcherMessage *msg = NULL;
-    uint8_t *payload = dispatcher->priv->payload;
-    uint32_t ack = ACK;
+    uint8_t *payload = priv->payload;
+    guint tail = priv->ring_tail;
 
-    if ((ret = read_safe(dispatcher->priv->recv_fd, (uint8_t*)&type, sizeof(type), 0)) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        return 0;
-    }
-    if (ret == 0) {
+    if ((guint)g_atomic_int_get(&priv->ring_head) == tail) {
         /* no messsage */
         return 0;
     }
-    msg = &dispatcher->priv->messages[type];
-    if (read_safe(dispatcher->priv->recv_fd, payload, msg->size, 1) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        /* TODO: close socketpair? */
+    dispatcher_ring_read(priv, tail, &type, sizeof(type));
+    if (type >= priv->max_message_type) {
+        spice_printerr("error: invalid message type %u in dispatcher", type);
         return 0;
     }
-    if (dispatcher->priv->any_handler) {
-        dispatcher->priv->any_handler(dispatcher->priv->opaque, type, payload);
+    msg = &priv->messages[type];
+    dispatcher_ring_read(priv, tail + sizeof(type), payload, msg->size);
+    /* the payload was copied out, let the sender reuse the space */
+    g_atomic_int_set(&priv->ring_tail, tail + sizeof(type) + msg->size);
+
+    if (priv->any_handler) {
+        priv->any_handler(priv->opaque, type, payload);
     }
     if (msg->handler) {
-        msg->handler(dispatcher->priv->opaque, payload);
+        msg->handler(priv->opaque, payload);
     } else {
         spice_printerr("error: no handler for message type %d", type);
     }
     if (msg->ack == DISPATCHER_ACK) {
-        if (write_safe(dispatcher->priv->recv_fd,
-                       (uint8_t*)&ack, sizeof(ack)) == -1) {
-            spice_printerr("error writing ack for message %d", type);
-            /* TODO: close socketpair? */
-        }
-    } else if (msg->ack == DISPATCHER_ASYNC && dispatcher->priv->handle_async_done) {
-        dispatcher->priv->handle_async_done(dispatcher->priv->opaque, type,
-                                      (void *)payload);
+        pthread_mutex_lock(&priv->ring_lock);
+        priv->acks++;
+        pthread_cond_broadcast(&priv->ring_cond);
+        pthread_mutex_unlock(&priv->ring_lock);
+    } else if (msg->ack == DISPATCHER_ASYNC && priv->handle_async_done) {
+        priv->handle_async_done(priv->opaque, type, (void *)payload);
     }
     return 1;
 }
 
 /*
  * dispatcher_handle_recv_read
- * doesn't handle being in the middle of a message. all reads are blocking.
+ * handles all the messages queued in the ring
  */
 void dispatcher_handle_recv_read(Dispatcher *dispatcher)
 {
+    DispatcherPrivate *priv = dispatcher->priv;
+
+    /* clear first, so that a message sent while draining wakes us up again */
+    dispatcher_clear_wakeup(dispatcher);
     while (dispatcher_handle_single_read(dispatcher)) {
     }
+
+    pthread_mutex_lock(&priv->ring_lock);
+    if (priv->space_waiters) {
+        pthread_cond_broadcast(&priv->ring_cond);
+    }
+    pthread_mutex_unlock(&priv->ring_lock);
 }
 
 void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
                              void *payload)
 {
+    DispatcherPrivate *priv = dispatcher->priv;
     DispatcherMessage *msg;
-    uint32_t ack;
-    int send_fd = dispatcher->priv->send_fd;
-
-    assert(dispatcher->priv->max_message_type > message_type);
-    assert(dispatcher->priv->messages[message_type].handler);
-    msg = &dispatcher->priv->messages[message_type];
-    pthread_mutex_lock(&dispatcher->priv->lock);
-    if (write_safe(send_fd, (uint8_t*)&message_type, sizeof(message_type)) == -1) {
-        spice_printerr("error: failed to send message type for message %d",
-                   message_type);
-        goto unlock;
+    size_t needed;
+    guint head, acks = 0;
+
+    assert(priv->max_message_type > message_type);
+    assert(priv->messages[message_type].handler);
+    msg = &priv->messages[message_type];
+    needed = sizeof(message_type) + msg->size;
+
+    pthread_mutex_lock(&priv->lock);
+    if (g_atomic_int_get(&priv->closed)) {
+        pthread_mutex_unlock(&priv->lock);
+        spice_warning("receiver is gone, message %u dropped", message_type);
+        return;
     }
-    if (write_safe(send_fd, payload, msg->size) == -1) {
-        spice_printerr("error: failed to send message body for message %d",
-                   message_type);
-        goto unlock;
+    head = priv->ring_head;
+    if (head - (guint)g_atomic_int_get(&priv->ring_tail) + needed > DISPATCHER_RING_SIZE) {
+        pthread_mutex_lock(&priv->ring_lock);
+        priv->space_waiters++;
+        while (head - (guint)g_atomic_int_get(&priv->ring_tail) + needed > DISPATCHER_RING_SIZE) {
+            pthread_cond_wait(&priv->ring_cond, &priv->ring_lock);
+        }
+        priv->space_waiters--;
+        pthread_mutex_unlock(&priv->ring_lock);
     }
     if (msg->ack == DISPATCHER_ACK) {
-        if (read_safe(send_fd, (uint8_t*)&ack, sizeof(ack), 1) == -1) {
-            spice_printerr("error: failed to read ack");
-        } else if (ack != ACK) {
-            spice_printerr("error: got wrong ack value in dispatcher "
-                       "for message %d\n", message_type);
-            /* TODO handling error? */
+        pthread_mutex_lock(&priv->ring_lock);
+        acks = priv->acks;
+        pthread_mutex_unlock(&priv->ring_lock);
+    }
+
+    dispatcher_ring_write(priv, head, &message_type, sizeof(message_type));
+    dispatcher_ring_write(priv, head + sizeof(message_type), payload, msg->size);
+    g_atomic_int_set(&priv->ring_head, head + needed);
+    /* both head and tail accesses are full barriers, so either we see the
+     * receiver caught up with us or the receiver sees the new message */
+    if ((guint)g_atomic_int_get(&priv->ring_tail) == head) {
+        dispatcher_wakeup(dispatcher);
+    }
+
+    if (msg->ack == DISPATCHER_ACK) {
+        pthread_mutex_lock(&priv->ring_lock);
+        while (priv->acks == acks) {
+            pthread_cond_wait(&priv->ring_cond, &priv->ring_lock);
         }
+        pthread_mutex_unlock(&priv->ring_lock);
     }
-unlock:
-    pthread_mutex_unlock(&dispatcher->priv->lock);
+    pthread_mutex_unlock(&priv->lock);
 }
 
 void dispatcher_register_async_done_callback(
@@ -369,6 +404,7 @@ void dispatcher_register_handler(Dispatcher *dispatcher, uint32_t message_type,
     msg->handler = handler;
     msg->size = size;
     msg->ack = ack;
+    assert(sizeof(message_type) + size <= DISPATCHER_RING_SIZE / 2);
     if (msg->size > dispatcher->priv->payload_size) {
         dispatcher->priv->payload = realloc(dispatcher->priv->payload, msg->size);
         dispatcher->priv->payload_size = msg->size;
@@ -412,6 +448,14 @@ void dispatcher_set_opaque(Dispatcher *self, void *opaque)
     g_object_notify(G_OBJECT(self), "opaque");
 }
 
+/* Called by the receiver while it handles an ack'ed message: the sender of
+ * that message holds the lock until the ack, so the senders after it all
+ * see the flag */
+void dispatcher_close(Dispatcher *dispatcher)
+{
+    g_atomic_int_set(&dispatcher->priv->closed, TRUE);
+}
+
 int dispatcher_get_recv_fd(Dispatcher *dispatcher)
 {
     return dispatcher->priv->recv_fd;
@@ -123,6 +123,15 @@ void dispatcher_register_universal_handler(Dispatcher *dispatcher,
  */
 void dispatcher_handle_recv_read(Dispatcher *);
 
+/*
+ *  dispatcher_close
+ *  @dispatcher: Dispatcher instance
+ *
+ *  Called from the receiver when it stops handling messages, the messages
+ *  sent afterwards are dropped instead of waiting for it forever.
+ */
+void dispatcher_close(Dispatcher *dispatcher);
+
 /*
  *  dispatcher_get_recv_fd
  *  @return: receive file descriptor of the dispatcher
@@ -48,10 +48,13 @@ void display_channel_compress_stats_reset(DisplayChannel *display)
 
 void display_channel_compress_stats_print(const DisplayChannel *display_channel)
 {
+    uint64_t glz_enc_size;
+
     spice_return_if_fail(display_channel);
 
-#ifdef COMPRESS_STAT
-    uint64_t glz_enc_size;
+    if (!stat_probes_enabled()) {
+        return;
+    }
 
     glz_enc_size = display_channel->enable_zlib_glz_wrap ?
                        display_channel->zlib_glz_stat.comp_size :
@@ -138,7 +141,6 @@ void display_channel_compress_stats_print(const DisplayChannel *display_channel)
                                     display_channel->lz4_stat.total +
                                     display_channel->jpeg_alpha_stat.total)
                );
-#endif
 }
 
 MonitorsConfig* monitors_config_ref(MonitorsConfig *monitors_config)
@@ -275,6 +277,8 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
     }
 
     region_destroy(&surface->draw_dirty_region);
+    tree_index_free(surface->current_index);
+    surface->current_index = NULL;
     surface->context.canvas = NULL;
     FOREACH_DCC(display, link, next, dcc) {
         dcc_destroy_surface(dcc, surface_id);
@@ -383,6 +387,14 @@ static void current_add_drawable(DisplayChannel *display,
 
     surface = &display->surfaces[surface_id];
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
+    if (surface->current_index && !drawable->tree_item.base.container) {
+        if (pos == &surface->current) {
+            tree_index_add_front(surface->current_index, &drawable->tree_item.base);
+        } else {
+            tree_index_add_behind(&drawable->tree_item.base,
+                                  SPICE_CONTAINEROF(pos, TreeItem, siblings_link));
+        }
+    }
     ring_add(&display->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
     display->current_size++;
@@ -394,6 +406,7 @@ static void current_remove_drawable(DisplayChannel *display, Drawable *item)
     /* todo: move all to unref? */
     stream_trace_add_drawable(display, item);
     draw_item_remove_shadow(&item->tree_item);
+    tree_index_remove(&item->tree_item.base);
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
     ring_remove(&item->surface_list_link);
@@ -629,8 +642,44 @@ static void __exclude_region(DisplayChannel *display, Ring *ring, TreeItem *item
     stat_add(&display->__exclude_stat, start_time);
 }
 
-static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_item,
-                           QRegion *rgn, TreeItem **last, Drawable *frame_candidate)
+/*
+ * Returns the item following @pos in @ring that may intersect @rgn, or NULL.
+ * @pos is either @ring itself or one of its items. The top level of the
+ * surface tree is looked up in its spatial index, other rings are walked
+ * item by item. If @stop lies between @pos and the returned item, @stop is
+ * returned instead so that walks bounded by it still reach it.
+ */
+static RingItem *current_next_candidate(RedSurface *surface, Ring *ring, RingItem *pos,
+                                        const QRegion *rgn, TreeItem *stop)
+{
+    TreeItem *after = NULL;
+    TreeItem *found;
+    SpiceRect area;
+
+    if (ring != &surface->current || !surface->current_index) {
+        return ring_next(ring, pos);
+    }
+    if (pos != ring) {
+        after = SPICE_CONTAINEROF(pos, TreeItem, siblings_link);
+    }
+    area.left = rgn->extents.x1;
+    area.top = rgn->extents.y1;
+    area.right = rgn->extents.x2;
+    area.bottom = rgn->extents.y2;
+    if (!tree_index_find_next(surface->current_index, &area, after, &found)) {
+        return ring_next(ring, pos);
+    }
+    if (stop && stop->index_entry &&
+        (!after || tree_index_is_behind(stop, after)) &&
+        (!found || tree_index_is_behind(found, stop))) {
+        return &stop->siblings_link;
+    }
+    return found ? &found->siblings_link : NULL;
+}
+
+static void exclude_region(DisplayChannel *display, RedSurface *surface, Ring *ring,
+                           RingItem *ring_item, QRegion *rgn, TreeItem **last,
+                           Drawable *frame_candidate)
 {
     Ring *top_ring;
     stat_start(&display->exclude_stat, start_time);
@@ -674,7 +723,8 @@ static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_i
         }
 
         while ((last && *last == (TreeItem *)ring_item) ||
-               !(ring_item = ring_next(ring, ring_item))) {
+               !(ring_item = current_next_candidate(surface, ring, ring_item, rgn,
+                                                    last ? *last : NULL))) {
             if (ring == top_ring) {
                 stat_add(&display->exclude_stat, start_time);
                 return;
@@ -693,6 +743,7 @@ static int current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawable
     ++display->add_with_shadow_count;
 #endif
 
+    RedSurface *surface = &display->surfaces[item->surface_id];
     RedDrawable *red_drawable = item->red_drawable;
     SpicePoint delta = {
         .x = red_drawable->u.copy_bits.src_pos.x - red_drawable->bbox.left,
@@ -713,11 +764,15 @@ static int current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawable
     }
 
     ring_add(ring, &shadow->base.siblings_link);
+    if (surface->current_index) {
+        tree_index_add_front(surface->current_index, &shadow->base);
+    }
     current_add_drawable(display, item, ring);
     if (item->tree_item.effect == QXL_EFFECT_OPAQUE) {
         QRegion exclude_rgn;
         region_clone(&exclude_rgn, &item->tree_item.base.rgn);
-        exclude_region(display, ring, &shadow->base.siblings_link, &exclude_rgn, NULL, NULL);
+        exclude_region(display, surface, ring, &shadow->base.siblings_link, &exclude_rgn,
+                       NULL, NULL);
         region_destroy(&exclude_rgn);
         streams_update_visible_region(display, item);
     } else {
@@ -731,6 +786,7 @@ static int current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawable
 
 static int current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
 {
+    RedSurface *surface = &display->surfaces[drawable->surface_id];
     DrawItem *item = &drawable->tree_item;
     RingItem *now;
     QRegion exclude_rgn;
@@ -739,19 +795,19 @@ static int current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
 
     spice_assert(!region_is_empty(&item->base.rgn));
     region_init(&exclude_rgn);
-    now = ring_next(ring, ring);
+    now = current_next_candidate(surface, ring, ring, &item->base.rgn, NULL);
 
     while (now) {
         TreeItem *sibling = SPICE_CONTAINEROF(now, TreeItem, siblings_link);
         int test_res;
 
         if (!region_bounds_intersects(&item->base.rgn, &sibling->rgn)) {
-            now = ring_next(ring, now);
+            now = current_next_candidate(surface, ring, now, &item->base.rgn, NULL);
             continue;
         }
         test_res = region_test(&item->base.rgn, &sibling->rgn, REGION_TEST_ALL);
         if (!(test_res & REGION_TEST_SHARED)) {
-            now = ring_next(ring, now);
+            now = current_next_candidate(surface, ring, now, &item->base.rgn, NULL);
             continue;
         } else if (sibling->type != TREE_ITEM_TYPE_SHADOW) {
             if (!(test_res & REGION_TEST_RIGHT_EXCLUSIVE) &&
@@ -768,7 +824,8 @@ static int current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                 if ((shadow = tree_item_find_shadow(sibling))) {
                     if (exclude_base) {
                         TreeItem *next = sibling;
-                        exclude_region(display, ring, exclude_base, &exclude_rgn, &next, NULL);
+                        exclude_region(display, surface, ring, exclude_base, &exclude_rgn,
+                                       &next, NULL);
                         if (next != sibling) {
                             now = next ? &next->siblings_link : NULL;
                             exclude_base = NULL;
@@ -790,7 +847,8 @@ static int current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                 Container *container;
 
                 if (exclude_base) {
-                    exclude_region(display, ring, exclude_base, &exclude_rgn, NULL, NULL);
+                    exclude_region(display, surface, ring, exclude_base, &exclude_rgn,
+                                   NULL, NULL);
                     region_clear(&exclude_rgn);
                     exclude_base = NULL;
                 }
@@ -821,7 +879,7 @@ static int current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
     }
     if (item->effect == QXL_EFFECT_OPAQUE) {
         region_or(&exclude_rgn, &item->base.rgn);
-        exclude_region(display, ring, exclude_base, &exclude_rgn, NULL, drawable);
+        exclude_region(display, surface, ring, exclude_base, &exclude_rgn, NULL, drawable);
         stream_trace_update(display, drawable);
         streams_update_visible_region(display, drawable);
         /*
@@ -890,6 +948,11 @@ void display_channel_print_stats(DisplayChannel *display)
 {
 #ifdef RED_WORKER_STAT
     stat_time_t total = display->add_stat.total;
+    RedCompressBufPool *bufs = &display->compress_bufs;
+    ImageCache *image_cache = &display->image_cache;
+    SlabStats slab_stats;
+    int i;
+
     spice_info("add with shadow count %u",
                display->add_with_shadow_count);
     display->add_with_shadow_count = 0;
@@ -909,6 +972,34 @@ void display_channel_print_stats(DisplayChannel *display)
     stat_reset(&display->add_stat);
     stat_reset(&display->exclude_stat);
     stat_reset(&display->__exclude_stat);
+
+    slab_get_stats(display->drawables, &slab_stats);
+    spice_info("drawables %u/%u (peak %u) in %u chunks, %zu/%zu bytes",
+               slab_stats.objects, slab_stats.capacity, slab_stats.peak_objects,
+               slab_stats.chunks, slab_stats.bytes, slab_stats.max_bytes);
+    pipe_item_pool_get_stats(display->drawable_pipe_items, &slab_stats);
+    spice_info("drawable pipe items %u/%u (peak %u) in %u chunks",
+               slab_stats.objects, slab_stats.capacity, slab_stats.peak_objects,
+               slab_stats.chunks);
+    pipe_item_pool_get_stats(display->stream_clip_items, &slab_stats);
+    spice_info("stream clip items %u/%u (peak %u) in %u chunks",
+               slab_stats.objects, slab_stats.capacity, slab_stats.peak_objects,
+               slab_stats.chunks);
+    for (i = 0; i < display->n_surfaces; i++) {
+        if (display->surfaces[i].drawable_count) {
+            spice_info("surface %d: %u drawables", i, display->surfaces[i].drawable_count);
+        }
+    }
+
+    pthread_mutex_lock(&bufs->lock);
+    spice_info("compress bufs: %" PRIu64 " hits %" PRIu64 " misses, %u/%u free",
+               bufs->hits, bufs->misses, bufs->n_free, bufs->max_free);
+    pthread_mutex_unlock(&bufs->lock);
+
+    spice_info("image cache: %" PRIu64 " hits %" PRIu64 " misses %" PRIu64 " evictions, "
+               "%u images in %zu/%zu bytes",
+               image_cache->hits, image_cache->misses, image_cache->evictions,
+               image_cache->num_items, image_cache->bytes, image_cache->max_bytes);
 #endif
 }
 
@@ -1112,6 +1203,7 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
 
     drawable->surface_id = red_drawable->surface_id;
     display->surfaces[drawable->surface_id].refs++;
+    display->surfaces[drawable->surface_id].drawable_count++;
 
     memcpy(drawable->surface_deps, red_drawable->surface_deps, sizeof(drawable->surface_deps));
     /*
@@ -1169,6 +1261,9 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
         drawable->streamable = drawable_can_stream(display, drawable);
         add_to_pipe = current_add(display, ring, drawable);
     }
+    if (drawable->pickup_time) {
+        drawable->tree_time = spice_get_monotonic_time_ns();
+    }
 
     if (add_to_pipe)
         pipes_add_drawable(display, drawable);
@@ -1180,7 +1275,7 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 }
 
 void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_drawable,
-                                  int process_commands_generation)
+                                  int process_commands_generation, uint64_t pickup_time)
 {
     Drawable *drawable =
         display_channel_get_drawable(display, red_drawable->effect, red_drawable,
@@ -1189,6 +1284,7 @@ void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_draw
     if (!drawable) {
         return;
     }
+    drawable->pickup_time = pickup_time;
 
     display_channel_add_drawable(display, drawable);
 
@@ -1334,34 +1430,43 @@ void display_channel_free_some(DisplayChannel *display)
     }
 }
 
+static void drawables_update_stats(DisplayChannel *display)
+{
+#ifdef RED_STATISTICS
+    SlabStats stats;
+
+    slab_get_stats(display->drawables, &stats);
+    stat_set_counter(reds, display->drawables_counter, stats.objects);
+    stat_set_counter(reds, display->drawables_peak_counter, stats.peak_objects);
+    stat_set_counter(reds, display->drawable_chunks_counter, stats.chunks);
+#endif
+}
+
 static Drawable* drawable_try_new(DisplayChannel *display)
 {
     Drawable *drawable;
 
-    if (!display->free_drawables)
+    if (!(drawable = slab_alloc(display->drawables)))
         return NULL;
 
-    drawable = &display->free_drawables->u.drawable;
-    display->free_drawables = display->free_drawables->u.next;
     display->drawable_count++;
+    drawables_update_stats(display);
 
     return drawable;
 }
 
 static void drawable_free(DisplayChannel *display, Drawable *drawable)
 {
-    ((_Drawable *)drawable)->u.next = display->free_drawables;
-    display->free_drawables = (_Drawable *)drawable;
+    slab_release(display->drawables, drawable);
+    drawables_update_stats(display);
 }
 
 static void drawables_init(DisplayChannel *display)
 {
-    int i;
+    size_t max_memory = slab_get_max_bytes(DRAWABLES_MAX_MEMORY_ENV,
+                                           DRAWABLES_DEFAULT_MAX_MEMORY);
 
-    display->free_drawables = NULL;
-    for (i = 0; i < NUM_DRAWABLES; i++) {
-        drawable_free(display, &display->drawables[i].u.drawable);
-    }
+    display->drawables = slab_new(sizeof(Drawable), DRAWABLES_CHUNK_SIZE, max_memory);
 }
 
 /**
@@ -1377,6 +1482,7 @@ Drawable *display_channel_drawable_try_new(DisplayChannel *display,
     while (!(drawable = drawable_try_new(display))) {
         if (!free_one_drawable(display, FALSE))
             return NULL;
+        stat_inc_counter(reds, display->drawable_forced_frees_counter, 1);
     }
 
     bzero(drawable, sizeof(Drawable));
@@ -1389,6 +1495,7 @@ Drawable *display_channel_drawable_try_new(DisplayChannel *display,
     region_init(&drawable->tree_item.base.rgn);
     ring_init(&drawable->pipes);
     ring_init(&drawable->glz_ring);
+    ring_init(&drawable->encoded_images);
     drawable->process_commands_generation = process_commands_generation;
 
     return drawable;
@@ -1447,12 +1554,17 @@ void display_channel_drawable_unref(DisplayChannel *display, Drawable *drawable)
 
     drawable_remove_dependencies(display, drawable);
     drawable_unref_surface_deps(display, drawable);
+    display->surfaces[drawable->surface_id].drawable_count--;
     display_channel_surface_unref(display, drawable->surface_id);
 
     RING_FOREACH_SAFE(item, next, &drawable->glz_ring) {
         SPICE_CONTAINEROF(item, RedGlzDrawable, drawable_link)->drawable = NULL;
         ring_remove(item);
     }
+    RING_FOREACH_SAFE(item, next, &drawable->encoded_images) {
+        ring_remove(item);
+        red_encoded_image_unref(SPICE_CONTAINEROF(item, RedEncodedImage, drawable_link));
+    }
     if (drawable->red_drawable) {
         red_drawable_unref(drawable->red_drawable);
     }
@@ -1669,7 +1781,8 @@ static Drawable* current_find_intersects_rect(Ring *current, RingItem *from,
 
     for (it = from ? from : ring_next(current, current); it != NULL; it = ring_next(current, it)) {
         Drawable *now = SPICE_CONTAINEROF(it, Drawable, surface_list_link);
-        if (region_intersects(&rgn, &now->tree_item.base.rgn)) {
+        if (region_bounds_intersects(&rgn, &now->tree_item.base.rgn) &&
+            region_intersects(&rgn, &now->tree_item.base.rgn)) {
             last = now;
             break;
         }
@@ -1913,6 +2026,8 @@ void display_channel_create_surface(DisplayChannel *display, uint32_t surface_id
     surface->create.info = NULL;
     surface->destroy.info = NULL;
     ring_init(&surface->current);
+    tree_index_free(surface->current_index);
+    surface->current_index = tree_index_new(width, height);
     ring_init(&surface->current_list);
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
@@ -1983,6 +2098,11 @@ static void hold_item(RedChannelClient *rcc, PipeItem *item)
     }
 }
 
+static int item_can_overtake(RedChannelClient *rcc, PipeItem *item, PipeItem *overtaken)
+{
+    return dcc_pipe_item_can_overtake(RCC_TO_DCC(rcc), item, overtaken);
+}
+
 static void release_item(RedChannelClient *rcc, PipeItem *item, int item_pushed)
 {
     DisplayChannelClient *dcc = RCC_TO_DCC(rcc);
@@ -2023,6 +2143,25 @@ static SpiceCanvas *image_surfaces_get(SpiceImageSurfaces *surfaces, uint32_t su
     return display->surfaces[surface_id].context.canvas;
 }
 
+static void display_channel_init_trace(DisplayChannel *display)
+{
+    const char *path = getenv(DRAWABLE_TRACE_ENV);
+    const char *sample = getenv(DRAWABLE_TRACE_SAMPLE_ENV);
+
+    display->trace_sample = sample && atoi(sample) > 0 ? atoi(sample) :
+                                                         DRAWABLE_TRACE_DEFAULT_SAMPLE;
+    if (!path) {
+        return;
+    }
+    display->trace_file = fopen(path, "a");
+    if (!display->trace_file) {
+        spice_warning("failed to open drawable trace %s: %s", path, strerror(errno));
+        return;
+    }
+    setvbuf(display->trace_file, NULL, _IOLBF, 0);
+    spice_info("tracing one out of %u drawables to %s", display->trace_sample, path);
+}
+
 DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker, 
                                     int migrate, int stream_video,
                                     uint32_t n_surfaces)
@@ -2033,6 +2172,7 @@ DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker,
         .send_item = send_item,
         .hold_item = hold_item,
         .release_item = release_item,
+        .item_can_overtake = item_can_overtake,
         .handle_migrate_flush_mark = handle_migrate_flush_mark,
         .handle_migrate_data = handle_migrate_data,
         .handle_migrate_data_get_serial = handle_migrate_data_get_serial
@@ -2061,7 +2201,33 @@ DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker,
                                                      "add_to_cache", TRUE);
     display->non_cache_counter = stat_add_counter(reds, channel->stat,
                                                   "non_cache", TRUE);
+    display->compress_pool_hits_counter = stat_add_counter(reds, channel->stat,
+                                                           "compress_pool_hits", TRUE);
+    display->compress_pool_misses_counter = stat_add_counter(reds, channel->stat,
+                                                             "compress_pool_misses", TRUE);
+    display->shared_encode_hits_counter = stat_add_counter(reds, channel->stat,
+                                                           "shared_encode_hits", TRUE);
+    display->shared_encode_misses_counter = stat_add_counter(reds, channel->stat,
+                                                             "shared_encode_misses", TRUE);
+    display->drawables_counter = stat_add_counter(reds, channel->stat, "drawables", TRUE);
+    display->drawables_peak_counter = stat_add_counter(reds, channel->stat,
+                                                       "drawables_peak", TRUE);
+    display->drawable_chunks_counter = stat_add_counter(reds, channel->stat,
+                                                        "drawable_chunks", TRUE);
+    display->drawable_forced_frees_counter = stat_add_counter(reds, channel->stat,
+                                                              "drawable_forced_frees", TRUE);
+    display->compress_buf_hits_counter = stat_add_counter(reds, channel->stat,
+                                                          "compress_buf_hits", TRUE);
+    display->compress_buf_misses_counter = stat_add_counter(reds, channel->stat,
+                                                            "compress_buf_misses", TRUE);
+    display->image_cache_hits_counter = stat_add_counter(reds, channel->stat,
+                                                         "image_cache_hits", TRUE);
+    display->image_cache_misses_counter = stat_add_counter(reds, channel->stat,
+                                                           "image_cache_misses", TRUE);
+    display->image_cache_evictions_counter = stat_add_counter(reds, channel->stat,
+                                                              "image_cache_evictions", TRUE);
 #endif
+    stat_compress_init(&display->off_stat, "off", stat_clock);
     stat_compress_init(&display->lz_stat, "lz", stat_clock);
     stat_compress_init(&display->glz_stat, "glz", stat_clock);
     stat_compress_init(&display->quic_stat, "quic", stat_clock);
@@ -2076,13 +2242,64 @@ DisplayChannel* display_channel_new(SpiceServer *reds, RedWorker *worker,
     ring_init(&display->current_list);
     display->image_surfaces.ops = &image_surfaces_ops;
     drawables_init(display);
-    image_cache_init(&display->image_cache);
+    display->drawable_pipe_items = pipe_item_pool_new("drawable", sizeof(DrawablePipeItem));
+    display->stream_clip_items = pipe_item_pool_new("stream clip", sizeof(StreamClipItem));
+    image_cache_init(&display->image_cache,
+                     slab_get_max_bytes(IMAGE_CACHE_MAX_MEMORY_ENV,
+                                        IMAGE_CACHE_DEFAULT_MAX_MEMORY));
+    red_compress_buf_pool_init(&display->compress_bufs, RED_COMPRESS_BUF_POOL_MAX_FREE);
+#ifdef RED_STATISTICS
+    display->image_cache.hits_counter = display->image_cache_hits_counter;
+    display->image_cache.misses_counter = display->image_cache_misses_counter;
+    display->image_cache.evictions_counter = display->image_cache_evictions_counter;
+    display->compress_bufs.hits_counter = display->compress_buf_hits_counter;
+    display->compress_bufs.misses_counter = display->compress_buf_misses_counter;
+    stat_info_publish(reds, channel->stat, &display->add_stat, FALSE);
+    stat_info_publish(reds, channel->stat, &display->exclude_stat, FALSE);
+    stat_info_publish(reds, channel->stat, &display->__exclude_stat, FALSE);
+    stat_info_publish(reds, channel->stat, &display->off_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->lz_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->glz_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->quic_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->jpeg_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->zlib_glz_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->jpeg_alpha_stat, TRUE);
+    stat_info_publish(reds, channel->stat, &display->lz4_stat, TRUE);
+#endif
+    display_channel_init_trace(display);
+    display->compress_pool =
+        compress_pool_new(compress_pool_get_n_threads(COMPRESS_POOL_THREADS_ENV,
+                                                      COMPRESS_POOL_DEFAULT_THREADS),
+                          &display->compress_bufs);
     display->stream_video = stream_video;
     display_channel_init_streams(display);
+    red_channel_set_zerocopy(RED_CHANNEL(display), getenv(DISPLAY_ZEROCOPY_ENV) != NULL);
 
     return display;
 }
 
+/* called by the worker thread once the clients are gone, before the channel
+ * is destroyed */
+void display_channel_close(DisplayChannel *display)
+{
+    spice_return_if_fail(display);
+
+    /* the pipe items owning the compression jobs went with the clients */
+    compress_pool_free(display->compress_pool);
+    display->compress_pool = NULL;
+    /* the compression threads allocated from it */
+    red_compress_buf_pool_destroy(&display->compress_bufs);
+    if (display->trace_file) {
+        fclose(display->trace_file);
+        display->trace_file = NULL;
+    }
+    image_cache_destroy(&display->image_cache);
+    pipe_item_pool_free(display->drawable_pipe_items);
+    display->drawable_pipe_items = NULL;
+    pipe_item_pool_free(display->stream_clip_items);
+    display->stream_clip_items = NULL;
+}
+
 void display_channel_process_surface_cmd(DisplayChannel *display, RedSurfaceCmd *surface,
                                          int loadvm)
 {
@@ -42,6 +42,8 @@
 #include "image-cache.h"
 #include "utils.h"
 #include "tree.h"
+#include "tree-index.h"
+#include "slab.h"
 #include "stream.h"
 #include "dcc.h"
 #include "display-limits.h"
@@ -63,6 +65,7 @@ struct Drawable {
     RedDrawable *red_drawable;
 
     Ring glz_ring;
+    Ring encoded_images; /* RedEncodedImage shared by the clients */
 
     red_time_t creation_time;
     red_time_t first_frame_time;
@@ -79,6 +82,10 @@ struct Drawable {
     int surface_deps[3];
 
     uint32_t process_commands_generation;
+
+    /* monotonic times for the latency probes, 0 if they were off */
+    uint64_t pickup_time; /* read from the QXL ring */
+    uint64_t tree_time;   /* added to the tree */
 };
 
 #define LINK_TO_DPI(ptr) SPICE_CONTAINEROF((ptr), DrawablePipeItem, base)
@@ -144,7 +151,9 @@ typedef struct DrawContext {
 typedef struct RedSurface {
     uint32_t refs;
     Ring current;
+    TreeIndex *current_index;
     Ring current_list;
+    uint32_t drawable_count;
     DrawContext context;
 
     Ring depend_on_me;
@@ -154,14 +163,21 @@ typedef struct RedSurface {
     QXLReleaseInfoExt create, destroy;
 } RedSurface;
 
-#define NUM_DRAWABLES 1000
-typedef struct _Drawable _Drawable;
-struct _Drawable {
-    union {
-        Drawable drawable;
-        _Drawable *next;
-    } u;
-};
+/* Drawables are allocated from a slab growing by chunks up to a memory
+ * ceiling, only then the oldest ones are rendered to make room */
+#define DRAWABLES_CHUNK_SIZE 256
+#define DRAWABLES_MAX_MEMORY_ENV "SPICE_WORKER_DRAWABLES_MAX_MEMORY"
+#define DRAWABLES_DEFAULT_MAX_MEMORY (16 * 1024 * 1024)
+
+/* With the probes on, the stage times of one out of
+ * SPICE_DRAWABLE_TRACE_SAMPLE drawables sent are appended to the
+ * SPICE_DRAWABLE_TRACE file */
+#define DRAWABLE_TRACE_ENV "SPICE_DRAWABLE_TRACE"
+#define DRAWABLE_TRACE_SAMPLE_ENV "SPICE_DRAWABLE_TRACE_SAMPLE"
+#define DRAWABLE_TRACE_DEFAULT_SAMPLE 100
+
+/* When set, large messages to TCP clients are sent with MSG_ZEROCOPY */
+#define DISPLAY_ZEROCOPY_ENV "SPICE_DISPLAY_ZEROCOPY"
 
 struct DisplayChannel {
     CommonGraphicsChannel common; // Must be the first thing
@@ -177,8 +193,9 @@ struct DisplayChannel {
     uint32_t current_size;
 
     uint32_t drawable_count;
-    _Drawable drawables[NUM_DRAWABLES];
-    _Drawable *free_drawables;
+    Slab *drawables;
+    PipeItemPool *drawable_pipe_items;
+    PipeItemPool *stream_clip_items;
 
     uint32_t glz_drawable_count;
 
@@ -196,11 +213,16 @@ struct DisplayChannel {
     SpiceImageSurfaces image_surfaces;
 
     ImageCache image_cache;
-    RedCompressBuf *free_compress_bufs;
+    RedCompressBufPool compress_bufs;
+    CompressPool *compress_pool;
 
     int gl_draw_async_count;
 
-/* TODO: some day unify this, make it more runtime.. */
+    uint32_t latency_slots; /* clientN latency stat nodes in use */
+    FILE *trace_file;
+    uint32_t trace_sample;
+    uint32_t trace_count;
+
     stat_info_t add_stat;
     stat_info_t exclude_stat;
     stat_info_t __exclude_stat;
@@ -212,6 +234,19 @@ struct DisplayChannel {
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *compress_pool_hits_counter;
+    uint64_t *compress_pool_misses_counter;
+    uint64_t *shared_encode_hits_counter;
+    uint64_t *shared_encode_misses_counter;
+    uint64_t *drawables_counter;
+    uint64_t *drawables_peak_counter;
+    uint64_t *drawable_chunks_counter;
+    uint64_t *drawable_forced_frees_counter;
+    uint64_t *compress_buf_hits_counter;
+    uint64_t *compress_buf_misses_counter;
+    uint64_t *image_cache_hits_counter;
+    uint64_t *image_cache_misses_counter;
+    uint64_t *image_cache_evictions_counter;
 #endif
     stat_info_t off_stat;
     stat_info_t lz_stat;
@@ -255,6 +290,7 @@ DisplayChannel*            display_channel_new                       (SpiceServe
                                                                       int migrate,
                                                                       int stream_video,
                                                                       uint32_t n_surfaces);
+void                       display_channel_close                     (DisplayChannel *display);
 void                       display_channel_create_surface            (DisplayChannel *display, uint32_t surface_id,
                                                                       uint32_t width, uint32_t height,
                                                                       int32_t stride, uint32_t format, void *line_0,
@@ -299,7 +335,8 @@ void                       display_channel_destroy_surface           (DisplayCha
 uint32_t                   display_channel_generate_uid              (DisplayChannel *display);
 void                       display_channel_process_draw              (DisplayChannel *display,
                                                                       RedDrawable *red_drawable,
-                                                                      int process_commands_generation);
+                                                                      int process_commands_generation,
+                                                                      uint64_t pickup_time);
 void                       display_channel_process_surface_cmd       (DisplayChannel *display,
                                                                       RedSurfaceCmd *surface,
                                                                       int loadvm);
@@ -97,6 +97,8 @@ static GIOCondition spice_event_to_giocondition(int event_mask)
         condition |= G_IO_IN;
     if (event_mask & SPICE_WATCH_EVENT_WRITE)
         condition |= G_IO_OUT;
+    if (event_mask & RED_WATCH_EVENT_ERROR)
+        condition |= G_IO_ERR;
 
     return condition;
 }
@@ -109,6 +111,8 @@ static int giocondition_to_spice_event(GIOCondition condition)
         event |= SPICE_WATCH_EVENT_READ;
     if (condition & G_IO_OUT)
         event |= SPICE_WATCH_EVENT_WRITE;
+    if (condition & G_IO_ERR)
+        event |= RED_WATCH_EVENT_ERROR;
 
     return event;
 }
@@ -22,9 +22,14 @@
 #include "red-parse-qxl.h"
 #include "display-channel.h"
 
+static ImageCacheItem **image_cache_bucket(ImageCache *cache, uint64_t id)
+{
+    return &cache->hash_table[id & cache->hash_mask];
+}
+
 static ImageCacheItem *image_cache_find(ImageCache *cache, uint64_t id)
 {
-    ImageCacheItem *item = cache->hash_table[id % IMAGE_CACHE_HASH_SIZE];
+    ImageCacheItem *item = *image_cache_bucket(cache, id);
 
     while (item) {
         if (item->id == id) {
@@ -41,9 +46,7 @@ int image_cache_hit(ImageCache *cache, uint64_t id)
     if (!(item = image_cache_find(cache, id))) {
         return FALSE;
     }
-#ifdef IMAGE_CACHE_AGE
-    item->age = cache->age;
-#endif
+    item->generation = cache->generation;
     ring_remove(&item->lru_link);
     ring_add(&cache->lru, &item->lru_link);
     return TRUE;
@@ -53,7 +56,7 @@ static void image_cache_remove(ImageCache *cache, ImageCacheItem *item)
 {
     ImageCacheItem **now;
 
-    now = &cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE];
+    now = image_cache_bucket(cache, item->id);
     for (;;) {
         spice_assert(*now);
         if (*now == item) {
@@ -64,41 +67,60 @@ static void image_cache_remove(ImageCache *cache, ImageCacheItem *item)
     }
     ring_remove(&item->lru_link);
     pixman_image_unref(item->image);
-    free(item);
-#ifndef IMAGE_CACHE_AGE
     cache->num_items--;
-#endif
+    cache->bytes -= item->size;
+    free(item);
 }
 
-#define IMAGE_CACHE_MAX_ITEMS 2
+/* returns FALSE if the images in use leave no room for @size */
+static int image_cache_make_room(ImageCache *cache, size_t size)
+{
+    ImageCacheItem *tail;
+
+    if (size > cache->max_bytes) {
+        return FALSE;
+    }
+    while (cache->bytes + size > cache->max_bytes) {
+        tail = (ImageCacheItem *)ring_get_tail(&cache->lru);
+        /* the hits of the current drawable are at the head of the lru, the
+         * canvas will ask for them after this put */
+        if (!tail || tail->generation == cache->generation) {
+            return FALSE;
+        }
+        image_cache_remove(cache, tail);
+        cache->evictions++;
+        stat_inc_counter(reds, cache->evictions_counter, 1);
+    }
+    return TRUE;
+}
 
 static void image_cache_put(SpiceImageCache *spice_cache, uint64_t id, pixman_image_t *image)
 {
     ImageCache *cache = (ImageCache *)spice_cache;
     ImageCacheItem *item;
+    ImageCacheItem **bucket;
+    size_t size = (size_t)pixman_image_get_stride(image) * pixman_image_get_height(image);
 
-#ifndef IMAGE_CACHE_AGE
-    if (cache->num_items == IMAGE_CACHE_MAX_ITEMS) {
-        ImageCacheItem *tail = (ImageCacheItem *)ring_get_tail(&cache->lru);
-        spice_assert(tail);
-        image_cache_remove(cache, tail);
+    if (image_cache_find(cache, id) || !image_cache_make_room(cache, size)) {
+        /* only images that hit are asked back from the cache, so not
+         * keeping this one is fine */
+        return;
     }
-#endif
 
     item = spice_new(ImageCacheItem, 1);
     item->id = id;
-#ifdef IMAGE_CACHE_AGE
-    item->age = cache->age;
-#else
-    cache->num_items++;
-#endif
+    item->generation = cache->generation;
+    item->size = size;
     item->image = pixman_image_ref(image);
     ring_item_init(&item->lru_link);
 
-    item->next = cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE];
-    cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE] = item;
+    bucket = image_cache_bucket(cache, id);
+    item->next = *bucket;
+    *bucket = item;
 
     ring_add(&cache->lru, &item->lru_link);
+    cache->num_items++;
+    cache->bytes += size;
 }
 
 static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id)
@@ -112,23 +134,39 @@ static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id
     return pixman_image_ref(item->image);
 }
 
-void image_cache_init(ImageCache *cache)
+void image_cache_init(ImageCache *cache, size_t max_bytes)
 {
     static SpiceImageCacheOps image_cache_ops = {
         image_cache_put,
         image_cache_get,
     };
+    uint32_t hash_size = IMAGE_CACHE_MIN_HASH_SIZE;
+
+    while (hash_size < max_bytes / IMAGE_CACHE_BYTES_PER_BUCKET && hash_size < (1u << 31)) {
+        hash_size <<= 1;
+    }
 
     cache->base.ops = &image_cache_ops;
-    memset(cache->hash_table, 0, sizeof(cache->hash_table));
+    cache->hash_table = spice_new0(ImageCacheItem *, hash_size);
+    cache->hash_mask = hash_size - 1;
     ring_init(&cache->lru);
-#ifdef IMAGE_CACHE_AGE
-    cache->age = 0;
-#else
+    cache->generation = 0;
     cache->num_items = 0;
+    cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+    cache->hits = cache->misses = cache->evictions = 0;
+#ifdef RED_STATISTICS
+    cache->hits_counter = cache->misses_counter = cache->evictions_counter = NULL;
 #endif
 }
 
+void image_cache_destroy(ImageCache *cache)
+{
+    image_cache_reset(cache);
+    free(cache->hash_table);
+    cache->hash_table = NULL;
+}
+
 void image_cache_reset(ImageCache *cache)
 {
     ImageCacheItem *item;
@@ -136,24 +174,13 @@ void image_cache_reset(ImageCache *cache)
     while ((item = (ImageCacheItem *)ring_get_head(&cache->lru))) {
         image_cache_remove(cache, item);
     }
-#ifdef IMAGE_CACHE_AGE
-    cache->age = 0;
-#endif
+    cache->generation = 0;
 }
 
-#define IMAGE_CACHE_DEPTH 4
-
+/* called before rendering each drawable */
 void image_cache_aging(ImageCache *cache)
 {
-#ifdef IMAGE_CACHE_AGE
-    ImageCacheItem *item;
-
-    cache->age++;
-    while ((item = (ImageCacheItem *)ring_get_tail(&cache->lru)) &&
-           cache->age - item->age > IMAGE_CACHE_DEPTH) {
-        image_cache_remove(cache, item);
-    }
-#endif
+    cache->generation++;
 }
 
 void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
@@ -169,6 +196,8 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
     }
 
     if (image_cache_hit(cache, image->descriptor.id)) {
+        cache->hits++;
+        stat_inc_counter(reds, cache->hits_counter, 1);
         image_store->descriptor = image->descriptor;
         image_store->descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
         image_store->descriptor.flags = 0;
@@ -178,16 +207,15 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
 
     switch (image->descriptor.type) {
     case SPICE_IMAGE_TYPE_QUIC: {
+        cache->misses++;
+        stat_inc_counter(reds, cache->misses_counter, 1);
         image_store->descriptor = image->descriptor;
         image_store->u.quic = image->u.quic;
         *image_ptr = image_store;
-#ifdef IMAGE_CACHE_AGE
-        image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
-#else
-        if (image_store->descriptor.width * image->descriptor.height >= 640 * 480) {
+        /* keep the decoded image if it could fit */
+        if ((size_t)image->descriptor.width * image->descriptor.height * 4 <= cache->max_bytes) {
             image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
         }
-#endif
         break;
     }
     case SPICE_IMAGE_TYPE_BITMAP:
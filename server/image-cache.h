@@ -31,28 +31,44 @@ typedef struct DisplayChannelClient DisplayChannelClient;
 typedef struct ImageCacheItem {
     RingItem lru_link;
     uint64_t id;
-#ifdef IMAGE_CACHE_AGE
-    uint32_t age;
-#endif
+    uint32_t generation;
+    size_t size;
     struct ImageCacheItem *next;
     pixman_image_t *image;
 } ImageCacheItem;
 
-#define IMAGE_CACHE_HASH_SIZE 1024
+/* Decoded images kept for the software canvas, least recently used first
+ * to go once the byte budget is reached. Images used by the drawable being
+ * rendered are never evicted. */
+#define IMAGE_CACHE_MAX_MEMORY_ENV "SPICE_WORKER_IMAGE_CACHE_MAX_MEMORY"
+#define IMAGE_CACHE_DEFAULT_MAX_MEMORY (32 * 1024 * 1024)
+/* one hash bucket for this many bytes of budget */
+#define IMAGE_CACHE_BYTES_PER_BUCKET (16 * 1024)
+#define IMAGE_CACHE_MIN_HASH_SIZE 64
 
 typedef struct ImageCache {
     SpiceImageCache base;
-    ImageCacheItem *hash_table[IMAGE_CACHE_HASH_SIZE];
+    ImageCacheItem **hash_table;
+    uint32_t hash_mask;
     Ring lru;
-#ifdef IMAGE_CACHE_AGE
-    uint32_t age;
-#else
+    uint32_t generation; // bumped for each drawable, see image_cache_aging()
     uint32_t num_items;
+    size_t bytes;
+    size_t max_bytes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+#ifdef RED_STATISTICS
+    uint64_t *hits_counter;
+    uint64_t *misses_counter;
+    uint64_t *evictions_counter;
 #endif
 } ImageCache;
 
 int          image_cache_hit               (ImageCache *cache, uint64_t id);
-void         image_cache_init              (ImageCache *cache);
+void         image_cache_init              (ImageCache *cache, size_t max_bytes);
+void         image_cache_destroy           (ImageCache *cache);
 void         image_cache_reset             (ImageCache *cache);
 void         image_cache_aging             (ImageCache *cache);
 void         image_cache_localize          (ImageCache *cache, SpiceImage **image_ptr,
@@ -0,0 +1,135 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "red-common.h"
+#include "red-arena.h"
+
+#define RED_ARENA_ALIGN 8
+
+struct RedArenaBlock {
+    RedArenaBlock *next;
+};
+
+struct RedArenaCleanup {
+    RedArenaCleanup *next;
+    RedArenaCleanupFunc func;
+    void *data;
+};
+
+#define BLOCK_HEADER_SIZE SPICE_ALIGN(sizeof(RedArenaBlock), RED_ARENA_ALIGN)
+
+static gint arena_allocs;
+static gint arena_blocks;
+
+void red_arena_init(RedArena *arena, void *buf, size_t size)
+{
+    spice_return_if_fail(((uintptr_t)buf & (RED_ARENA_ALIGN - 1)) == 0);
+
+    arena->ptr = buf;
+    arena->left = buf ? size : 0;
+    arena->blocks = NULL;
+    arena->cleanups = NULL;
+}
+
+void red_arena_destroy(RedArena *arena)
+{
+    RedArenaBlock *block;
+    RedArenaCleanup *cleanup;
+
+    /* cleanups live in the arena too, run them all before freeing */
+    for (cleanup = arena->cleanups; cleanup; cleanup = cleanup->next) {
+        cleanup->func(cleanup->data);
+    }
+    arena->cleanups = NULL;
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->ptr = NULL;
+    arena->left = 0;
+}
+
+static uint8_t *red_arena_add_block(RedArena *arena, size_t size)
+{
+    RedArenaBlock *block = spice_malloc(BLOCK_HEADER_SIZE + size);
+
+    g_atomic_int_inc(&arena_blocks);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return (uint8_t *)block + BLOCK_HEADER_SIZE;
+}
+
+void *red_arena_alloc(RedArena *arena, size_t size)
+{
+    uint8_t *ptr;
+
+    g_atomic_int_inc(&arena_allocs);
+    size = SPICE_ALIGN(size, RED_ARENA_ALIGN);
+    if (size > arena->left) {
+        if (size > RED_ARENA_BLOCK_SIZE / 4) {
+            /* big objects get a block of their own, keep using the current one */
+            return red_arena_add_block(arena, size);
+        }
+        arena->ptr = red_arena_add_block(arena, RED_ARENA_BLOCK_SIZE);
+        arena->left = RED_ARENA_BLOCK_SIZE;
+    }
+    ptr = arena->ptr;
+    arena->ptr += size;
+    arena->left -= size;
+    return ptr;
+}
+
+void *red_arena_alloc0(RedArena *arena, size_t size)
+{
+    void *ptr = red_arena_alloc(arena, size);
+
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *red_arena_alloc_n_m(RedArena *arena, size_t n_blocks, size_t block_size,
+                          size_t extra_size)
+{
+    if (block_size && n_blocks > (SIZE_MAX - extra_size - RED_ARENA_ALIGN) / block_size) {
+        spice_error("arena allocation of %zu*%zu+%zu bytes overflows",
+                    n_blocks, block_size, extra_size);
+    }
+    return red_arena_alloc(arena, n_blocks * block_size + extra_size);
+}
+
+void red_arena_add_cleanup(RedArena *arena, RedArenaCleanupFunc func, void *data)
+{
+    RedArenaCleanup *cleanup = red_arena_alloc(arena, sizeof(*cleanup));
+
+    cleanup->func = func;
+    cleanup->data = data;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+}
+
+void red_arena_get_stats(RedArenaStats *stats)
+{
+    stats->allocs = g_atomic_int_get(&arena_allocs);
+    stats->blocks = g_atomic_int_get(&arena_blocks);
+}
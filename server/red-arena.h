@@ -0,0 +1,64 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RED_ARENA_H_
+#define RED_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump allocator for objects sharing the lifetime of their owner, like
+ * the parts of a parsed QXL command. Memory comes from an optional buffer
+ * given at init time, then from heap blocks, and is only released all at
+ * once by red_arena_destroy().
+ *
+ * A zeroed RedArena is a valid empty arena. Not thread safe.
+ */
+
+#define RED_ARENA_BLOCK_SIZE 4096
+
+typedef struct RedArenaBlock RedArenaBlock;
+typedef struct RedArenaCleanup RedArenaCleanup;
+
+typedef void (*RedArenaCleanupFunc)(void *data);
+
+typedef struct RedArena {
+    uint8_t *ptr;
+    size_t left;
+    RedArenaBlock *blocks;
+    RedArenaCleanup *cleanups;
+} RedArena;
+
+/* Process wide counters, to compare against one heap allocation per object */
+typedef struct RedArenaStats {
+    unsigned int allocs;
+    unsigned int blocks;
+} RedArenaStats;
+
+void  red_arena_init(RedArena *arena, void *buf, size_t size);
+void  red_arena_destroy(RedArena *arena);
+void *red_arena_alloc(RedArena *arena, size_t size);
+void *red_arena_alloc0(RedArena *arena, size_t size);
+/* like spice_malloc_n_m(), aborts on overflow */
+void *red_arena_alloc_n_m(RedArena *arena, size_t n_blocks, size_t block_size,
+                          size_t extra_size);
+/* @func is called on @data by red_arena_destroy(), in reverse order of
+ * registration, for objects owning memory outside of the arena */
+void  red_arena_add_cleanup(RedArena *arena, RedArenaCleanupFunc func, void *data);
+void  red_arena_get_stats(RedArenaStats *stats);
+
+#endif /* RED_ARENA_H_ */
@@ -73,6 +73,7 @@ static void red_channel_client_cancel_ping_timer(RedChannelClient *rcc);
 static void red_channel_client_restart_ping_timer(RedChannelClient *rcc);
 
 static void red_channel_client_event(int fd, int event, void *data);
+static void red_channel_client_remove_zerocopy_watch(RedChannelClient *rcc);
 static void red_client_add_channel(RedClient *client, RedChannelClient *rcc);
 static void red_client_remove_channel(RedChannelClient *rcc);
 static RedChannelClient *red_client_get_channel(RedClient *client, int type, int id);
@@ -355,7 +356,11 @@ static void red_peer_handle_outgoing(RedsStream *stream, OutgoingHandler *handle
 
     for (;;) {
         handler->cb->prepare(handler->opaque, handler->vec, &handler->vec_size, handler->pos);
-        n = reds_stream_writev(stream, handler->vec, handler->vec_size);
+        if (handler->zerocopy) {
+            n = reds_stream_writev_zerocopy(stream, handler->vec, handler->vec_size);
+        } else {
+            n = reds_stream_writev(stream, handler->vec, handler->vec_size);
+        }
         if (n == -1) {
             switch (errno) {
             case EAGAIN:
@@ -451,6 +456,7 @@ static void red_channel_client_reset_send_data(RedChannelClient *rcc)
     spice_marshaller_set_base(rcc->send_data.marshaller, rcc->send_data.header.header_size);
     rcc->send_data.header.set_msg_type(&rcc->send_data.header, 0);
     rcc->send_data.header.set_msg_size(&rcc->send_data.header, 0);
+    rcc->send_data.no_zerocopy = FALSE;
 
     /* Keeping the serial consecutive: resetting it if reset_send_data
      * has been called before, but no message has been sent since then.
@@ -488,7 +494,7 @@ static void red_channel_client_send_set_ack(RedChannelClient *rcc)
     red_channel_client_init_send_data(rcc, SPICE_MSG_SET_ACK, NULL);
     ack.generation = ++rcc->ack_data.generation;
     ack.window = rcc->ack_data.client_window;
-    rcc->ack_data.messages_window = 0;
+    red_channel_client_ack_zero_messages_window(rcc);
 
     spice_marshall_msg_set_ack(rcc->send_data.marshaller, &ack);
 
@@ -595,6 +601,57 @@ static void red_channel_client_release_item(RedChannelClient *rcc, PipeItem *ite
     }
 }
 
+typedef struct ZeroCopyMsg {
+    RingItem link;
+    SpiceMarshaller *marshaller;
+    PipeItem *item;
+    uint32_t sent; /* reds_stream_zerocopy_sent() after the message */
+} ZeroCopyMsg;
+
+/* the kernel may still read the buffers of the message, the marshaller
+ * holding them and the item are kept aside and replaced */
+static void red_channel_client_hold_zerocopy_msg(RedChannelClient *rcc)
+{
+    ZeroCopyMsg *msg = spice_new0(ZeroCopyMsg, 1);
+
+    spice_assert(!red_channel_client_urgent_marshaller_is_active(rcc));
+    msg->marshaller = rcc->send_data.main.marshaller;
+    msg->item = rcc->send_data.item;
+    msg->sent = reds_stream_zerocopy_sent(rcc->stream);
+    ring_add(&rcc->zerocopy_pending, &msg->link);
+
+    rcc->send_data.item = NULL;
+    rcc->send_data.main.marshaller = spice_marshaller_new();
+    rcc->send_data.marshaller = rcc->send_data.main.marshaller;
+}
+
+/* releases the messages the kernel is done with, or all of them,
+ * returns how many were released */
+static int red_channel_client_release_zerocopy_msgs(RedChannelClient *rcc, int all)
+{
+    ZeroCopyMsg *msg;
+    uint32_t completed;
+    int n = 0;
+
+    if (ring_is_empty(&rcc->zerocopy_pending)) {
+        return 0;
+    }
+    completed = rcc->stream ? reds_stream_zerocopy_completed(rcc->stream) : 0;
+    while ((msg = (ZeroCopyMsg *)ring_get_tail(&rcc->zerocopy_pending))) {
+        if (!all && (int32_t)(completed - msg->sent) < 0) {
+            break;
+        }
+        ring_remove(&msg->link);
+        spice_marshaller_destroy(msg->marshaller);
+        if (msg->item) {
+            red_channel_client_release_item(rcc, msg->item, TRUE);
+        }
+        free(msg);
+        n++;
+    }
+    return n;
+}
+
 static inline void red_channel_client_release_sent_item(RedChannelClient *rcc)
 {
     if (rcc->send_data.item) {
@@ -623,6 +680,10 @@ static void red_channel_peer_on_out_msg_done(void *opaque)
             close(fd);
     }
 
+    if (rcc->outgoing.zerocopy &&
+        reds_stream_zerocopy_sent(rcc->stream) != rcc->zerocopy_sent) {
+        red_channel_client_hold_zerocopy_msg(rcc);
+    }
     red_channel_client_release_sent_item(rcc);
     if (rcc->send_data.blocked) {
         rcc->send_data.blocked = FALSE;
@@ -878,6 +939,8 @@ RedChannelClient *red_channel_client_create(int size, RedChannel *channel, RedCl
                                              // block flags)
     rcc->ack_data.client_generation = ~0;
     rcc->ack_data.client_window = CLIENT_ACK_WINDOW;
+    rcc->ack_data.max_bytes_window = CLIENT_ACK_INITIAL_BYTES;
+    rcc->ack_data.ack_roundtrip = -1;
     rcc->send_data.main.marshaller = spice_marshaller_new();
     rcc->send_data.urgent.marshaller = spice_marshaller_new();
 
@@ -911,11 +974,22 @@ RedChannelClient *red_channel_client_create(int size, RedChannel *channel, RedCl
 
     ring_init(&rcc->pipe);
     rcc->pipe_size = 0;
+    ring_init(&rcc->zerocopy_pending);
+    if (channel->zerocopy) {
+        rcc->zerocopy = reds_stream_enable_zerocopy(stream);
+    }
 
     stream->watch = channel->core->watch_add(channel->core,
                                            stream->socket,
                                            SPICE_WATCH_EVENT_READ,
                                            red_channel_client_event, rcc);
+    if (rcc->zerocopy) {
+        rcc->zerocopy_watch = channel->core->watch_add(channel->core,
+                                                       stream->socket,
+                                                       RED_WATCH_EVENT_ERROR,
+                                                       red_channel_client_zerocopy_event,
+                                                       rcc);
+    }
     rcc->id = channel->clients_num;
     red_channel_add_client(channel, rcc);
     red_client_add_channel(client, rcc);
@@ -1218,6 +1292,11 @@ void red_channel_set_cap(RedChannel *channel, uint32_t cap)
     add_capability(&channel->local_caps.caps, &channel->local_caps.num_caps, cap);
 }
 
+void red_channel_set_zerocopy(RedChannel *channel, int zerocopy)
+{
+    channel->zerocopy = zerocopy;
+}
+
 static void red_channel_ref(RedChannel *channel)
 {
     channel->refs++;
@@ -1248,6 +1327,8 @@ void red_channel_client_unref(RedChannelClient *rcc)
     if (!--rcc->refs) {
         spice_debug("destroy rcc=%p", rcc);
 
+        red_channel_client_release_zerocopy_msgs(rcc, TRUE);
+        red_channel_client_remove_zerocopy_watch(rcc);
         reds_stream_free(rcc->stream);
         rcc->stream = NULL;
 
@@ -1296,6 +1377,7 @@ void red_channel_client_shutdown(RedChannelClient *rcc)
     if (rcc->stream && !rcc->stream->shutdown) {
         rcc->channel->core->watch_remove(rcc->stream->watch);
         rcc->stream->watch = NULL;
+        red_channel_client_remove_zerocopy_watch(rcc);
         shutdown(rcc->stream->socket, SHUT_RDWR);
         rcc->stream->shutdown = TRUE;
     }
@@ -1318,10 +1400,57 @@ void red_channel_send(RedChannel *channel)
     }
 }
 
+/*
+ * The client only acknowledges whole windows of messages, sending stops on
+ * the byte limit only when one is complete, otherwise no ack would come.
+ */
 static inline int red_channel_client_waiting_for_ack(RedChannelClient *rcc)
 {
+    uint32_t window = rcc->ack_data.client_window;
+
     return (rcc->channel->handle_acks &&
-            (rcc->ack_data.messages_window > rcc->ack_data.client_window * 2));
+            ((rcc->ack_data.messages_window >= window &&
+              rcc->ack_data.bytes_window >= rcc->ack_data.max_bytes_window) ||
+             rcc->ack_data.messages_window >= window * (CLIENT_ACK_BATCHES - 1)));
+}
+
+/* Returns the oldest item of the pipe, unless a newer item of a higher
+ * priority can be sent before it and all the other items it would overtake.
+ * Messages are never split, an item being sent can't be overtaken. */
+static PipeItem *red_channel_client_pipe_item_pick(RedChannelClient *rcc)
+{
+    Ring *pipe = &rcc->pipe;
+    PipeItem *oldest, *item, *older;
+    int scanned = 0;
+
+    oldest = (PipeItem *)ring_get_tail(pipe);
+    if (!oldest || oldest->priority == PIPE_ITEM_PRIORITY_INTERACTIVE ||
+        !rcc->channel->channel_cbs.item_can_overtake ||
+        rcc->pipe_overtakes >= PIPE_MAX_OVERTAKES) {
+        rcc->pipe_overtakes = 0;
+        return oldest;
+    }
+
+    for (item = (PipeItem *)ring_prev(pipe, &oldest->link);
+         item && scanned < PIPE_OVERTAKE_SCAN;
+         item = (PipeItem *)ring_prev(pipe, &item->link), scanned++) {
+        if (item->priority >= oldest->priority) {
+            continue;
+        }
+        for (older = oldest; older != item;
+             older = (PipeItem *)ring_prev(pipe, &older->link)) {
+            if (older->priority <= item->priority ||
+                !rcc->channel->channel_cbs.item_can_overtake(rcc, item, older)) {
+                break;
+            }
+        }
+        if (older == item) {
+            rcc->pipe_overtakes++;
+            return item;
+        }
+    }
+    rcc->pipe_overtakes = 0;
+    return oldest;
 }
 
 static inline PipeItem *red_channel_client_pipe_item_get(RedChannelClient *rcc)
@@ -1330,13 +1459,34 @@ static inline PipeItem *red_channel_client_pipe_item_get(RedChannelClient *rcc)
 
     if (!rcc || rcc->send_data.blocked
              || red_channel_client_waiting_for_ack(rcc)
-             || !(item = (PipeItem *)ring_get_tail(&rcc->pipe))) {
+             || !(item = red_channel_client_pipe_item_pick(rcc))) {
         return NULL;
     }
     red_channel_client_pipe_remove(rcc, item);
     return item;
 }
 
+static void red_channel_client_cork(RedChannelClient *rcc)
+{
+    if (rcc->cork.active || !rcc->stream) {
+        return;
+    }
+    rcc->cork.active = reds_stream_set_cork(rcc->stream, TRUE);
+    rcc->cork.bytes = 0;
+    rcc->cork.start = spice_get_monotonic_time_ns();
+}
+
+static void red_channel_client_uncork(RedChannelClient *rcc)
+{
+    if (!rcc->cork.active) {
+        return;
+    }
+    rcc->cork.active = FALSE;
+    if (rcc->stream) {
+        reds_stream_set_cork(rcc->stream, FALSE);
+    }
+}
+
 void red_channel_client_push(RedChannelClient *rcc)
 {
     PipeItem *pipe_item;
@@ -1357,8 +1507,17 @@ void red_channel_client_push(RedChannelClient *rcc)
     }
 
     while ((pipe_item = red_channel_client_pipe_item_get(rcc))) {
+        if (!ring_is_empty(&rcc->pipe)) {
+            red_channel_client_cork(rcc);
+        }
         red_channel_client_send_item(rcc, pipe_item);
+        if (rcc->cork.active &&
+            (rcc->cork.bytes >= RED_CHANNEL_CORK_MAX_BYTES ||
+             spice_get_monotonic_time_ns() - rcc->cork.start >= RED_CHANNEL_CORK_MAX_TIME)) {
+            red_channel_client_uncork(rcc);
+        }
     }
+    red_channel_client_uncork(rcc);
     if (red_channel_client_no_item_being_sent(rcc) && ring_is_empty(&rcc->pipe)
         && rcc->stream->watch) {
         rcc->channel->core->watch_update_mask(rcc->stream->watch,
@@ -1383,6 +1542,76 @@ void red_channel_push(RedChannel *channel)
     }
 }
 
+void red_channel_client_account_sent_bytes(RedChannelClient *rcc, uint32_t size,
+                                           uint64_t now)
+{
+    uint32_t window = MAX(rcc->ack_data.client_window, 1);
+    int batch = (rcc->ack_data.sent / window) % CLIENT_ACK_BATCHES;
+
+    if (rcc->ack_data.sent % window == 0) {
+        rcc->ack_data.batches[batch].bytes = 0;
+        rcc->ack_data.batches[batch].first_send_time = now;
+        rcc->ack_data.batches[batch].delivered = rcc->ack_data.delivered;
+    }
+    rcc->ack_data.batches[batch].bytes += size;
+    rcc->ack_data.batches[batch].last_send_time = now;
+    rcc->ack_data.bytes_window += size;
+    rcc->ack_data.messages_window++;
+    rcc->ack_data.sent++;
+}
+
+/*
+ * The rate of an ack is the bytes acknowledged from the first message of its
+ * window being sent to the ack, over that time, so it always spans at least
+ * a roundtrip and acks arriving back to back can't inflate it. Once the
+ * window is full the rate is the one the client receives the data at, so the
+ * window grows until it stops increasing, like TCP slow start. The bandwidth
+ * estimate is the best recent rate, it decays slowly so that the windows sent
+ * while the server had little to send don't shrink it. The window is then
+ * twice bandwidth * roundtrip, the smallest ping roundtrip being the one of
+ * the link without the queues.
+ */
+void red_channel_client_handle_ack_bytes(RedChannelClient *rcc, uint64_t now)
+{
+    int batch = rcc->ack_data.acked % CLIENT_ACK_BATCHES;
+    uint64_t bytes = rcc->ack_data.batches[batch].bytes;
+    uint64_t start = rcc->ack_data.batches[batch].first_send_time;
+    int64_t roundtrip;
+
+    if (rcc->ack_data.acked == rcc->ack_data.sent / MAX(rcc->ack_data.client_window, 1)) {
+        /* an ack for a window not sent yet, after a reset */
+        return;
+    }
+    rcc->ack_data.acked++;
+    rcc->ack_data.bytes_window -= MIN(bytes, rcc->ack_data.bytes_window);
+
+    roundtrip = now - rcc->ack_data.batches[batch].last_send_time;
+    if (rcc->ack_data.ack_roundtrip < 0 || roundtrip < rcc->ack_data.ack_roundtrip) {
+        rcc->ack_data.ack_roundtrip = roundtrip;
+    }
+    rcc->ack_data.delivered += bytes;
+    if (now > start) {
+        uint64_t delivered = rcc->ack_data.delivered - rcc->ack_data.batches[batch].delivered;
+        uint64_t rate;
+
+        delivered = MIN(delivered, UINT64_MAX / NSEC_PER_SEC);
+        rate = delivered * NSEC_PER_SEC / (now - start);
+        rcc->ack_data.bandwidth = MAX(rate, rcc->ack_data.bandwidth -
+                                            rcc->ack_data.bandwidth / 16);
+    }
+
+    roundtrip = rcc->latency_monitor.roundtrip > 0 ? rcc->latency_monitor.roundtrip :
+                                                     rcc->ack_data.ack_roundtrip;
+    if (rcc->ack_data.bandwidth && roundtrip > 0) {
+        /* bandwidth * roundtrip can't overflow under this */
+        uint64_t max_bandwidth = (uint64_t)CLIENT_ACK_MAX_BYTES * NSEC_PER_SEC / roundtrip;
+        uint64_t bdp = MIN(rcc->ack_data.bandwidth, max_bandwidth) * roundtrip / NSEC_PER_SEC;
+
+        rcc->ack_data.max_bytes_window = CLAMP(2 * bdp, CLIENT_ACK_MIN_BYTES,
+                                               CLIENT_ACK_MAX_BYTES);
+    }
+}
+
 int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
 {
     if (rcc->latency_monitor.roundtrip < 0) {
@@ -1393,7 +1622,7 @@ int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
 
 static void red_channel_client_init_outgoing_messages_window(RedChannelClient *rcc)
 {
-    rcc->ack_data.messages_window = 0;
+    red_channel_client_ack_zero_messages_window(rcc);
     red_channel_client_push(rcc);
 }
 
@@ -1549,6 +1778,7 @@ int red_channel_client_handle_message(RedChannelClient *rcc, uint32_t size,
     case SPICE_MSGC_ACK:
         if (rcc->ack_data.client_generation == rcc->ack_data.generation) {
             rcc->ack_data.messages_window -= rcc->ack_data.client_window;
+            red_channel_client_handle_ack_bytes(rcc, spice_get_monotonic_time_ns());
             red_channel_client_push(rcc);
         }
         break;
@@ -1575,6 +1805,31 @@ int red_channel_client_handle_message(RedChannelClient *rcc, uint32_t size,
     return TRUE;
 }
 
+/* POLLERR stays up until the error queue is drained, it also reports an
+ * error of the socket itself, which the read then takes care of */
+static void red_channel_client_zerocopy_event(int fd, int event, void *data)
+{
+    RedChannelClient *rcc = (RedChannelClient *)data;
+    RedsStream *stream = rcc->stream;
+
+    red_channel_client_ref(rcc);
+    /* drained even when a pipe clear already released the messages */
+    reds_stream_zerocopy_completed(stream);
+    if (!red_channel_client_release_zerocopy_msgs(rcc, FALSE) &&
+        reds_stream_zerocopy_completed(stream) == reds_stream_zerocopy_sent(stream)) {
+        red_channel_client_receive(rcc);
+    }
+    red_channel_client_unref(rcc);
+}
+
+static void red_channel_client_remove_zerocopy_watch(RedChannelClient *rcc)
+{
+    if (rcc->zerocopy_watch) {
+        rcc->channel->core->watch_remove(rcc->zerocopy_watch);
+        rcc->zerocopy_watch = NULL;
+    }
+}
+
 static void red_channel_client_event(int fd, int event, void *data)
 {
     RedChannelClient *rcc = (RedChannelClient *)data;
@@ -1617,12 +1872,24 @@ void red_channel_client_begin_send_message(RedChannelClient *rcc)
     rcc->send_data.size = spice_marshaller_get_total_size(m);
     rcc->send_data.header.set_msg_size(&rcc->send_data.header,
                                        rcc->send_data.size - rcc->send_data.header.header_size);
-    rcc->ack_data.messages_window++;
+    red_channel_client_account_sent_bytes(rcc, rcc->send_data.size,
+                                          spice_get_monotonic_time_ns());
+    rcc->outgoing.zerocopy = rcc->zerocopy &&
+                             !rcc->send_data.no_zerocopy &&
+                             !red_channel_client_urgent_marshaller_is_active(rcc) &&
+                             rcc->send_data.size >= RED_CHANNEL_ZEROCOPY_MIN_SIZE;
+    rcc->zerocopy_sent = reds_stream_zerocopy_sent(rcc->stream);
+    rcc->cork.bytes += rcc->send_data.size;
     rcc->send_data.last_sent_serial = rcc->send_data.serial;
     rcc->send_data.header.data = NULL; /* avoid writing to this until we have a new message */
     red_channel_client_send(rcc);
 }
 
+void red_channel_client_send_data_no_zerocopy(RedChannelClient *rcc)
+{
+    rcc->send_data.no_zerocopy = TRUE;
+}
+
 SpiceMarshaller *red_channel_client_switch_to_urgent_sender(RedChannelClient *rcc)
 {
     spice_assert(red_channel_client_no_item_being_sent(rcc));
@@ -1785,17 +2052,23 @@ void red_channel_client_pipe_clear(RedChannelClient *rcc)
 
     if (rcc) {
         red_channel_client_clear_sent_item(rcc);
+        red_channel_client_release_zerocopy_msgs(rcc, TRUE);
     }
     while ((item = (PipeItem *)ring_get_head(&rcc->pipe))) {
         ring_remove(&item->link);
         red_channel_client_release_item(rcc, item, FALSE);
     }
     rcc->pipe_size = 0;
+    rcc->pipe_overtakes = 0;
 }
 
 void red_channel_client_ack_zero_messages_window(RedChannelClient *rcc)
 {
     rcc->ack_data.messages_window = 0;
+    rcc->ack_data.sent = 0;
+    rcc->ack_data.acked = 0;
+    rcc->ack_data.bytes_window = 0;
+    rcc->ack_data.delivered = 0;
 }
 
 void red_channel_client_ack_set_client_window(RedChannelClient *rcc, int client_window)
@@ -1856,6 +2129,7 @@ void red_channel_client_disconnect(RedChannelClient *rcc)
         rcc->channel->core->watch_remove(rcc->stream->watch);
         rcc->stream->watch = NULL;
     }
+    red_channel_client_remove_zerocopy_watch(rcc);
     if (rcc->latency_monitor.timer) {
         rcc->channel->core->timer_remove(rcc->latency_monitor.timer);
         rcc->latency_monitor.timer = NULL;
@@ -1912,6 +2186,7 @@ RedChannelClient *red_channel_client_create_dummy(int size,
     rcc->incoming.header.data = rcc->incoming.header_buf;
     rcc->incoming.serial = 1;
     ring_init(&rcc->pipe);
+    ring_init(&rcc->zerocopy_pending);
 
     rcc->dummy = TRUE;
     rcc->dummy_connected = TRUE;
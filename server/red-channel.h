@@ -37,6 +37,26 @@
 
 #define MAX_SEND_BUFS 1000
 #define CLIENT_ACK_WINDOW 20
+/* messages sent with MSG_ZEROCOPY when the channel allows it */
+#define RED_CHANNEL_ZEROCOPY_MIN_SIZE (64 * 1024)
+/* While more items are ready, the socket is corked so that their messages
+ * leave in full segments. It is uncorked when the pipe drains, or after
+ * this many bytes or this long, so the first messages are not held back
+ * by the marshalling of the following ones. */
+#define RED_CHANNEL_CORK_MAX_BYTES (256 * 1024)
+#define RED_CHANNEL_CORK_MAX_TIME (2 * NSEC_PER_MILLISEC)
+/* Besides the message window acknowledged by the client, the bytes sent and
+ * not acknowledged are kept under twice the bandwidth-delay product of the
+ * link, measured from the acks and the pings. At most this many windows of
+ * messages can be waiting for their ack. */
+#define CLIENT_ACK_BATCHES 8
+#define CLIENT_ACK_MIN_BYTES (64 * 1024)
+#define CLIENT_ACK_INITIAL_BYTES (256 * 1024)
+#define CLIENT_ACK_MAX_BYTES (64 * 1024 * 1024)
+/* newer items looked at when the oldest one can be overtaken, and how many
+ * may be sent ahead of it before it is sent anyway */
+#define PIPE_OVERTAKE_SCAN 32
+#define PIPE_MAX_OVERTAKES 16
 
 #ifndef IOV_MAX
 #define IOV_MAX 1024
@@ -125,6 +145,7 @@ typedef struct OutgoingHandler {
     struct iovec *vec;
     int pos;
     int size;
+    int zerocopy; /* write the message with reds_stream_writev_zerocopy() */
 } OutgoingHandler;
 
 /* Red Channel interface */
@@ -162,6 +183,10 @@ typedef void (*channel_send_pipe_item_proc)(RedChannelClient *rcc, PipeItem *ite
 typedef void (*channel_hold_pipe_item_proc)(RedChannelClient *rcc, PipeItem *item);
 typedef void (*channel_release_pipe_item_proc)(RedChannelClient *rcc,
                                                PipeItem *item, int item_pushed);
+/* returns TRUE if @item, of a higher priority, can be sent before the older
+ * @overtaken */
+typedef int (*channel_item_can_overtake_proc)(RedChannelClient *rcc, PipeItem *item,
+                                              PipeItem *overtaken);
 typedef void (*channel_on_incoming_error_proc)(RedChannelClient *rcc);
 typedef void (*channel_on_outgoing_error_proc)(RedChannelClient *rcc);
 
@@ -190,6 +215,7 @@ typedef struct {
     channel_send_pipe_item_proc send_item;
     channel_hold_pipe_item_proc hold_item;
     channel_release_pipe_item_proc release_item;
+    channel_item_can_overtake_proc item_can_overtake;
     channel_alloc_msg_recv_buf_proc alloc_recv_buf;
     channel_release_msg_recv_buf_proc release_recv_buf;
     channel_handle_migrate_flush_mark_proc handle_migrate_flush_mark;
@@ -252,6 +278,22 @@ struct RedChannelClient {
         uint32_t client_generation;
         uint32_t messages_window;
         uint32_t client_window;
+
+        /* since the last SET_ACK, the acks cover the messages in windows
+         * of client_window */
+        uint32_t sent;
+        uint32_t acked;
+        struct {
+            uint64_t bytes;
+            uint64_t first_send_time;
+            uint64_t last_send_time;
+            uint64_t delivered; /* when the first message was sent */
+        } batches[CLIENT_ACK_BATCHES];
+        uint64_t bytes_window; /* sent and not acknowledged */
+        uint64_t max_bytes_window;
+        uint64_t delivered; /* bytes acknowledged */
+        uint64_t bandwidth; /* bytes per second */
+        int64_t ack_roundtrip; /* ns, from the last message of a window to its ack */
     } ack_data;
 
     struct {
@@ -260,6 +302,7 @@ struct RedChannelClient {
         uint32_t size;
         PipeItem *item;
         int blocked;
+        int no_zerocopy; /* the message references memory that is reused */
         uint64_t serial;
         uint64_t last_sent_serial;
 
@@ -280,6 +323,20 @@ struct RedChannelClient {
     int id; // debugging purposes
     Ring pipe;
     uint32_t pipe_size;
+    uint32_t pipe_overtakes; /* items sent ahead of the oldest one */
+
+    /* messages sent with MSG_ZEROCOPY, their marshaller and item are kept
+     * until the kernel is done with them */
+    int zerocopy;
+    uint32_t zerocopy_sent; /* reds_stream_zerocopy_sent() when sending started */
+    Ring zerocopy_pending;
+    SpiceWatch *zerocopy_watch; /* RED_WATCH_EVENT_ERROR, for the completions */
+
+    struct {
+        int active;
+        uint32_t bytes;
+        uint64_t start;
+    } cork;
 
     RedChannelCapabilities remote_caps;
     int is_mini_header;
@@ -304,6 +361,7 @@ struct RedChannel {
 
     const SpiceCoreInterfaceInternal *core;
     int handle_acks;
+    int zerocopy;
 
     // RedChannel will hold only connected channel clients (logic - when pushing pipe item to all channel clients, there
     // is no need to go over disconnect clients)
@@ -376,6 +434,10 @@ void red_channel_register_client_cbs(RedChannel *channel, const ClientCbs *clien
 // caps are freed when the channel is destroyed
 void red_channel_set_common_cap(RedChannel *channel, uint32_t cap);
 void red_channel_set_cap(RedChannel *channel, uint32_t cap);
+/* sends the big messages of the clients connected after it with
+ * MSG_ZEROCOPY when their socket allows it. The completions are waited
+ * for with RED_WATCH_EVENT_ERROR, the channel must use event_loop_core */
+void red_channel_set_zerocopy(RedChannel *channel, int zerocopy);
 
 RedChannelClient *red_channel_client_create(int size, RedChannel *channel, RedClient *client,
                                             RedsStream *stream,
@@ -445,6 +507,10 @@ void red_channel_client_set_message_serial(RedChannelClient *channel, uint64_t);
  */
 void red_channel_client_begin_send_message(RedChannelClient *rcc);
 
+/* The message being marshalled references memory that is reused before a
+ * MSG_ZEROCOPY send would complete, send it with a copy */
+void red_channel_client_send_data_no_zerocopy(RedChannelClient *rcc);
+
 /*
  * Stores the current send data, and switches to urgent send data.
  * When it begins the actual send, it will send first the urgent data
@@ -459,6 +525,12 @@ SpiceMarshaller *red_channel_client_switch_to_urgent_sender(RedChannelClient *rc
 /* returns -1 if we don't have an estimation */
 int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc);
 
+/* the byte accounting of the ack window, for a message of size bytes sent
+ * and for an ack received at time now */
+void red_channel_client_account_sent_bytes(RedChannelClient *rcc, uint32_t size,
+                                           uint64_t now);
+void red_channel_client_handle_ack_bytes(RedChannelClient *rcc, uint64_t now);
+
 /*
  * Checks periodically if the connection is still alive
  */
@@ -41,6 +41,10 @@
 
 typedef struct SpiceCoreInterfaceInternal SpiceCoreInterfaceInternal;
 
+/* only understood by event_loop_core, the watch fires when the socket has
+ * an error or its error queue is not empty (MSG_ZEROCOPY completions) */
+#define RED_WATCH_EVENT_ERROR (1 << 2)
+
 struct SpiceCoreInterfaceInternal {
     SpiceTimer *(*timer_add)(const SpiceCoreInterfaceInternal *iface, SpiceTimerFunc func, void *opaque);
     void (*timer_start)(SpiceTimer *timer, uint32_t ms);
@@ -236,7 +236,7 @@ void red_get_rect_ptr(SpiceRect *red, const QXLRect *qxl)
     red->right  = qxl->right;
 }
 
-static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
+static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
@@ -278,7 +278,7 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
         start = (QXLPathSeg*)(&start->points[count]);
     }
 
-    red = spice_malloc(mem_size);
+    red = red_arena_alloc(arena, mem_size);
     red->num_segments = n_segments;
 
     start = (QXLPathSeg*)data;
@@ -321,7 +321,7 @@ static SpicePath *red_get_path(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
-                                          QXLPHYSICAL addr)
+                                          RedArena *arena, QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
     QXLClipRects *qxl;
@@ -354,7 +354,7 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
      */
     spice_assert((uint64_t) num_rects * sizeof(QXLRect) == size);
     G_STATIC_ASSERT(sizeof(SpiceRect) == sizeof(QXLRect));
-    red = spice_malloc(sizeof(*red) + num_rects * sizeof(SpiceRect));
+    red = red_arena_alloc(arena, sizeof(*red) + num_rects * sizeof(SpiceRect));
     red->num_rects = num_rects;
 
     start = (QXLRect*)data;
@@ -368,13 +368,37 @@ static SpiceClipRects *red_get_clip_rects(RedMemSlotInfo *slots, int group_id,
     return red;
 }
 
+/* spice_chunks_linearize() may replace the chunks by a malloc'ed copy
+ * owned by them, free that along with the arena */
+static void red_chunks_cleanup(void *data)
+{
+    SpiceChunks *chunks = data;
+    unsigned int i;
+
+    if (chunks->flags & SPICE_CHUNKS_FLAGS_FREE) {
+        for (i = 0; i < chunks->num_chunks; i++) {
+            free(chunks->chunk[i].data);
+        }
+    }
+}
+
+static SpiceChunks *red_chunks_new(RedArena *arena, int count)
+{
+    SpiceChunks *chunks;
+
+    chunks = red_arena_alloc0(arena, sizeof(SpiceChunks) + sizeof(SpiceChunk) * count);
+    chunks->num_chunks = count;
+    red_arena_add_cleanup(arena, red_chunks_cleanup, chunks);
+    return chunks;
+}
+
 static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
-                                            QXLPHYSICAL addr, size_t size)
+                                            RedArena *arena, QXLPHYSICAL addr, size_t size)
 {
     SpiceChunks *data;
     int error;
 
-    data = spice_chunks_new(1);
+    data = red_chunks_new(arena, 1);
     data->data_size      = size;
     data->chunk[0].data  = (void*)memslot_get_virt(slots, addr, size, group_id, &error);
     if (error) {
@@ -385,7 +409,7 @@ static SpiceChunks *red_get_image_data_flat(RedMemSlotInfo *slots, int group_id,
 }
 
 static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_id,
-                                               RedDataChunk *head)
+                                               RedArena *arena, RedDataChunk *head)
 {
     SpiceChunks *data;
     RedDataChunk *chunk;
@@ -395,7 +419,7 @@ static SpiceChunks *red_get_image_data_chunked(RedMemSlotInfo *slots, int group_
         i++;
     }
 
-    data = spice_chunks_new(i);
+    data = red_chunks_new(arena, i);
     data->data_size = 0;
     for (i = 0, chunk = head;
          chunk != NULL && i < data->num_chunks;
@@ -450,7 +474,7 @@ static int bitmap_consistent(SpiceBitmap *bitmap)
     return TRUE;
 }
 
-static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
+static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                  QXLPHYSICAL addr, uint32_t flags, int is_mask)
 {
     RedDataChunk chunks;
@@ -470,7 +494,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     if (error) {
         return NULL;
     }
-    red = spice_new0(SpiceImage, 1);
+    red = red_arena_alloc0(arena, sizeof(SpiceImage));
     red->descriptor.id     = qxl->descriptor.id;
     red->descriptor.type   = qxl->descriptor.type;
     red->descriptor.flags = 0;
@@ -520,7 +544,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                                        num_ents * sizeof(qp->ents[0]), group_id)) {
                 goto error;
             }
-            rp = spice_malloc_n_m(num_ents, sizeof(rp->ents[0]), sizeof(*rp));
+            rp = red_arena_alloc_n_m(arena, num_ents, sizeof(rp->ents[0]), sizeof(*rp));
             rp->unique   = qp->unique;
             rp->num_ents = num_ents;
             if (flags & QXL_COMMAND_FLAG_COMPAT_16BPP) {
@@ -540,7 +564,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
             goto error;
         }
         if (qxl_flags & QXL_BITMAP_DIRECT) {
-            red->u.bitmap.data = red_get_image_data_flat(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_flat(slots, group_id, arena,
                                                          qxl->bitmap.data,
                                                          bitmap_size);
         } else {
@@ -550,7 +574,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
                 red_put_data_chunks(&chunks);
                 goto error;
             }
-            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id,
+            red->u.bitmap.data = red_get_image_data_chunked(slots, group_id, arena,
                                                             &chunks);
             red_put_data_chunks(&chunks);
         }
@@ -570,7 +594,7 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
             red_put_data_chunks(&chunks);
             goto error;
         }
-        red->u.quic.data = red_get_image_data_chunked(slots, group_id,
+        red->u.quic.data = red_get_image_data_chunked(slots, group_id, arena,
                                                       &chunks);
         red_put_data_chunks(&chunks);
         break;
@@ -580,11 +604,12 @@ static SpiceImage *red_get_image(RedMemSlotInfo *slots, int group_id,
     }
     return red;
 error:
-    free(red);
-    free(rp);
+    /* red and rp belong to the arena */
     return NULL;
 }
 
+/* Only for images allocated with malloc, like the self bitmap of a drawable,
+ * the ones parsed from QXL commands belong to the arena of the command */
 void red_put_image(SpiceImage *red)
 {
     if (red == NULL)
@@ -602,7 +627,7 @@ void red_put_image(SpiceImage *red)
     free(red);
 }
 
-static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                               SpiceBrush *red, QXLBrush *qxl, uint32_t flags)
 {
     red->type = qxl->type;
@@ -615,140 +640,91 @@ static void red_get_brush_ptr(RedMemSlotInfo *slots, int group_id,
         }
         break;
     case SPICE_BRUSH_TYPE_PATTERN:
-        red->u.pattern.pat = red_get_image(slots, group_id, qxl->u.pattern.pat, flags, FALSE);
+        red->u.pattern.pat = red_get_image(slots, group_id, arena, qxl->u.pattern.pat, flags, FALSE);
         break;
     }
 }
 
-static void red_put_brush(SpiceBrush *red)
-{
-    switch (red->type) {
-    case SPICE_BRUSH_TYPE_PATTERN:
-        red_put_image(red->u.pattern.pat);
-        break;
-    }
-}
-
-static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_qmask_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                               SpiceQMask *red, QXLQMask *qxl, uint32_t flags)
 {
     red->flags  = qxl->flags;
     red_get_point_ptr(&red->pos, &qxl->pos);
-    red->bitmap = red_get_image(slots, group_id, qxl->bitmap, flags, TRUE);
-}
-
-static void red_put_qmask(SpiceQMask *red)
-{
-    red_put_image(red->bitmap);
+    red->bitmap = red_get_image(slots, group_id, arena, qxl->bitmap, flags, TRUE);
 }
 
-static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_fill_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                              SpiceFill *red, QXLFill *qxl, uint32_t flags)
 {
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->rop_descriptor = qxl->rop_descriptor;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_fill(SpiceFill *red)
-{
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_opaque_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                SpiceOpaque *red, QXLOpaque *qxl, uint32_t flags)
 {
-   red->src_bitmap     = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+   red->src_bitmap     = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop_descriptor = qxl->rop_descriptor;
    red->scale_mode     = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
-}
-
-static void red_put_opaque(SpiceOpaque *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static int red_get_copy_ptr(RedMemSlotInfo *slots, int group_id,
+static int red_get_copy_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                             SpiceCopy *red, QXLCopy *qxl, uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     if (!red->src_bitmap) {
         return 1;
     }
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
     red->rop_descriptor  = qxl->rop_descriptor;
     red->scale_mode      = qxl->scale_mode;
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
     return 0;
 }
 
-static void red_put_copy(SpiceCopy *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_blend_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_blend_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                              SpiceBlend *red, QXLBlend *qxl, uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
    red->rop_descriptor  = qxl->rop_descriptor;
    red->scale_mode      = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_blend(SpiceBlend *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_transparent_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                     SpiceTransparent *red, QXLTransparent *qxl,
                                     uint32_t flags)
 {
-    red->src_bitmap      = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap      = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
    red->src_color       = qxl->src_color;
    red->true_color      = qxl->true_color;
 }
 
-static void red_put_transparent(SpiceTransparent *red)
-{
-    red_put_image(red->src_bitmap);
-}
-
-static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_alpha_blend_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                     SpiceAlphaBlend *red, QXLAlphaBlend *qxl,
                                     uint32_t flags)
 {
     red->alpha_flags = qxl->alpha_flags;
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
 static void red_get_alpha_blend_ptr_compat(RedMemSlotInfo *slots, int group_id,
-                                           SpiceAlphaBlend *red, QXLCompatAlphaBlend *qxl,
-                                           uint32_t flags)
+                                           RedArena *arena, SpiceAlphaBlend *red,
+                                           QXLCompatAlphaBlend *qxl, uint32_t flags)
 {
     red->alpha       = qxl->alpha;
-    red->src_bitmap  = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+    red->src_bitmap  = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
     red_get_rect_ptr(&red->src_area, &qxl->src_area);
 }
 
-static void red_put_alpha_blend(SpiceAlphaBlend *red)
-{
-    red_put_image(red->src_bitmap);
-}
-
 static bool get_transform(RedMemSlotInfo *slots,
                           int group_id,
                           QXLPHYSICAL qxl_transform,
@@ -769,17 +745,17 @@ static bool get_transform(RedMemSlotInfo *slots,
     return TRUE;
 }
 
-static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                   SpiceComposite *red, QXLComposite *qxl, uint32_t flags)
 {
     red->flags = qxl->flags;
 
-    red->src_bitmap = red_get_image(slots, group_id, qxl->src, flags, FALSE);
+    red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src, flags, FALSE);
     if (get_transform(slots, group_id, qxl->src_transform, &red->src_transform))
         red->flags |= SPICE_COMPOSITE_HAS_SRC_TRANSFORM;
 
     if (qxl->mask) {
-        red->mask_bitmap = red_get_image(slots, group_id, qxl->mask, flags, FALSE);
+        red->mask_bitmap = red_get_image(slots, group_id, arena, qxl->mask, flags, FALSE);
         red->flags |= SPICE_COMPOSITE_HAS_MASK;
         if (get_transform(slots, group_id, qxl->mask_transform, &red->mask_transform))
             red->flags |= SPICE_COMPOSITE_HAS_MASK_TRANSFORM;
@@ -792,37 +768,23 @@ static void red_get_composite_ptr(RedMemSlotInfo *slots, int group_id,
     red->mask_origin.y = qxl->mask_origin.y;
 }
 
-static void red_put_composite(SpiceComposite *red)
-{
-    red_put_image(red->src_bitmap);
-    if (red->mask_bitmap)
-        red_put_image(red->mask_bitmap);
-}
-
-static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_rop3_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                              SpiceRop3 *red, QXLRop3 *qxl, uint32_t flags)
 {
-   red->src_bitmap = red_get_image(slots, group_id, qxl->src_bitmap, flags, FALSE);
+   red->src_bitmap = red_get_image(slots, group_id, arena, qxl->src_bitmap, flags, FALSE);
    red_get_rect_ptr(&red->src_area, &qxl->src_area);
-   red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
    red->rop3       = qxl->rop3;
    red->scale_mode = qxl->scale_mode;
-   red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+   red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_rop3(SpiceRop3 *red)
-{
-    red_put_image(red->src_bitmap);
-    red_put_brush(&red->brush);
-    red_put_qmask(&red->mask);
-}
-
-static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
+static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                               SpiceStroke *red, QXLStroke *qxl, uint32_t flags)
 {
     int error;
 
-    red->path = red_get_path(slots, group_id, qxl->path);
+    red->path = red_get_path(slots, group_id, arena, qxl->path);
     if (!red->path) {
         return 1;
     }
@@ -832,7 +794,7 @@ static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         uint8_t *buf;
 
         style_nseg = qxl->attr.style_nseg;
-        red->attr.style = spice_malloc_n(style_nseg, sizeof(SPICE_FIXED28_4));
+        red->attr.style = red_arena_alloc_n_m(arena, style_nseg, sizeof(SPICE_FIXED28_4), 0);
         red->attr.style_nseg  = style_nseg;
         spice_assert(qxl->attr.style);
         buf = (uint8_t *)memslot_get_virt(slots, qxl->attr.style,
@@ -845,22 +807,13 @@ static int red_get_stroke_ptr(RedMemSlotInfo *slots, int group_id,
         red->attr.style_nseg  = 0;
         red->attr.style       = NULL;
     }
-    red_get_brush_ptr(slots, group_id, &red->brush, &qxl->brush, flags);
+    red_get_brush_ptr(slots, group_id, arena, &red->brush, &qxl->brush, flags);
     red->fore_mode        = qxl->fore_mode;
     red->back_mode        = qxl->back_mode;
     return 0;
 }
 
-static void red_put_stroke(SpiceStroke *red)
-{
-    red_put_brush(&red->brush);
-    free(red->path);
-    if (red->attr.flags & SPICE_LINE_FLAGS_STYLED) {
-        free(red->attr.style);
-    }
-}
-
-static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
+static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                    QXLPHYSICAL addr)
 {
     RedDataChunk chunks;
@@ -923,7 +876,7 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     spice_assert(start <= end);
     spice_assert(glyphs == qxl_length);
 
-    red = spice_malloc(red_size);
+    red = red_arena_alloc(arena, red_size);
     red->length = qxl_length;
     red->flags = qxl_flags;
 
@@ -953,73 +906,42 @@ static SpiceString *red_get_string(RedMemSlotInfo *slots, int group_id,
     return red;
 }
 
-static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_text_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                              SpiceText *red, QXLText *qxl, uint32_t flags)
 {
-   red->str = red_get_string(slots, group_id, qxl->str);
+   red->str = red_get_string(slots, group_id, arena, qxl->str);
    red_get_rect_ptr(&red->back_area, &qxl->back_area);
-   red_get_brush_ptr(slots, group_id, &red->fore_brush, &qxl->fore_brush, flags);
-   red_get_brush_ptr(slots, group_id, &red->back_brush, &qxl->back_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->fore_brush, &qxl->fore_brush, flags);
+   red_get_brush_ptr(slots, group_id, arena, &red->back_brush, &qxl->back_brush, flags);
    red->fore_mode  = qxl->fore_mode;
    red->back_mode  = qxl->back_mode;
 }
 
-static void red_put_text_ptr(SpiceText *red)
-{
-    free(red->str);
-    red_put_brush(&red->fore_brush);
-    red_put_brush(&red->back_brush);
-}
-
-static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_whiteness_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                   SpiceWhiteness *red, QXLWhiteness *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_whiteness(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_blackness_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_blackness_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                   SpiceBlackness *red, QXLBlackness *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_blackness(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_invers_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_invers_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                                SpiceInvers *red, QXLInvers *qxl, uint32_t flags)
 {
-    red_get_qmask_ptr(slots, group_id, &red->mask, &qxl->mask, flags);
+    red_get_qmask_ptr(slots, group_id, arena, &red->mask, &qxl->mask, flags);
 }
 
-static void red_put_invers(SpiceWhiteness *red)
-{
-    red_put_qmask(&red->mask);
-}
-
-static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id,
+static void red_get_clip_ptr(RedMemSlotInfo *slots, int group_id, RedArena *arena,
                              SpiceClip *red, QXLClip *qxl)
 {
     red->type = qxl->type;
     switch (red->type) {
     case SPICE_CLIP_TYPE_RECTS:
-        red->rects = red_get_clip_rects(slots, group_id, qxl->data);
-        break;
-    }
-}
-
-static void red_put_clip(SpiceClip *red)
-{
-    switch (red->type) {
-    case SPICE_CLIP_TYPE_RECTS:
-        free(red->rects);
+        red->rects = red_get_clip_rects(slots, group_id, arena, qxl->data);
         break;
     }
 }
@@ -1027,6 +949,7 @@ static void red_put_clip(SpiceClip *red)
 static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
                                    RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
+    RedArena *arena = &red->arena;
     QXLDrawable *qxl;
     int i;
     int error = 0;
@@ -1039,7 +962,7 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
     red->self_bitmap      = qxl->self_bitmap;
@@ -1054,51 +977,51 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr(slots, group_id,
+        red_get_alpha_blend_ptr(slots, group_id, arena,
                                 &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
-        red_get_blend_ptr(slots, group_id, &red->u.blend, &qxl->u.blend, flags);
+        red_get_blend_ptr(slots, group_id, arena, &red->u.blend, &qxl->u.blend, flags);
         break;
     case QXL_DRAW_COPY:
-        error = red_get_copy_ptr(slots, group_id, &red->u.copy, &qxl->u.copy, flags);
+        error = red_get_copy_ptr(slots, group_id, arena, &red->u.copy, &qxl->u.copy, flags);
         break;
     case QXL_COPY_BITS:
         red_get_point_ptr(&red->u.copy_bits.src_pos, &qxl->u.copy_bits.src_pos);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_COMPOSITE:
-        red_get_composite_ptr(slots, group_id, &red->u.composite, &qxl->u.composite, flags);
+        red_get_composite_ptr(slots, group_id, arena, &red->u.composite, &qxl->u.composite, flags);
         break;
     case QXL_DRAW_STROKE:
-        error = red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        error = red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
         break;
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1112,6 +1035,7 @@ static int red_get_native_drawable(RedMemSlotInfo *slots, int group_id,
 static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
                                    RedDrawable *red, QXLPHYSICAL addr, uint32_t flags)
 {
+    RedArena *arena = &red->arena;
     QXLCompatDrawable *qxl;
     int error;
 
@@ -1123,7 +1047,7 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
     red->release_info_ext.group_id = group_id;
 
     red_get_rect_ptr(&red->bbox, &qxl->bbox);
-    red_get_clip_ptr(slots, group_id, &red->clip, &qxl->clip);
+    red_get_clip_ptr(slots, group_id, arena, &red->clip, &qxl->clip);
     red->effect           = qxl->effect;
     red->mm_time          = qxl->mm_time;
 
@@ -1137,18 +1061,18 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
     red->type = qxl->type;
     switch (red->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_get_alpha_blend_ptr_compat(slots, group_id,
+        red_get_alpha_blend_ptr_compat(slots, group_id, arena,
                                        &red->u.alpha_blend, &qxl->u.alpha_blend, flags);
         break;
     case QXL_DRAW_BLACKNESS:
-        red_get_blackness_ptr(slots, group_id,
+        red_get_blackness_ptr(slots, group_id, arena,
                               &red->u.blackness, &qxl->u.blackness, flags);
         break;
     case QXL_DRAW_BLEND:
-        red_get_blend_ptr(slots, group_id, &red->u.blend, &qxl->u.blend, flags);
+        red_get_blend_ptr(slots, group_id, arena, &red->u.blend, &qxl->u.blend, flags);
         break;
     case QXL_DRAW_COPY:
-        error = red_get_copy_ptr(slots, group_id, &red->u.copy, &qxl->u.copy, flags);
+        error = red_get_copy_ptr(slots, group_id, arena, &red->u.copy, &qxl->u.copy, flags);
         break;
     case QXL_COPY_BITS:
         red_get_point_ptr(&red->u.copy_bits.src_pos, &qxl->u.copy_bits.src_pos);
@@ -1161,31 +1085,31 @@ static int red_get_compat_drawable(RedMemSlotInfo *slots, int group_id,
             (red->bbox.bottom - red->bbox.top);
         break;
     case QXL_DRAW_FILL:
-        red_get_fill_ptr(slots, group_id, &red->u.fill, &qxl->u.fill, flags);
+        red_get_fill_ptr(slots, group_id, arena, &red->u.fill, &qxl->u.fill, flags);
         break;
     case QXL_DRAW_OPAQUE:
-        red_get_opaque_ptr(slots, group_id, &red->u.opaque, &qxl->u.opaque, flags);
+        red_get_opaque_ptr(slots, group_id, arena, &red->u.opaque, &qxl->u.opaque, flags);
         break;
     case QXL_DRAW_INVERS:
-        red_get_invers_ptr(slots, group_id, &red->u.invers, &qxl->u.invers, flags);
+        red_get_invers_ptr(slots, group_id, arena, &red->u.invers, &qxl->u.invers, flags);
         break;
     case QXL_DRAW_NOP:
         break;
     case QXL_DRAW_ROP3:
-        red_get_rop3_ptr(slots, group_id, &red->u.rop3, &qxl->u.rop3, flags);
+        red_get_rop3_ptr(slots, group_id, arena, &red->u.rop3, &qxl->u.rop3, flags);
         break;
     case QXL_DRAW_STROKE:
-        error = red_get_stroke_ptr(slots, group_id, &red->u.stroke, &qxl->u.stroke, flags);
+        error = red_get_stroke_ptr(slots, group_id, arena, &red->u.stroke, &qxl->u.stroke, flags);
         break;
     case QXL_DRAW_TEXT:
-        red_get_text_ptr(slots, group_id, &red->u.text, &qxl->u.text, flags);
+        red_get_text_ptr(slots, group_id, arena, &red->u.text, &qxl->u.text, flags);
         break;
     case QXL_DRAW_TRANSPARENT:
-        red_get_transparent_ptr(slots, group_id,
+        red_get_transparent_ptr(slots, group_id, arena,
                                 &red->u.transparent, &qxl->u.transparent, flags);
         break;
     case QXL_DRAW_WHITENESS:
-        red_get_whiteness_ptr(slots, group_id,
+        red_get_whiteness_ptr(slots, group_id, arena,
                               &red->u.whiteness, &qxl->u.whiteness, flags);
         break;
     default:
@@ -1211,51 +1135,11 @@ int red_get_drawable(RedMemSlotInfo *slots, int group_id,
 
 void red_put_drawable(RedDrawable *red)
 {
-    red_put_clip(&red->clip);
     if (red->self_bitmap_image) {
         red_put_image(red->self_bitmap_image);
     }
-    switch (red->type) {
-    case QXL_DRAW_ALPHA_BLEND:
-        red_put_alpha_blend(&red->u.alpha_blend);
-        break;
-    case QXL_DRAW_BLACKNESS:
-        red_put_blackness(&red->u.blackness);
-        break;
-    case QXL_DRAW_BLEND:
-        red_put_blend(&red->u.blend);
-        break;
-    case QXL_DRAW_COPY:
-        red_put_copy(&red->u.copy);
-        break;
-    case QXL_DRAW_FILL:
-        red_put_fill(&red->u.fill);
-        break;
-    case QXL_DRAW_OPAQUE:
-        red_put_opaque(&red->u.opaque);
-        break;
-    case QXL_DRAW_INVERS:
-        red_put_invers(&red->u.invers);
-        break;
-    case QXL_DRAW_ROP3:
-        red_put_rop3(&red->u.rop3);
-        break;
-    case QXL_DRAW_COMPOSITE:
-        red_put_composite(&red->u.composite);
-        break;
-    case QXL_DRAW_STROKE:
-        red_put_stroke(&red->u.stroke);
-        break;
-    case QXL_DRAW_TEXT:
-        red_put_text_ptr(&red->u.text);
-        break;
-    case QXL_DRAW_TRANSPARENT:
-        red_put_transparent(&red->u.transparent);
-        break;
-    case QXL_DRAW_WHITENESS:
-        red_put_whiteness(&red->u.whiteness);
-        break;
-    }
+    /* everything else was parsed into the arena */
+    red_arena_destroy(&red->arena);
 }
 
 int red_get_update_cmd(RedMemSlotInfo *slots, int group_id,
@@ -1388,14 +1272,15 @@ void red_put_surface_cmd(RedSurfaceCmd *red)
     /* nothing yet */
 }
 
+/* The shape is only copied when it has to be linearized, otherwise it
+ * references guest memory, which stays valid until the command is
+ * released */
 static int red_get_cursor(RedMemSlotInfo *slots, int group_id,
-                          SpiceCursor *red, QXLPHYSICAL addr)
+                          SpiceCursor *red, bool *free_data, QXLPHYSICAL addr)
 {
     QXLCursor *qxl;
     RedDataChunk chunks;
     size_t size;
-    uint8_t *data;
-    bool free_data;
     int error;
 
     qxl = (QXLCursor *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id, &error);
@@ -1419,20 +1304,16 @@ static int red_get_cursor(RedMemSlotInfo *slots, int group_id,
         return 1;
     }
     red->data_size = MIN(red->data_size, size);
-    data = red_linearize_chunk(&chunks, size, &free_data);
+    red->data = red_linearize_chunk(&chunks, size, free_data);
     red_put_data_chunks(&chunks);
-    if (free_data) {
-        red->data = data;
-    } else {
-        red->data = spice_malloc(size);
-        memcpy(red->data, data, size);
-    }
     return 0;
 }
 
-static void red_put_cursor(SpiceCursor *red)
+static void red_put_cursor(SpiceCursor *red, bool free_data)
 {
-    free(red->data);
+    if (free_data) {
+        free(red->data);
+    }
 }
 
 int red_get_cursor_cmd(RedMemSlotInfo *slots, int group_id,
@@ -1453,7 +1334,8 @@ int red_get_cursor_cmd(RedMemSlotInfo *slots, int group_id,
     case QXL_CURSOR_SET:
         red_get_point16_ptr(&red->u.set.position, &qxl->u.set.position);
         red->u.set.visible  = qxl->u.set.visible;
-        error = red_get_cursor(slots, group_id,  &red->u.set.shape, qxl->u.set.shape);
+        error = red_get_cursor(slots, group_id, &red->u.set.shape,
+                               &red->u.set.free_shape_data, qxl->u.set.shape);
         break;
     case QXL_CURSOR_MOVE:
         red_get_point16_ptr(&red->u.position, &qxl->u.position);
@@ -1470,7 +1352,7 @@ void red_put_cursor_cmd(RedCursorCmd *red)
 {
     switch (red->type) {
     case QXL_CURSOR_SET:
-        red_put_cursor(&red->u.set.shape);
+        red_put_cursor(&red->u.set.shape, red->u.set.free_shape_data);
         break;
     }
 }
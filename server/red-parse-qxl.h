@@ -22,6 +22,10 @@
 #include <spice/qxl_dev.h>
 #include "red-common.h"
 #include "memslot.h"
+#include "red-arena.h"
+
+/* most drawables fit in here without touching the heap */
+#define RED_DRAWABLE_ARENA_SIZE 512
 
 typedef struct RedDrawable {
     int refs;
@@ -56,6 +60,9 @@ typedef struct RedDrawable {
         SpiceWhiteness whiteness;
         SpiceComposite composite;
     } u;
+    /* owns everything the command parsing allocated */
+    RedArena arena;
+    uint64_t arena_buf[RED_DRAWABLE_ARENA_SIZE / sizeof(uint64_t)];
 } RedDrawable;
 
 static inline RedDrawable *red_drawable_ref(RedDrawable *drawable)
@@ -102,6 +109,8 @@ typedef struct RedCursorCmd {
             SpicePoint16 position;
             uint8_t visible;
             SpiceCursor shape;
+            /* FALSE if shape.data points to guest memory */
+            bool free_shape_data;
         } set;
         struct {
             uint16_t length;
@@ -20,6 +20,14 @@
 #include "red-channel.h"
 #include "red-pipe-item.h"
 
+#define PIPE_ITEM_POOL_POISON 0x6b
+
+struct PipeItemPool {
+    const char *name;
+    size_t item_size;
+    Slab *slab;
+};
+
 PipeItem *pipe_item_ref(gpointer object)
 {
     PipeItem *item = object;
@@ -48,6 +56,76 @@ void pipe_item_init_full(PipeItem *item,
 {
     ring_item_init(&item->link);
     item->type = type;
+    item->priority = PIPE_ITEM_PRIORITY_INTERACTIVE;
     item->refcount = 1;
     item->free_func = free_func ? free_func : (GDestroyNotify)free;
 }
+
+PipeItemPool *pipe_item_pool_new(const char *name, size_t item_size)
+{
+    PipeItemPool *pool = spice_new0(PipeItemPool, 1);
+
+    pool->name = name;
+    pool->item_size = item_size;
+    /* no ceiling, running out is as fatal as for the other items */
+    pool->slab = slab_new(item_size, PIPE_ITEM_POOL_CHUNK_ITEMS, SIZE_MAX);
+#ifdef DEBUG_PIPE_ITEM_POOL
+    slab_set_poison(pool->slab, PIPE_ITEM_POOL_POISON);
+#endif
+
+    return pool;
+}
+
+void pipe_item_pool_free(PipeItemPool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    slab_free(pool->slab);
+    free(pool);
+}
+
+#ifdef DEBUG_PIPE_ITEM_POOL
+/* the slab keeps the items poisoned from the creation of their chunk and
+ * after each release */
+static void pipe_item_pool_check_poison(PipeItemPool *pool, const uint8_t *item)
+{
+    size_t i;
+
+    for (i = 0; i < pool->item_size; i++) {
+        if (item[i] != PIPE_ITEM_POOL_POISON) {
+            spice_warning("%s item %p written after release at offset %zu",
+                          pool->name, item, i);
+            return;
+        }
+    }
+}
+#endif
+
+void *pipe_item_pool_alloc(PipeItemPool *pool)
+{
+    void *item = slab_alloc(pool->slab);
+
+    if (!item) {
+        spice_error("unable to allocate a %s item", pool->name);
+    }
+#ifdef DEBUG_PIPE_ITEM_POOL
+    pipe_item_pool_check_poison(pool, item);
+#endif
+    memset(item, 0, pool->item_size);
+
+    return item;
+}
+
+void pipe_item_pool_release(PipeItemPool *pool, void *item)
+{
+    if (!item) {
+        return;
+    }
+    slab_release(pool->slab, item);
+}
+
+void pipe_item_pool_get_stats(PipeItemPool *pool, SlabStats *stats)
+{
+    slab_get_stats(pool->slab, stats);
+}
@@ -20,9 +20,20 @@
 
 #include <glib.h>
 
+#include "slab.h"
+
+/* Items of a class may be sent before the older items of the classes after
+ * it, if the channel allows it with ChannelCbs.item_can_overtake */
+typedef enum {
+    PIPE_ITEM_PRIORITY_INTERACTIVE,
+    PIPE_ITEM_PRIORITY_STREAM,
+    PIPE_ITEM_PRIORITY_BULK,
+} PipeItemPriority;
+
 typedef struct {
     RingItem link;
     int type;
+    int priority; /* PipeItemPriority, interactive unless set */
 
     /* private */
     int refcount;
@@ -43,4 +54,22 @@ static inline void pipe_item_init(PipeItem *item, int type)
 {
     pipe_item_init_full(item, type, NULL);
 }
+
+/* Pool for the items of one type sent often by a channel, they are
+ * carved from a Slab rather than each taken from the heap. Build with
+ * DEBUG_PIPE_ITEM_POOL to have the released items poisoned and checked
+ * for writes when they are reused.
+ *
+ * Not thread safe, the items must be allocated and released from the
+ * thread of the channel. */
+#define PIPE_ITEM_POOL_CHUNK_ITEMS 64
+
+typedef struct PipeItemPool PipeItemPool;
+
+PipeItemPool *pipe_item_pool_new(const char *name, size_t item_size);
+void pipe_item_pool_free(PipeItemPool *pool);
+/* returns a zeroed item */
+void *pipe_item_pool_alloc(PipeItemPool *pool);
+void pipe_item_pool_release(PipeItemPool *pool, void *item);
+void pipe_item_pool_get_stats(PipeItemPool *pool, SlabStats *stats);
 #endif
@@ -57,6 +57,7 @@ struct QXLState {
     QXLDevSurfaceCreate surface_create;
     unsigned int max_monitors;
     RedsState *reds;
+    RedWorker *worker;
 
     pthread_mutex_t scanout_mutex;
     SpiceMsgDisplayGlScanoutUnix scanout;
@@ -836,6 +837,41 @@ void spice_qxl_driver_unload(QXLInstance *instance)
     red_qxl_driver_unload(instance->st);
 }
 
+SPICE_GNUC_VISIBLE
+int spice_qxl_dump_flight_recorder(QXLInstance *instance, const char *filename)
+{
+    RedWorkerMessageDumpFlightRecorder payload;
+    int result = FALSE;
+
+    spice_return_val_if_fail(instance != NULL, -1);
+    spice_return_val_if_fail(filename != NULL, -1);
+
+    payload.filename = filename;
+    payload.result = &result;
+    dispatcher_send_message(instance->st->dispatcher,
+                            RED_WORKER_MESSAGE_DUMP_FLIGHT_RECORDER,
+                            &payload);
+    return result ? 0 : -1;
+}
+
+SPICE_GNUC_VISIBLE
+int spice_qxl_set_flight_recorder(QXLInstance *instance,
+                                  unsigned int seconds, unsigned int max_mb)
+{
+    RedWorkerMessageSetFlightRecorder payload;
+    int result = FALSE;
+
+    spice_return_val_if_fail(instance != NULL, -1);
+
+    payload.seconds = seconds;
+    payload.max_bytes = (size_t)max_mb * 1024 * 1024;
+    payload.result = &result;
+    dispatcher_send_message(instance->st->dispatcher,
+                            RED_WORKER_MESSAGE_SET_FLIGHT_RECORDER,
+                            &payload);
+    return result ? 0 : -1;
+}
+
 SpiceMsgDisplayGlScanoutUnix *red_qxl_get_gl_scanout(QXLInstance *qxl)
 {
     pthread_mutex_lock(&qxl->st->scanout_mutex);
@@ -992,11 +1028,20 @@ void red_qxl_init(RedsState *reds, QXLInstance *qxl)
     client_display_cbs.disconnect = red_qxl_disconnect_display_peer;
     client_display_cbs.migrate = red_qxl_display_migrate;
 
-    // TODO: reference and free
-    RedWorker *worker = red_worker_new(qxl, &client_cursor_cbs,
+    qxl_state->worker = red_worker_new(qxl, &client_cursor_cbs,
                                        &client_display_cbs);
 
-    red_worker_run(worker);
+    red_worker_run(qxl_state->worker);
+}
+
+void red_qxl_destroy(QXLInstance *qxl)
+{
+    QXLState *qxl_state = qxl->st;
+
+    spice_return_if_fail(qxl_state->worker != NULL);
+
+    red_worker_free(qxl_state->worker);
+    qxl_state->worker = NULL;
 }
 
 Dispatcher *red_qxl_get_dispatcher(QXLInstance *qxl)
@@ -24,6 +24,7 @@
 typedef struct AsyncCommand AsyncCommand;
 
 void red_qxl_init(SpiceServer *reds, QXLInstance *qxl);
+void red_qxl_destroy(QXLInstance *qxl);
 
 void red_qxl_on_ic_change(QXLInstance *qxl, SpiceImageCompression ic);
 void red_qxl_on_sv_change(QXLInstance *qxl, int sv);
@@ -113,6 +114,9 @@ enum {
     RED_WORKER_MESSAGE_DRIVER_UNLOAD,
     RED_WORKER_MESSAGE_GL_SCANOUT,
     RED_WORKER_MESSAGE_GL_DRAW_ASYNC,
+    RED_WORKER_MESSAGE_DUMP_FLIGHT_RECORDER,
+    RED_WORKER_MESSAGE_CLOSE_WORKER,
+    RED_WORKER_MESSAGE_SET_FLIGHT_RECORDER,
 
     RED_WORKER_MESSAGE_COUNT // LAST
 };
@@ -285,6 +289,20 @@ typedef struct RedWorkerMessageDriverUnload {
 typedef struct RedWorkerMessageGlScanout {
 } RedWorkerMessageGlScanout;
 
+typedef struct RedWorkerMessageDumpFlightRecorder {
+    const char *filename;
+    int *result;
+} RedWorkerMessageDumpFlightRecorder;
+
+typedef struct RedWorkerMessageClose {
+} RedWorkerMessageClose;
+
+typedef struct RedWorkerMessageSetFlightRecorder {
+    unsigned int seconds;
+    size_t max_bytes;
+    int *result;
+} RedWorkerMessageSetFlightRecorder;
+
 enum {
     RED_DISPATCHER_PENDING_WAKEUP,
     RED_DISPATCHER_PENDING_OOM,
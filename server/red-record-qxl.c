@@ -21,11 +21,19 @@
 
 #include <stdbool.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <glib.h>
 #include "red-worker.h"
 #include "red-common.h"
 #include "memslot.h"
 #include "red-parse-qxl.h"
-#include "zlib-encoder.h"
+#include "red-record-qxl.h"
+
+/* same limit as the parser, see red-parse-qxl.c */
+#define RECORD_MAX_CHUNKS (0x7fffffff / 1024)
+/* longest text recorded for a QXL_CMD_MESSAGE */
+#define RECORD_MAX_MESSAGE 1024
 
 #if 0
 static void hexdump_qxl(RedMemSlotInfo *slots, int group_id,
@@ -52,117 +60,73 @@ static void hexdump_qxl(RedMemSlotInfo *slots, int group_id,
 }
 #endif
 
-#define WITH_ZLIB 0
-
-/* TODO: make this thread safe (required for two qxl devices) */
-
-#if WITH_ZLIB
-typedef struct RecordEncoderData {
-    ZlibEncoderUsrContext base;
-    uint8_t *buf;
-    int size;
-} RecordEncoderData;
-
-static int record_zlib_more_space(ZlibEncoderUsrContext *usr, uint8_t **io_ptr)
-{
-    return 0;
-}
-
-static int record_zlib_more_input(ZlibEncoderUsrContext *usr, uint8_t **input)
-{
-    RecordEncoderData *data = SPICE_CONTAINEROF(usr, RecordEncoderData, base);
-
-    if (data->buf == NULL) {
-        fprintf(stderr, "%s: error: no more data\n", __FUNCTION__);
-        exit(1);
-    }
-    *input = data->buf;
-    data->buf = 0;
-    return data->size;
-}
-
-RecordEncoderData record_encoder_data = {
-    .base = {
-        record_zlib_more_space,
-        record_zlib_more_input,
-    },
-    .buf = NULL,
-    .size = 0,
-};
-#define RECORD_ZLIB_DEFAULT_COMPRESSION_LEVEL 3
-#endif
-
-#if WITH_ZLIB
-static uint8_t output[1024*1024*4]; // static buffer for encoding, 4MB
-#endif
-
 static void write_binary(FILE *fd, const char *prefix, size_t size, const uint8_t *buf)
 {
     int n;
 
-#if WITH_ZLIB
-    ZlibEncoder *enc;
-    int zlib_size;
-
-    record_encoder_data.buf = buf;
-    record_encoder_data.size = size;
-    enc = zlib_encoder_create(&record_encoder_data.base,
-            RECORD_ZLIB_DEFAULT_COMPRESSION_LEVEL);
-    if (!enc) {
-        fprintf(stderr, "%s: zlib encoder creation failed\n", __FUNCTION__);
-        exit(1);
-    }
-#endif
-
-    fprintf(fd, "binary %d %s %zu:", WITH_ZLIB, prefix, size);
-#if WITH_ZLIB
-    zlib_size = zlib_encode(enc, RECORD_ZLIB_DEFAULT_COMPRESSION_LEVEL, size,
-        output, sizeof(output));
-    fprintf(fd, "%d:", zlib_size);
-    n = fwrite(output, zlib_size, 1, fd);
-    zlib_encoder_destroy(enc);
-#else
+    /* the chunks are compressed as a whole by the writer thread */
+    fprintf(fd, "binary 0 %s %zu:", prefix, size);
     n = fwrite(buf, size, 1, fd);
-#endif
     (void)n;
     fprintf(fd, "\n");
 }
 
-static size_t red_record_data_chunks_ptr(FILE *fd, const char *prefix,
-                                         RedMemSlotInfo *slots, int group_id,
-                                         int memslot_id, QXLDataChunk *qxl)
+/* The record functions read guest memory that was not parsed yet, they
+ * return non zero as soon as an address is not valid and the record is
+ * then dropped */
+static int red_record_data_chunks_ptr(FILE *fd, const char *prefix,
+                                      RedMemSlotInfo *slots, int group_id,
+                                      int memslot_id, QXLDataChunk *qxl,
+                                      size_t *size)
 {
     size_t data_size = qxl->data_size;
     int count_chunks = 0;
     QXLDataChunk *cur = qxl;
     int error;
 
+    /* a looping chain of chunks must not hang the worker */
     while (cur->next_chunk) {
+        if (++count_chunks > RECORD_MAX_CHUNKS) {
+            return 1;
+        }
         cur =
             (QXLDataChunk*)memslot_get_virt(slots, cur->next_chunk, sizeof(*cur), group_id,
                                             &error);
+        if (error) {
+            return error;
+        }
         data_size += cur->data_size;
-        count_chunks++;
+    }
+    if (!memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_id,
+                               qxl->data_size, group_id)) {
+        return 1;
     }
     fprintf(fd, "data_chunks %d %zu\n", count_chunks, data_size);
-    memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_id, qxl->data_size, group_id);
     write_binary(fd, prefix, qxl->data_size, qxl->data);
 
-    while (qxl->next_chunk) {
+    while (count_chunks--) {
         memslot_id = memslot_get_id(slots, qxl->next_chunk);
         qxl = (QXLDataChunk*)memslot_get_virt(slots, qxl->next_chunk, sizeof(*qxl), group_id,
                                               &error);
-
-        memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_id, qxl->data_size, group_id);
+        if (error) {
+            return error;
+        }
+        if (!memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_id,
+                                   qxl->data_size, group_id)) {
+            return 1;
+        }
         write_binary(fd, prefix, qxl->data_size, qxl->data);
     }
 
-    return data_size;
+    if (size) {
+        *size = data_size;
+    }
+    return 0;
 }
 
-static size_t red_record_data_chunks(FILE *fd, const char *prefix,
-                                     RedMemSlotInfo *slots, int group_id,
-                                     QXLPHYSICAL addr)
+static int red_record_data_chunks(FILE *fd, const char *prefix,
+                                  RedMemSlotInfo *slots, int group_id,
+                                  QXLPHYSICAL addr, size_t *size)
 {
     QXLDataChunk *qxl;
     int memslot_id = memslot_get_id(slots, addr);
@@ -170,7 +134,10 @@ static size_t red_record_data_chunks(FILE *fd, const char *prefix,
 
     qxl = (QXLDataChunk*)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                           &error);
-    return red_record_data_chunks_ptr(fd, prefix, slots, group_id, memslot_id, qxl);
+    if (error) {
+        return error;
+    }
+    return red_record_data_chunks_ptr(fd, prefix, slots, group_id, memslot_id, qxl, size);
 }
 
 static void red_record_point_ptr(FILE *fd, QXLPoint *qxl)
@@ -189,59 +156,72 @@ static void red_record_rect_ptr(FILE *fd, const char *prefix, QXLRect *qxl)
         qxl->top, qxl->left, qxl->bottom, qxl->right);
 }
 
-static void red_record_path(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                            QXLPHYSICAL addr)
+static int red_record_path(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                           QXLPHYSICAL addr)
 {
     QXLPath *qxl;
     int error;
 
     qxl = (QXLPath *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                       &error);
-    red_record_data_chunks_ptr(fd, "path", slots, group_id,
-                                   memslot_get_id(slots, addr),
-                                   &qxl->chunk);
+    if (error) {
+        return error;
+    }
+    return red_record_data_chunks_ptr(fd, "path", slots, group_id,
+                                      memslot_get_id(slots, addr),
+                                      &qxl->chunk, NULL);
 }
 
-static void red_record_clip_rects(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                  QXLPHYSICAL addr)
+static int red_record_clip_rects(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                 QXLPHYSICAL addr)
 {
     QXLClipRects *qxl;
     int error;
 
     qxl = (QXLClipRects *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                            &error);
+    if (error) {
+        return error;
+    }
     fprintf(fd, "num_rects %d\n", qxl->num_rects);
-    red_record_data_chunks_ptr(fd, "clip_rects", slots, group_id,
-                                   memslot_get_id(slots, addr),
-                                   &qxl->chunk);
+    return red_record_data_chunks_ptr(fd, "clip_rects", slots, group_id,
+                                      memslot_get_id(slots, addr),
+                                      &qxl->chunk, NULL);
 }
 
-static void red_record_virt_data_flat(FILE *fd, const char *prefix,
-                                      RedMemSlotInfo *slots, int group_id,
-                                      QXLPHYSICAL addr, size_t size)
+static int red_record_virt_data_flat(FILE *fd, const char *prefix,
+                                     RedMemSlotInfo *slots, int group_id,
+                                     QXLPHYSICAL addr, size_t size)
 {
+    uint8_t *data;
     int error;
 
-    write_binary(fd, prefix,
-                 size, (uint8_t*)memslot_get_virt(slots, addr, size, group_id,
-                                                  &error));
+    if (size > UINT32_MAX) {
+        return 1;
+    }
+    data = (uint8_t*)memslot_get_virt(slots, addr, size, group_id, &error);
+    if (error) {
+        return error;
+    }
+    write_binary(fd, prefix, size, data);
+    return 0;
 }
 
-static void red_record_image_data_flat(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                       QXLPHYSICAL addr, size_t size)
+static int red_record_image_data_flat(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                      QXLPHYSICAL addr, size_t size)
 {
-    red_record_virt_data_flat(fd, "image_data_flat", slots, group_id, addr, size);
+    return red_record_virt_data_flat(fd, "image_data_flat", slots, group_id, addr, size);
 }
 
-static void red_record_transform(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                 QXLPHYSICAL addr)
+static int red_record_transform(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                QXLPHYSICAL addr)
 {
-    red_record_virt_data_flat(fd, "transform", slots, group_id,
-                              addr, sizeof(SpiceTransform));
+    return red_record_virt_data_flat(fd, "transform", slots, group_id,
+                                     addr, sizeof(SpiceTransform));
 }
 
-static void red_record_image(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                 QXLPHYSICAL addr, uint32_t flags)
+static int red_record_image(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                            QXLPHYSICAL addr, uint32_t flags)
 {
     QXLImage *qxl;
     size_t bitmap_size, size;
@@ -250,11 +230,14 @@ static void red_record_image(FILE *fd, RedMemSlotInfo *slots, int group_id,
 
     fprintf(fd, "image %d\n", addr ? 1 : 0);
     if (addr == 0) {
-        return;
+        return 0;
     }
 
     qxl = (QXLImage *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                        &error);
+    if (error) {
+        return error;
+    }
     fprintf(fd, "descriptor.id %"PRIu64"\n", qxl->descriptor.id);
     fprintf(fd, "descriptor.type %d\n", qxl->descriptor.type);
     fprintf(fd, "descriptor.flags %d\n", qxl->descriptor.flags);
@@ -275,25 +258,31 @@ static void red_record_image(FILE *fd, RedMemSlotInfo *slots, int group_id,
             int i, num_ents;
             qp = (QXLPalette *)memslot_get_virt(slots, qxl->bitmap.palette,
                                                 sizeof(*qp), group_id, &error);
+            if (error) {
+                return error;
+            }
             num_ents = qp->num_ents;
-            fprintf(fd, "qp.num_ents %d\n", qp->num_ents);
-            memslot_validate_virt(slots, (intptr_t)qp->ents,
-                          memslot_get_id(slots, qxl->bitmap.palette),
-                          num_ents * sizeof(qp->ents[0]), group_id);
+            if (!memslot_validate_virt(slots, (intptr_t)qp->ents,
+                                       memslot_get_id(slots, qxl->bitmap.palette),
+                                       num_ents * sizeof(qp->ents[0]), group_id)) {
+                return 1;
+            }
+            fprintf(fd, "qp.num_ents %d\n", num_ents);
             fprintf(fd, "unique %"PRIu64"\n", qp->unique);
             for (i = 0; i < num_ents; i++) {
                 fprintf(fd, "ents %d\n", qp->ents[i]);
             }
         }
-        bitmap_size = qxl->bitmap.y * abs(qxl->bitmap.stride);
+        bitmap_size = (size_t)qxl->bitmap.y * abs(qxl->bitmap.stride);
         if (qxl_flags & QXL_BITMAP_DIRECT) {
-            red_record_image_data_flat(fd, slots, group_id,
-                                                         qxl->bitmap.data,
-                                                         bitmap_size);
-        } else {
-            size = red_record_data_chunks(fd, "bitmap.data", slots, group_id,
-                                          qxl->bitmap.data);
-            spice_assert(size == bitmap_size);
+            return red_record_image_data_flat(fd, slots, group_id,
+                                              qxl->bitmap.data,
+                                              bitmap_size);
+        }
+        error = red_record_data_chunks(fd, "bitmap.data", slots, group_id,
+                                       qxl->bitmap.data, &size);
+        if (error || size != bitmap_size) {
+            return 1;
         }
         break;
     case SPICE_IMAGE_TYPE_SURFACE:
@@ -301,143 +290,183 @@ static void red_record_image(FILE *fd, RedMemSlotInfo *slots, int group_id,
         break;
     case SPICE_IMAGE_TYPE_QUIC:
         fprintf(fd, "quic.data_size %d\n", qxl->quic.data_size);
-        size = red_record_data_chunks_ptr(fd, "quic.data", slots, group_id,
-                                       memslot_get_id(slots, addr),
-                                       (QXLDataChunk *)qxl->quic.data);
-        spice_assert(size == qxl->quic.data_size);
+        error = red_record_data_chunks_ptr(fd, "quic.data", slots, group_id,
+                                           memslot_get_id(slots, addr),
+                                           (QXLDataChunk *)qxl->quic.data, &size);
+        if (error || size != qxl->quic.data_size) {
+            return 1;
+        }
         break;
     default:
-        spice_error("%s: unknown type %d", __FUNCTION__, qxl->descriptor.type);
+        spice_warning("unknown image type %d", qxl->descriptor.type);
+        return 1;
     }
+    return 0;
 }
 
-static void red_record_brush_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                 QXLBrush *qxl, uint32_t flags)
+static int red_record_brush_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                QXLBrush *qxl, uint32_t flags)
 {
+    int error = 0;
+
     fprintf(fd, "type %d\n", qxl->type);
     switch (qxl->type) {
     case SPICE_BRUSH_TYPE_SOLID:
         fprintf(fd, "u.color %d\n", qxl->u.color);
         break;
     case SPICE_BRUSH_TYPE_PATTERN:
-        red_record_image(fd, slots, group_id, qxl->u.pattern.pat, flags);
+        error = red_record_image(fd, slots, group_id, qxl->u.pattern.pat, flags);
         red_record_point_ptr(fd, &qxl->u.pattern.pos);
         break;
     }
+    return error;
 }
 
-static void red_record_qmask_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                 QXLQMask *qxl, uint32_t flags)
+static int red_record_qmask_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                QXLQMask *qxl, uint32_t flags)
 {
     fprintf(fd, "flags %d\n", qxl->flags);
     red_record_point_ptr(fd, &qxl->pos);
-    red_record_image(fd, slots, group_id, qxl->bitmap, flags);
+    return red_record_image(fd, slots, group_id, qxl->bitmap, flags);
 }
 
-static void red_record_fill_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLFill *qxl, uint32_t flags)
+static int red_record_fill_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLFill *qxl, uint32_t flags)
 {
-    red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags);
+    if (red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags)) {
+        return 1;
+    }
     fprintf(fd, "rop_descriptor %d\n", qxl->rop_descriptor);
-    red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+    return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_opaque_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                  QXLOpaque *qxl, uint32_t flags)
+static int red_record_opaque_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                 QXLOpaque *qxl, uint32_t flags)
 {
-   red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+   if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+       return 1;
+   }
    red_record_rect_ptr(fd, "src_area", &qxl->src_area);
-   red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags);
+   if (red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags)) {
+       return 1;
+   }
    fprintf(fd, "rop_descriptor %d\n", qxl->rop_descriptor);
    fprintf(fd, "scale_mode %d\n", qxl->scale_mode);
-   red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+   return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_copy_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLCopy *qxl, uint32_t flags)
+static int red_record_copy_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLCopy *qxl, uint32_t flags)
 {
-   red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+   if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+       return 1;
+   }
    red_record_rect_ptr(fd, "src_area", &qxl->src_area);
    fprintf(fd, "rop_descriptor %d\n", qxl->rop_descriptor);
    fprintf(fd, "scale_mode %d\n", qxl->scale_mode);
-   red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+   return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_blend_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                             QXLBlend *qxl, uint32_t flags)
+static int red_record_blend_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                QXLBlend *qxl, uint32_t flags)
 {
-   red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+   if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+       return 1;
+   }
    red_record_rect_ptr(fd, "src_area", &qxl->src_area);
    fprintf(fd, "rop_descriptor %d\n", qxl->rop_descriptor);
    fprintf(fd, "scale_mode %d\n", qxl->scale_mode);
-   red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+   return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_transparent_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                    QXLTransparent *qxl,
-                                    uint32_t flags)
+static int red_record_transparent_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                      QXLTransparent *qxl,
+                                      uint32_t flags)
 {
-   red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+   if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+       return 1;
+   }
    red_record_rect_ptr(fd, "src_area", &qxl->src_area);
    fprintf(fd, "src_color %d\n", qxl->src_color);
    fprintf(fd, "true_color %d\n", qxl->true_color);
+   return 0;
 }
 
-static void red_record_alpha_blend_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                    QXLAlphaBlend *qxl,
-                                    uint32_t flags)
+static int red_record_alpha_blend_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                      QXLAlphaBlend *qxl,
+                                      uint32_t flags)
 {
     fprintf(fd, "alpha_flags %d\n", qxl->alpha_flags);
     fprintf(fd, "alpha %d\n", qxl->alpha);
-    red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+    if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+        return 1;
+    }
     red_record_rect_ptr(fd, "src_area", &qxl->src_area);
+    return 0;
 }
 
-static void red_record_alpha_blend_ptr_compat(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                           QXLCompatAlphaBlend *qxl,
-                                           uint32_t flags)
+static int red_record_alpha_blend_ptr_compat(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                             QXLCompatAlphaBlend *qxl,
+                                             uint32_t flags)
 {
     fprintf(fd, "alpha %d\n", qxl->alpha);
-    red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+    if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+        return 1;
+    }
     red_record_rect_ptr(fd, "src_area", &qxl->src_area);
+    return 0;
 }
 
-static void red_record_rop3_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLRop3 *qxl, uint32_t flags)
+static int red_record_rop3_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLRop3 *qxl, uint32_t flags)
 {
-    red_record_image(fd, slots, group_id, qxl->src_bitmap, flags);
+    if (red_record_image(fd, slots, group_id, qxl->src_bitmap, flags)) {
+        return 1;
+    }
     red_record_rect_ptr(fd, "src_area", &qxl->src_area);
-    red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags);
+    if (red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags)) {
+        return 1;
+    }
     fprintf(fd, "rop3 %d\n", qxl->rop3);
     fprintf(fd, "scale_mode %d\n", qxl->scale_mode);
-    red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+    return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_stroke_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                  QXLStroke *qxl, uint32_t flags)
+static int red_record_stroke_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                 QXLStroke *qxl, uint32_t flags)
 {
     int error;
 
-    red_record_path(fd, slots, group_id, qxl->path);
+    if (red_record_path(fd, slots, group_id, qxl->path)) {
+        return 1;
+    }
     fprintf(fd, "attr.flags %d\n", qxl->attr.flags);
     if (qxl->attr.flags & SPICE_LINE_FLAGS_STYLED) {
         int style_nseg = qxl->attr.style_nseg;
         uint8_t *buf;
 
         fprintf(fd, "attr.style_nseg %d\n", qxl->attr.style_nseg);
-        spice_assert(qxl->attr.style);
+        if (!qxl->attr.style) {
+            return 1;
+        }
         buf = (uint8_t *)memslot_get_virt(slots, qxl->attr.style,
                                           style_nseg * sizeof(QXLFIXED), group_id,
                                           &error);
+        if (error) {
+            return error;
+        }
         write_binary(fd, "style", style_nseg * sizeof(QXLFIXED), buf);
     }
-    red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags);
+    if (red_record_brush_ptr(fd, slots, group_id, &qxl->brush, flags)) {
+        return 1;
+    }
     fprintf(fd, "fore_mode %d\n", qxl->fore_mode);
     fprintf(fd, "back_mode %d\n", qxl->back_mode);
+    return 0;
 }
 
-static void red_record_string(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                              QXLPHYSICAL addr)
+static int red_record_string(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                             QXLPHYSICAL addr)
 {
     QXLString *qxl;
     size_t chunk_size;
@@ -445,77 +474,97 @@ static void red_record_string(FILE *fd, RedMemSlotInfo *slots, int group_id,
 
     qxl = (QXLString *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                         &error);
+    if (error) {
+        return error;
+    }
     fprintf(fd, "data_size %d\n", qxl->data_size);
     fprintf(fd, "length %d\n", qxl->length);
     fprintf(fd, "flags %d\n", qxl->flags);
-    chunk_size = red_record_data_chunks_ptr(fd, "string", slots, group_id,
-                                            memslot_get_id(slots, addr),
-                                            &qxl->chunk);
-    spice_assert(chunk_size == qxl->data_size);
+    error = red_record_data_chunks_ptr(fd, "string", slots, group_id,
+                                       memslot_get_id(slots, addr),
+                                       &qxl->chunk, &chunk_size);
+    if (error || chunk_size != qxl->data_size) {
+        return 1;
+    }
+    return 0;
 }
 
-static void red_record_text_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLText *qxl, uint32_t flags)
+static int red_record_text_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLText *qxl, uint32_t flags)
 {
-   red_record_string(fd, slots, group_id, qxl->str);
+   if (red_record_string(fd, slots, group_id, qxl->str)) {
+       return 1;
+   }
    red_record_rect_ptr(fd, "back_area", &qxl->back_area);
-   red_record_brush_ptr(fd, slots, group_id, &qxl->fore_brush, flags);
-   red_record_brush_ptr(fd, slots, group_id, &qxl->back_brush, flags);
+   if (red_record_brush_ptr(fd, slots, group_id, &qxl->fore_brush, flags) ||
+       red_record_brush_ptr(fd, slots, group_id, &qxl->back_brush, flags)) {
+       return 1;
+   }
    fprintf(fd, "fore_mode %d\n", qxl->fore_mode);
    fprintf(fd, "back_mode %d\n", qxl->back_mode);
+   return 0;
 }
 
-static void red_record_whiteness_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                     QXLWhiteness *qxl, uint32_t flags)
+static int red_record_whiteness_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                    QXLWhiteness *qxl, uint32_t flags)
 {
-    red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+    return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_blackness_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                     QXLBlackness *qxl, uint32_t flags)
+static int red_record_blackness_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                    QXLBlackness *qxl, uint32_t flags)
 {
-    red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+    return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_invers_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                  QXLInvers *qxl, uint32_t flags)
+static int red_record_invers_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                 QXLInvers *qxl, uint32_t flags)
 {
-    red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
+    return red_record_qmask_ptr(fd, slots, group_id, &qxl->mask, flags);
 }
 
-static void red_record_clip_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLClip *qxl)
+static int red_record_clip_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLClip *qxl)
 {
     fprintf(fd, "type %d\n", qxl->type);
     switch (qxl->type) {
     case SPICE_CLIP_TYPE_RECTS:
-        red_record_clip_rects(fd, slots, group_id, qxl->data);
-        break;
+        return red_record_clip_rects(fd, slots, group_id, qxl->data);
     }
+    return 0;
 }
 
-static void red_record_composite_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                     QXLComposite *qxl, uint32_t flags)
+static int red_record_composite_ptr(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                    QXLComposite *qxl, uint32_t flags)
 {
     fprintf(fd, "flags %d\n", qxl->flags);
 
-    red_record_image(fd, slots, group_id, qxl->src, flags);
+    if (red_record_image(fd, slots, group_id, qxl->src, flags)) {
+        return 1;
+    }
     fprintf(fd, "src_transform %d\n", !!qxl->src_transform);
-    if (qxl->src_transform)
-        red_record_transform(fd, slots, group_id, qxl->src_transform);
+    if (qxl->src_transform &&
+        red_record_transform(fd, slots, group_id, qxl->src_transform)) {
+        return 1;
+    }
     fprintf(fd, "mask %d\n", !!qxl->mask);
-    if (qxl->mask)
-        red_record_image(fd, slots, group_id, qxl->mask, flags);
+    if (qxl->mask &&
+        red_record_image(fd, slots, group_id, qxl->mask, flags)) {
+        return 1;
+    }
     fprintf(fd, "mask_transform %d\n", !!qxl->mask_transform);
-    if (qxl->mask_transform)
-        red_record_transform(fd, slots, group_id, qxl->mask_transform);
+    if (qxl->mask_transform &&
+        red_record_transform(fd, slots, group_id, qxl->mask_transform)) {
+        return 1;
+    }
 
     fprintf(fd, "src_origin %d %d\n", qxl->src_origin.x, qxl->src_origin.y);
     fprintf(fd, "mask_origin %d %d\n", qxl->mask_origin.x, qxl->mask_origin.y);
+    return 0;
 }
 
-static void red_record_native_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                       QXLPHYSICAL addr, uint32_t flags)
+static int red_record_native_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                      QXLPHYSICAL addr, uint32_t flags)
 {
     QXLDrawable *qxl;
     int i;
@@ -523,9 +572,14 @@ static void red_record_native_drawable(FILE *fd, RedMemSlotInfo *slots, int grou
 
     qxl = (QXLDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                           &error);
+    if (error) {
+        return error;
+    }
 
     red_record_rect_ptr(fd, "bbox", &qxl->bbox);
-    red_record_clip_ptr(fd, slots, group_id, &qxl->clip);
+    if (red_record_clip_ptr(fd, slots, group_id, &qxl->clip)) {
+        return 1;
+    }
     fprintf(fd, "effect %d\n", qxl->effect);
     fprintf(fd, "mm_time %d\n", qxl->mm_time);
     fprintf(fd, "self_bitmap %d\n", qxl->self_bitmap);
@@ -540,68 +594,60 @@ static void red_record_native_drawable(FILE *fd, RedMemSlotInfo *slots, int grou
     fprintf(fd, "type %d\n", qxl->type);
     switch (qxl->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_record_alpha_blend_ptr(fd, slots, group_id,
-                                   &qxl->u.alpha_blend, flags);
-        break;
+        return red_record_alpha_blend_ptr(fd, slots, group_id,
+                                          &qxl->u.alpha_blend, flags);
     case QXL_DRAW_BLACKNESS:
-        red_record_blackness_ptr(fd, slots, group_id,
-                                 &qxl->u.blackness, flags);
-        break;
+        return red_record_blackness_ptr(fd, slots, group_id,
+                                        &qxl->u.blackness, flags);
     case QXL_DRAW_BLEND:
-        red_record_blend_ptr(fd, slots, group_id, &qxl->u.blend, flags);
-        break;
+        return red_record_blend_ptr(fd, slots, group_id, &qxl->u.blend, flags);
     case QXL_DRAW_COPY:
-        red_record_copy_ptr(fd, slots, group_id, &qxl->u.copy, flags);
-        break;
+        return red_record_copy_ptr(fd, slots, group_id, &qxl->u.copy, flags);
     case QXL_COPY_BITS:
         red_record_point_ptr(fd, &qxl->u.copy_bits.src_pos);
-        break;
+        return 0;
     case QXL_DRAW_FILL:
-        red_record_fill_ptr(fd, slots, group_id, &qxl->u.fill, flags);
-        break;
+        return red_record_fill_ptr(fd, slots, group_id, &qxl->u.fill, flags);
     case QXL_DRAW_OPAQUE:
-        red_record_opaque_ptr(fd, slots, group_id, &qxl->u.opaque, flags);
-        break;
+        return red_record_opaque_ptr(fd, slots, group_id, &qxl->u.opaque, flags);
     case QXL_DRAW_INVERS:
-        red_record_invers_ptr(fd, slots, group_id, &qxl->u.invers, flags);
-        break;
+        return red_record_invers_ptr(fd, slots, group_id, &qxl->u.invers, flags);
     case QXL_DRAW_NOP:
-        break;
+        return 0;
     case QXL_DRAW_ROP3:
-        red_record_rop3_ptr(fd, slots, group_id, &qxl->u.rop3, flags);
-        break;
+        return red_record_rop3_ptr(fd, slots, group_id, &qxl->u.rop3, flags);
     case QXL_DRAW_STROKE:
-        red_record_stroke_ptr(fd, slots, group_id, &qxl->u.stroke, flags);
-        break;
+        return red_record_stroke_ptr(fd, slots, group_id, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
-        red_record_text_ptr(fd, slots, group_id, &qxl->u.text, flags);
-        break;
+        return red_record_text_ptr(fd, slots, group_id, &qxl->u.text, flags);
     case QXL_DRAW_TRANSPARENT:
-        red_record_transparent_ptr(fd, slots, group_id, &qxl->u.transparent, flags);
-        break;
+        return red_record_transparent_ptr(fd, slots, group_id, &qxl->u.transparent, flags);
     case QXL_DRAW_WHITENESS:
-        red_record_whiteness_ptr(fd, slots, group_id, &qxl->u.whiteness, flags);
-        break;
+        return red_record_whiteness_ptr(fd, slots, group_id, &qxl->u.whiteness, flags);
     case QXL_DRAW_COMPOSITE:
-        red_record_composite_ptr(fd, slots, group_id, &qxl->u.composite, flags);
-        break;
+        return red_record_composite_ptr(fd, slots, group_id, &qxl->u.composite, flags);
     default:
-        spice_error("%s: unknown type %d", __FUNCTION__, qxl->type);
-        break;
+        spice_warning("unknown drawable type %d", qxl->type);
+        return 1;
     };
 }
 
-static void red_record_compat_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                       QXLPHYSICAL addr, uint32_t flags)
+static int red_record_compat_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                      QXLPHYSICAL addr, uint32_t flags)
 {
     QXLCompatDrawable *qxl;
     int error;
 
     qxl = (QXLCompatDrawable *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                                 &error);
+    if (error) {
+        return error;
+    }
 
     red_record_rect_ptr(fd, "bbox", &qxl->bbox);
-    red_record_clip_ptr(fd, slots, group_id, &qxl->clip);
+    if (red_record_clip_ptr(fd, slots, group_id, &qxl->clip)) {
+        return 1;
+    }
     fprintf(fd, "effect %d\n", qxl->effect);
     fprintf(fd, "mm_time %d\n", qxl->mm_time);
 
@@ -611,99 +657,98 @@ static void red_record_compat_drawable(FILE *fd, RedMemSlotInfo *slots, int grou
     fprintf(fd, "type %d\n", qxl->type);
     switch (qxl->type) {
     case QXL_DRAW_ALPHA_BLEND:
-        red_record_alpha_blend_ptr_compat(fd, slots, group_id,
-                                       &qxl->u.alpha_blend, flags);
-        break;
+        return red_record_alpha_blend_ptr_compat(fd, slots, group_id,
+                                                 &qxl->u.alpha_blend, flags);
     case QXL_DRAW_BLACKNESS:
-        red_record_blackness_ptr(fd, slots, group_id,
-                              &qxl->u.blackness, flags);
-        break;
+        return red_record_blackness_ptr(fd, slots, group_id,
+                                        &qxl->u.blackness, flags);
     case QXL_DRAW_BLEND:
-        red_record_blend_ptr(fd, slots, group_id, &qxl->u.blend, flags);
-        break;
+        return red_record_blend_ptr(fd, slots, group_id, &qxl->u.blend, flags);
     case QXL_DRAW_COPY:
-        red_record_copy_ptr(fd, slots, group_id, &qxl->u.copy, flags);
-        break;
+        return red_record_copy_ptr(fd, slots, group_id, &qxl->u.copy, flags);
     case QXL_COPY_BITS:
         red_record_point_ptr(fd, &qxl->u.copy_bits.src_pos);
-        break;
+        return 0;
     case QXL_DRAW_FILL:
-        red_record_fill_ptr(fd, slots, group_id, &qxl->u.fill, flags);
-        break;
+        return red_record_fill_ptr(fd, slots, group_id, &qxl->u.fill, flags);
     case QXL_DRAW_OPAQUE:
-        red_record_opaque_ptr(fd, slots, group_id, &qxl->u.opaque, flags);
-        break;
+        return red_record_opaque_ptr(fd, slots, group_id, &qxl->u.opaque, flags);
     case QXL_DRAW_INVERS:
-        red_record_invers_ptr(fd, slots, group_id, &qxl->u.invers, flags);
-        break;
+        return red_record_invers_ptr(fd, slots, group_id, &qxl->u.invers, flags);
     case QXL_DRAW_NOP:
-        break;
+        return 0;
     case QXL_DRAW_ROP3:
-        red_record_rop3_ptr(fd, slots, group_id, &qxl->u.rop3, flags);
-        break;
+        return red_record_rop3_ptr(fd, slots, group_id, &qxl->u.rop3, flags);
     case QXL_DRAW_STROKE:
-        red_record_stroke_ptr(fd, slots, group_id, &qxl->u.stroke, flags);
-        break;
+        return red_record_stroke_ptr(fd, slots, group_id, &qxl->u.stroke, flags);
     case QXL_DRAW_TEXT:
-        red_record_text_ptr(fd, slots, group_id, &qxl->u.text, flags);
-        break;
+        return red_record_text_ptr(fd, slots, group_id, &qxl->u.text, flags);
     case QXL_DRAW_TRANSPARENT:
-        red_record_transparent_ptr(fd, slots, group_id, &qxl->u.transparent, flags);
-        break;
+        return red_record_transparent_ptr(fd, slots, group_id, &qxl->u.transparent, flags);
     case QXL_DRAW_WHITENESS:
-        red_record_whiteness_ptr(fd, slots, group_id, &qxl->u.whiteness, flags);
-        break;
+        return red_record_whiteness_ptr(fd, slots, group_id, &qxl->u.whiteness, flags);
     default:
-        spice_error("%s: unknown type %d", __FUNCTION__, qxl->type);
-        break;
+        spice_warning("unknown drawable type %d", qxl->type);
+        return 1;
     };
 }
 
-static void red_record_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                QXLPHYSICAL addr, uint32_t flags)
+static int red_record_drawable(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                               QXLPHYSICAL addr, uint32_t flags)
 {
     fprintf(fd, "drawable\n");
     if (flags & QXL_COMMAND_FLAG_COMPAT) {
-        red_record_compat_drawable(fd, slots, group_id, addr, flags);
+        return red_record_compat_drawable(fd, slots, group_id, addr, flags);
     } else {
-        red_record_native_drawable(fd, slots, group_id, addr, flags);
+        return red_record_native_drawable(fd, slots, group_id, addr, flags);
     }
 }
 
-static void red_record_update_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                                  QXLPHYSICAL addr)
+static int red_record_update_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                 QXLPHYSICAL addr)
 {
     QXLUpdateCmd *qxl;
     int error;
 
     qxl = (QXLUpdateCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                            &error);
+    if (error) {
+        return error;
+    }
 
     fprintf(fd, "update\n");
     red_record_rect_ptr(fd, "area", &qxl->area);
     fprintf(fd, "update_id %d\n", qxl->update_id);
     fprintf(fd, "surface_id %d\n", qxl->surface_id);
+    return 0;
 }
 
-static void red_record_message(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                               QXLPHYSICAL addr)
+static int red_record_message(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                              QXLPHYSICAL addr)
 {
     QXLMessage *qxl;
+    size_t len = 0;
     int error;
 
     /*
-     * security alert:
-     *   qxl->data[0] size isn't specified anywhere -> can't verify
-     *   luckily this is for debug logging only,
-     *   so we can just ignore it by default.
+     * qxl->data[0] size isn't specified anywhere, only the text found in
+     * the next RECORD_MAX_MESSAGE bytes of the slot is recorded
      */
     qxl = (QXLMessage *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                          &error);
-    write_binary(fd, "message", strlen((char*)qxl->data), (uint8_t*)qxl->data);
+    if (error) {
+        return error;
+    }
+    if (memslot_validate_virt(slots, (intptr_t)qxl->data, memslot_get_id(slots, addr),
+                              RECORD_MAX_MESSAGE, group_id)) {
+        len = strnlen((char*)qxl->data, RECORD_MAX_MESSAGE);
+    }
+    write_binary(fd, "message", len, (uint8_t*)qxl->data);
+    return 0;
 }
 
-static void red_record_surface_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                            QXLPHYSICAL addr)
+static int red_record_surface_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                                  QXLPHYSICAL addr, QXLSurfaceCmd **surface_cmd)
 {
     QXLSurfaceCmd *qxl;
     size_t size;
@@ -711,6 +756,9 @@ static void red_record_surface_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id
 
     qxl = (QXLSurfaceCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                             &error);
+    if (error) {
+        return error;
+    }
 
     fprintf(fd, "surface_cmd\n");
     fprintf(fd, "surface_id %d\n", qxl->surface_id);
@@ -723,24 +771,29 @@ static void red_record_surface_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id
         fprintf(fd, "u.surface_create.width %d\n", qxl->u.surface_create.width);
         fprintf(fd, "u.surface_create.height %d\n", qxl->u.surface_create.height);
         fprintf(fd, "u.surface_create.stride %d\n", qxl->u.surface_create.stride);
-        size = qxl->u.surface_create.height * abs(qxl->u.surface_create.stride);
-        if ((qxl->flags & QXL_SURF_FLAG_KEEP_DATA) != 0) {
-            write_binary(fd, "data", size,
-                (uint8_t*)memslot_get_virt(slots, qxl->u.surface_create.data, size, group_id,
-                                           &error));
+        size = (size_t)qxl->u.surface_create.height * abs(qxl->u.surface_create.stride);
+        if ((qxl->flags & QXL_SURF_FLAG_KEEP_DATA) != 0 &&
+            red_record_virt_data_flat(fd, "data", slots, group_id,
+                                      qxl->u.surface_create.data, size)) {
+            return 1;
         }
         break;
     }
+    *surface_cmd = qxl;
+    return 0;
 }
 
-static void red_record_cursor(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                              QXLPHYSICAL addr)
+static int red_record_cursor(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                             QXLPHYSICAL addr)
 {
     QXLCursor *qxl;
     int error;
 
     qxl = (QXLCursor *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                         &error);
+    if (error) {
+        return error;
+    }
 
     fprintf(fd, "header.unique %"PRIu64"\n", qxl->header.unique);
     fprintf(fd, "header.type %d\n", qxl->header.type);
@@ -750,19 +803,22 @@ static void red_record_cursor(FILE *fd, RedMemSlotInfo *slots, int group_id,
     fprintf(fd, "header.hot_spot_y %d\n", qxl->header.hot_spot_y);
 
     fprintf(fd, "data_size %d\n", qxl->data_size);
-    red_record_data_chunks_ptr(fd, "cursor", slots, group_id,
-                                   memslot_get_id(slots, addr),
-                                   &qxl->chunk);
+    return red_record_data_chunks_ptr(fd, "cursor", slots, group_id,
+                                      memslot_get_id(slots, addr),
+                                      &qxl->chunk, NULL);
 }
 
-void red_record_cursor_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
-                           QXLPHYSICAL addr)
+int red_record_cursor_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
+                          QXLPHYSICAL addr)
 {
     QXLCursorCmd *qxl;
     int error;
 
     qxl = (QXLCursorCmd *)memslot_get_virt(slots, addr, sizeof(*qxl), group_id,
                                            &error);
+    if (error) {
+        return error;
+    }
 
     fprintf(fd, "cursor_cmd\n");
     fprintf(fd, "type %d\n", qxl->type);
@@ -770,8 +826,7 @@ void red_record_cursor_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
     case QXL_CURSOR_SET:
         red_record_point16_ptr(fd, &qxl->u.set.position);
         fprintf(fd, "u.set.visible %d\n", qxl->u.set.visible);
-        red_record_cursor(fd, slots, group_id, qxl->u.set.shape);
-        break;
+        return red_record_cursor(fd, slots, group_id, qxl->u.set.shape);
     case QXL_CURSOR_MOVE:
         red_record_point16_ptr(fd, &qxl->u.position);
         break;
@@ -780,48 +835,601 @@ void red_record_cursor_cmd(FILE *fd, RedMemSlotInfo *slots, int group_id,
         fprintf(fd, "u.trail.frequency %d\n", qxl->u.trail.frequency);
         break;
     }
+    return 0;
+}
+
+typedef struct RedRecordChunk RedRecordChunk;
+typedef struct RedRecordEntry RedRecordEntry;
+struct RedRecordChunk {
+    RedRecordChunk *next;
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+    uint32_t n_records;
+    uint64_t first_ts;
+};
+
+/* One or more records kept by the flight recorder */
+struct RedRecordEntry {
+    int refs;
+    int in_ring;
+    uint64_t ts;
+    size_t size;
+    uint8_t data[];
+};
+
+/* The worker formats each record in a memory stream and appends it to the
+ * current chunk. Full chunks are compressed and written by a thread of
+ * their own, the worker only waits on it when RED_RECORD_MAX_QUEUED chunks
+ * are pending. The writer also takes a current chunk left idle for
+ * RED_RECORD_FLUSH_INTERVAL seconds, so that recordings are usable while
+ * they run. red_worker_free() closes the recordings of a worker when
+ * spice_server_destroy() tears it down, the red_record_exit() destructor
+ * closes the ones still open when the process exits without that.
+ */
+struct RedRecord {
+    FILE *file;
+    int compression_level;
+    int flight;
+
+    /* worker thread only */
+    FILE *mem;
+    char *mem_buf;
+    size_t mem_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued_cond;
+    pthread_cond_t written_cond;
+    RedRecordChunk *current;
+    RedRecordChunk *queue_head;
+    RedRecordChunk *queue_tail;
+    int n_queued;
+    int stop;
+    pthread_t thread;
+
+    /* writer thread only */
+    GArray *index; /* RedRecordIndexEntry */
+    uint64_t offset;
+
+    /* flight recorder, worker thread only */
+    uint64_t flight_window; /* ns */
+    size_t flight_max_bytes;
+    size_t flight_bytes;
+    uint64_t flight_last_ts;
+    GQueue *flight_entries; /* RedRecordEntry, oldest first */
+    int flight_continued;
+    RedRecordEntry *primary;
+    GHashTable *surfaces; /* surface id -> RedRecordEntry creating it */
+};
+
+/* the recordings to a file, closed at exit if they are still open */
+static GList *open_records;
+static pthread_mutex_t open_records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+G_STATIC_ASSERT(sizeof(RedRecordChunkHeader) == 32);
+G_STATIC_ASSERT(sizeof(RedRecordIndexEntry) == 24);
+G_STATIC_ASSERT(sizeof(RedRecordTrailer) == 16);
+
+static void red_record_chunk_free(RedRecordChunk *chunk)
+{
+    g_free(chunk->data);
+    g_free(chunk);
 }
 
-void red_record_dev_input_primary_surface_create(FILE *fd,
+/* called with the lock held */
+static void red_record_queue_current(RedRecord *record)
+{
+    RedRecordChunk *chunk = record->current;
+
+    if (!chunk) {
+        return;
+    }
+    record->current = NULL;
+    if (record->queue_tail) {
+        record->queue_tail->next = chunk;
+    } else {
+        record->queue_head = chunk;
+    }
+    record->queue_tail = chunk;
+    record->n_queued++;
+    pthread_cond_signal(&record->queued_cond);
+}
+
+static void red_record_write_chunk(RedRecord *record, uint32_t type,
+                                   const uint8_t *data, uint32_t size,
+                                   uint32_t n_records, uint64_t first_ts)
+{
+    RedRecordChunkHeader header;
+    RedRecordIndexEntry entry;
+    uint8_t *compressed = NULL;
+    uLongf compressed_size;
+
+    header.type = GUINT32_TO_LE(type);
+    header.flags = 0;
+    header.raw_size = GUINT32_TO_LE(size);
+    header.n_records = GUINT32_TO_LE(n_records);
+    header.padding = 0;
+    header.first_ts = GUINT64_TO_LE(first_ts);
+
+    if (record->compression_level > 0 && type == RED_RECORD_CHUNK_DATA) {
+        compressed_size = compressBound(size);
+        compressed = g_malloc(compressed_size);
+        if (compress2(compressed, &compressed_size, data, size,
+                      record->compression_level) == Z_OK && compressed_size < size) {
+            header.flags = GUINT32_TO_LE(RED_RECORD_CHUNK_FLAG_ZLIB);
+            data = compressed;
+            size = compressed_size;
+        }
+    }
+    header.size = GUINT32_TO_LE(size);
+
+    if (fwrite(&header, sizeof(header), 1, record->file) != 1 ||
+        (size && fwrite(data, size, 1, record->file) != 1) ||
+        fflush(record->file) != 0) {
+        spice_warning("failed to write recording: %s", strerror(errno));
+    }
+    g_free(compressed);
+
+    if (type == RED_RECORD_CHUNK_DATA) {
+        entry.offset = GUINT64_TO_LE(record->offset);
+        entry.first_ts = GUINT64_TO_LE(first_ts);
+        entry.n_records = GUINT32_TO_LE(n_records);
+        entry.raw_size = header.raw_size;
+        g_array_append_val(record->index, entry);
+    }
+    record->offset += sizeof(header) + size;
+}
+
+static void *red_record_writer_thread(void *opaque)
+{
+    RedRecord *record = opaque;
+    RedRecordChunk *chunk;
+    struct timespec deadline;
+    int ret;
+
+    pthread_mutex_lock(&record->lock);
+    for (;;) {
+        while (!record->queue_head && !record->stop) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RED_RECORD_FLUSH_INTERVAL;
+            ret = pthread_cond_timedwait(&record->queued_cond, &record->lock, &deadline);
+            if (ret == ETIMEDOUT) {
+                red_record_queue_current(record);
+            }
+        }
+        chunk = record->queue_head;
+        if (!chunk) {
+            break;
+        }
+        record->queue_head = chunk->next;
+        if (!record->queue_head) {
+            record->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&record->lock);
+
+        red_record_write_chunk(record, RED_RECORD_CHUNK_DATA, chunk->data, chunk->size,
+                               chunk->n_records, chunk->first_ts);
+        red_record_chunk_free(chunk);
+
+        pthread_mutex_lock(&record->lock);
+        record->n_queued--;
+        pthread_cond_signal(&record->written_cond);
+    }
+    pthread_mutex_unlock(&record->lock);
+    return NULL;
+}
+
+RedRecord *red_record_new(const char *filename, int compression_level)
+{
+    static const char header[] = "SPICE_REPLAY 2\n";
+    RedRecord *record;
+    FILE *file;
+
+    file = fopen(filename, "w+");
+    if (!file) {
+        spice_warning("failed to open recording file %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+    if (fwrite(header, sizeof(header) - 1, 1, file) != 1) {
+        spice_warning("failed to write replay header");
+        fclose(file);
+        return NULL;
+    }
+
+    record = spice_new0(RedRecord, 1);
+    record->file = file;
+    record->compression_level = CLAMP(compression_level, 0, 9);
+    record->offset = sizeof(header) - 1;
+    record->index = g_array_new(FALSE, FALSE, sizeof(RedRecordIndexEntry));
+    record->mem = open_memstream(&record->mem_buf, &record->mem_size);
+    if (!record->mem) {
+        spice_error("failed to create the recording buffer");
+    }
+    pthread_mutex_init(&record->lock, NULL);
+    pthread_cond_init(&record->queued_cond, NULL);
+    pthread_cond_init(&record->written_cond, NULL);
+    if (pthread_create(&record->thread, NULL, red_record_writer_thread, record) != 0) {
+        spice_error("failed to create the recording thread");
+    }
+
+    pthread_mutex_lock(&open_records_lock);
+    open_records = g_list_prepend(open_records, record);
+    pthread_mutex_unlock(&open_records_lock);
+    return record;
+}
+
+static RedRecordEntry *red_record_entry_new(const uint8_t *data, size_t size,
+                                            const uint8_t *more, size_t more_size,
+                                            uint64_t ts)
+{
+    RedRecordEntry *entry = g_malloc(sizeof(RedRecordEntry) + size + more_size);
+
+    entry->refs = 1;
+    entry->in_ring = FALSE;
+    entry->ts = ts;
+    entry->size = size + more_size;
+    memcpy(entry->data, data, size);
+    if (more_size) {
+        memcpy(entry->data + size, more, more_size);
+    }
+    return entry;
+}
+
+static RedRecordEntry *red_record_entry_ref(RedRecordEntry *entry)
+{
+    entry->refs++;
+    return entry;
+}
+
+static void red_record_entry_unref(gpointer data)
+{
+    RedRecordEntry *entry = data;
+
+    if (entry && --entry->refs == 0) {
+        g_free(entry);
+    }
+}
+
+/* Writes what is pending, then the index, records appended after that are
+ * dropped */
+static void red_record_close(RedRecord *record)
+{
+    RedRecordTrailer trailer;
+    uint64_t index_offset;
+
+    pthread_mutex_lock(&record->lock);
+    if (record->stop) {
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
+    red_record_queue_current(record);
+    record->stop = TRUE;
+    pthread_cond_signal(&record->queued_cond);
+    pthread_mutex_unlock(&record->lock);
+    pthread_join(record->thread, NULL);
+
+    index_offset = record->offset;
+    red_record_write_chunk(record, RED_RECORD_CHUNK_INDEX, (uint8_t *)record->index->data,
+                           record->index->len * sizeof(RedRecordIndexEntry),
+                           record->index->len, 0);
+    trailer.index_offset = GUINT64_TO_LE(index_offset);
+    memcpy(trailer.magic, RED_RECORD_TRAILER_MAGIC, sizeof(trailer.magic));
+    if (fwrite(&trailer, sizeof(trailer), 1, record->file) != 1) {
+        spice_warning("failed to write the recording index");
+    }
+    fclose(record->file);
+}
+
+SPICE_DESTRUCTOR_FUNC(red_record_exit)
+{
+    GList *l;
+
+    pthread_mutex_lock(&open_records_lock);
+    for (l = open_records; l != NULL; l = l->next) {
+        red_record_close(l->data);
+    }
+    pthread_mutex_unlock(&open_records_lock);
+}
+
+void red_record_free(RedRecord *record)
+{
+    if (record->flight) {
+        RedRecordEntry *entry;
+
+        while ((entry = g_queue_pop_head(record->flight_entries))) {
+            red_record_entry_unref(entry);
+        }
+        g_queue_free(record->flight_entries);
+        red_record_entry_unref(record->primary);
+        g_hash_table_destroy(record->surfaces);
+        fclose(record->mem);
+        free(record->mem_buf);
+        free(record);
+        return;
+    }
+
+    pthread_mutex_lock(&open_records_lock);
+    open_records = g_list_remove(open_records, record);
+    pthread_mutex_unlock(&open_records_lock);
+    red_record_close(record);
+    if (record->current) {
+        red_record_chunk_free(record->current);
+    }
+
+    fclose(record->mem);
+    free(record->mem_buf);
+    g_array_free(record->index, TRUE);
+    pthread_mutex_destroy(&record->lock);
+    pthread_cond_destroy(&record->queued_cond);
+    pthread_cond_destroy(&record->written_cond);
+    free(record);
+}
+
+/* Returns the stream to write one record to, until red_record_end() */
+FILE *red_record_begin(RedRecord *record)
+{
+    rewind(record->mem);
+    return record->mem;
+}
+
+static void red_record_append(RedRecord *record, const uint8_t *data, size_t size,
+                              uint64_t ts)
+{
+    RedRecordChunk *chunk;
+
+    pthread_mutex_lock(&record->lock);
+    if (record->stop) {
+        pthread_mutex_unlock(&record->lock);
+        return;
+    }
+    chunk = record->current;
+    if (!chunk) {
+        chunk = record->current = g_new0(RedRecordChunk, 1);
+    }
+    if (chunk->size + size > chunk->alloc) {
+        chunk->alloc = MAX(RED_RECORD_CHUNK_SIZE, chunk->size + size);
+        chunk->data = g_realloc(chunk->data, chunk->alloc);
+    }
+    memcpy(chunk->data + chunk->size, data, size);
+    chunk->size += size;
+    chunk->n_records++;
+    if (!chunk->first_ts) {
+        chunk->first_ts = ts;
+    }
+    if (chunk->size >= RED_RECORD_CHUNK_SIZE) {
+        while (record->n_queued >= RED_RECORD_MAX_QUEUED && !record->stop) {
+            pthread_cond_wait(&record->written_cond, &record->lock);
+        }
+        if (!record->stop) {
+            red_record_queue_current(record);
+        }
+    }
+    pthread_mutex_unlock(&record->lock);
+}
+
+static void red_record_flight_add(RedRecord *record, const uint8_t *data, size_t size,
+                                  uint64_t ts)
+{
+    RedRecordEntry *entry, *newest;
+    GList *tail;
+
+    if (ts) {
+        record->flight_last_ts = ts;
+    } else {
+        ts = record->flight_last_ts;
+    }
+
+    tail = g_queue_peek_tail_link(record->flight_entries);
+    if (record->flight_continued && tail) {
+        /* replay reads the primary surface right after the message
+         * creating it, they have to stay together */
+        RedRecordEntry *message = tail->data;
+
+        entry = red_record_entry_new(message->data, message->size, data, size, message->ts);
+        entry->in_ring = TRUE;
+        tail->data = entry;
+        message->in_ring = FALSE;
+        red_record_entry_unref(message);
+    } else {
+        entry = red_record_entry_new(data, size, NULL, 0, ts);
+        entry->in_ring = TRUE;
+        g_queue_push_tail(record->flight_entries, entry);
+    }
+    record->flight_continued = FALSE;
+    record->flight_bytes += size;
+
+    /* the newest entry is always kept, it may be pinned next */
+    newest = entry;
+    while ((entry = g_queue_peek_head(record->flight_entries)) != newest &&
+           (record->flight_bytes > record->flight_max_bytes ||
+            entry->ts + record->flight_window < ts)) {
+        g_queue_pop_head(record->flight_entries);
+        record->flight_bytes -= entry->size;
+        entry->in_ring = FALSE;
+        red_record_entry_unref(entry);
+    }
+}
+
+/* The surfaces must be created again before replaying the commands kept, so
+ * the records creating the live ones are kept aside until they are
+ * destroyed */
+static void red_record_flight_pin_primary(RedRecord *record)
+{
+    RedRecordEntry *entry = g_queue_peek_tail(record->flight_entries);
+
+    red_record_entry_unref(record->primary);
+    record->primary = entry ? red_record_entry_ref(entry) : NULL;
+}
+
+static void red_record_flight_pin_surface(RedRecord *record, QXLSurfaceCmd *surface_cmd)
+{
+    RedRecordEntry *entry;
+
+    switch (surface_cmd->type) {
+    case QXL_SURFACE_CMD_CREATE:
+        entry = g_queue_peek_tail(record->flight_entries);
+        if (entry) {
+            g_hash_table_insert(record->surfaces, GUINT_TO_POINTER(surface_cmd->surface_id),
+                                red_record_entry_ref(entry));
+        }
+        break;
+    case QXL_SURFACE_CMD_DESTROY:
+        g_hash_table_remove(record->surfaces, GUINT_TO_POINTER(surface_cmd->surface_id));
+        break;
+    }
+}
+
+static void red_record_flight_message(RedRecord *record, uint32_t message)
+{
+    switch (message) {
+    case RED_WORKER_MESSAGE_CREATE_PRIMARY_SURFACE:
+    case RED_WORKER_MESSAGE_CREATE_PRIMARY_SURFACE_ASYNC:
+        record->flight_continued = TRUE;
+        break;
+    case RED_WORKER_MESSAGE_DESTROY_SURFACES:
+    case RED_WORKER_MESSAGE_DESTROY_SURFACES_ASYNC:
+        g_hash_table_remove_all(record->surfaces);
+        /* fall through */
+    case RED_WORKER_MESSAGE_DESTROY_PRIMARY_SURFACE:
+    case RED_WORKER_MESSAGE_DESTROY_PRIMARY_SURFACE_ASYNC:
+        red_record_entry_unref(record->primary);
+        record->primary = NULL;
+        break;
+    }
+}
+
+RedRecord *red_record_new_flight(unsigned int seconds, size_t max_bytes)
+{
+    RedRecord *record = spice_new0(RedRecord, 1);
+
+    record->flight = TRUE;
+    record->flight_window = (uint64_t)seconds * 1000 * 1000 * 1000;
+    record->flight_max_bytes = max_bytes;
+    record->flight_entries = g_queue_new();
+    record->surfaces = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, red_record_entry_unref);
+    record->mem = open_memstream(&record->mem_buf, &record->mem_size);
+    if (!record->mem) {
+        spice_error("failed to create the recording buffer");
+    }
+    return record;
+}
+
+/* Writes the pinned surfaces which are not in the ring anymore, then the
+ * ring, to a new recording. The worker waits for the file to be written,
+ * this is only meant to be done on demand. */
+int red_record_dump(RedRecord *record, const char *filename, int compression_level)
+{
+    RedRecord *dump;
+    RedRecordEntry *entry;
+    GHashTableIter iter;
+    gpointer value;
+    GList *link;
+
+    spice_return_val_if_fail(record->flight, FALSE);
+
+    dump = red_record_new(filename, compression_level);
+    if (!dump) {
+        return FALSE;
+    }
+    if (record->primary && !record->primary->in_ring) {
+        red_record_append(dump, record->primary->data, record->primary->size,
+                          record->primary->ts);
+    }
+    g_hash_table_iter_init(&iter, record->surfaces);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        entry = value;
+        if (!entry->in_ring) {
+            red_record_append(dump, entry->data, entry->size, entry->ts);
+        }
+    }
+    for (link = g_queue_peek_head_link(record->flight_entries); link; link = link->next) {
+        entry = link->data;
+        red_record_append(dump, entry->data, entry->size, entry->ts);
+    }
+    red_record_free(dump);
+    return TRUE;
+}
+
+void red_record_end(RedRecord *record, uint64_t ts)
+{
+    if (fflush(record->mem) != 0) {
+        spice_warning("failed to format record");
+        return;
+    }
+    if (record->flight) {
+        red_record_flight_add(record, (uint8_t *)record->mem_buf, record->mem_size, ts);
+    } else {
+        red_record_append(record, (uint8_t *)record->mem_buf, record->mem_size, ts);
+    }
+}
+
+void red_record_dev_input_primary_surface_create(RedRecord *record,
     QXLDevSurfaceCreate* surface, uint8_t *line_0)
 {
+    FILE *fd = red_record_begin(record);
+
     fprintf(fd, "%d %d %d %d\n", surface->width, surface->height,
         surface->stride, surface->format);
     fprintf(fd, "%d %d %d %d\n", surface->position, surface->mouse_mode,
         surface->flags, surface->type);
     write_binary(fd, "data", line_0 ? abs(surface->stride)*surface->height : 0,
         line_0);
+    red_record_end(record, 0);
+    if (record->flight) {
+        red_record_flight_pin_primary(record);
+    }
 }
 
-void red_record_event(FILE *fd, int what, uint32_t type, unsigned long ts)
+static void record_event(FILE *fd, int what, uint32_t type, unsigned long ts)
 {
     static int counter = 0;
 
-    // TODO: record the size of the packet in the header. This would make
-    // navigating it much faster (well, I can add an index while I'm at it..)
-    // and make it trivial to get a histogram from a file.
-    // But to implement that I would need some temporary buffer for each event.
-    // (that can be up to VGA_FRAMEBUFFER large)
     fprintf(fd, "event %d %d %u %lu\n", counter++, what, type, ts);
 }
 
-void red_record_qxl_command(FILE *fd, RedMemSlotInfo *slots,
+void red_record_event(RedRecord *record, int what, uint32_t type, unsigned long ts)
+{
+    record_event(red_record_begin(record), what, type, ts);
+    red_record_end(record, ts);
+    if (record->flight && what == 1) {
+        red_record_flight_message(record, type);
+    }
+}
+
+void red_record_qxl_command(RedRecord *record, RedMemSlotInfo *slots,
                             QXLCommandExt ext_cmd, unsigned long ts)
 {
-    red_record_event(fd, 0, ext_cmd.cmd.type, ts);
+    FILE *fd = red_record_begin(record);
+    QXLSurfaceCmd *surface_cmd = NULL;
+    int error = 0;
+
+    record_event(fd, 0, ext_cmd.cmd.type, ts);
 
     switch (ext_cmd.cmd.type) {
     case QXL_CMD_DRAW:
-        red_record_drawable(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data, ext_cmd.flags);
+        error = red_record_drawable(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data,
+                                    ext_cmd.flags);
         break;
     case QXL_CMD_UPDATE:
-        red_record_update_cmd(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data);
+        error = red_record_update_cmd(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data);
         break;
     case QXL_CMD_MESSAGE:
-        red_record_message(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data);
+        error = red_record_message(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data);
         break;
     case QXL_CMD_SURFACE:
-        red_record_surface_cmd(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data);
+        error = red_record_surface_cmd(fd, slots, ext_cmd.group_id, ext_cmd.cmd.data,
+                                       &surface_cmd);
         break;
     }
+    if (error) {
+        /* the parser rejects the command as well, nothing to replay */
+        spice_warning("invalid command %d not recorded", ext_cmd.cmd.type);
+        return;
+    }
+    red_record_end(record, ts);
+    if (record->flight && surface_cmd) {
+        red_record_flight_pin_surface(record, surface_cmd);
+    }
 }
+
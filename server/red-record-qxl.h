@@ -23,12 +23,81 @@
 #include "red-common.h"
 #include "memslot.h"
 
+/* Recording format, version 2
+ *
+ * After the "SPICE_REPLAY 2\n" line, the file is a sequence of chunks, each
+ * a RedRecordChunkHeader followed by @size bytes of payload. The payload of
+ * RED_RECORD_CHUNK_DATA chunks is @n_records whole records in the text
+ * format of version 1, zlib compressed if RED_RECORD_CHUNK_FLAG_ZLIB is set,
+ * @raw_size bytes once uncompressed. A last RED_RECORD_CHUNK_INDEX chunk
+ * lists the data chunks as RedRecordIndexEntry, and is located by the
+ * RedRecordTrailer ending the file. Integers are little endian.
+ */
+#define RED_RECORD_VERSION 2
+
+#define RED_RECORD_COMPRESSION_ENV "SPICE_WORKER_RECORD_COMPRESSION"
+#define RED_RECORD_DEFAULT_COMPRESSION 1
+
+#define RED_RECORD_CHUNK_SIZE (1024 * 1024)
+#define RED_RECORD_MAX_QUEUED 8
+#define RED_RECORD_FLUSH_INTERVAL 1 /* seconds */
+
+/* The flight recorder keeps the last seconds of recording in memory, it
+ * is off unless a number of seconds is given */
+#define RED_FLIGHT_RECORDER_ENV "SPICE_WORKER_FLIGHT_RECORDER"
+#define RED_FLIGHT_RECORDER_SIZE_ENV "SPICE_WORKER_FLIGHT_RECORDER_SIZE" /* MB */
+#define RED_FLIGHT_RECORDER_DEFAULT_SIZE 32
+
+enum {
+    RED_RECORD_CHUNK_DATA = 1,
+    RED_RECORD_CHUNK_INDEX,
+};
+
+#define RED_RECORD_CHUNK_FLAG_ZLIB (1 << 0)
+
+typedef struct RedRecordChunkHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint32_t size;
+    uint32_t raw_size;
+    uint32_t n_records;
+    uint32_t padding;
+    uint64_t first_ts;
+} RedRecordChunkHeader;
+
+typedef struct RedRecordIndexEntry {
+    uint64_t offset; /* of the chunk header, from the start of the file */
+    uint64_t first_ts;
+    uint32_t n_records;
+    uint32_t raw_size;
+} RedRecordIndexEntry;
+
+#define RED_RECORD_TRAILER_MAGIC "SPICEIDX"
+
+typedef struct RedRecordTrailer {
+    uint64_t index_offset;
+    char magic[8];
+} RedRecordTrailer;
+
+typedef struct RedRecord RedRecord;
+
+/* @compression_level is the zlib one, 0 to store the chunks as they are */
+RedRecord *red_record_new(const char *filename, int compression_level);
+/* keeps the records of the last @seconds in memory, no more than
+ * @max_bytes, until they are written by red_record_dump() */
+RedRecord *red_record_new_flight(unsigned int seconds, size_t max_bytes);
+void red_record_free(RedRecord *record);
+int red_record_dump(RedRecord *record, const char *filename, int compression_level);
+
+FILE *red_record_begin(RedRecord *record);
+void red_record_end(RedRecord *record, uint64_t ts);
+
 void red_record_dev_input_primary_surface_create(
-                           FILE *fd, QXLDevSurfaceCreate *surface, uint8_t *line_0);
+                           RedRecord *record, QXLDevSurfaceCreate *surface, uint8_t *line_0);
 
-void red_record_event(FILE *fd, int what, uint32_t type, unsigned long ts);
+void red_record_event(RedRecord *record, int what, uint32_t type, unsigned long ts);
 
-void red_record_qxl_command(FILE *fd, RedMemSlotInfo *slots,
+void red_record_qxl_command(RedRecord *record, RedMemSlotInfo *slots,
                             QXLCommandExt ext_cmd, unsigned long ts);
 
 #endif
@@ -29,6 +29,7 @@
 #include "memslot.h"
 #include "red-parse-qxl.h"
 #include "red-replay-qxl.h"
+#include "red-record-qxl.h"
 #include <glib.h>
 
 #define QXLPHYSICAL_FROM_PTR(ptr) ((QXLPHYSICAL)(intptr_t)(ptr))
@@ -42,6 +43,12 @@ typedef enum {
 struct SpiceReplay {
     FILE *fd;
     int eof;
+    unsigned int version;
+    /* since version 2, @fd reads the current chunk of @file */
+    FILE *file;
+    uint8_t *chunk;
+    size_t chunk_size;
+    uint64_t timestamp; /* of the last command */
     int counter;
     bool created_primary;
 
@@ -54,12 +61,78 @@ struct SpiceReplay {
     pthread_cond_t cond;
 };
 
+/* Loads the next data chunk of a version 2 recording */
+static int replay_next_chunk(SpiceReplay *replay)
+{
+    RedRecordChunkHeader header;
+    uint32_t size, raw_size;
+    uint8_t *data;
+    uLongf data_size;
+
+    if (fread(&header, sizeof(header), 1, replay->file) != 1 ||
+        GUINT32_FROM_LE(header.type) != RED_RECORD_CHUNK_DATA) {
+        return FALSE;
+    }
+    size = GUINT32_FROM_LE(header.size);
+    raw_size = GUINT32_FROM_LE(header.raw_size);
+    data = g_malloc(MAX(size, 1));
+    if (size && fread(data, size, 1, replay->file) != 1) {
+        spice_warning("truncated replay chunk");
+        g_free(data);
+        return FALSE;
+    }
+    if (GUINT32_FROM_LE(header.flags) & RED_RECORD_CHUNK_FLAG_ZLIB) {
+        uint8_t *compressed = data;
+
+        data = g_malloc(MAX(raw_size, 1));
+        data_size = raw_size;
+        if (uncompress(data, &data_size, compressed, size) != Z_OK || data_size != raw_size) {
+            spice_warning("corrupted replay chunk");
+            g_free(compressed);
+            g_free(data);
+            return FALSE;
+        }
+        g_free(compressed);
+    } else if (size != raw_size) {
+        spice_warning("corrupted replay chunk");
+        g_free(data);
+        return FALSE;
+    }
+
+    if (replay->fd) {
+        fclose(replay->fd);
+    }
+    g_free(replay->chunk);
+    replay->chunk = data;
+    replay->chunk_size = raw_size;
+    replay->fd = fmemopen(replay->chunk, MAX(raw_size, 1), "r");
+    if (!replay->fd) {
+        spice_warning("failed to open replay chunk: %s", strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int replay_has_data(SpiceReplay *replay)
+{
+    if (replay->version < 2) {
+        return !feof(replay->fd);
+    }
+    /* records don't span chunks */
+    while (!replay->fd || feof(replay->fd) || (size_t)ftell(replay->fd) >= replay->chunk_size) {
+        if (!replay_next_chunk(replay)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 static int replay_fread(SpiceReplay *replay, uint8_t *buf, size_t size)
 {
     if (replay->eof) {
         return 0;
     }
-    if (feof(replay->fd)) {
+    if (!replay_has_data(replay)) {
         replay->eof = 1;
         return 0;
     }
@@ -75,14 +148,15 @@ static replay_t replay_fscanf(SpiceReplay *replay, const char *fmt, ...)
     if (replay->eof) {
         return REPLAY_EOF;
     }
-    if (feof(replay->fd)) {
+    if (!replay_has_data(replay)) {
         replay->eof = 1;
         return REPLAY_EOF;
     }
     va_start(ap, fmt);
     ret = vfscanf(replay->fd, fmt, ap);
     va_end(ap);
-    if (ret == EOF) {
+    /* matching the trailing spaces of a record may hit the end of its chunk */
+    if (ret == EOF && !replay_has_data(replay)) {
         replay->eof = 1;
     }
     return replay->eof ? REPLAY_EOF : REPLAY_OK;
@@ -1062,7 +1136,9 @@ static void replay_handle_create_primary(QXLWorker *worker, SpiceReplay *replay)
         spice_printerr(
             "WARNING: %d: original recording event not preceded by a destroy primary",
             replay->counter);
-        worker->destroy_primary_surface(worker, 0);
+        if (worker) {
+            worker->destroy_primary_surface(worker, 0);
+        }
     }
     replay->created_primary = TRUE;
 
@@ -1071,6 +1147,10 @@ static void replay_handle_create_primary(QXLWorker *worker, SpiceReplay *replay)
     replay_fscanf(replay, "%d %d %d %d\n", &surface.position, &surface.mouse_mode,
         &surface.flags, &surface.type);
     read_binary(replay, "data", &size, &mem, 0);
+    if (!worker) {
+        free(mem);
+        return;
+    }
     surface.group_id = 0;
     surface.mem = QXLPHYSICAL_FROM_PTR(mem);
     worker->create_primary_surface(worker, 0, &surface);
@@ -1086,11 +1166,15 @@ static void replay_handle_dev_input(QXLWorker *worker, SpiceReplay *replay,
         break;
     case RED_WORKER_MESSAGE_DESTROY_PRIMARY_SURFACE:
         replay->created_primary = FALSE;
-        worker->destroy_primary_surface(worker, 0);
+        if (worker) {
+            worker->destroy_primary_surface(worker, 0);
+        }
         break;
     case RED_WORKER_MESSAGE_DESTROY_SURFACES:
         replay->created_primary = FALSE;
-        worker->destroy_surfaces(worker);
+        if (worker) {
+            worker->destroy_surfaces(worker);
+        }
         break;
     case RED_WORKER_MESSAGE_UPDATE:
         // XXX do anything? we record the correct bitmaps already.
@@ -1110,6 +1194,7 @@ static void replay_handle_dev_input(QXLWorker *worker, SpiceReplay *replay,
  * dispatcher, until it sees a command, at which point it returns it via the
  * last parameter [ext_cmd]. Hence you cannot call this from the worker thread
  * since it will block reading from the dispatcher pipe.
+ * With a NULL worker the io actions are skipped, to only read the commands.
  */
 SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
                                                          QXLWorker *worker)
@@ -1130,6 +1215,7 @@ SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
             replay_handle_dev_input(worker, replay, type);
         }
     }
+    replay->timestamp = timestamp;
     cmd = g_new(QXLCommandExt, 1);
     cmd->cmd.type = type;
     cmd->group_id = 0;
@@ -1164,6 +1250,13 @@ SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
     return cmd;
 }
 
+SPICE_GNUC_VISIBLE uint64_t spice_replay_get_timestamp(SpiceReplay *replay)
+{
+    spice_return_val_if_fail(replay != NULL, 0);
+
+    return replay->timestamp;
+}
+
 SPICE_GNUC_VISIBLE void spice_replay_free_cmd(SpiceReplay *replay, QXLCommandExt *cmd)
 {
     spice_return_if_fail(replay);
@@ -1205,7 +1298,7 @@ SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
     spice_return_val_if_fail(file != NULL, NULL);
 
     if (fscanf(file, "SPICE_REPLAY %u\n", &version) == 1) {
-        if (version > 1) {
+        if (version > RED_RECORD_VERSION) {
             spice_warning("Replay file version unsupported");
             return NULL;
         }
@@ -1217,7 +1310,12 @@ SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
     replay = spice_malloc0(sizeof(SpiceReplay));
 
     replay->eof = 0;
-    replay->fd = file;
+    replay->version = version;
+    if (version >= 2) {
+        replay->file = file;
+    } else {
+        replay->fd = file;
+    }
     replay->created_primary = FALSE;
     pthread_mutex_init(&replay->mutex, NULL);
     pthread_cond_init(&replay->cond, NULL);
@@ -1241,6 +1339,12 @@ SPICE_GNUC_VISIBLE void spice_replay_free(SpiceReplay *replay)
     g_array_free(replay->id_map, TRUE);
     g_array_free(replay->id_map_inv, TRUE);
     g_array_free(replay->id_free, TRUE);
-    fclose(replay->fd);
+    if (replay->fd) {
+        fclose(replay->fd);
+    }
+    if (replay->file) {
+        fclose(replay->file);
+    }
+    g_free(replay->chunk);
     free(replay);
 }
@@ -25,9 +25,11 @@
 typedef struct SpiceReplay SpiceReplay;
 
 /* reads until encountering a cmd, processing any recorded messages (io) on the
- * way */
+ * way, or skipping them if @worker is NULL */
 QXLCommandExt*  spice_replay_next_cmd(SpiceReplay *replay, QXLWorker *worker);
 void            spice_replay_free_cmd(SpiceReplay *replay, QXLCommandExt *cmd);
+/* monotonic time, in ns, at which the last command read was recorded */
+uint64_t        spice_replay_get_timestamp(SpiceReplay *replay);
 void            spice_replay_free(SpiceReplay *replay);
 SpiceReplay *   spice_replay_new(FILE *file, int nsurfaces);
 
@@ -59,8 +59,10 @@
 
 struct RedWorker {
     pthread_t thread;
+    GMainLoop *loop;
     QXLInstance *qxl;
     SpiceWatch *dispatch_watch;
+    GSource *source;
     int running;
     SpiceCoreInterfaceInternal core;
 
@@ -88,7 +90,11 @@ struct RedWorker {
 
     int driver_cap_monitors_config;
 
-    FILE *record_fd;
+    RedRecord *record;
+    RedRecord *flight_recorder;
+    /* to start the flight recorder with the current primary surface */
+    QXLDevSurfaceCreate primary_create;
+    uint8_t *primary_line_0;
 };
 
 static RedsState* red_worker_get_server(RedWorker *worker);
@@ -185,6 +191,7 @@ static RedDrawable *red_drawable_new(QXLInstance *qxl)
 
     red->refs = 1;
     red->qxl = qxl;
+    red_arena_init(&red->arena, red->arena_buf, sizeof(red->arena_buf));
 
     return red;
 }
@@ -215,20 +222,25 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             return n;
         }
 
-        if (worker->record_fd)
-            red_record_qxl_command(worker->record_fd, &worker->mem_slots, ext_cmd,
+        if (worker->record)
+            red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd,
+                                   stat_now(CLOCK_MONOTONIC));
+        if (worker->flight_recorder)
+            red_record_qxl_command(worker->flight_recorder, &worker->mem_slots, ext_cmd,
                                    stat_now(CLOCK_MONOTONIC));
 
         stat_inc_counter(reds, worker->command_counter, 1);
         worker->display_poll_tries = 0;
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
+            uint64_t pickup_time = stat_probes_enabled() ? spice_get_monotonic_time_ns() : 0;
             RedDrawable *red_drawable = red_drawable_new(worker->qxl); // returns with 1 ref
 
             if (!red_get_drawable(&worker->mem_slots, ext_cmd.group_id,
                                  red_drawable, ext_cmd.cmd.data, ext_cmd.flags)) {
                 display_channel_process_draw(worker->display_channel, red_drawable,
-                                             worker->process_display_generation);
+                                             worker->process_display_generation,
+                                             pickup_time);
             }
             // release the red_drawable
             red_drawable_unref(red_drawable);
@@ -690,8 +702,14 @@ static void dev_create_primary_surface(RedWorker *worker, uint32_t surface_id,
     if (error) {
         return;
     }
-    if (worker->record_fd) {
-        red_record_dev_input_primary_surface_create(worker->record_fd,
+    worker->primary_create = surface;
+    worker->primary_line_0 = line_0;
+    if (worker->record) {
+        red_record_dev_input_primary_surface_create(worker->record,
+                    &surface, line_0);
+    }
+    if (worker->flight_recorder) {
+        red_record_dev_input_primary_surface_create(worker->flight_recorder,
                     &surface, line_0);
     }
 
@@ -1199,11 +1217,94 @@ static void worker_handle_dispatcher_async_done(void *opaque,
     red_qxl_async_complete(worker->qxl, msg_async->cmd);
 }
 
+static void handle_dev_dump_flight_recorder(void *opaque, void *payload)
+{
+    RedWorkerMessageDumpFlightRecorder *msg = payload;
+    RedWorker *worker = opaque;
+    const char *level;
+
+    if (!worker->flight_recorder) {
+        spice_warning("the flight recorder is disabled, set %s or call "
+                      "spice_qxl_set_flight_recorder()", RED_FLIGHT_RECORDER_ENV);
+        *msg->result = FALSE;
+        return;
+    }
+    level = getenv(RED_RECORD_COMPRESSION_ENV);
+    *msg->result = red_record_dump(worker->flight_recorder, msg->filename,
+                                   level ? atoi(level) : RED_RECORD_DEFAULT_COMPRESSION);
+}
+
+static void handle_dev_set_flight_recorder(void *opaque, void *payload)
+{
+    RedWorkerMessageSetFlightRecorder *msg = payload;
+    RedWorker *worker = opaque;
+    DisplayChannel *display = worker->display_channel;
+    QXLDevSurfaceCreate primary;
+
+    if (worker->flight_recorder) {
+        red_record_free(worker->flight_recorder);
+        worker->flight_recorder = NULL;
+    }
+    *msg->result = TRUE;
+    if (msg->seconds == 0) {
+        return;
+    }
+    worker->flight_recorder = red_record_new_flight(msg->seconds, msg->max_bytes);
+    if (!worker->flight_recorder) {
+        *msg->result = FALSE;
+        return;
+    }
+    /* a replay needs the primary surface, with what it shows now */
+    if (display->surfaces[0].context.canvas) {
+        primary = worker->primary_create;
+        primary.flags |= QXL_SURF_FLAG_KEEP_DATA;
+        red_record_event(worker->flight_recorder, 1, RED_WORKER_MESSAGE_CREATE_PRIMARY_SURFACE,
+                         stat_now(CLOCK_MONOTONIC));
+        red_record_dev_input_primary_surface_create(worker->flight_recorder,
+                                                    &primary, worker->primary_line_0);
+    }
+}
+
+/* The clients have their watches and timers on the worker loop and their
+ * pipes hold items of the channels, they are destroyed first. The main
+ * thread, which otherwise manages the RedClients, waits for the ack. */
+static void handle_dev_close(void *opaque, void *payload)
+{
+    RedWorker *worker = opaque;
+
+    red_channel_apply_clients(RED_CHANNEL(worker->cursor_channel), red_channel_client_destroy);
+    red_channel_apply_clients(RED_CHANNEL(worker->display_channel), red_channel_client_destroy);
+    cursor_channel_close(worker->cursor_channel);
+    display_channel_close(worker->display_channel);
+    red_channel_destroy(RED_CHANNEL(worker->cursor_channel));
+    worker->cursor_channel = NULL;
+    red_channel_destroy(RED_CHANNEL(worker->display_channel));
+    worker->display_channel = NULL;
+
+    /* it may be ready in this iteration of the loop already */
+    g_source_destroy(worker->source);
+    worker->source = NULL;
+    dispatcher_close(red_qxl_get_dispatcher(worker->qxl));
+    g_main_loop_quit(worker->loop);
+}
+
 static void worker_dispatcher_record(void *opaque, uint32_t message_type, void *payload)
 {
     RedWorker *worker = opaque;
+    uint64_t now;
 
-    red_record_event(worker->record_fd, 1, message_type, stat_now(CLOCK_MONOTONIC));
+    if ((!worker->record && !worker->flight_recorder) ||
+        message_type == RED_WORKER_MESSAGE_DUMP_FLIGHT_RECORDER ||
+        message_type == RED_WORKER_MESSAGE_SET_FLIGHT_RECORDER) {
+        return;
+    }
+    now = stat_now(CLOCK_MONOTONIC);
+    if (worker->record) {
+        red_record_event(worker->record, 1, message_type, now);
+    }
+    if (worker->flight_recorder) {
+        red_record_event(worker->flight_recorder, 1, message_type, now);
+    }
 }
 
 static void register_callbacks(Dispatcher *dispatcher)
@@ -1338,6 +1439,21 @@ static void register_callbacks(Dispatcher *dispatcher)
                                 handle_dev_loadvm_commands,
                                 sizeof(RedWorkerMessageLoadvmCommands),
                                 DISPATCHER_ACK);
+    dispatcher_register_handler(dispatcher,
+                                RED_WORKER_MESSAGE_DUMP_FLIGHT_RECORDER,
+                                handle_dev_dump_flight_recorder,
+                                sizeof(RedWorkerMessageDumpFlightRecorder),
+                                DISPATCHER_ACK);
+    dispatcher_register_handler(dispatcher,
+                                RED_WORKER_MESSAGE_SET_FLIGHT_RECORDER,
+                                handle_dev_set_flight_recorder,
+                                sizeof(RedWorkerMessageSetFlightRecorder),
+                                DISPATCHER_ACK);
+    dispatcher_register_handler(dispatcher,
+                                RED_WORKER_MESSAGE_CLOSE_WORKER,
+                                handle_dev_close,
+                                sizeof(RedWorkerMessageClose),
+                                DISPATCHER_ACK);
     dispatcher_register_handler(dispatcher,
                                 RED_WORKER_MESSAGE_SET_COMPRESSION,
                                 handle_dev_set_compression,
@@ -1471,7 +1587,7 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     QXLDevInitInfo init_info;
     RedWorker *worker;
     Dispatcher *dispatcher;
-    const char *record_filename;
+    const char *record_filename, *flight_seconds, *flight_size;
     RedsState *reds = red_qxl_get_server(qxl->st);
     RedChannel *channel;
 
@@ -1483,24 +1599,30 @@ RedWorker* red_worker_new(QXLInstance *qxl,
 
     record_filename = getenv("SPICE_WORKER_RECORD_FILENAME");
     if (record_filename) {
-        static const char header[] = "SPICE_REPLAY 1\n";
+        const char *level = getenv(RED_RECORD_COMPRESSION_ENV);
 
-        worker->record_fd = fopen(record_filename, "w+");
-        if (worker->record_fd == NULL) {
+        worker->record = red_record_new(record_filename,
+                                        level ? atoi(level) : RED_RECORD_DEFAULT_COMPRESSION);
+        if (worker->record == NULL) {
             spice_error("failed to open recording file %s\n", record_filename);
         }
-        if (fwrite(header, sizeof(header)-1, 1, worker->record_fd) != 1) {
-            spice_error("failed to write replay header");
-        }
+    }
+    flight_seconds = getenv(RED_FLIGHT_RECORDER_ENV);
+    flight_size = getenv(RED_FLIGHT_RECORDER_SIZE_ENV);
+    if (flight_seconds && atoi(flight_seconds) > 0) {
+        worker->flight_recorder =
+            red_record_new_flight(atoi(flight_seconds),
+                                  (size_t)(flight_size ? atoi(flight_size)
+                                                       : RED_FLIGHT_RECORDER_DEFAULT_SIZE)
+                                  * 1024 * 1024);
     }
     dispatcher = red_qxl_get_dispatcher(qxl);
     dispatcher_set_opaque(dispatcher, worker);
 
     worker->qxl = qxl;
     register_callbacks(dispatcher);
-    if (worker->record_fd) {
-        dispatcher_register_universal_handler(dispatcher, worker_dispatcher_record);
-    }
+    /* the flight recorder can be started later */
+    dispatcher_register_universal_handler(dispatcher, worker_dispatcher_record);
 
     worker->image_compression = spice_server_get_image_compression(reds);
     worker->jpeg_state = reds_get_jpeg_state(reds);
@@ -1519,10 +1641,10 @@ RedWorker* red_worker_new(QXLInstance *qxl,
                                SPICE_WATCH_EVENT_READ, handle_dev_input, dispatcher);
     spice_assert(worker->dispatch_watch != NULL);
 
-    GSource *source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
-    SPICE_CONTAINEROF(source, RedWorkerSource, source)->worker = worker;
-    g_source_attach(source, worker->core.main_context);
-    g_source_unref(source);
+    worker->source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
+    SPICE_CONTAINEROF(worker->source, RedWorkerSource, source)->worker = worker;
+    g_source_attach(worker->source, worker->core.main_context);
+    g_source_unref(worker->source);
 
     memslot_info_init(&worker->mem_slots,
                       init_info.num_memslots_groups,
@@ -1554,7 +1676,7 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     return worker;
 }
 
-SPICE_GNUC_NORETURN static void *red_worker_main(void *arg)
+static void *red_worker_main(void *arg)
 {
     RedWorker *worker = arg;
 
@@ -1565,12 +1687,12 @@ SPICE_GNUC_NORETURN static void *red_worker_main(void *arg)
     RED_CHANNEL(worker->cursor_channel)->thread_id = pthread_self();
     RED_CHANNEL(worker->display_channel)->thread_id = pthread_self();
 
-    GMainLoop *loop = g_main_loop_new(worker->core.main_context, FALSE);
-    g_main_loop_run(loop);
-    g_main_loop_unref(loop);
+    worker->loop = g_main_loop_new(worker->core.main_context, FALSE);
+    g_main_loop_run(worker->loop);
+    g_main_loop_unref(worker->loop);
+    worker->loop = NULL;
 
-    /* FIXME: free worker, and join threads */
-    exit(0);
+    return NULL;
 }
 
 bool red_worker_run(RedWorker *worker)
@@ -1595,6 +1717,32 @@ bool red_worker_run(RedWorker *worker)
     return r == 0;
 }
 
+/* The channels and their clients are destroyed by the worker thread before
+ * it stops, see handle_dev_close(). */
+void red_worker_free(RedWorker *worker)
+{
+    RedsState *reds = red_worker_get_server(worker);
+    Dispatcher *dispatcher = red_qxl_get_dispatcher(worker->qxl);
+    RedWorkerMessageClose payload;
+
+    spice_return_if_fail(worker->thread);
+
+    reds_unregister_channel(reds, RED_CHANNEL(worker->cursor_channel));
+    reds_unregister_channel(reds, RED_CHANNEL(worker->display_channel));
+    dispatcher_send_message(dispatcher, RED_WORKER_MESSAGE_CLOSE_WORKER, &payload);
+    pthread_join(worker->thread, NULL);
+
+    if (worker->record) {
+        red_record_free(worker->record);
+    }
+    if (worker->flight_recorder) {
+        red_record_free(worker->flight_recorder);
+    }
+    worker->core.watch_remove(worker->dispatch_watch);
+    g_main_context_unref(worker->core.main_context);
+    free(worker);
+}
+
 static RedsState* red_worker_get_server(RedWorker *worker)
 {
     return red_qxl_get_server(worker->qxl->st);
@@ -94,6 +94,8 @@ RedWorker* red_worker_new(QXLInstance *qxl,
                           const ClientCbs *client_cursor_cbs,
                           const ClientCbs *client_display_cbs);
 bool       red_worker_run(RedWorker *worker);
+/* stops the worker thread and frees what it owns */
+void       red_worker_free(RedWorker *worker);
 
 void red_drawable_unref(RedDrawable *red_drawable);
 
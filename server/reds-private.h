@@ -31,7 +31,6 @@ typedef struct TicketAuthentication {
 typedef struct TicketInfo {
     RSA *rsa;
     int rsa_size;
-    BIGNUM *bn;
     SpiceLinkEncryptedTicket encrypted_ticket;
 } TicketInfo;
 
@@ -42,7 +41,7 @@ typedef struct MonitorMode {
 
 #ifdef RED_STATISTICS
 
-#define REDS_MAX_STAT_NODES 100
+#define REDS_MAX_STAT_NODES 1024
 #define REDS_STAT_SHM_SIZE (sizeof(SpiceStat) + REDS_MAX_STAT_NODES * sizeof(SpiceStatNode))
 
 typedef struct RedsStatValue {
@@ -132,12 +131,15 @@ struct RedsState {
     int seamless_migration_enabled; /* command line arg */
 
     SSL_CTX *ctx;
+    TicketKeyPool *ticket_key_pool;
 
 #ifdef RED_STATISTICS
     char *stat_shm_name;
     SpiceStat *stat;
     pthread_mutex_t stat_lock;
     RedsStatValue roundtrip_stat;
+    uint64_t *ticket_key_pool_hits_counter;
+    uint64_t *ticket_key_pool_misses_counter;
 #endif
     int peer_minor_version;
     int allow_multiple_clients;
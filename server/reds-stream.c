@@ -29,12 +29,32 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define REDS_STREAM_ZEROCOPY 1
+#endif
 
 #include <glib.h>
 
 #include <openssl/err.h>
 
+/* OpenSSL 3.0 can hand the record layer over to the kernel once the
+ * handshake is done */
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define REDS_STREAM_KTLS 1
+#endif
+
+/* buffers smaller than this are gathered, up to a TLS record, before
+ * going to SSL_write() */
+#define REDS_STREAM_SSL_RECORD_SIZE (16 * 1024)
+#define REDS_STREAM_SSL_COALESCE_MAX (4 * 1024)
+
 struct AsyncRead {
     RedsStream *stream;
     void *opaque;
@@ -78,6 +98,7 @@ typedef struct RedsSASL {
 
 struct RedsStreamPrivate {
     SSL *ssl;
+    uint8_t *ssl_staging; /* REDS_STREAM_SSL_RECORD_SIZE, allocated on first use */
 
 #if HAVE_SASL
     RedsSASL sasl;
@@ -95,6 +116,15 @@ struct RedsStreamPrivate {
     ssize_t (*write)(RedsStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedsStream *s, const struct iovec *iov, int iovcnt);
 
+    /* MSG_ZEROCOPY sends, the kernel numbers them from 0 */
+    int zerocopy;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_completed; /* all the sends before it are completed */
+    GArray *zerocopy_ranges; /* completed after a send still pending */
+
+    bool corked;
+    bool no_cork; /* TCP_CORK failed once, not TCP */
+
     RedsState *reds;
 };
 
@@ -294,6 +324,51 @@ int reds_stream_send_msgfd(RedsStream *stream, int fd)
     return r;
 }
 
+/* Gathers the runs of small buffers so that each gives one TLS record
+ * instead of one per buffer. After a failed SSL_write() the caller comes
+ * back with the same buffers, the runs are then cut at the same places
+ * and rebuilt at the same address, as OpenSSL wants for the retry. */
+static ssize_t stream_ssl_writev(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret = 0;
+    int i = 0;
+
+    if (!s->priv->ssl_staging) {
+        s->priv->ssl_staging = spice_malloc(REDS_STREAM_SSL_RECORD_SIZE);
+    }
+    while (i < iovcnt) {
+        const void *buf = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        int n;
+
+        if (len < REDS_STREAM_SSL_COALESCE_MAX &&
+            i + 1 < iovcnt && iov[i + 1].iov_len < REDS_STREAM_SSL_COALESCE_MAX) {
+            len = 0;
+            while (i < iovcnt && iov[i].iov_len < REDS_STREAM_SSL_COALESCE_MAX &&
+                   len + iov[i].iov_len <= REDS_STREAM_SSL_RECORD_SIZE) {
+                memcpy(s->priv->ssl_staging + len, iov[i].iov_base, iov[i].iov_len);
+                len += iov[i].iov_len;
+                i++;
+            }
+            buf = s->priv->ssl_staging;
+        } else {
+            i++;
+        }
+        if (len == 0) {
+            continue;
+        }
+        n = reds_stream_write(s, buf, len);
+        if (n <= 0)
+            return ret == 0 ? n : ret;
+        ret += n;
+        if ((size_t)n < len) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
 ssize_t reds_stream_writev(RedsStream *s, const struct iovec *iov, int iovcnt)
 {
     int i;
@@ -303,6 +378,9 @@ ssize_t reds_stream_writev(RedsStream *s, const struct iovec *iov, int iovcnt)
     if (s->priv->writev != NULL) {
         return s->priv->writev(s, iov, iovcnt);
     }
+    if (s->priv->write == stream_ssl_write_cb) {
+        return stream_ssl_writev(s, iov, iovcnt);
+    }
 
     for (i = 0; i < iovcnt; ++i) {
         n = reds_stream_write(s, iov[i].iov_base, iov[i].iov_len);
@@ -314,6 +392,29 @@ ssize_t reds_stream_writev(RedsStream *s, const struct iovec *iov, int iovcnt)
     return ret;
 }
 
+bool reds_stream_set_cork(RedsStream *s, bool cork)
+{
+#ifdef TCP_CORK
+    int val = cork;
+
+    if (s->priv->no_cork) {
+        return FALSE;
+    }
+    if (s->priv->corked == cork) {
+        return TRUE;
+    }
+    if (setsockopt(s->socket, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) != 0) {
+        spice_debug("no TCP_CORK on fd %d: %s", s->socket, strerror(errno));
+        s->priv->no_cork = TRUE;
+        return FALSE;
+    }
+    s->priv->corked = cork;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
 void reds_stream_free(RedsStream *s)
 {
     if (!s) {
@@ -339,6 +440,10 @@ void reds_stream_free(RedsStream *s)
     if (s->priv->ssl) {
         SSL_free(s->priv->ssl);
     }
+    free(s->priv->ssl_staging);
+    if (s->priv->zerocopy_ranges) {
+        g_array_free(s->priv->zerocopy_ranges, TRUE);
+    }
 
     reds_stream_remove_watch(s);
     spice_info("close socket fd %d", s->socket);
@@ -416,6 +521,157 @@ void reds_stream_disable_writev(RedsStream *stream)
     stream->priv->writev = NULL;
 }
 
+typedef struct ZeroCopyRange {
+    uint32_t lo, hi;
+} ZeroCopyRange;
+
+bool reds_stream_enable_zerocopy(RedsStream *stream)
+{
+#ifdef REDS_STREAM_ZEROCOPY
+    int on = 1;
+
+    /* the buffers go to the kernel as they are only on plain sockets */
+    if (stream->priv->writev != stream_writev_cb) {
+        return FALSE;
+    }
+    /* kernel TLS does not take MSG_ZEROCOPY */
+    if (stream->priv->ssl) {
+        return FALSE;
+    }
+    /* not supported by unix sockets */
+    if (setsockopt(stream->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        spice_debug("no zerocopy on fd %d: %s", stream->socket, strerror(errno));
+        return FALSE;
+    }
+    stream->priv->zerocopy = TRUE;
+    stream->priv->zerocopy_ranges = g_array_new(FALSE, FALSE, sizeof(ZeroCopyRange));
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+ssize_t reds_stream_writev_zerocopy(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+#ifdef REDS_STREAM_ZEROCOPY
+    struct msghdr msgh = { 0, };
+    ssize_t n;
+
+    if (!s->priv->zerocopy) {
+        return reds_stream_writev(s, iov, iovcnt);
+    }
+    msgh.msg_iov = (struct iovec *)iov;
+#ifdef IOV_MAX
+    msgh.msg_iovlen = MIN(iovcnt, IOV_MAX);
+#else
+    msgh.msg_iovlen = iovcnt;
+#endif
+    n = sendmsg(s->socket, &msgh, MSG_ZEROCOPY);
+    if (n >= 0) {
+        s->priv->zerocopy_sent++;
+    } else if (errno == ENOBUFS) {
+        /* out of memory for the notifications */
+        return reds_stream_writev(s, iov, iovcnt);
+    }
+    return n;
+#else
+    return reds_stream_writev(s, iov, iovcnt);
+#endif
+}
+
+uint32_t reds_stream_zerocopy_sent(RedsStream *s)
+{
+    return s->priv->zerocopy_sent;
+}
+
+#ifdef REDS_STREAM_ZEROCOPY
+static void reds_stream_zerocopy_complete(RedsStream *s, uint32_t lo, uint32_t hi)
+{
+    GArray *ranges = s->priv->zerocopy_ranges;
+    ZeroCopyRange range = { lo, hi };
+    guint i;
+
+    if (lo != s->priv->zerocopy_completed) {
+        g_array_append_val(ranges, range);
+        return;
+    }
+    s->priv->zerocopy_completed = hi + 1;
+    /* merge the ranges completed earlier */
+    for (i = 0; i < ranges->len;) {
+        ZeroCopyRange *next = &g_array_index(ranges, ZeroCopyRange, i);
+
+        if (next->lo == s->priv->zerocopy_completed) {
+            s->priv->zerocopy_completed = next->hi + 1;
+            g_array_remove_index_fast(ranges, i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+#endif
+
+/* reads the notifications of the kernel, returns the number of the first
+ * send it may still be using */
+uint32_t reds_stream_zerocopy_completed(RedsStream *s)
+{
+#ifdef REDS_STREAM_ZEROCOPY
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msgh;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+
+    if (s->priv->zerocopy_completed == s->priv->zerocopy_sent) {
+        return s->priv->zerocopy_completed;
+    }
+    for (;;) {
+        memset(&msgh, 0, sizeof(msgh));
+        msgh.msg_control = control;
+        msgh.msg_controllen = sizeof(control);
+        if (recvmsg(s->socket, &msgh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            reds_stream_zerocopy_complete(s, serr->ee_info, serr->ee_data);
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* the kernel copied the data anyway, loopback for instance,
+                 * the notifications would only add to the cost */
+                s->priv->zerocopy = FALSE;
+            }
+        }
+    }
+#endif
+    return s->priv->zerocopy_completed;
+}
+
+/* with the transmit side offloaded, the kernel encrypts what is written
+ * to the socket, so the writes skip SSL_write() and use writev(). The
+ * reads keep going through SSL_read(), which handles the control
+ * records the kernel does not */
+static void reds_stream_ssl_check_ktls(RedsStream *stream)
+{
+#ifdef REDS_STREAM_KTLS
+    BIO *wbio = SSL_get_wbio(stream->priv->ssl);
+
+    if (!wbio || !BIO_get_ktls_send(wbio)) {
+        spice_debug("no kernel TLS on fd %d", stream->socket);
+        return;
+    }
+    spice_debug("kernel TLS on fd %d, receive %s", stream->socket,
+                BIO_get_ktls_recv(SSL_get_rbio(stream->priv->ssl)) ? "on" : "off");
+    stream->priv->write = stream_write_cb;
+    stream->priv->writev = stream_writev_cb;
+#endif
+}
+
 RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 {
     int ssl_error;
@@ -423,6 +679,7 @@ RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        reds_stream_ssl_check_ktls(stream);
         return REDS_STREAM_SSL_STATUS_OK;
     }
 
@@ -62,6 +62,19 @@ bool reds_stream_write_all(RedsStream *stream, const void *in_buf, size_t n);
 bool reds_stream_write_u8(RedsStream *s, uint8_t n);
 bool reds_stream_write_u32(RedsStream *s, uint32_t n);
 void reds_stream_disable_writev(RedsStream *stream);
+/* With zerocopy, the kernel sends the pages of the buffers written by
+ * reds_stream_writev_zerocopy() rather than a copy, they must be left
+ * untouched until reds_stream_zerocopy_completed() reaches the value
+ * reds_stream_zerocopy_sent() has after the write. Returns FALSE if the
+ * stream can't do it, TLS, SASL or unix sockets for instance. */
+bool reds_stream_enable_zerocopy(RedsStream *stream);
+ssize_t reds_stream_writev_zerocopy(RedsStream *s, const struct iovec *iov, int iovcnt);
+uint32_t reds_stream_zerocopy_sent(RedsStream *s);
+uint32_t reds_stream_zerocopy_completed(RedsStream *s);
+/* While corked, the partial segments are held back so that the following
+ * writes fill them, uncorking sends what is pending. Returns FALSE if the
+ * stream can't be corked (not TCP). */
+bool reds_stream_set_cork(RedsStream *s, bool cork);
 void reds_stream_free(RedsStream *s);
 
 void reds_stream_push_channel_event(RedsStream *s, int event);
@@ -69,6 +69,7 @@
 #endif
 #include "reds-stream.h"
 #include "utils.h"
+#include "ticket-key-pool.h"
 
 #include "reds-private.h"
 
@@ -291,9 +292,6 @@ static void reds_link_free(RedLinkInfo *link)
     free(link->link_mess);
     link->link_mess = NULL;
 
-    BN_free(link->tiTicketing.bn);
-    link->tiTicketing.bn = NULL;
-
     if (link->tiTicketing.rsa) {
         RSA_free(link->tiTicketing.rsa);
         link->tiTicketing.rsa = NULL;
@@ -1504,25 +1502,22 @@ static int reds_send_link_ack(RedsState *reds, RedLinkInfo *link)
     ack.caps_offset = GUINT32_TO_LE(sizeof(SpiceLinkReply));
     if (!reds->sasl_enabled
         || !red_link_info_test_capability(link, SPICE_COMMON_CAP_AUTH_SASL)) {
-        if (!(link->tiTicketing.rsa = RSA_new())) {
-            spice_warning("RSA new failed");
-            return FALSE;
-        }
+        gboolean from_pool;
 
         if (!(bio = BIO_new(BIO_s_mem()))) {
             spice_warning("BIO new failed");
             return FALSE;
         }
 
-        if (RSA_generate_key_ex(link->tiTicketing.rsa,
-                                SPICE_TICKET_KEY_PAIR_LENGTH,
-                                link->tiTicketing.bn,
-                                NULL) != 1) {
-            spice_warning("Failed to generate %d bits RSA key: %s",
-                          SPICE_TICKET_KEY_PAIR_LENGTH,
-                          ERR_error_string(ERR_get_error(), NULL));
+        link->tiTicketing.rsa = ticket_key_pool_get_key(reds->ticket_key_pool, &from_pool);
+        if (!link->tiTicketing.rsa) {
             goto end;
         }
+        if (from_pool) {
+            stat_inc_counter(reds, reds->ticket_key_pool_hits_counter, 1);
+        } else {
+            stat_inc_counter(reds, reds->ticket_key_pool_misses_counter, 1);
+        }
         link->tiTicketing.rsa_size = RSA_size(link->tiTicketing.rsa);
 
         i2d_RSA_PUBKEY_bio(bio, link->tiTicketing.rsa);
@@ -1809,18 +1804,6 @@ void reds_set_client_mouse_allowed(RedsState *reds, int is_client_mouse_allowed,
     }
 }
 
-static void openssl_init(RedLinkInfo *link)
-{
-    unsigned long f4 = RSA_F4;
-    link->tiTicketing.bn = BN_new();
-
-    if (!link->tiTicketing.bn) {
-        spice_error("OpenSSL BIGNUMS alloc failed");
-    }
-
-    BN_set_word(link->tiTicketing.bn, f4);
-}
-
 static void reds_channel_do_link(RedChannel *channel, RedClient *client,
                                  SpiceLinkMess *link_msg,
                                  RedsStream *stream)
@@ -2435,8 +2418,6 @@ static RedLinkInfo *reds_init_client_connection(RedsState *reds, int socket)
 
     reds_stream_push_channel_event(link->stream, SPICE_CHANNEL_EVENT_CONNECTED);
 
-    openssl_init(link);
-
     return link;
 
 error:
@@ -2475,7 +2456,6 @@ static RedLinkInfo *reds_init_client_ssl_connection(RedsState *reds, int socket)
 
 error:
     free(link->stream);
-    BN_free(link->tiTicketing.bn);
     free(link);
     return NULL;
 }
@@ -2758,6 +2738,11 @@ static void openssl_thread_setup(void)
 {
     int i;
 
+    if (lock_cs) {
+        /* already done by another server instance or by the ticket key pool */
+        return;
+    }
+
     lock_cs = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
     lock_count = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(long));
 
@@ -2798,6 +2783,10 @@ static int reds_init_ssl(RedsState *reds)
     /* Limit connection to TLSv1 only */
 #ifdef SSL_OP_NO_COMPRESSION
     ssl_options |= SSL_OP_NO_COMPRESSION;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    /* used only when the kernel supports the negotiated cipher */
+    ssl_options |= SSL_OP_ENABLE_KTLS;
 #endif
     SSL_CTX_set_options(reds->ctx, ssl_options);
 
@@ -3395,6 +3384,7 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
 #ifdef RED_STATISTICS
     int shm_name_len;
     int fd;
+    StatNodeRef ticketing_stat;
 
     shm_name_len = strlen(SPICE_STAT_SHM_NAME) + 20;
     reds->stat_shm_name = (char *)spice_malloc(shm_name_len);
@@ -3417,8 +3407,18 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
     if (pthread_mutex_init(&reds->stat_lock, NULL)) {
         spice_error("mutex init failed");
     }
+    ticketing_stat = stat_add_node(reds, INVALID_STAT_REF, "ticketing", TRUE);
+    reds->ticket_key_pool_hits_counter = stat_add_counter(reds, ticketing_stat,
+                                                          "key_pool_hits", TRUE);
+    reds->ticket_key_pool_misses_counter = stat_add_counter(reds, ticketing_stat,
+                                                            "key_pool_misses", TRUE);
 #endif
 
+    /* keys are generated on another thread from now on */
+    openssl_thread_setup();
+    reds->ticket_key_pool = ticket_key_pool_new(TICKET_KEY_POOL_SIZE,
+                                                SPICE_TICKET_KEY_PAIR_LENGTH);
+
     if (reds_init_net(reds) < 0) {
         goto err;
     }
@@ -3448,6 +3448,9 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
     if (reds->allow_multiple_clients) {
         spice_warning("spice: allowing multiple client connections");
     }
+    if (getenv(STAT_PROBES_ENV) && atoi(getenv(STAT_PROBES_ENV))) {
+        spice_server_set_stat_probes(reds, TRUE);
+    }
     servers = g_list_prepend(servers, reds);
     return 0;
 
@@ -3532,10 +3535,18 @@ SPICE_GNUC_VISIBLE int spice_server_init(SpiceServer *reds, SpiceCoreInterface *
 
 SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
 {
+    GList *l;
+
+    /* the workers use the renderers */
+    for (l = reds->qxl_instances; l != NULL; l = l->next) {
+        red_qxl_destroy(l->data);
+    }
     g_array_unref(reds->renderers);
     if (reds->main_channel) {
         main_channel_close(reds->main_channel);
     }
+    ticket_key_pool_free(reds->ticket_key_pool);
+    reds->ticket_key_pool = NULL;
     reds_cleanup(reds);
 
     /* remove the server from the list of servers so that we don't attempt to
@@ -3862,6 +3873,12 @@ SPICE_GNUC_VISIBLE int spice_server_set_agent_file_xfer(SpiceServer *reds, int e
     return 0;
 }
 
+SPICE_GNUC_VISIBLE void spice_server_set_stat_probes(SpiceServer *reds, int enable)
+{
+    spice_info("statistics probes %s", enable ? "enabled" : "disabled");
+    stat_probes_set_enabled(enable);
+}
+
 /* returns FALSE if info is invalid */
 static int reds_set_migration_dest_info(RedsState *reds,
                                         const char* dest,
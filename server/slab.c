@@ -0,0 +1,249 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "common/ring.h"
+
+#include "red-common.h"
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+
+typedef struct SlabChunk SlabChunk;
+
+/* header in front of every object */
+typedef struct SlabSlot {
+    SlabChunk *chunk;
+    struct SlabSlot *next_free;
+} SlabSlot;
+
+struct SlabChunk {
+    RingItem link;
+    uint32_t used;
+    SlabSlot *free_slots;
+};
+
+struct Slab {
+    size_t object_size;
+    size_t slot_size;
+    size_t chunk_size;
+    uint32_t chunk_objects;
+
+    /* chunks are kept by state, a chunk with no free slot is in none */
+    Ring partial;
+    Ring empty;
+    uint32_t n_empty;
+
+    int poison; /* the byte, or -1 */
+
+    SlabStats stats;
+};
+
+#define SLOT_HEADER_SIZE ((sizeof(SlabSlot) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+#define CHUNK_HEADER_SIZE ((sizeof(SlabChunk) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+static inline SlabSlot *slot_from_object(void *object)
+{
+    return (SlabSlot *)((uint8_t *)object - SLOT_HEADER_SIZE);
+}
+
+static inline void *slot_to_object(SlabSlot *slot)
+{
+    return (uint8_t *)slot + SLOT_HEADER_SIZE;
+}
+
+Slab *slab_new(size_t object_size, uint32_t chunk_objects, size_t max_bytes)
+{
+    Slab *slab;
+
+    spice_return_val_if_fail(object_size > 0 && chunk_objects > 0, NULL);
+
+    slab = spice_new0(Slab, 1);
+    slab->object_size = object_size;
+    slab->poison = -1;
+    slab->slot_size = (SLOT_HEADER_SIZE + object_size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    slab->chunk_objects = chunk_objects;
+    slab->chunk_size = CHUNK_HEADER_SIZE + slab->slot_size * chunk_objects;
+    ring_init(&slab->partial);
+    ring_init(&slab->empty);
+    /* always allow one chunk, or nothing could ever be allocated */
+    slab->stats.max_bytes = MAX(max_bytes, slab->chunk_size);
+
+    return slab;
+}
+
+static void slab_chunk_free(Slab *slab, SlabChunk *chunk)
+{
+    slab->stats.chunks--;
+    slab->stats.capacity -= slab->chunk_objects;
+    slab->stats.bytes -= slab->chunk_size;
+    free(chunk);
+}
+
+void slab_free(Slab *slab)
+{
+    RingItem *link;
+
+    if (!slab) {
+        return;
+    }
+
+    spice_warn_if_fail(slab->stats.objects == 0);
+    while ((link = ring_get_head(&slab->empty))) {
+        ring_remove(link);
+        slab_chunk_free(slab, SPICE_CONTAINEROF(link, SlabChunk, link));
+    }
+    /* leaking chunks still in use rather than freeing memory still used */
+    free(slab);
+}
+
+static SlabChunk *slab_chunk_new(Slab *slab)
+{
+    SlabChunk *chunk;
+    uint8_t *slots;
+    uint32_t i;
+
+    if (slab->stats.bytes + slab->chunk_size > slab->stats.max_bytes) {
+        return NULL;
+    }
+    chunk = malloc(slab->chunk_size);
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->used = 0;
+    chunk->free_slots = NULL;
+    slots = (uint8_t *)chunk + CHUNK_HEADER_SIZE;
+    for (i = slab->chunk_objects; i > 0; i--) {
+        SlabSlot *slot = (SlabSlot *)(slots + (i - 1) * slab->slot_size);
+        slot->chunk = chunk;
+        slot->next_free = chunk->free_slots;
+        chunk->free_slots = slot;
+        if (slab->poison >= 0) {
+            memset(slot_to_object(slot), slab->poison, slab->object_size);
+        }
+    }
+    ring_item_init(&chunk->link);
+    ring_add(&slab->empty, &chunk->link);
+    slab->n_empty++;
+
+    slab->stats.chunks++;
+    slab->stats.capacity += slab->chunk_objects;
+    slab->stats.bytes += slab->chunk_size;
+
+    return chunk;
+}
+
+void *slab_alloc(Slab *slab)
+{
+    RingItem *link;
+    SlabChunk *chunk;
+    SlabSlot *slot;
+
+    if ((link = ring_get_head(&slab->partial))) {
+        chunk = SPICE_CONTAINEROF(link, SlabChunk, link);
+    } else if ((link = ring_get_head(&slab->empty))) {
+        chunk = SPICE_CONTAINEROF(link, SlabChunk, link);
+    } else if (!(chunk = slab_chunk_new(slab))) {
+        return NULL;
+    }
+
+    slot = chunk->free_slots;
+    chunk->free_slots = slot->next_free;
+    if (chunk->used++ == 0) {
+        ring_remove(&chunk->link);
+        slab->n_empty--;
+        if (chunk->free_slots) {
+            ring_add(&slab->partial, &chunk->link);
+        }
+    } else if (!chunk->free_slots) {
+        ring_remove(&chunk->link);
+    }
+
+    slab->stats.objects++;
+    slab->stats.peak_objects = MAX(slab->stats.peak_objects, slab->stats.objects);
+
+    return slot_to_object(slot);
+}
+
+void slab_release(Slab *slab, void *object)
+{
+    SlabSlot *slot;
+    SlabChunk *chunk;
+
+    if (!object) {
+        return;
+    }
+
+    slot = slot_from_object(object);
+    chunk = slot->chunk;
+    spice_return_if_fail(chunk->used > 0);
+
+    if (slab->poison >= 0) {
+        memset(object, slab->poison, slab->object_size);
+    }
+    if (!chunk->free_slots) {
+        /* was full */
+        ring_add(&slab->partial, &chunk->link);
+    }
+    slot->next_free = chunk->free_slots;
+    chunk->free_slots = slot;
+    slab->stats.objects--;
+
+    if (--chunk->used == 0) {
+        ring_remove(&chunk->link);
+        if (slab->n_empty > 0) {
+            /* one spare chunk is enough */
+            slab_chunk_free(slab, chunk);
+            return;
+        }
+        ring_add(&slab->empty, &chunk->link);
+        slab->n_empty++;
+    }
+}
+
+void slab_get_stats(const Slab *slab, SlabStats *stats)
+{
+    *stats = slab->stats;
+}
+
+void slab_set_poison(Slab *slab, uint8_t poison)
+{
+    spice_return_if_fail(slab->stats.chunks == 0);
+
+    slab->poison = poison;
+}
+
+size_t slab_get_max_bytes(const char *env_name, size_t default_max_bytes)
+{
+    const char *env_str = getenv(env_name);
+    char *end;
+    long long max_bytes;
+
+    if (!env_str) {
+        return default_max_bytes;
+    }
+    max_bytes = strtoll(env_str, &end, 10);
+    if (end == env_str || *end != '\0' || max_bytes <= 0) {
+        spice_warning("invalid %s value \"%s\"", env_name, env_str);
+        return default_max_bytes;
+    }
+    return max_bytes;
+}
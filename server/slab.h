@@ -0,0 +1,58 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SLAB_H_
+# define SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocator for fixed size objects, carved from chunks of @chunk_objects.
+ *
+ * Chunks are allocated on demand as long as the total stays under
+ * @max_bytes, and released again once all their objects are freed, keeping
+ * a single empty chunk around to absorb the next burst. Allocations favour
+ * partially used chunks so that the others get a chance to empty.
+ *
+ * Not thread safe.
+ */
+
+typedef struct Slab Slab;
+
+typedef struct SlabStats {
+    uint32_t objects;      /* allocated right now */
+    uint32_t peak_objects;
+    uint32_t capacity;     /* objects fitting in the current chunks */
+    uint32_t chunks;
+    size_t bytes;          /* taken by the current chunks */
+    size_t max_bytes;
+} SlabStats;
+
+Slab  *slab_new(size_t object_size, uint32_t chunk_objects, size_t max_bytes);
+void   slab_free(Slab *slab);
+/* returns NULL if the memory ceiling is reached */
+void  *slab_alloc(Slab *slab);
+void   slab_release(Slab *slab, void *object);
+void   slab_get_stats(const Slab *slab, SlabStats *stats);
+/* Fills the objects with @poison while they are not allocated, from the
+ * creation of their chunk on, so that any object returned by slab_alloc()
+ * can be checked for writes after release. To be set before the first
+ * allocation. */
+void   slab_set_poison(Slab *slab, uint8_t poison);
+size_t slab_get_max_bytes(const char *env_name, size_t default_max_bytes);
+
+#endif /* SLAB_H_ */
@@ -0,0 +1,174 @@
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Vector versions of row_gradual_score_rgb16/32(), see spice-bitmap-utils.c.
+ * A lane scores -1 + 3 if the pixels are equal, -1 + 5 if they contrast and
+ * stays at -1 otherwise, which gives the scaled pair scores. */
+
+#ifdef RED_BITMAP_UTILS_SSE2
+#define VTARGET __attribute__((target("sse2")))
+#define VFNAME(name) name##_sse2
+#define VEC __m128i
+#define V(op) _mm_##op
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define VZERO() _mm_setzero_si128()
+#define VAND(a, b) _mm_and_si128(a, b)
+#define VANDNOT(a, b) _mm_andnot_si128(a, b)
+#define VOR(a, b) _mm_or_si128(a, b)
+#define VXOR(a, b) _mm_xor_si128(a, b)
+#define VBYTES 16
+#endif
+
+#ifdef RED_BITMAP_UTILS_AVX2
+#define VTARGET __attribute__((target("avx2")))
+#define VFNAME(name) name##_avx2
+#define VEC __m256i
+#define V(op) _mm256_##op
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define VZERO() _mm256_setzero_si256()
+#define VAND(a, b) _mm256_and_si256(a, b)
+#define VANDNOT(a, b) _mm256_andnot_si256(a, b)
+#define VOR(a, b) _mm256_or_si256(a, b)
+#define VXOR(a, b) _mm256_xor_si256(a, b)
+#define VBYTES 32
+#endif
+
+#define VLANES32 (VBYTES / 4)
+#define VLANES16 (VBYTES / 2)
+
+VTARGET
+static inline VEC VFNAME(pair_score_rgb32)(VEC p1, VEC p2)
+{
+    VEC diff, contrast, equal;
+
+    diff = VOR(V(subs_epu8)(p1, p2), V(subs_epu8)(p2, p1));
+    diff = VAND(diff, V(set1_epi32)(0x00ffffff));
+    equal = V(cmpeq_epi32)(diff, VZERO());
+    contrast = V(subs_epu8)(diff, V(set1_epi8)(GRADUAL_CONTRAST_TH_RGB - 1));
+    contrast = VANDNOT(V(cmpeq_epi32)(contrast, VZERO()), V(set1_epi32)(5));
+    return V(add_epi32)(V(add_epi32)(V(set1_epi32)(-1), contrast),
+                        VAND(equal, V(set1_epi32)(3)));
+}
+
+VTARGET
+static int64_t VFNAME(row_gradual_score_rgb32)(const uint8_t *line1, const uint8_t *line2,
+                                               int width)
+{
+    const rgb32_pixel_t *pix1 = (const rgb32_pixel_t *)line1;
+    const rgb32_pixel_t *pix2 = (const rgb32_pixel_t *)line2;
+    const VEC same = V(set1_epi32)(GRADUAL_SAME_PIXEL_SCORE);
+    VEC acc = VZERO();
+    int32_t sums[VLANES32];
+    int64_t score;
+    int i;
+
+    for (i = 0; i + VLANES32 < width; i += VLANES32) {
+        VEC p = VLOAD(pix1 + i);
+        VEC s1 = VFNAME(pair_score_rgb32)(p, VLOAD(pix1 + i + 1));
+        VEC s2 = VFNAME(pair_score_rgb32)(p, VLOAD(pix2 + i));
+        VEC s3 = VFNAME(pair_score_rgb32)(p, VLOAD(pix2 + i + 1));
+        // ignore squares where all pixels are identical
+        VEC all_equal = VAND(VAND(V(cmpeq_epi32)(s1, same), V(cmpeq_epi32)(s2, same)),
+                             V(cmpeq_epi32)(s3, same));
+
+        acc = V(add_epi32)(acc, VANDNOT(all_equal, V(add_epi32)(V(add_epi32)(s1, s2), s3)));
+    }
+
+    VSTORE(sums, acc);
+    score = row_gradual_score_from_rgb32(line1, line2, i, width);
+    for (i = 0; i < VLANES32; i++) {
+        score += sums[i];
+    }
+    return score;
+}
+
+VTARGET
+static inline VEC VFNAME(contrast_rgb16)(VEC p1, VEC p2, int shift)
+{
+    const VEC mask = V(set1_epi16)(0x1f);
+    VEC diff;
+
+    diff = V(sub_epi16)(VAND(V(srli_epi16)(p1, shift), mask),
+                        VAND(V(srli_epi16)(p2, shift), mask));
+    diff = V(max_epi16)(diff, V(sub_epi16)(VZERO(), diff));
+    return V(cmpgt_epi16)(diff, V(set1_epi16)(GRADUAL_CONTRAST_TH_RGB16 - 1));
+}
+
+VTARGET
+static inline VEC VFNAME(pair_score_rgb16)(VEC p1, VEC p2)
+{
+    VEC contrast, equal;
+
+    equal = V(cmpeq_epi16)(VAND(VXOR(p1, p2), V(set1_epi16)(0x7fff)), VZERO());
+    contrast = VOR(VOR(VFNAME(contrast_rgb16)(p1, p2, 10), VFNAME(contrast_rgb16)(p1, p2, 5)),
+                   VFNAME(contrast_rgb16)(p1, p2, 0));
+    return V(add_epi16)(V(add_epi16)(V(set1_epi16)(-1), VAND(contrast, V(set1_epi16)(5))),
+                        VAND(equal, V(set1_epi16)(3)));
+}
+
+VTARGET
+static int64_t VFNAME(row_gradual_score_rgb16)(const uint8_t *line1, const uint8_t *line2,
+                                               int width)
+{
+    const rgb16_pixel_t *pix1 = (const rgb16_pixel_t *)line1;
+    const rgb16_pixel_t *pix2 = (const rgb16_pixel_t *)line2;
+    const VEC same = V(set1_epi16)(GRADUAL_SAME_PIXEL_SCORE);
+    const VEC ones = V(set1_epi16)(1);
+    VEC acc = VZERO();
+    int32_t sums[VLANES32];
+    int64_t score;
+    int i;
+
+    for (i = 0; i + VLANES16 < width; i += VLANES16) {
+        VEC p = VLOAD(pix1 + i);
+        VEC s1 = VFNAME(pair_score_rgb16)(p, VLOAD(pix1 + i + 1));
+        VEC s2 = VFNAME(pair_score_rgb16)(p, VLOAD(pix2 + i));
+        VEC s3 = VFNAME(pair_score_rgb16)(p, VLOAD(pix2 + i + 1));
+        VEC all_equal = VAND(VAND(V(cmpeq_epi16)(s1, same), V(cmpeq_epi16)(s2, same)),
+                             V(cmpeq_epi16)(s3, same));
+        VEC square = VANDNOT(all_equal, V(add_epi16)(V(add_epi16)(s1, s2), s3));
+
+        // widen to 32 bits before the sums may overflow
+        acc = V(add_epi32)(acc, V(madd_epi16)(square, ones));
+    }
+
+    VSTORE(sums, acc);
+    score = row_gradual_score_from_rgb16(line1, line2, i, width);
+    for (i = 0; i < VLANES32; i++) {
+        score += sums[i];
+    }
+    return score;
+}
+
+#undef VTARGET
+#undef VFNAME
+#undef VEC
+#undef V
+#undef VLOAD
+#undef VSTORE
+#undef VZERO
+#undef VAND
+#undef VANDNOT
+#undef VOR
+#undef VXOR
+#undef VBYTES
+#undef VLANES32
+#undef VLANES16
+#undef RED_BITMAP_UTILS_SSE2
+#undef RED_BITMAP_UTILS_AVX2
@@ -18,8 +18,28 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdlib.h>
+
 #include "spice-bitmap-utils.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#define HAVE_GRADUALITY_SIMD
+#include <immintrin.h>
+#endif
+
+/* Scores of a pair of neighbour pixels, the average score of all sampled
+ * pairs tells how gradual the bitmap is. Scaled by GRADUAL_SCORE_SCALE to
+ * keep the sums in integers, so all implementations give the same result.
+ */
+#define GRADUAL_SCORE_SCALE 4
+#define GRADUAL_SAME_PIXEL_SCORE 2              // 0.5
+#define GRADUAL_CONTRAST_PIXELS_SCORE 4         // 1.0
+#define GRADUAL_NOT_CONTRAST_PIXELS_SCORE -1    // -0.25
+
+#define GRADUAL_CONTRAST_TH_RGB 60
+#define GRADUAL_CONTRAST_TH_RGB16 8
+
 #define RED_BITMAP_UTILS_RGB16
 #include "spice-bitmap-utils.tmpl.c"
 #define RED_BITMAP_UTILS_RGB24
@@ -35,56 +55,179 @@
 // in window media player 12). see red_stream_add_frame
 #define GRADUAL_MEDIUM_SCORE_TH 0.002
 
-// assumes that stride doesn't overflow
-BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+#ifdef HAVE_GRADUALITY_SIMD
+G_STATIC_ASSERT(GRADUAL_SAME_PIXEL_SCORE == 2 && GRADUAL_CONTRAST_PIXELS_SCORE == 4 &&
+                GRADUAL_NOT_CONTRAST_PIXELS_SCORE == -1);
+
+#define RED_BITMAP_UTILS_SSE2
+#include "spice-bitmap-utils-simd.tmpl.c"
+#define RED_BITMAP_UTILS_AVX2
+#include "spice-bitmap-utils-simd.tmpl.c"
+#endif
+
+typedef int64_t (*RowGradualScoreFunc)(const uint8_t *line1, const uint8_t *line2, int width);
+
+typedef struct GradualityFuncs {
+    const char *name;
+    RowGradualScoreFunc rgb16;
+    RowGradualScoreFunc rgb24;
+    RowGradualScoreFunc rgb32;
+} GradualityFuncs;
+
+/* 24 bit pixels do not map well to vector lanes, and are rare */
+static const GradualityFuncs graduality_funcs[] = {
+    [BITMAP_GRADUALITY_SCALAR] = { "scalar", row_gradual_score_rgb16,
+                                   row_gradual_score_rgb24, row_gradual_score_rgb32 },
+#ifdef HAVE_GRADUALITY_SIMD
+    [BITMAP_GRADUALITY_SSE2] = { "sse2", row_gradual_score_rgb16_sse2,
+                                 row_gradual_score_rgb24, row_gradual_score_rgb32_sse2 },
+    [BITMAP_GRADUALITY_AVX2] = { "avx2", row_gradual_score_rgb16_avx2,
+                                 row_gradual_score_rgb24, row_gradual_score_rgb32_avx2 },
+#endif
+};
+
+static const GradualityFuncs *graduality = &graduality_funcs[BITMAP_GRADUALITY_SCALAR];
+static int graduality_row_step = BITMAP_GRADUALITY_DEFAULT_ROW_STEP;
+
+int bitmap_graduality_impl_supported(BitmapGradualityImpl impl)
+{
+    switch (impl) {
+    case BITMAP_GRADUALITY_SCALAR:
+        return TRUE;
+#ifdef HAVE_GRADUALITY_SIMD
+    case BITMAP_GRADUALITY_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case BITMAP_GRADUALITY_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+static void bitmap_graduality_init(void)
+{
+    static gsize initialized = 0;
+    const char *env_str;
+
+    if (!g_once_init_enter(&initialized)) {
+        return;
+    }
+
+    if (bitmap_graduality_impl_supported(BITMAP_GRADUALITY_AVX2)) {
+        graduality = &graduality_funcs[BITMAP_GRADUALITY_AVX2];
+    } else if (bitmap_graduality_impl_supported(BITMAP_GRADUALITY_SSE2)) {
+        graduality = &graduality_funcs[BITMAP_GRADUALITY_SSE2];
+    }
+    env_str = getenv(BITMAP_GRADUALITY_ROW_STEP_ENV);
+    if (env_str) {
+        char *end;
+        long row_step = strtol(env_str, &end, 10);
+
+        if (end == env_str || *end != '\0' || row_step <= 0 || row_step > G_MAXINT) {
+            spice_warning("invalid %s value \"%s\"", BITMAP_GRADUALITY_ROW_STEP_ENV, env_str);
+        } else {
+            graduality_row_step = row_step;
+        }
+    }
+    spice_debug("bitmap graduality: %s, sampling one row out of %d",
+                graduality->name, graduality_row_step);
+
+    g_once_init_leave(&initialized, 1);
+}
+
+int bitmap_graduality_set_impl(BitmapGradualityImpl impl)
 {
-    double score = 0.0;
-    int num_samples = 0;
-    int num_lines;
-    double chunk_score = 0.0;
-    int chunk_num_samples = 0;
-    uint32_t x, i;
+    bitmap_graduality_init();
+    if (!bitmap_graduality_impl_supported(impl)) {
+        return FALSE;
+    }
+    graduality = &graduality_funcs[impl];
+    return TRUE;
+}
+
+void bitmap_graduality_set_row_step(int row_step)
+{
+    spice_return_if_fail(row_step > 0);
+    bitmap_graduality_init();
+    graduality_row_step = row_step;
+}
+
+// scores whole rows, one out of graduality_row_step
+int64_t bitmap_get_graduality_score(SpiceBitmap *bitmap, uint64_t *num_samples)
+{
+    RowGradualScoreFunc row_score;
+    int64_t score = 0;
+    uint32_t num_lines, line, x, i;
     SpiceChunk *chunk;
 
+    bitmap_graduality_init();
+    *num_samples = 0;
+
+    switch (bitmap->format) {
+    case SPICE_BITMAP_FMT_16BIT:
+        row_score = graduality->rgb16;
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        row_score = graduality->rgb24;
+        break;
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        row_score = graduality->rgb32;
+        break;
+    default:
+        spice_error("invalid bitmap format (not RGB) %u", bitmap->format);
+        return 0;
+    }
+
+    x = bitmap->x;
     chunk = bitmap->data->chunk;
     for (i = 0; i < bitmap->data->num_chunks; i++) {
         num_lines = chunk[i].len / bitmap->stride;
-        x = bitmap->x;
-        switch (bitmap->format) {
-        case SPICE_BITMAP_FMT_16BIT:
-            compute_lines_gradual_score_rgb16((rgb16_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        case SPICE_BITMAP_FMT_24BIT:
-            compute_lines_gradual_score_rgb24((rgb24_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        case SPICE_BITMAP_FMT_32BIT:
-        case SPICE_BITMAP_FMT_RGBA:
-            compute_lines_gradual_score_rgb32((rgb32_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
-            break;
-        default:
-            spice_error("invalid bitmap format (not RGB) %u", bitmap->format);
+        if (x <= 1 || num_lines <= 1) {
+            // count a single contrasting sample
+            score += GRADUAL_CONTRAST_PIXELS_SCORE;
+            (*num_samples)++;
+            continue;
+        }
+        for (line = 0; line + 1 < num_lines; line += graduality_row_step) {
+            uint8_t *row = chunk[i].data + (size_t)line * bitmap->stride;
+
+            score += row_score(row, row + bitmap->stride, x);
+            // 3 pairs per square
+            *num_samples += 3 * (x - 1);
         }
-        score += chunk_score;
-        num_samples += chunk_num_samples;
     }
+    return score;
+}
 
+BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+{
+    uint64_t num_samples;
+    int64_t score;
+    double avg_score;
+
+    if (!bitmap_fmt_has_graduality(bitmap->format)) {
+        spice_error("invalid bitmap format (not RGB) %u", bitmap->format);
+        return BITMAP_GRADUAL_NOT_AVAIL;
+    }
+    score = bitmap_get_graduality_score(bitmap, &num_samples);
     spice_assert(num_samples);
-    score /= num_samples;
+    avg_score = (double)score / GRADUAL_SCORE_SCALE / num_samples;
 
     if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
-        if (score < GRADUAL_HIGH_RGB16_TH) {
+        if (avg_score < GRADUAL_HIGH_RGB16_TH) {
             return BITMAP_GRADUAL_HIGH;
         }
     } else {
-        if (score < GRADUAL_HIGH_RGB24_TH) {
+        if (avg_score < GRADUAL_HIGH_RGB24_TH) {
             return BITMAP_GRADUAL_HIGH;
         }
     }
 
-    if (score < GRADUAL_MEDIUM_SCORE_TH) {
+    if (avg_score < GRADUAL_MEDIUM_SCORE_TH) {
         return BITMAP_GRADUAL_MEDIUM;
     } else {
         return BITMAP_GRADUAL_LOW;
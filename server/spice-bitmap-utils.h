@@ -82,7 +82,26 @@ static inline int bitmap_fmt_has_graduality(uint8_t fmt)
 }
 
 
+/* The graduality is scored on whole rows, one out of
+ * BITMAP_GRADUALITY_ROW_STEP_ENV or BITMAP_GRADUALITY_DEFAULT_ROW_STEP, with
+ * the best vector implementation the CPU supports. */
+#define BITMAP_GRADUALITY_ROW_STEP_ENV "SPICE_WORKER_GRADUALITY_ROW_STEP"
+#define BITMAP_GRADUALITY_DEFAULT_ROW_STEP 8
+
+typedef enum {
+    BITMAP_GRADUALITY_SCALAR,
+    BITMAP_GRADUALITY_SSE2,
+    BITMAP_GRADUALITY_AVX2,
+} BitmapGradualityImpl;
+
 BitmapGradualType bitmap_get_graduality_level     (SpiceBitmap *bitmap);
+/* sum of the scaled scores of the pairs sampled, the same with every
+ * implementation */
+int64_t           bitmap_get_graduality_score     (SpiceBitmap *bitmap, uint64_t *num_samples);
+int               bitmap_graduality_impl_supported(BitmapGradualityImpl impl);
+/* returns FALSE if @impl is not supported */
+int               bitmap_graduality_set_impl      (BitmapGradualityImpl impl);
+void              bitmap_graduality_set_row_step  (int row_step);
 int               bitmap_has_extra_stride         (SpiceBitmap *bitmap);
 
 void dump_bitmap(SpiceBitmap *bitmap);
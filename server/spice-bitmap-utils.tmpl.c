@@ -43,24 +43,17 @@
 #endif
 
 
-#define SAME_PIXEL_WEIGHT 0.5
-#define NOT_CONTRAST_PIXELS_WEIGHT -0.25
-#define CONTRAST_PIXELS_WEIGHT 1.0
-
 #ifndef RED_BITMAP_UTILS_RGB16
-#define CONTRAST_TH 60
+#define CONTRAST_TH GRADUAL_CONTRAST_TH_RGB
 #else
-#define CONTRAST_TH 8
+#define CONTRAST_TH GRADUAL_CONTRAST_TH_RGB16
 #endif
 #define CONTRASTING(n) ((n) <= -CONTRAST_TH || (n) >= CONTRAST_TH)
 
-
-#define SAMPLE_JUMP 15
-
-static const double FNAME(PIX_PAIR_SCORE)[] = {
-    SAME_PIXEL_WEIGHT,
-    CONTRAST_PIXELS_WEIGHT,
-    NOT_CONTRAST_PIXELS_WEIGHT,
+static const int FNAME(PIX_PAIR_SCORE)[] = {
+    GRADUAL_SAME_PIXEL_SCORE,
+    GRADUAL_CONTRAST_PIXELS_SCORE,
+    GRADUAL_NOT_CONTRAST_PIXELS_SCORE,
 };
 
 // return 0 - equal, 1 - for contrast, 2 for no contrast (PIX_PAIR_SCORE is defined accordingly)
@@ -93,9 +86,9 @@ static inline int FNAME(pixelcmp)(PIXEL p1, PIXEL p2)
     }
 }
 
-static inline double FNAME(pixels_square_score)(PIXEL *line1, PIXEL *line2)
+static inline int FNAME(pixels_square_score)(const PIXEL *line1, const PIXEL *line2)
 {
-    double ret;
+    int ret;
     int any_different = 0;
     int cmp_res;
     cmp_res = FNAME(pixelcmp)(*line1, line1[1]);
@@ -116,34 +109,25 @@ static inline double FNAME(pixels_square_score)(PIXEL *line1, PIXEL *line2)
     return ret;
 }
 
-static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_lines,
-                                               double *o_samples_sum_score, int *o_num_samples)
+/* Sum of the scores of the squares starting at pixels @first to
+ * @width - 2 of @line1, @line2 being the next line */
+static int64_t FNAME(row_gradual_score_from)(const uint8_t *line1, const uint8_t *line2,
+                                             int first, int width)
 {
-    int jump = (SAMPLE_JUMP % width) ? SAMPLE_JUMP : SAMPLE_JUMP - 1;
-    PIXEL *cur_pix = lines + width / 2;
-    PIXEL *bottom_pix;
-    PIXEL *last_line = lines + (num_lines - 1) * width;
-
-    if ((width <= 1) || (num_lines <= 1)) {
-        *o_num_samples = 1;
-        *o_samples_sum_score = 1.0;
-        return;
-    }
+    const PIXEL *pix1 = (const PIXEL *)line1;
+    const PIXEL *pix2 = (const PIXEL *)line2;
+    int64_t score = 0;
+    int i;
 
-    *o_samples_sum_score = 0;
-    *o_num_samples = 0;
-
-    while (cur_pix < last_line) {
-        if ((cur_pix + 1 - lines) % width == 0) { // last pixel in the row
-            cur_pix--; // jump is bigger than 1 so we will not enter endless loop
-        }
-        bottom_pix = cur_pix + width;
-        (*o_samples_sum_score) += FNAME(pixels_square_score)(cur_pix, bottom_pix);
-        (*o_num_samples)++;
-        cur_pix += jump;
+    for (i = first; i < width - 1; i++) {
+        score += FNAME(pixels_square_score)(pix1 + i, pix2 + i);
     }
+    return score;
+}
 
-    (*o_num_samples) *= 3;
+static int64_t FNAME(row_gradual_score)(const uint8_t *line1, const uint8_t *line2, int width)
+{
+    return FNAME(row_gradual_score_from)(line1, line2, 0, width);
 }
 
 #undef PIXEL
@@ -154,7 +138,5 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
 #undef RED_BITMAP_UTILS_RGB16
 #undef RED_BITMAP_UTILS_RGB24
 #undef RED_BITMAP_UTILS_RGB32
-#undef SAMPLE_JUMP
 #undef CONTRAST_TH
-#undef SAME_PIXEL_WEIGHT
-#undef NOT_CONTRAST_PIXELS_WEIGHT
+#undef CONTRASTING
@@ -114,6 +114,16 @@ void spice_qxl_gl_draw_async(QXLInstance *instance,
                              uint32_t x, uint32_t y,
                              uint32_t w, uint32_t h,
                              uint64_t cookie);
+/* since spice 0.13.2 */
+/* writes the last seconds of QXL commands kept by the worker, when
+ * SPICE_WORKER_FLIGHT_RECORDER is set, to @filename,
+ * in the format of SPICE_WORKER_RECORD_FILENAME, returns 0 on success */
+int spice_qxl_dump_flight_recorder(QXLInstance *instance, const char *filename);
+/* starts keeping the last @seconds of QXL commands, up to @max_mb MB, as
+ * SPICE_WORKER_FLIGHT_RECORDER does, or stops if @seconds is 0,
+ * returns 0 on success */
+int spice_qxl_set_flight_recorder(QXLInstance *instance,
+                                  unsigned int seconds, unsigned int max_mb);
 
 typedef struct QXLDrawArea {
     uint8_t *buf;
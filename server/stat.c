@@ -0,0 +1,116 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "red-common.h"
+#include "stat.h"
+
+gint stat_probes;
+
+void stat_probes_set_enabled(int enabled)
+{
+    g_atomic_int_set(&stat_probes, !!enabled);
+}
+
+stat_time_t stat_histogram_bucket_limit(int bucket)
+{
+    int octave, sub;
+
+    if (bucket == 0) {
+        return 1 << STAT_HISTOGRAM_MIN_SHIFT;
+    }
+    if (bucket >= STAT_HISTOGRAM_BUCKETS - 1) {
+        return ~(stat_time_t)0;
+    }
+    octave = bucket >> STAT_HISTOGRAM_SUB_BITS;
+    sub = bucket & ((1 << STAT_HISTOGRAM_SUB_BITS) - 1);
+    return ((stat_time_t)1 << (octave + STAT_HISTOGRAM_MIN_SHIFT)) +
+           ((stat_time_t)sub << (octave + STAT_HISTOGRAM_MIN_SHIFT - STAT_HISTOGRAM_SUB_BITS));
+}
+
+stat_time_t stat_info_get_percentile(const stat_info_t *info, unsigned int percent)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (info->count == 0) {
+        return 0;
+    }
+    rank = ((uint64_t)info->count * percent + 99) / 100;
+    for (i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+        seen += info->histogram[i];
+        if (seen >= rank) {
+            return MIN(stat_histogram_bucket_limit(i), info->max);
+        }
+    }
+    return info->max;
+}
+
+void stat_info_update_counters(stat_info_t *info)
+{
+    if (!info->count_counter) {
+        return;
+    }
+    *info->count_counter = info->count;
+    *info->total_counter = info->total;
+    *info->max_counter = info->max;
+    *info->p50_counter = stat_info_get_percentile(info, 50);
+    *info->p90_counter = stat_info_get_percentile(info, 90);
+    *info->p99_counter = stat_info_get_percentile(info, 99);
+    if (info->orig_size_counter) {
+        *info->orig_size_counter = info->orig_size;
+        *info->comp_size_counter = info->comp_size;
+    }
+}
+
+#ifdef RED_STATISTICS
+void stat_info_publish(SpiceServer *reds, StatNodeRef parent, stat_info_t *info, int compress)
+{
+    StatNodeRef node = stat_add_node(reds, parent, info->name, TRUE);
+    uint64_t *counters[8];
+    int i, n = compress ? 8 : 6;
+    static const char *const names[] = {
+        "count", "total_ns", "max_ns", "p50_ns", "p90_ns", "p99_ns", "orig_bytes", "comp_bytes"
+    };
+
+    if (node == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        counters[i] = stat_add_counter(reds, node, names[i], TRUE);
+        if (!counters[i]) {
+            spice_warning("no room for the %s stat counters", info->name);
+            return;
+        }
+    }
+    info->total_counter = counters[1];
+    info->max_counter = counters[2];
+    info->p50_counter = counters[3];
+    info->p90_counter = counters[4];
+    info->p99_counter = counters[5];
+    if (compress) {
+        info->orig_size_counter = counters[6];
+        info->comp_size_counter = counters[7];
+    }
+    /* set last, stat_info_update_counters() checks it */
+    info->count_counter = counters[0];
+    stat_info_update_counters(info);
+}
+#endif
@@ -19,6 +19,8 @@
 #define _H_STAT
 
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <glib.h>
 
 typedef uint32_t StatNodeRef;
@@ -37,16 +39,51 @@ void stat_update_value(SpiceServer *reds, uint32_t value);
     }                                       \
 }
 
+#define stat_set_counter(reds, counter, value) {  \
+    if (counter) {                          \
+        *(counter) = (value);               \
+    }                                       \
+}
+
 #else
 #define stat_add_node(r, p, n, v) INVALID_STAT_REF
 #define stat_remove_node(r, n)
 #define stat_add_counter(r, p, n, v) NULL
 #define stat_remove_counter(r, c)
 #define stat_inc_counter(r, c, v)
+#define stat_set_counter(r, c, v)
 #endif /* RED_STATISTICS */
 
 typedef uint64_t stat_time_t;
 
+/* The probes below are always built and turned on and off at run time,
+ * either with SPICE_STAT_PROBES=1 in the environment or through
+ * spice_server_set_stat_probes(). When off, a probe costs an atomic load
+ * in stat_start_time_init().
+ *
+ * A stat_info_t is only updated by the thread owning it, usually a worker,
+ * which keeps the accumulators free of locks. Latencies also go to a
+ * log-linear histogram: after STAT_HISTOGRAM_MIN_SHIFT (1us), each power
+ * of two is split in 1 << STAT_HISTOGRAM_SUB_BITS buckets.
+ */
+#define STAT_PROBES_ENV "SPICE_STAT_PROBES"
+
+extern gint stat_probes;
+
+static inline int stat_probes_enabled(void)
+{
+    return g_atomic_int_get(&stat_probes);
+}
+
+void stat_probes_set_enabled(int enabled);
+
+#define STAT_HISTOGRAM_MIN_SHIFT 10
+#define STAT_HISTOGRAM_SUB_BITS 2
+#define STAT_HISTOGRAM_OCTAVES 24
+#define STAT_HISTOGRAM_BUCKETS ((STAT_HISTOGRAM_OCTAVES << STAT_HISTOGRAM_SUB_BITS) + 2)
+/* published quantiles are refreshed once every so many samples */
+#define STAT_PUBLISH_INTERVAL 64
+
 static inline stat_time_t stat_now(clockid_t clock_id)
 {
     struct timespec ts;
@@ -56,85 +93,117 @@ static inline stat_time_t stat_now(clockid_t clock_id)
 }
 
 typedef struct {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
-    stat_time_t time;
-#endif
+    stat_time_t time; /* 0 if the probes were off */
 } stat_start_time_t;
 
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
 static inline double stat_cpu_time_to_sec(stat_time_t time)
 {
     return (double)time / (1000 * 1000 * 1000);
 }
-#endif
 
 typedef struct {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     const char *name;
     clockid_t clock;
     uint32_t count;
     stat_time_t max;
     stat_time_t min;
     stat_time_t total;
-#ifdef COMPRESS_STAT
     uint64_t orig_size;
     uint64_t comp_size;
-#endif
-#endif
+    uint32_t histogram[STAT_HISTOGRAM_BUCKETS];
+    /* nodes of the SpiceStat tree, see stat_info_publish() */
+    uint64_t *count_counter;
+    uint64_t *total_counter;
+    uint64_t *max_counter;
+    uint64_t *p50_counter;
+    uint64_t *p90_counter;
+    uint64_t *p99_counter;
+    uint64_t *orig_size_counter;
+    uint64_t *comp_size_counter;
 } stat_info_t;
 
-static inline void stat_start_time_init(G_GNUC_UNUSED stat_start_time_t *tm,
-                                        G_GNUC_UNUSED const stat_info_t *info)
+static inline int stat_histogram_bucket(stat_time_t time)
 {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
-    tm->time = stat_now(info->clock);
-#endif
+    int shift, bucket;
+
+    if (time < (1 << STAT_HISTOGRAM_MIN_SHIFT)) {
+        return 0;
+    }
+    shift = g_bit_storage(time) - 1;
+    bucket = ((shift - STAT_HISTOGRAM_MIN_SHIFT) << STAT_HISTOGRAM_SUB_BITS) +
+             ((time >> (shift - STAT_HISTOGRAM_SUB_BITS)) &
+              ((1 << STAT_HISTOGRAM_SUB_BITS) - 1)) + 1;
+    return MIN(bucket, STAT_HISTOGRAM_BUCKETS - 1);
+}
+
+/* upper bound of the times going to @bucket */
+stat_time_t stat_histogram_bucket_limit(int bucket);
+/* smallest bucket limit with at least @percent of the samples below it */
+stat_time_t stat_info_get_percentile(const stat_info_t *info, unsigned int percent);
+/* writes the accumulators to the published counters */
+void stat_info_update_counters(stat_info_t *info);
+
+static inline void stat_start_time_init(stat_start_time_t *tm, const stat_info_t *info)
+{
+    tm->time = stat_probes_enabled() ? stat_now(info->clock) : 0;
 }
 
-static inline void stat_reset(G_GNUC_UNUSED stat_info_t *info)
+static inline void stat_reset(stat_info_t *info)
 {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     info->count = info->max = info->total = 0;
     info->min = ~(stat_time_t)0;
-#ifdef COMPRESS_STAT
     info->orig_size = info->comp_size = 0;
-#endif
-#endif
+    memset(info->histogram, 0, sizeof(info->histogram));
+    stat_info_update_counters(info);
 }
 
-static inline void stat_init(G_GNUC_UNUSED stat_info_t *info,
-                             G_GNUC_UNUSED const char *name,
-                             G_GNUC_UNUSED clockid_t clock)
+static inline void stat_init(stat_info_t *info, const char *name, clockid_t clock)
 {
-#if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
+    memset(info, 0, sizeof(*info));
     info->name = name;
     info->clock = clock;
     stat_reset(info);
-#endif
 }
 
-static inline void stat_compress_init(G_GNUC_UNUSED stat_info_t *info,
-                                      G_GNUC_UNUSED const char *name,
-                                      G_GNUC_UNUSED clockid_t clock)
+static inline void stat_compress_init(stat_info_t *info, const char *name, clockid_t clock)
 {
     stat_init(info, name, clock);
 }
 
-static inline void stat_compress_add(G_GNUC_UNUSED stat_info_t *info,
-                                     G_GNUC_UNUSED stat_start_time_t start,
-                                     G_GNUC_UNUSED int orig_size,
-                                     G_GNUC_UNUSED int comp_size)
+static inline void stat_account(stat_info_t *info, stat_time_t time)
 {
-#ifdef COMPRESS_STAT
-    stat_time_t time;
     ++info->count;
-    time = stat_now(info->clock) - start.time;
     info->total += time;
     info->max = MAX(info->max, time);
     info->min = MIN(info->min, time);
+    info->histogram[stat_histogram_bucket(time)]++;
+    if (info->count_counter && (info->count % STAT_PUBLISH_INTERVAL) == 0) {
+        stat_info_update_counters(info);
+    }
+}
+
+static inline void stat_compress_add(stat_info_t *info, stat_start_time_t start,
+                                     int orig_size, int comp_size)
+{
+    if (!start.time) {
+        return;
+    }
     info->orig_size += orig_size;
     info->comp_size += comp_size;
-#endif
+    stat_account(info, stat_now(info->clock) - start.time);
+}
+
+/* for a compression timed by another thread with the clock of @info,
+ * @time is 0 if the probes were off there */
+static inline void stat_compress_add_time(stat_info_t *info, stat_time_t time,
+                                          int orig_size, int comp_size)
+{
+    if (!time) {
+        return;
+    }
+    info->orig_size += orig_size;
+    info->comp_size += comp_size;
+    stat_account(info, time);
 }
 
 static inline double stat_byte_to_mega(uint64_t size)
@@ -142,17 +211,20 @@ static inline double stat_byte_to_mega(uint64_t size)
     return (double)size / (1000 * 1000);
 }
 
-static inline void stat_add(G_GNUC_UNUSED stat_info_t *info,
-                            G_GNUC_UNUSED stat_start_time_t start)
+static inline void stat_add(stat_info_t *info, stat_start_time_t start)
 {
-#ifdef RED_WORKER_STAT
-    stat_time_t time;
-    ++info->count;
-    time = stat_now(info->clock) - start.time;
-    info->total += time;
-    info->max = MAX(info->max, time);
-    info->min = MIN(info->min, time);
-#endif
+    if (!start.time) {
+        return;
+    }
+    stat_account(info, stat_now(info->clock) - start.time);
 }
 
+#ifdef RED_STATISTICS
+/* adds a node named after @info under @parent, with its count, total, max,
+ * percentiles and, if @compress, sizes */
+void stat_info_publish(SpiceServer *reds, StatNodeRef parent, stat_info_t *info, int compress);
+#else
+#define stat_info_publish(r, p, i, c)
+#endif
+
 #endif /* _H_STAT */
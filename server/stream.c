@@ -142,12 +142,13 @@ void stream_clip_item_free(StreamClipItem *item)
 
     stream_agent_unref(display, item->stream_agent);
     free(item->rects);
-    free(item);
+    pipe_item_pool_release(display->stream_clip_items, item);
 }
 
 StreamClipItem *stream_clip_item_new(StreamAgent *agent)
 {
-    StreamClipItem *item = spice_new(StreamClipItem, 1);
+    DisplayChannel *display = DCC_TO_DC(agent->dcc);
+    StreamClipItem *item = pipe_item_pool_alloc(display->stream_clip_items);
     pipe_item_init_full((PipeItem *)item, PIPE_ITEM_TYPE_STREAM_CLIP,
                         (GDestroyNotify)stream_clip_item_free);
 
@@ -0,0 +1,685 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Run the bitmaps of a recording (via SPICE_WORKER_RECORD_FILENAME) through
+ * each of the image codecs used by dcc_compress_image(), and report their
+ * throughput, compression ratio and latency.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include <spice/macros.h>
+#include "red-replay-qxl.h"
+#include "memslot.h"
+#include "red-parse-qxl.h"
+#include "dcc-encoders.h"
+#include "spice-bitmap-utils.h"
+
+#define MAX_SURFACE_NUM 1024
+/* see get_compression_for_bitmap() */
+#define MIN_SIZE_TO_COMPRESS 54
+#define MIN_DIMENSION_TO_QUIC 3
+#define MIN_GLZ_SIZE_FOR_ZLIB 100
+/* in pixels, the client picks it in SpiceMsgcDisplayInit */
+#define DEFAULT_GLZ_WINDOW_SIZE (16 * 1024 * 1024)
+
+typedef struct BenchDrawable {
+    QXLCommandExt *cmd;
+    RedDrawable red_drawable;
+} BenchDrawable;
+
+typedef struct Encoders {
+    RedCompressBufPool bufs;
+    QuicData quic_data;
+    QuicContext *quic;
+    LzData lz_data;
+    LzContext *lz;
+    GlzData glz_data;
+    GlzEncDictContext *glz_dict;
+    GlzEncoderContext *glz;
+    JpegData jpeg_data;
+    JpegEncoderContext *jpeg;
+#ifdef USE_LZ4
+    Lz4Data lz4_data;
+    Lz4EncoderContext *lz4;
+#endif
+    ZlibData zlib_data;
+    ZlibEncoder *zlib;
+    int jpeg_quality;
+    int zlib_level;
+} Encoders;
+
+typedef struct Codec {
+    const char *name;
+    /* returns FALSE if the codec does not handle @src */
+    int (*can_compress)(Encoders *enc, SpiceBitmap *src);
+    /* returns the compressed size, or 0 if the compression failed */
+    int (*compress)(Encoders *enc, SpiceBitmap *src);
+    /* called before each pass over the images */
+    void (*reset)(Encoders *enc);
+} Codec;
+
+typedef struct CodecStats {
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint64_t total_ns;
+    unsigned int n_failed;
+    unsigned int n_skipped;
+    GArray *latencies; // uint64_t ns, one per compressed image
+} CodecStats;
+
+static const LzImageType bitmap_fmt_to_lz_image_type[] = {
+    LZ_IMAGE_TYPE_INVALID,
+    LZ_IMAGE_TYPE_PLT1_LE,
+    LZ_IMAGE_TYPE_PLT1_BE,
+    LZ_IMAGE_TYPE_PLT4_LE,
+    LZ_IMAGE_TYPE_PLT4_BE,
+    LZ_IMAGE_TYPE_PLT8,
+    LZ_IMAGE_TYPE_RGB16,
+    LZ_IMAGE_TYPE_RGB24,
+    LZ_IMAGE_TYPE_RGB32,
+    LZ_IMAGE_TYPE_RGBA,
+    LZ_IMAGE_TYPE_A8
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void set_lines(EncoderData *data, SpiceBitmap *src, int reverse)
+{
+    data->u.lines_data.chunks = src->data;
+    data->u.lines_data.stride = src->stride;
+    data->u.lines_data.next = reverse ? src->data->num_chunks - 1 : 0;
+    data->u.lines_data.reverse = reverse;
+}
+
+static int can_quic_compress(Encoders *enc, SpiceBitmap *src)
+{
+    return src->x >= MIN_DIMENSION_TO_QUIC && src->y >= MIN_DIMENSION_TO_QUIC;
+}
+
+static int can_lz_compress(Encoders *enc, SpiceBitmap *src)
+{
+    return !bitmap_has_extra_stride(src);
+}
+
+static int can_glz_compress(Encoders *enc, SpiceBitmap *src)
+{
+    return can_lz_compress(enc, src) &&
+           src->x * src->y < glz_enc_dictionary_get_size(enc->glz_dict);
+}
+
+static int can_jpeg_compress(Encoders *enc, SpiceBitmap *src)
+{
+    return can_quic_compress(enc, src) &&
+           (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src));
+}
+
+static int compress_quic(Encoders *enc, SpiceBitmap *src)
+{
+    QuicData *quic_data = &enc->quic_data;
+    volatile QuicImageType type;
+    int size, stride;
+    int top_down = src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
+
+    switch (src->format) {
+    case SPICE_BITMAP_FMT_32BIT:
+        type = QUIC_IMAGE_TYPE_RGB32;
+        break;
+    case SPICE_BITMAP_FMT_RGBA:
+        type = QUIC_IMAGE_TYPE_RGBA;
+        break;
+    case SPICE_BITMAP_FMT_16BIT:
+        type = QUIC_IMAGE_TYPE_RGB16;
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        type = QUIC_IMAGE_TYPE_RGB24;
+        break;
+    default:
+        return 0;
+    }
+
+    encoder_data_init(&quic_data->data, NULL);
+
+    if (setjmp(quic_data->data.jmp_env)) {
+        encoder_data_reset(&quic_data->data);
+        return 0;
+    }
+
+    set_lines(&quic_data->data, src, !top_down);
+    stride = top_down ? src->stride : -src->stride;
+    size = quic_encode(enc->quic, type, src->x, src->y, NULL, 0, stride,
+                       quic_data->data.bufs_head->buf.words,
+                       G_N_ELEMENTS(quic_data->data.bufs_head->buf.words));
+
+    encoder_data_reset(&quic_data->data);
+    return size << 2;
+}
+
+static int compress_lz(Encoders *enc, SpiceBitmap *src)
+{
+    LzData *lz_data = &enc->lz_data;
+    int size;
+
+    encoder_data_init(&lz_data->data, NULL);
+
+    if (setjmp(lz_data->data.jmp_env)) {
+        encoder_data_reset(&lz_data->data);
+        return 0;
+    }
+
+    set_lines(&lz_data->data, src, FALSE);
+    size = lz_encode(enc->lz, bitmap_fmt_to_lz_image_type[src->format], src->x, src->y,
+                     !!(src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN),
+                     NULL, 0, src->stride,
+                     lz_data->data.bufs_head->buf.bytes,
+                     sizeof(lz_data->data.bufs_head->buf));
+
+    encoder_data_reset(&lz_data->data);
+    return size;
+}
+
+/* leaves the output in glz_data for compress_zlib_glz() */
+static int compress_glz_keep(Encoders *enc, SpiceBitmap *src)
+{
+    GlzData *glz_data = &enc->glz_data;
+    GlzEncDictImageContext *dict_context;
+
+    encoder_data_init(&glz_data->data, NULL);
+    set_lines(&glz_data->data, src, FALSE);
+
+    return glz_encode(enc->glz, bitmap_fmt_to_lz_image_type[src->format], src->x, src->y,
+                      (src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN), NULL, 0,
+                      src->stride, glz_data->data.bufs_head->buf.bytes,
+                      sizeof(glz_data->data.bufs_head->buf),
+                      (GlzUsrImageContext *)src, &dict_context);
+}
+
+static int compress_glz(Encoders *enc, SpiceBitmap *src)
+{
+    int size = compress_glz_keep(enc, src);
+
+    encoder_data_reset(&enc->glz_data.data);
+    return size;
+}
+
+static int compress_zlib_glz(Encoders *enc, SpiceBitmap *src)
+{
+    ZlibData *zlib_data = &enc->zlib_data;
+    int glz_size, zlib_size;
+
+    glz_size = compress_glz_keep(enc, src);
+    if (glz_size < MIN_GLZ_SIZE_FOR_ZLIB) {
+        encoder_data_reset(&enc->glz_data.data);
+        return glz_size;
+    }
+
+    encoder_data_init(&zlib_data->data, NULL);
+    zlib_data->data.u.compressed_data.next = enc->glz_data.data.bufs_head;
+    zlib_data->data.u.compressed_data.size_left = glz_size;
+
+    zlib_size = zlib_encode(enc->zlib, enc->zlib_level,
+                            glz_size, zlib_data->data.bufs_head->buf.bytes,
+                            sizeof(zlib_data->data.bufs_head->buf));
+
+    encoder_data_reset(&zlib_data->data);
+    encoder_data_reset(&enc->glz_data.data);
+    // like dcc_compress_image_glz(), send the smallest
+    return MIN(glz_size, zlib_size);
+}
+
+static void reset_glz(Encoders *enc)
+{
+    glz_enc_dictionary_reset(enc->glz_dict, &enc->glz_data.usr);
+}
+
+static int compress_jpeg(Encoders *enc, SpiceBitmap *src)
+{
+    JpegData *jpeg_data = &enc->jpeg_data;
+    LzData *lz_data = &enc->lz_data;
+    volatile JpegEncoderImageType jpeg_in_type;
+    volatile int has_alpha = FALSE;
+    int top_down = src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
+    int jpeg_size, alpha_lz_size, comp_head_filled;
+
+    switch (src->format) {
+    case SPICE_BITMAP_FMT_16BIT:
+        jpeg_in_type = JPEG_IMAGE_TYPE_RGB16;
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        jpeg_in_type = JPEG_IMAGE_TYPE_BGR24;
+        break;
+    case SPICE_BITMAP_FMT_32BIT:
+        jpeg_in_type = JPEG_IMAGE_TYPE_BGRX32;
+        break;
+    case SPICE_BITMAP_FMT_RGBA:
+        jpeg_in_type = JPEG_IMAGE_TYPE_BGRX32;
+        has_alpha = TRUE;
+        break;
+    default:
+        return 0;
+    }
+
+    encoder_data_init(&jpeg_data->data, NULL);
+
+    if (setjmp(jpeg_data->data.jmp_env)) {
+        encoder_data_reset(&jpeg_data->data);
+        return 0;
+    }
+
+    set_lines(&jpeg_data->data, src, !top_down);
+    jpeg_size = jpeg_encode(enc->jpeg, enc->jpeg_quality, jpeg_in_type,
+                            src->x, src->y, NULL, 0,
+                            top_down ? src->stride : -src->stride,
+                            jpeg_data->data.bufs_head->buf.bytes,
+                            sizeof(jpeg_data->data.bufs_head->buf));
+    if (!has_alpha) {
+        encoder_data_reset(&jpeg_data->data);
+        return jpeg_size;
+    }
+
+    /* the alpha channel is appended to the jpeg data, see dcc_compress_image_jpeg() */
+    lz_data->data.bufs_head = jpeg_data->data.bufs_tail;
+    lz_data->data.bufs_tail = lz_data->data.bufs_head;
+    lz_data->data.dcc = NULL;
+    lz_data->data.pool = jpeg_data->data.pool;
+    set_lines(&lz_data->data, src, FALSE);
+
+    comp_head_filled = jpeg_size % sizeof(lz_data->data.bufs_head->buf);
+    alpha_lz_size = lz_encode(enc->lz, LZ_IMAGE_TYPE_XXXA, src->x, src->y,
+                              !!top_down, NULL, 0, src->stride,
+                              lz_data->data.bufs_head->buf.bytes + comp_head_filled,
+                              sizeof(lz_data->data.bufs_head->buf) - comp_head_filled);
+
+    /* lz only appended buffers to the jpeg chain */
+    encoder_data_reset(&jpeg_data->data);
+    return jpeg_size + alpha_lz_size;
+}
+
+#ifdef USE_LZ4
+static int compress_lz4(Encoders *enc, SpiceBitmap *src)
+{
+    Lz4Data *lz4_data = &enc->lz4_data;
+    int size;
+
+    encoder_data_init(&lz4_data->data, NULL);
+
+    if (setjmp(lz4_data->data.jmp_env)) {
+        encoder_data_reset(&lz4_data->data);
+        return 0;
+    }
+
+    set_lines(&lz4_data->data, src, FALSE);
+    size = lz4_encode(enc->lz4, src->y, src->stride, lz4_data->data.bufs_head->buf.bytes,
+                      sizeof(lz4_data->data.bufs_head->buf),
+                      src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
+
+    encoder_data_reset(&lz4_data->data);
+    return size;
+}
+#endif
+
+static const Codec codecs[] = {
+    { "quic", can_quic_compress, compress_quic, NULL },
+    { "lz", can_lz_compress, compress_lz, NULL },
+    { "glz", can_glz_compress, compress_glz, reset_glz },
+    { "zlib-glz", can_glz_compress, compress_zlib_glz, reset_glz },
+#ifdef USE_LZ4
+    { "lz4", can_lz_compress, compress_lz4, NULL },
+#endif
+    { "jpeg", can_jpeg_compress, compress_jpeg, NULL },
+};
+
+static void glz_usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+    /* the bitmaps outlive the dictionary */
+}
+
+static void encoders_init(Encoders *enc, int glz_window_size)
+{
+    red_compress_buf_pool_init(&enc->bufs, RED_COMPRESS_BUF_POOL_MAX_FREE);
+
+    enc->quic_data.data.pool = &enc->bufs;
+    enc->quic = quic_data_create_encoder(&enc->quic_data);
+    enc->lz_data.data.pool = &enc->bufs;
+    enc->lz = lz_data_create_encoder(&enc->lz_data);
+
+    enc->glz_data.data.pool = &enc->bufs;
+    glz_data_init(&enc->glz_data);
+    enc->glz_data.usr.free_image = glz_usr_free_image;
+    enc->glz_dict = glz_enc_dictionary_create(glz_window_size, 1, &enc->glz_data.usr);
+    enc->glz = glz_encoder_create(0, enc->glz_dict, &enc->glz_data.usr);
+
+    enc->jpeg_data.data.pool = &enc->bufs;
+    enc->jpeg = jpeg_data_create_encoder(&enc->jpeg_data);
+#ifdef USE_LZ4
+    enc->lz4_data.data.pool = &enc->bufs;
+    enc->lz4 = lz4_data_create_encoder(&enc->lz4_data);
+#endif
+    enc->zlib_data.data.pool = &enc->bufs;
+    enc->zlib = zlib_data_create_encoder(&enc->zlib_data, enc->zlib_level);
+}
+
+static void encoders_free(Encoders *enc)
+{
+    RedCompressBuf *buf;
+
+    quic_destroy(enc->quic);
+    lz_destroy(enc->lz);
+    glz_encoder_destroy(enc->glz);
+    glz_enc_dictionary_destroy(enc->glz_dict, &enc->glz_data.usr);
+    jpeg_encoder_destroy(enc->jpeg);
+#ifdef USE_LZ4
+    lz4_encoder_destroy(enc->lz4);
+#endif
+    zlib_encoder_destroy(enc->zlib);
+
+    while ((buf = enc->bufs.free_bufs)) {
+        enc->bufs.free_bufs = buf->send_next;
+        g_free(buf);
+    }
+    pthread_mutex_destroy(&enc->bufs.lock);
+}
+
+static void add_bitmap(GPtrArray *bitmaps, SpiceImage *image)
+{
+    SpiceBitmap *bitmap;
+
+    if (!image || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    bitmap = &image->u.bitmap;
+    /* palette and alpha only bitmaps only go through lz */
+    if (!bitmap_fmt_has_graduality(bitmap->format) ||
+        bitmap->y * bitmap->stride < MIN_SIZE_TO_COMPRESS) {
+        return;
+    }
+    if (bitmap->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE) {
+        spice_chunks_linearize(bitmap->data);
+    }
+    g_ptr_array_add(bitmaps, bitmap);
+}
+
+static void read_bitmaps(SpiceReplay *replay, RedMemSlotInfo *slots, guint max_images,
+                         GPtrArray *drawables, GPtrArray *bitmaps)
+{
+    QXLCommandExt *cmd;
+
+    while (bitmaps->len < max_images && (cmd = spice_replay_next_cmd(replay, NULL))) {
+        BenchDrawable *bd;
+        RedDrawable *red;
+
+        if (cmd->cmd.type != QXL_CMD_DRAW) {
+            spice_replay_free_cmd(replay, cmd);
+            continue;
+        }
+        bd = spice_new0(BenchDrawable, 1);
+        bd->cmd = cmd;
+        red = &bd->red_drawable;
+        red_arena_init(&red->arena, red->arena_buf, sizeof(red->arena_buf));
+        if (red_get_drawable(slots, cmd->group_id, red, cmd->cmd.data, cmd->flags)) {
+            red_put_drawable(red);
+            spice_replay_free_cmd(replay, cmd);
+            free(bd);
+            continue;
+        }
+        /* the bitmaps reference the command data, keep both around */
+        g_ptr_array_add(drawables, bd);
+
+        switch (red->type) {
+        case QXL_DRAW_COPY:
+            add_bitmap(bitmaps, red->u.copy.src_bitmap);
+            break;
+        case QXL_DRAW_OPAQUE:
+            add_bitmap(bitmaps, red->u.opaque.src_bitmap);
+            break;
+        case QXL_DRAW_BLEND:
+            add_bitmap(bitmaps, red->u.blend.src_bitmap);
+            break;
+        case QXL_DRAW_ALPHA_BLEND:
+            add_bitmap(bitmaps, red->u.alpha_blend.src_bitmap);
+            break;
+        case QXL_DRAW_ROP3:
+            add_bitmap(bitmaps, red->u.rop3.src_bitmap);
+            break;
+        case QXL_DRAW_COMPOSITE:
+            add_bitmap(bitmaps, red->u.composite.src_bitmap);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void run_codec(const Codec *codec, Encoders *enc, GPtrArray *bitmaps,
+                      guint iterations, CodecStats *stats)
+{
+    guint i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->latencies = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t),
+                                         bitmaps->len * iterations);
+
+    for (i = 0; i < iterations; i++) {
+        if (codec->reset) {
+            codec->reset(enc);
+        }
+        for (j = 0; j < bitmaps->len; j++) {
+            SpiceBitmap *src = g_ptr_array_index(bitmaps, j);
+            uint64_t start, elapsed;
+            int size;
+
+            if (!codec->can_compress(enc, src)) {
+                stats->n_skipped++;
+                continue;
+            }
+            start = now_ns();
+            size = codec->compress(enc, src);
+            elapsed = now_ns() - start;
+            if (size <= 0) {
+                stats->n_failed++;
+                continue;
+            }
+            stats->in_bytes += src->y * src->stride;
+            stats->out_bytes += size;
+            stats->total_ns += elapsed;
+            g_array_append_val(stats->latencies, elapsed);
+        }
+    }
+}
+
+static gboolean codec_selected(gchar **selected, const char *name)
+{
+    for (; *selected; selected++) {
+        if (strcmp(*selected, name) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(GArray *sorted, int percent)
+{
+    if (sorted->len == 0) {
+        return 0;
+    }
+    return g_array_index(sorted, uint64_t, (sorted->len - 1) * percent / 100) / 1000.0;
+}
+
+static void print_stats(const Codec *codec, CodecStats *stats, gboolean csv)
+{
+    GArray *lat = stats->latencies;
+    double ratio = stats->out_bytes ? (double)stats->in_bytes / stats->out_bytes : 0;
+    double mbps = stats->total_ns ? stats->in_bytes * 1000.0 / stats->total_ns : 0;
+
+    g_array_sort(lat, compare_uint64);
+    if (csv) {
+        printf("%s,%u,%u,%u,%"PRIu64",%"PRIu64",%.3f,%.2f,%.1f,%.1f,%.1f,%.1f\n",
+               codec->name, lat->len, stats->n_skipped, stats->n_failed,
+               stats->in_bytes, stats->out_bytes, ratio, mbps,
+               percentile_us(lat, 50), percentile_us(lat, 90), percentile_us(lat, 99),
+               percentile_us(lat, 100));
+        return;
+    }
+    printf("%-10s %8u %8u %6u %10.2f %8.3f %10.2f %10.1f %10.1f %10.1f\n",
+           codec->name, lat->len, stats->n_skipped, stats->n_failed,
+           stats->in_bytes / 1000000.0, ratio, mbps,
+           percentile_us(lat, 50), percentile_us(lat, 90), percentile_us(lat, 99));
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    gchar **file = NULL, *codec_names = NULL, **selected = NULL;
+    gint iterations = 1, max_images = G_MAXINT;
+    gint jpeg_quality = 85, zlib_level = ZLIB_DEFAULT_COMPRESSION_LEVEL;
+    gint glz_window_size = DEFAULT_GLZ_WINDOW_SIZE;
+    gboolean csv = FALSE;
+    RedMemSlotInfo mem_slots;
+    SpiceReplay *replay;
+    GPtrArray *drawables, *bitmaps;
+    Encoders enc;
+    uint64_t total_bytes = 0;
+    FILE *fd;
+    guint i;
+
+    GOptionEntry entries[] = {
+        { "codecs", 'c', 0, G_OPTION_ARG_STRING, &codec_names, "Comma separated codecs to run (default all)", "LIST" },
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Passes over the images (default 1)", "N" },
+        { "max-images", 'm', 0, G_OPTION_ARG_INT, &max_images, "Only read the first N bitmaps", "N" },
+        { "jpeg-quality", 0, 0, G_OPTION_ARG_INT, &jpeg_quality, "JPEG quality (default 85)", "INT" },
+        { "zlib-level", 0, 0, G_OPTION_ARG_INT, &zlib_level, "zlib level over glz (default 3)", "INT" },
+        { "glz-window", 0, 0, G_OPTION_ARG_INT, &glz_window_size, "GLZ dictionary size in pixels", "INT" },
+        { "csv", 0, 0, G_OPTION_ARG_NONE, &csv, "Print the results as CSV", NULL },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &file, "replay file", "FILE" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- benchmark image codecs on a spice server recording");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if (!file) {
+        g_printerr("%s\n", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    if (codec_names) {
+        selected = g_strsplit(codec_names, ",", -1);
+        g_free(codec_names);
+    }
+    if (iterations <= 0 || max_images <= 0 || glz_window_size <= 0) {
+        g_printerr("invalid option value\n");
+        exit(1);
+    }
+
+    if (strcmp(file[0], "-") == 0) {
+        fd = stdin;
+    } else {
+        fd = fopen(file[0], "r");
+    }
+    if (fd == NULL) {
+        g_printerr("error opening %s\n", file[0]);
+        exit(1);
+    }
+    g_strfreev(file);
+
+    replay = spice_replay_new(fd, MAX_SURFACE_NUM);
+    if (replay == NULL) {
+        g_printerr("Error initializing replay\n");
+        exit(1);
+    }
+
+    /* the replayed commands use plain pointers, see spice_replay_next_cmd() */
+    memslot_info_init(&mem_slots, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&mem_slots, 0, 0, 0 /* delta */, 0 /* start */, ~0ul /* end */,
+                          0 /* generation */);
+
+    drawables = g_ptr_array_new();
+    bitmaps = g_ptr_array_new();
+    read_bitmaps(replay, &mem_slots, max_images, drawables, bitmaps);
+    for (i = 0; i < bitmaps->len; i++) {
+        SpiceBitmap *bitmap = g_ptr_array_index(bitmaps, i);
+        total_bytes += bitmap->y * bitmap->stride;
+    }
+    g_printerr("%u bitmaps, %.2f MB\n", bitmaps->len, total_bytes / 1000000.0);
+
+    memset(&enc, 0, sizeof(enc));
+    enc.jpeg_quality = jpeg_quality;
+    enc.zlib_level = zlib_level;
+    encoders_init(&enc, glz_window_size);
+
+    if (csv) {
+        printf("codec,images,skipped,failed,in_bytes,out_bytes,ratio,mb_per_s,"
+               "p50_us,p90_us,p99_us,max_us\n");
+    } else {
+        printf("%-10s %8s %8s %6s %10s %8s %10s %10s %10s %10s\n",
+               "codec", "images", "skipped", "failed", "MB", "ratio", "MB/s",
+               "p50 us", "p90 us", "p99 us");
+    }
+    for (i = 0; i < G_N_ELEMENTS(codecs); i++) {
+        CodecStats stats;
+
+        if (selected && !codec_selected(selected, codecs[i].name)) {
+            continue;
+        }
+        run_codec(&codecs[i], &enc, bitmaps, iterations, &stats);
+        print_stats(&codecs[i], &stats, csv);
+        g_array_free(stats.latencies, TRUE);
+    }
+
+    encoders_free(&enc);
+    for (i = 0; i < drawables->len; i++) {
+        BenchDrawable *bd = g_ptr_array_index(drawables, i);
+
+        red_put_drawable(&bd->red_drawable);
+        spice_replay_free_cmd(replay, bd->cmd);
+        free(bd);
+    }
+    g_ptr_array_free(drawables, TRUE);
+    g_ptr_array_free(bitmaps, TRUE);
+    spice_replay_free(replay);
+    g_strfreev(selected);
+
+    return 0;
+}
@@ -17,6 +17,11 @@
 */
 
 /* Replay a previously recorded file (via SPICE_WORKER_RECORD_FILENAME)
+ *
+ * With --bench, the commands are replayed as fast as possible to a built-in
+ * headless client, and a report of the throughput, worker cpu time, encoded
+ * bytes and latencies is printed at the end. The last two come from the
+ * statistics the server publishes.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -25,19 +30,27 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <glib.h>
 #include <pthread.h>
 
 #include <spice/macros.h>
+#include <spice/stats.h>
 #include "red-replay-qxl.h"
+#include "red-arena.h"
 #include "test_display_base.h"
+#include "sink-client.h"
+#include "stat.h"
 #include "common/log.h"
 
 static SpiceCoreInterface *core;
@@ -54,6 +67,14 @@ static pid_t client_pid;
 static GMainLoop *loop = NULL;
 static GAsyncQueue *aqueue = NULL;
 static long total_size;
+static gboolean realtime = FALSE;
+static uint64_t realtime_start_timestamp;
+static uint64_t realtime_start_time;
+static gboolean bench = FALSE;
+static SinkClient *sink = NULL;
+static uint64_t bench_start_time;
+static clockid_t worker_clock;
+static gboolean have_worker_clock = FALSE;
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static GSource *fill_source = NULL;
@@ -125,6 +146,21 @@ static gboolean fill_queue_idle(gpointer user_data)
         if (slow && (ncommands > skip)) {
             g_usleep(slow);
         }
+        if (realtime) {
+            uint64_t timestamp = spice_replay_get_timestamp(replay);
+            int64_t delay;
+
+            if (!realtime_start_time) {
+                realtime_start_timestamp = timestamp;
+                realtime_start_time = stat_now(CLOCK_MONOTONIC);
+            }
+            /* keeps the recorded intervals between the commands */
+            delay = (int64_t)(timestamp - realtime_start_timestamp) -
+                    (int64_t)(stat_now(CLOCK_MONOTONIC) - realtime_start_time);
+            if (delay > 0) {
+                g_usleep(delay / 1000);
+            }
+        }
 
         wakeup = TRUE;
         g_async_queue_push(aqueue, cmd);
@@ -170,6 +206,10 @@ static int get_command(QXLInstance *qin, QXLCommandExt *ext)
 {
     QXLCommandExt *cmd;
 
+    if (!have_worker_clock) {
+        have_worker_clock = pthread_getcpuclockid(pthread_self(), &worker_clock) == 0;
+    }
+
     if (g_async_queue_length(aqueue) == 0) {
         /* could use a gcondition ? */
         fill_queue();
@@ -183,6 +223,9 @@ static int get_command(QXLInstance *qin, QXLCommandExt *ext)
     }
 
     *ext = *cmd;
+    if (!bench_start_time) {
+        bench_start_time = stat_now(CLOCK_MONOTONIC);
+    }
 
     return TRUE;
 }
@@ -198,6 +241,9 @@ static void end_replay(void)
 
     /* FIXME: wait threads and end cleanly */
     spice_replay_free(replay);
+    if (sink) {
+        sink_client_free(sink);
+    }
 
     if (client_pid) {
         g_debug("kill %d", client_pid);
@@ -286,6 +332,130 @@ static gboolean progress_timer(gpointer user_data)
     return TRUE;
 }
 
+static SpiceStat *bench_stat_open(size_t *size)
+{
+    char name[64];
+    struct stat st;
+    SpiceStat *stats;
+    int fd;
+
+    snprintf(name, sizeof(name), SPICE_STAT_SHM_NAME, getpid());
+    fd = shm_open(name, O_RDONLY, 0444);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SpiceStat)) {
+        close(fd);
+        return NULL;
+    }
+    stats = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        return NULL;
+    }
+    if (stats->magic != SPICE_STAT_MAGIC || stats->version != SPICE_STAT_VERSION) {
+        munmap(stats, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return stats;
+}
+
+static uint32_t bench_stat_find(SpiceStat *stats, uint32_t index, const char *name)
+{
+    while (index != INVALID_STAT_REF) {
+        if (strcmp(stats->nodes[index].name, name) == 0) {
+            return index;
+        }
+        index = stats->nodes[index].next_sibling_index;
+    }
+    return INVALID_STAT_REF;
+}
+
+static uint32_t bench_stat_child(SpiceStat *stats, uint32_t parent, const char *name)
+{
+    if (parent == INVALID_STAT_REF) {
+        return INVALID_STAT_REF;
+    }
+    return bench_stat_find(stats, stats->nodes[parent].first_child_index, name);
+}
+
+static uint64_t bench_stat_value(SpiceStat *stats, uint32_t parent, const char *name)
+{
+    uint32_t index = bench_stat_child(stats, parent, name);
+
+    return index == INVALID_STAT_REF ? 0 : stats->nodes[index].value;
+}
+
+/* The percentiles published by the server are refreshed every
+ * STAT_PUBLISH_INTERVAL samples, which is close enough on a whole run */
+static void bench_report(uint64_t end_time)
+{
+    static const char *const codecs[] = {
+        "off", "lz", "glz", "quic", "jpeg", "zlib", "jpeg_alpha", "lz4"
+    };
+    static const char *const stages[] = {
+        "process", "queue", "compress", "send", "total"
+    };
+    double elapsed = end_time > bench_start_time ?
+                     stat_cpu_time_to_sec(end_time - bench_start_time) : 0;
+    uint64_t messages, bytes;
+    struct timespec cpu;
+    SpiceStat *stats;
+    size_t stat_size;
+    uint32_t display, node;
+    unsigned int i;
+
+    sink_client_get_received(sink, &messages, &bytes);
+    g_print("commands:    %u in %.3f s, %.1f commands/s\n",
+            ncommands, elapsed, elapsed > 0 ? ncommands / elapsed : 0);
+    if (have_worker_clock && clock_gettime(worker_clock, &cpu) == 0) {
+        double cpu_time = cpu.tv_sec + cpu.tv_nsec / 1e9;
+
+        g_print("worker cpu:  %.3f s (%.1f%%)\n", cpu_time,
+                elapsed > 0 ? cpu_time * 100 / elapsed : 0);
+    }
+    g_print("received:    %"PRIu64" messages, %"PRIu64" bytes\n", messages, bytes);
+
+    stats = bench_stat_open(&stat_size);
+    if (!stats) {
+        g_print("no server statistics, codec and latency reports skipped\n");
+        return;
+    }
+    display = bench_stat_find(stats, stats->root_index, "display[0]");
+    display = bench_stat_child(stats, display, "display_channel");
+
+    g_print("\n%-12s %10s %14s %14s %7s\n", "codec", "images", "orig bytes", "comp bytes", "ratio");
+    for (i = 0; i < G_N_ELEMENTS(codecs); i++) {
+        uint64_t count, orig_bytes, comp_bytes;
+
+        node = bench_stat_child(stats, display, codecs[i]);
+        count = bench_stat_value(stats, node, "count");
+        if (count == 0) {
+            continue;
+        }
+        orig_bytes = bench_stat_value(stats, node, "orig_bytes");
+        comp_bytes = bench_stat_value(stats, node, "comp_bytes");
+        g_print("%-12s %10"PRIu64" %14"PRIu64" %14"PRIu64" %7.2f\n", codecs[i], count,
+                orig_bytes, comp_bytes, comp_bytes ? (double)orig_bytes / comp_bytes : 0);
+    }
+
+    g_print("\n%-12s %10s %10s %10s %10s %10s\n", "latency (us)", "count",
+            "p50", "p90", "p99", "max");
+    node = bench_stat_child(stats, display, "client0");
+    for (i = 0; i < G_N_ELEMENTS(stages); i++) {
+        uint32_t stage = bench_stat_child(stats, node, stages[i]);
+
+        g_print("%-12s %10"PRIu64" %10.1f %10.1f %10.1f %10.1f\n", stages[i],
+                bench_stat_value(stats, stage, "count"),
+                bench_stat_value(stats, stage, "p50_ns") / 1000.0,
+                bench_stat_value(stats, stage, "p90_ns") / 1000.0,
+                bench_stat_value(stats, stage, "p99_ns") / 1000.0,
+                bench_stat_value(stats, stage, "max_ns") / 1000.0);
+    }
+    munmap(stats, stat_size);
+}
+
 int main(int argc, char **argv)
 {
     GError *error = NULL;
@@ -305,6 +475,8 @@ int main(int argc, char **argv)
         { "slow", 's', 0, G_OPTION_ARG_INT, &slow, "Slow down replay. Delays USEC microseconds before each command", "USEC" },
         { "skip", 0, 0, G_OPTION_ARG_INT, &skip, "skip 'slow' for the first n commands", NULL },
         { "count", 0, 0, G_OPTION_ARG_NONE, &print_count, "Print the number of commands processed", NULL },
+        { "realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime, "Keep the recorded intervals between commands", NULL },
+        { "bench", 'b', 0, G_OPTION_ARG_NONE, &bench, "Replay as fast as possible to a built-in client and print a report", NULL },
         { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &file, "replay file", "FILE" },
         { NULL }
     };
@@ -352,6 +524,10 @@ int main(int argc, char **argv)
         g_printerr("invalid streaming value\n");
         exit(1);
     }
+    if (bench && (client || realtime || slow)) {
+        g_printerr("--bench can't be used with --client, --realtime or --slow\n");
+        exit(1);
+    }
 
     if (strncmp(file[0], "-", 1) == 0) {
         fd = stdin;
@@ -371,7 +547,7 @@ int main(int argc, char **argv)
     fseek(fd, 0L, SEEK_END);
     total_size = ftell(fd);
     fseek(fd, 0L, SEEK_SET);
-    if (total_size > 0)
+    if (total_size > 0 && !bench)
         g_timeout_add_seconds(1, progress_timer, fd);
     replay = spice_replay_new(fd, MAX_SURFACE_NUM);
     if (replay == NULL) {
@@ -386,15 +562,27 @@ int main(int argc, char **argv)
     server = spice_server_new();
     spice_server_set_image_compression(server, compression);
     spice_server_set_streaming_video(server, streaming);
-    spice_server_set_port(server, port);
     spice_server_set_noauth(server);
-
-    g_print("listening on port %d (insecure)\n", port);
+    if (bench) {
+        spice_server_set_stat_probes(server, TRUE);
+    } else {
+        spice_server_set_port(server, port);
+        g_print("listening on port %d (insecure)\n", port);
+    }
     spice_server_init(server, core);
 
     display_sin.base.sif = &display_sif.base;
     spice_server_add_interface(server, &display_sin.base);
 
+    if (bench) {
+        sink = sink_client_new(server, basic_event_loop_get_context());
+        if (!sink) {
+            g_printerr("Error starting the benchmark client\n");
+            exit(1);
+        }
+        wait = TRUE;
+    }
+
     if (client) {
         start_client(client, &error);
         wait = TRUE;
@@ -410,8 +598,20 @@ int main(int argc, char **argv)
     loop = g_main_loop_new(basic_event_loop_get_context(), FALSE);
     g_main_loop_run(loop);
 
-    if (print_count)
+    if (bench) {
+        /* the last commands may still be on their way to the client */
+        bench_report(sink_client_wait_idle(sink, 500));
+    }
+
+    if (print_count) {
+        RedArenaStats arena_stats;
+
         g_print("Counted %d commands\n", ncommands);
+        /* without the arenas each of these objects would be a malloc() */
+        red_arena_get_stats(&arena_stats);
+        g_print("Parsed %u objects using %u heap blocks\n",
+                arena_stats.allocs, arena_stats.blocks);
+    }
 
     end_replay();
     g_async_queue_unref(aqueue);
@@ -0,0 +1,515 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <spice/protocol.h>
+#include <spice/enums.h>
+#include "sink-client.h"
+
+#define SINK_PIXMAP_CACHE_SIZE (20 * 1024 * 1024)
+#define SINK_GLZ_WINDOW_SIZE (4 * 1024 * 1024)
+
+#include <spice/start-packed.h>
+
+typedef struct SinkLinkMess {
+    SpiceLinkHeader header;
+    SpiceLinkMess mess;
+    uint32_t caps[2]; /* common, then channel ones */
+} SPICE_ATTR_PACKED SinkLinkMess;
+
+/* SpiceMsgcDisplayInit as sent on the wire */
+typedef struct SinkDisplayInit {
+    uint8_t pixmap_cache_id;
+    int64_t pixmap_cache_size;
+    uint8_t glz_dictionary_id;
+    int32_t glz_dictionary_window_size;
+} SPICE_ATTR_PACKED SinkDisplayInit;
+
+#include <spice/end-packed.h>
+
+typedef struct SinkChannel {
+    const char *name;
+    int fd;
+    uint32_t ack_window;
+    uint32_t ack_count;
+    uint8_t *buf;
+    size_t buf_size;
+} SinkChannel;
+
+struct SinkClient {
+    SpiceServer *server;
+    GMainContext *context;
+    SinkChannel main;
+    SinkChannel display;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t last_receive;
+    gboolean done;
+};
+
+typedef struct SinkAddClient {
+    SpiceServer *server;
+    int fd;
+} SinkAddClient;
+
+static uint64_t sink_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (uint64_t)ts.tv_sec * 1000 * 1000 * 1000;
+}
+
+static gboolean read_all(int fd, void *data, size_t size)
+{
+    uint8_t *pos = data;
+    ssize_t n;
+
+    while (size) {
+        n = read(fd, pos, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        pos += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+static gboolean write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *pos = data;
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, pos, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        pos += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+static gboolean add_client_idle(gpointer user_data)
+{
+    SinkAddClient *add = user_data;
+
+    if (spice_server_add_client(add->server, add->fd, TRUE) < 0) {
+        g_warning("failed to add the sink client");
+        close(add->fd);
+    }
+    g_free(add);
+    return FALSE;
+}
+
+/* A TCP loopback connection rather than a socketpair: the server sends the
+ * images raw to AF_UNIX clients, a benchmark must see them compressed as a
+ * remote client does */
+static gboolean tcp_pair(int sv[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    sv[0] = sv[1] = -1;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        g_warning("socket failed: %s", strerror(errno));
+        return FALSE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) < 0 ||
+        listen(listener, 1) < 0) {
+        g_warning("listen on loopback failed: %s", strerror(errno));
+        goto error;
+    }
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (sv[0] < 0 || connect(sv[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        g_warning("connect on loopback failed: %s", strerror(errno));
+        goto error;
+    }
+    sv[1] = accept(listener, NULL, NULL);
+    if (sv[1] < 0) {
+        g_warning("accept on loopback failed: %s", strerror(errno));
+        goto error;
+    }
+    close(listener);
+    return TRUE;
+
+error:
+    if (sv[0] >= 0) {
+        close(sv[0]);
+    }
+    close(listener);
+    return FALSE;
+}
+
+/* the server must only be called from its own thread */
+static gboolean sink_channel_connect(SinkClient *sink, SinkChannel *channel)
+{
+    SinkAddClient *add;
+    GSource *source;
+    int sv[2];
+
+    if (!tcp_pair(sv)) {
+        return FALSE;
+    }
+    channel->fd = sv[0];
+
+    add = g_new0(SinkAddClient, 1);
+    add->server = sink->server;
+    add->fd = sv[1];
+    source = g_idle_source_new();
+    g_source_set_callback(source, add_client_idle, add, NULL);
+    g_source_attach(source, sink->context);
+    g_source_unref(source);
+    return TRUE;
+}
+
+static gboolean sink_channel_link(SinkChannel *channel, uint32_t connection_id,
+                                  uint8_t channel_type, uint32_t channel_caps)
+{
+    SinkLinkMess link;
+    SpiceLinkHeader reply_header;
+    SpiceLinkReply *reply;
+    SpiceLinkAuthMechanism auth;
+    uint8_t ticket[SPICE_TICKET_KEY_PAIR_LENGTH / 8];
+    const unsigned char *pub_key;
+    uint32_t link_result;
+    RSA *rsa;
+    int size;
+
+    memset(&link, 0, sizeof(link));
+    link.header.magic = SPICE_MAGIC;
+    link.header.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    link.header.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    link.header.size = GUINT32_TO_LE(sizeof(link.mess) + sizeof(link.caps));
+    link.mess.connection_id = GUINT32_TO_LE(connection_id);
+    link.mess.channel_type = channel_type;
+    link.mess.channel_id = 0;
+    link.mess.num_common_caps = GUINT32_TO_LE(1);
+    link.mess.num_channel_caps = GUINT32_TO_LE(1);
+    link.mess.caps_offset = GUINT32_TO_LE(sizeof(link.mess));
+    link.caps[0] = GUINT32_TO_LE((1 << SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION) |
+                                 (1 << SPICE_COMMON_CAP_AUTH_SPICE) |
+                                 (1 << SPICE_COMMON_CAP_MINI_HEADER));
+    link.caps[1] = GUINT32_TO_LE(channel_caps);
+    if (!write_all(channel->fd, &link, sizeof(link)) ||
+        !read_all(channel->fd, &reply_header, sizeof(reply_header))) {
+        return FALSE;
+    }
+
+    size = GUINT32_FROM_LE(reply_header.size);
+    if (reply_header.magic != SPICE_MAGIC || size < (int)sizeof(SpiceLinkReply)) {
+        g_warning("%s: bad link reply", channel->name);
+        return FALSE;
+    }
+    reply = g_malloc(size);
+    if (!read_all(channel->fd, reply, size)) {
+        g_free(reply);
+        return FALSE;
+    }
+    if (GUINT32_FROM_LE(reply->error) != SPICE_LINK_ERR_OK) {
+        g_warning("%s: link error %u", channel->name, GUINT32_FROM_LE(reply->error));
+        g_free(reply);
+        return FALSE;
+    }
+
+    /* the server runs with noauth, but still wants an encrypted ticket */
+    pub_key = reply->pub_key;
+    rsa = d2i_RSA_PUBKEY(NULL, &pub_key, SPICE_TICKET_PUBKEY_BYTES);
+    g_free(reply);
+    if (!rsa) {
+        g_warning("%s: bad public key", channel->name);
+        return FALSE;
+    }
+    memset(ticket, 0, sizeof(ticket));
+    size = RSA_public_encrypt(1, (const unsigned char *)"", ticket, rsa,
+                              RSA_PKCS1_OAEP_PADDING);
+    RSA_free(rsa);
+    if (size <= 0 || size > (int)sizeof(ticket)) {
+        g_warning("%s: failed to encrypt the ticket", channel->name);
+        return FALSE;
+    }
+
+    auth.auth_mechanism = GUINT32_TO_LE(SPICE_COMMON_CAP_AUTH_SPICE);
+    if (!write_all(channel->fd, &auth, sizeof(auth)) ||
+        !write_all(channel->fd, ticket, size) ||
+        !read_all(channel->fd, &link_result, sizeof(link_result))) {
+        return FALSE;
+    }
+    if (GUINT32_FROM_LE(link_result) != SPICE_LINK_ERR_OK) {
+        g_warning("%s: link result %u", channel->name, GUINT32_FROM_LE(link_result));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean sink_channel_send(SinkChannel *channel, uint16_t type,
+                                  const void *data, uint32_t size)
+{
+    SpiceMiniDataHeader header;
+
+    header.type = GUINT16_TO_LE(type);
+    header.size = GUINT32_TO_LE(size);
+    return write_all(channel->fd, &header, sizeof(header)) &&
+           (size == 0 || write_all(channel->fd, data, size));
+}
+
+static gboolean sink_display_init(SinkChannel *channel)
+{
+    SinkDisplayInit init;
+
+    init.pixmap_cache_id = 1;
+    init.pixmap_cache_size = GINT64_TO_LE(SINK_PIXMAP_CACHE_SIZE);
+    init.glz_dictionary_id = 1;
+    init.glz_dictionary_window_size = GINT32_TO_LE(SINK_GLZ_WINDOW_SIZE);
+    return sink_channel_send(channel, SPICE_MSGC_DISPLAY_INIT, &init, sizeof(init));
+}
+
+/* Reads one message and answers it if needed, the payload is left in
+ * channel->buf */
+static gboolean sink_channel_receive(SinkChannel *channel, uint16_t *type, uint32_t *size)
+{
+    SpiceMiniDataHeader header;
+
+    if (!read_all(channel->fd, &header, sizeof(header))) {
+        return FALSE;
+    }
+    *type = GUINT16_FROM_LE(header.type);
+    *size = GUINT32_FROM_LE(header.size);
+    if (*size > channel->buf_size) {
+        channel->buf_size = *size;
+        channel->buf = g_realloc(channel->buf, channel->buf_size);
+    }
+    if (!read_all(channel->fd, channel->buf, *size)) {
+        return FALSE;
+    }
+
+    switch (*type) {
+    case SPICE_MSG_SET_ACK: {
+        uint32_t generation;
+
+        if (*size < 2 * sizeof(uint32_t)) {
+            return FALSE;
+        }
+        memcpy(&generation, channel->buf, sizeof(generation));
+        memcpy(&channel->ack_window, channel->buf + sizeof(generation), sizeof(uint32_t));
+        channel->ack_window = GUINT32_FROM_LE(channel->ack_window);
+        channel->ack_count = 0;
+        /* the generation is sent back as it came */
+        return sink_channel_send(channel, SPICE_MSGC_ACK_SYNC, &generation, sizeof(generation));
+    }
+    case SPICE_MSG_PING:
+        /* SpiceMsgcPong is the id and the timestamp of the ping */
+        if (*size < sizeof(uint32_t) + sizeof(uint64_t)) {
+            return FALSE;
+        }
+        if (!sink_channel_send(channel, SPICE_MSGC_PONG, channel->buf,
+                               sizeof(uint32_t) + sizeof(uint64_t))) {
+            return FALSE;
+        }
+        break;
+    }
+
+    if (channel->ack_window && ++channel->ack_count == channel->ack_window) {
+        channel->ack_count = 0;
+        return sink_channel_send(channel, SPICE_MSGC_ACK, NULL, 0);
+    }
+    return TRUE;
+}
+
+static gboolean sink_link_display(SinkClient *sink, uint32_t session_id)
+{
+    uint32_t caps = (1 << SPICE_DISPLAY_CAP_SIZED_STREAM) |
+                    (1 << SPICE_DISPLAY_CAP_MONITORS_CONFIG) |
+                    (1 << SPICE_DISPLAY_CAP_COMPOSITE) |
+                    (1 << SPICE_DISPLAY_CAP_A8_SURFACE) |
+                    (1 << SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
+
+    return sink_channel_connect(sink, &sink->display) &&
+           sink_channel_link(&sink->display, session_id, SPICE_CHANNEL_DISPLAY, caps) &&
+           sink_display_init(&sink->display);
+}
+
+static void *sink_thread(void *opaque)
+{
+    SinkClient *sink = opaque;
+    struct pollfd fds[2];
+    uint16_t type;
+    uint32_t size;
+    int nfds = 1;
+
+    if (!sink_channel_link(&sink->main, 0, SPICE_CHANNEL_MAIN, 0)) {
+        g_warning("sink client failed to link the main channel");
+        goto end;
+    }
+
+    for (;;) {
+        fds[0].fd = sink->main.fd;
+        fds[1].fd = sink->display.fd;
+        fds[0].events = fds[1].events = POLLIN;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents) {
+            if (!sink_channel_receive(&sink->main, &type, &size)) {
+                break;
+            }
+            if (type == SPICE_MSG_MAIN_INIT && nfds == 1) {
+                uint32_t session_id;
+
+                /* session_id is the first field of SpiceMsgMainInit */
+                memcpy(&session_id, sink->main.buf, sizeof(session_id));
+                if (!sink_channel_send(&sink->main, SPICE_MSGC_MAIN_ATTACH_CHANNELS, NULL, 0) ||
+                    !sink_link_display(sink, GUINT32_FROM_LE(session_id))) {
+                    g_warning("sink client failed to link the display channel");
+                    break;
+                }
+                nfds = 2;
+            }
+        }
+        if (nfds == 2 && fds[1].revents) {
+            if (!sink_channel_receive(&sink->display, &type, &size)) {
+                break;
+            }
+            pthread_mutex_lock(&sink->lock);
+            sink->messages++;
+            sink->bytes += sizeof(SpiceMiniDataHeader) + size;
+            sink->last_receive = sink_now();
+            pthread_cond_signal(&sink->cond);
+            pthread_mutex_unlock(&sink->lock);
+        }
+    }
+
+end:
+    pthread_mutex_lock(&sink->lock);
+    sink->done = TRUE;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
+}
+
+SinkClient *sink_client_new(SpiceServer *server, GMainContext *context)
+{
+    SinkClient *sink = g_new0(SinkClient, 1);
+
+    sink->server = server;
+    sink->context = context;
+    sink->main.name = "main";
+    sink->main.fd = -1;
+    sink->display.name = "display";
+    sink->display.fd = -1;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+
+    if (!sink_channel_connect(sink, &sink->main)) {
+        g_free(sink);
+        return NULL;
+    }
+    if (pthread_create(&sink->thread, NULL, sink_thread, sink) != 0) {
+        g_warning("failed to create the sink client thread");
+        close(sink->main.fd);
+        g_free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+uint64_t sink_client_wait_idle(SinkClient *sink, guint idle_ms)
+{
+    uint64_t idle = (uint64_t)idle_ms * 1000 * 1000;
+    uint64_t last_receive;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&sink->lock);
+    for (;;) {
+        last_receive = sink->last_receive;
+        if (sink->done || (last_receive && sink_now() - last_receive >= idle)) {
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += idle_ms % 1000 * 1000 * 1000;
+        deadline.tv_sec += idle_ms / 1000 + deadline.tv_nsec / (1000 * 1000 * 1000);
+        deadline.tv_nsec %= 1000 * 1000 * 1000;
+        pthread_cond_timedwait(&sink->cond, &sink->lock, &deadline);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return last_receive;
+}
+
+void sink_client_get_received(SinkClient *sink, uint64_t *messages, uint64_t *bytes)
+{
+    pthread_mutex_lock(&sink->lock);
+    *messages = sink->messages;
+    *bytes = sink->bytes;
+    pthread_mutex_unlock(&sink->lock);
+}
+
+void sink_client_free(SinkClient *sink)
+{
+    /* makes the thread read the end of the streams */
+    shutdown(sink->main.fd, SHUT_RDWR);
+    if (sink->display.fd != -1) {
+        shutdown(sink->display.fd, SHUT_RDWR);
+    }
+    pthread_join(sink->thread, NULL);
+
+    close(sink->main.fd);
+    if (sink->display.fd != -1) {
+        close(sink->display.fd);
+    }
+    g_free(sink->main.buf);
+    g_free(sink->display.buf);
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->cond);
+    g_free(sink);
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SINK_CLIENT_H__
+#define __SINK_CLIENT_H__
+
+#include <glib.h>
+#include <spice.h>
+
+/*
+ * Headless client linking the main and display channels of @server over
+ * socket pairs. It acknowledges what the server sends and throws it away,
+ * so that the server runs as if a client was keeping up with it.
+ * The sockets are added to the server from @context, which must be the
+ * one running the server.
+ */
+typedef struct SinkClient SinkClient;
+
+SinkClient *sink_client_new(SpiceServer *server, GMainContext *context);
+/* waits until the display channel didn't receive anything for @idle_ms,
+ * returns the monotonic time (in ns) of the last message received */
+uint64_t sink_client_wait_idle(SinkClient *sink, guint idle_ms);
+void sink_client_get_received(SinkClient *sink, uint64_t *messages, uint64_t *bytes);
+void sink_client_free(SinkClient *sink);
+
+#endif /* __SINK_CLIENT_H__ */
@@ -21,46 +21,41 @@
 
 #include <config.h>
 
-#undef COMPRESS_STAT
-#undef RED_WORKER_STAT
-
-#if TEST_COMPRESS_STAT
-#define COMPRESS_STAT
-#endif
-
-#if TEST_RED_WORKER_STAT
-#define RED_WORKER_STAT
-#endif
-
 #include <unistd.h>
 #include <glib.h>
 #include "../stat.h"
 
-#ifndef TEST_NAME
-#error TEST_NAME must be defined!
-#endif
-
-void TEST_NAME(void)
+static void test_disabled(void)
 {
     stat_info_t info;
     stat_start_time_t start_time;
 
-#if !defined(COMPRESS_STAT) && !defined(RED_WORKER_STAT)
-    G_STATIC_ASSERT(sizeof(start_time) == 0);
-    G_STATIC_ASSERT(sizeof(info) == 0);
-#endif
+    stat_probes_set_enabled(FALSE);
+    stat_init(&info, "test", CLOCK_MONOTONIC);
+    stat_start_time_init(&start_time, &info);
+    usleep(2);
+    stat_add(&info, start_time);
+    stat_compress_add(&info, start_time, 100, 50);
+
+    g_assert_cmpuint(info.count, ==, 0);
+    g_assert_cmpuint(info.orig_size, ==, 0);
+}
+
+static void test_enabled(void)
+{
+    stat_info_t info;
+    stat_start_time_t start_time;
 
+    stat_probes_set_enabled(TRUE);
     stat_init(&info, "test", CLOCK_MONOTONIC);
     stat_start_time_init(&start_time, &info);
     usleep(2);
     stat_add(&info, start_time);
 
-#ifdef RED_WORKER_STAT
     g_assert_cmpuint(info.count, ==, 1);
     g_assert_cmpuint(info.min, ==, info.max);
     g_assert_cmpuint(info.min, >=, 2000);
     g_assert_cmpuint(info.min, <, 100000000);
-#endif
 
     stat_reset(&info);
 
@@ -71,7 +66,6 @@ void TEST_NAME(void)
     usleep(1);
     stat_compress_add(&info, start_time, 1000, 500);
 
-#ifdef COMPRESS_STAT
     g_assert_cmpuint(info.count, ==, 2);
     g_assert_cmpuint(info.min, !=, info.max);
     g_assert_cmpuint(info.min, >=, 2000);
@@ -79,5 +73,46 @@ void TEST_NAME(void)
     g_assert_cmpuint(info.total, >=, 5000);
     g_assert_cmpuint(info.orig_size, ==, 1100);
     g_assert_cmpuint(info.comp_size, ==, 550);
-#endif
+    stat_probes_set_enabled(FALSE);
+}
+
+static void test_histogram(void)
+{
+    stat_info_t info;
+    stat_time_t time;
+    int bucket, i;
+
+    g_assert_cmpint(stat_histogram_bucket(0), ==, 0);
+    g_assert_cmpint(stat_histogram_bucket(1023), ==, 0);
+    g_assert_cmpint(stat_histogram_bucket(1024), ==, 1);
+    g_assert_cmpint(stat_histogram_bucket(~(stat_time_t)0), ==, STAT_HISTOGRAM_BUCKETS - 1);
+
+    /* every time falls under the limit of its bucket, and not under the
+     * limit of the previous one */
+    for (time = 1; time < ((stat_time_t)1 << 40); time = time * 3 / 2 + 1) {
+        bucket = stat_histogram_bucket(time);
+        g_assert_cmpuint(time, <, stat_histogram_bucket_limit(bucket));
+        if (bucket > 0) {
+            g_assert_cmpuint(time, >=, stat_histogram_bucket_limit(bucket - 1));
+        }
+    }
+
+    stat_init(&info, "test", CLOCK_MONOTONIC);
+    g_assert_cmpuint(stat_info_get_percentile(&info, 50), ==, 0);
+    for (i = 1; i <= 100; i++) {
+        stat_account(&info, i * 10000);
+    }
+    /* within a quarter of the octave above the real value */
+    g_assert_cmpuint(stat_info_get_percentile(&info, 50), >=, 500000);
+    g_assert_cmpuint(stat_info_get_percentile(&info, 50), <=, 500000 * 5 / 4);
+    g_assert_cmpuint(stat_info_get_percentile(&info, 99), >=, 990000);
+    g_assert_cmpuint(stat_info_get_percentile(&info, 100), ==, info.max);
+}
+
+int main(void)
+{
+    test_disabled();
+    test_enabled();
+    test_histogram();
+    return 0;
 }
@@ -0,0 +1,117 @@
+/* Check the byte window of the acks follows the bandwidth-delay product of
+ * the link, and that acks arriving back to back don't blow it up
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "red-channel.h"
+
+#define WINDOW 20
+#define MSG_SIZE (16 * 1024)
+/* a 10MB/s link with a 50ms roundtrip, a bandwidth-delay product of 512KB */
+#define LINK_BANDWIDTH (10 * 1024 * 1024)
+#define LINK_ROUNDTRIP (50 * NSEC_PER_MILLISEC)
+#define LINK_BDP (LINK_BANDWIDTH / 20)
+
+static RedChannelClient *test_rcc_new(int64_t roundtrip)
+{
+    RedChannelClient *rcc = spice_new0(RedChannelClient, 1);
+
+    rcc->ack_data.client_window = WINDOW;
+    rcc->ack_data.max_bytes_window = CLIENT_ACK_INITIAL_BYTES;
+    rcc->ack_data.ack_roundtrip = -1;
+    rcc->latency_monitor.roundtrip = roundtrip;
+    return rcc;
+}
+
+static void send_window(RedChannelClient *rcc, uint32_t size, uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < WINDOW; i++) {
+        red_channel_client_account_sent_bytes(rcc, size, now);
+    }
+}
+
+/* the link is kept busy, every window is acked when the client got it */
+static void test_steady(void)
+{
+    RedChannelClient *rcc = test_rcc_new(LINK_ROUNDTRIP);
+    uint64_t window_time = (uint64_t)WINDOW * MSG_SIZE * NSEC_PER_SEC / LINK_BANDWIDTH;
+    uint64_t now = NSEC_PER_SEC;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        send_window(rcc, MSG_SIZE, now);
+        now += window_time;
+        if (i >= 1) {
+            /* the ack of the window sent a roundtrip ago */
+            red_channel_client_handle_ack_bytes(rcc, now);
+        }
+    }
+    assert(rcc->ack_data.max_bytes_window >= LINK_BDP &&
+           rcc->ack_data.max_bytes_window <= 4 * LINK_BDP);
+    free(rcc);
+}
+
+/* the acks of all the windows in flight are received at once */
+static void test_back_to_back(void)
+{
+    RedChannelClient *rcc = test_rcc_new(LINK_ROUNDTRIP);
+    uint64_t now = NSEC_PER_SEC;
+    int i;
+
+    for (i = 0; i < CLIENT_ACK_BATCHES - 1; i++) {
+        send_window(rcc, MSG_SIZE, now);
+    }
+    now += LINK_ROUNDTRIP;
+    for (i = 0; i < CLIENT_ACK_BATCHES - 1; i++) {
+        red_channel_client_handle_ack_bytes(rcc, now + i);
+    }
+    assert(rcc->ack_data.bytes_window == 0);
+    /* (CLIENT_ACK_BATCHES - 1) * 320KB in a roundtrip at most */
+    assert(rcc->ack_data.bandwidth <=
+           (uint64_t)(CLIENT_ACK_BATCHES - 1) * WINDOW * MSG_SIZE * NSEC_PER_SEC / LINK_ROUNDTRIP);
+    assert(rcc->ack_data.max_bytes_window < CLIENT_ACK_MAX_BYTES);
+    free(rcc);
+}
+
+/* a fast link with a very long roundtrip, bandwidth * roundtrip overflows */
+static void test_overflow(void)
+{
+    RedChannelClient *rcc = test_rcc_new(1000 * NSEC_PER_SEC);
+    uint64_t now = NSEC_PER_SEC;
+
+    send_window(rcc, 64 * 1024 * 1024, now);
+    red_channel_client_handle_ack_bytes(rcc, now + NSEC_PER_SEC);
+    assert(rcc->ack_data.bandwidth > UINT64_MAX / (1000 * NSEC_PER_SEC));
+    assert(rcc->ack_data.max_bytes_window == CLIENT_ACK_MAX_BYTES);
+    free(rcc);
+}
+
+/* acks after the window was reset are ignored */
+static void test_reset(void)
+{
+    RedChannelClient *rcc = test_rcc_new(LINK_ROUNDTRIP);
+
+    send_window(rcc, MSG_SIZE, NSEC_PER_SEC);
+    red_channel_client_ack_zero_messages_window(rcc);
+    red_channel_client_handle_ack_bytes(rcc, 2 * NSEC_PER_SEC);
+    assert(rcc->ack_data.acked == 0 && rcc->ack_data.bandwidth == 0);
+    assert(rcc->ack_data.max_bytes_window == CLIENT_ACK_INITIAL_BYTES);
+    free(rcc);
+}
+
+int main(int argc, char *argv[])
+{
+    test_steady();
+    test_back_to_back();
+    test_overflow();
+    test_reset();
+
+    return 0;
+}
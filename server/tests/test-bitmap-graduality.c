@@ -0,0 +1,104 @@
+/* Check the vector implementations of the bitmap graduality score give the
+ * same result as the scalar one, on random rows of every width around the
+ * vector sizes
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "spice-bitmap-utils.h"
+
+#define MAX_WIDTH 70
+#define N_ROWS 3
+#define N_RUNS 20
+
+/* random pixels mostly contrast, also make pixels equal or close */
+static void fill_row(uint8_t *row, size_t size, GRand *rand)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        switch (g_rand_int_range(rand, 0, 4)) {
+        case 0:
+            row[i] = g_rand_int_range(rand, 0, 256);
+            break;
+        case 1:
+            row[i] = i > 0 ? row[i - 1] : 0;
+            break;
+        default:
+            row[i] = 0x80 + g_rand_int_range(rand, -8, 8);
+            break;
+        }
+    }
+}
+
+static int64_t score(SpiceBitmap *bitmap, BitmapGradualityImpl impl, uint64_t *num_samples)
+{
+    assert(bitmap_graduality_set_impl(impl));
+    return bitmap_get_graduality_score(bitmap, num_samples);
+}
+
+static void test_format(uint8_t format, int bytes_per_pixel, GRand *rand)
+{
+    static const BitmapGradualityImpl impls[] = {
+        BITMAP_GRADUALITY_SSE2,
+        BITMAP_GRADUALITY_AVX2,
+    };
+    uint8_t data[N_ROWS * MAX_WIDTH * 4];
+    SpiceChunks *chunks = spice_chunks_new(1);
+    SpiceBitmap bitmap;
+    int width, run;
+    unsigned i;
+
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = format;
+    bitmap.data = chunks;
+    chunks->chunk[0].data = data;
+
+    for (width = 1; width <= MAX_WIDTH; width++) {
+        bitmap.x = width;
+        bitmap.y = N_ROWS;
+        bitmap.stride = width * bytes_per_pixel;
+        chunks->chunk[0].len = chunks->data_size = bitmap.stride * N_ROWS;
+        for (run = 0; run < N_RUNS; run++) {
+            uint64_t expected_samples, num_samples;
+            int64_t expected;
+
+            fill_row(data, chunks->data_size, rand);
+            expected = score(&bitmap, BITMAP_GRADUALITY_SCALAR, &expected_samples);
+            for (i = 0; i < G_N_ELEMENTS(impls); i++) {
+                if (!bitmap_graduality_impl_supported(impls[i])) {
+                    continue;
+                }
+                if (score(&bitmap, impls[i], &num_samples) != expected ||
+                    num_samples != expected_samples) {
+                    printf("format %u width %d: implementation %d differs\n",
+                           format, width, impls[i]);
+                    abort();
+                }
+            }
+        }
+    }
+    free(chunks);
+}
+
+int main(int argc, char *argv[])
+{
+    GRand *rand = g_rand_new_with_seed(0x5eed);
+
+    bitmap_graduality_set_row_step(1);
+    test_format(SPICE_BITMAP_FMT_16BIT, 2, rand);
+    test_format(SPICE_BITMAP_FMT_32BIT, 4, rand);
+    test_format(SPICE_BITMAP_FMT_RGBA, 4, rand);
+
+    if (!bitmap_graduality_impl_supported(BITMAP_GRADUALITY_AVX2)) {
+        printf("no AVX2 support, only SSE2 checked\n");
+    }
+    g_rand_free(rand);
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+/* Check the eviction order and byte accounting of the worker image cache
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "image-cache.h"
+
+#define IMAGE_SIZE (64 * 64 * 4)
+
+static pixman_image_t *image_new(int width, int height)
+{
+    return pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+}
+
+static void put(ImageCache *cache, uint64_t id, int width, int height)
+{
+    pixman_image_t *image = image_new(width, height);
+
+    cache->base.ops->put(&cache->base, id, image);
+    pixman_image_unref(image);
+}
+
+static void test_lru(void)
+{
+    ImageCache cache;
+
+    image_cache_init(&cache, 3 * IMAGE_SIZE);
+    assert(cache.hash_mask + 1 == IMAGE_CACHE_MIN_HASH_SIZE);
+
+    put(&cache, 1, 64, 64);
+    image_cache_aging(&cache);
+    put(&cache, 2, 64, 64);
+    image_cache_aging(&cache);
+    put(&cache, 3, 64, 64);
+    assert(cache.num_items == 3 && cache.bytes == 3 * IMAGE_SIZE);
+
+    /* 1 becomes the most recently used, 2 goes first */
+    image_cache_aging(&cache);
+    assert(image_cache_hit(&cache, 1));
+    image_cache_aging(&cache);
+    put(&cache, 4, 64, 64);
+    assert(cache.num_items == 3 && cache.evictions == 1);
+    assert(!image_cache_hit(&cache, 2));
+    assert(image_cache_hit(&cache, 1));
+    assert(image_cache_hit(&cache, 3));
+    assert(image_cache_hit(&cache, 4));
+
+    /* a big image pushes out several small ones */
+    image_cache_aging(&cache);
+    put(&cache, 5, 64, 128);
+    assert(cache.num_items == 2 && cache.bytes == 3 * IMAGE_SIZE);
+    assert(image_cache_hit(&cache, 4) && image_cache_hit(&cache, 5));
+
+    /* too big for the whole budget */
+    image_cache_aging(&cache);
+    put(&cache, 6, 128, 128);
+    assert(!image_cache_hit(&cache, 6));
+    assert(cache.num_items == 2);
+
+    image_cache_destroy(&cache);
+}
+
+static void test_in_use(void)
+{
+    ImageCache cache;
+    pixman_image_t *image;
+
+    image_cache_init(&cache, 2 * IMAGE_SIZE);
+
+    put(&cache, 1, 64, 64);
+    put(&cache, 2, 64, 64);
+
+    /* both hit while localizing the same drawable, the canvas will get
+     * them after putting the new image, so it is not cached */
+    image_cache_aging(&cache);
+    assert(image_cache_hit(&cache, 1));
+    assert(image_cache_hit(&cache, 2));
+    put(&cache, 3, 64, 64);
+    assert(!image_cache_hit(&cache, 3));
+    image = cache.base.ops->get(&cache.base, 1);
+    pixman_image_unref(image);
+    image = cache.base.ops->get(&cache.base, 2);
+    pixman_image_unref(image);
+
+    /* only one in use, the other one can go */
+    image_cache_aging(&cache);
+    assert(image_cache_hit(&cache, 1));
+    put(&cache, 3, 64, 64);
+    assert(image_cache_hit(&cache, 1) && image_cache_hit(&cache, 3));
+    assert(!image_cache_hit(&cache, 2));
+
+    image_cache_reset(&cache);
+    assert(cache.num_items == 0 && cache.bytes == 0);
+    image_cache_destroy(&cache);
+}
+
+static void test_localize(void)
+{
+    ImageCache cache;
+    SpiceImage image, store, *image_ptr;
+
+    image_cache_init(&cache, IMAGE_CACHE_DEFAULT_MAX_MEMORY);
+    assert(cache.hash_mask + 1 ==
+           IMAGE_CACHE_DEFAULT_MAX_MEMORY / IMAGE_CACHE_BYTES_PER_BUCKET);
+
+    memset(&image, 0, sizeof(image));
+    image.descriptor.id = 42;
+    image.descriptor.type = SPICE_IMAGE_TYPE_QUIC;
+    image.descriptor.width = 64;
+    image.descriptor.height = 64;
+
+    image_ptr = &image;
+    image_cache_localize(&cache, &image_ptr, &store, NULL);
+    assert(image_ptr == &store);
+    assert(store.descriptor.type == SPICE_IMAGE_TYPE_QUIC);
+    assert(store.descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME);
+    assert(cache.misses == 1 && cache.hits == 0);
+
+    /* what the canvas does with SPICE_IMAGE_FLAGS_CACHE_ME */
+    put(&cache, 42, 64, 64);
+
+    image_ptr = &image;
+    image_cache_localize(&cache, &image_ptr, &store, NULL);
+    assert(image_ptr == &store);
+    assert(store.descriptor.type == SPICE_IMAGE_TYPE_FROM_CACHE);
+    assert(cache.misses == 1 && cache.hits == 1);
+
+    image_cache_destroy(&cache);
+}
+
+int main(int argc, char **argv)
+{
+    test_lru();
+    test_in_use();
+    test_localize();
+
+    return 0;
+}
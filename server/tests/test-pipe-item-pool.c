@@ -0,0 +1,127 @@
+/* Check the pipe item pools hand out zeroed items and account for them,
+ * and that their slab keeps the free objects poisoned
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "red-channel.h"
+#include "red-pipe-item.h"
+
+#define N_ITEMS (PIPE_ITEM_POOL_CHUNK_ITEMS * 3 + 5)
+#define POISON 0x6b
+#define OBJECT_SIZE 40
+#define CHUNK_OBJECTS 4
+
+typedef struct TestItem {
+    PipeItem base;
+    PipeItemPool *pool;
+    uint8_t data[40];
+} TestItem;
+
+static void test_item_free(TestItem *item)
+{
+    pipe_item_pool_release(item->pool, item);
+}
+
+static TestItem *test_item_new(PipeItemPool *pool)
+{
+    TestItem *item = pipe_item_pool_alloc(pool);
+    unsigned i;
+
+    for (i = 0; i < sizeof(item->data); i++) {
+        assert(item->data[i] == 0);
+    }
+    pipe_item_init_full(&item->base, 1, (GDestroyNotify)test_item_free);
+    item->pool = pool;
+    memset(item->data, 0xaa, sizeof(item->data));
+    return item;
+}
+
+static void test_alloc_release(void)
+{
+    PipeItemPool *pool = pipe_item_pool_new("test", sizeof(TestItem));
+    TestItem *items[N_ITEMS];
+    SlabStats stats;
+    int i;
+
+    for (i = 0; i < N_ITEMS; i++) {
+        items[i] = test_item_new(pool);
+    }
+    pipe_item_pool_get_stats(pool, &stats);
+    assert(stats.objects == N_ITEMS && stats.peak_objects == N_ITEMS);
+    assert(stats.chunks == 4 && stats.capacity == 4 * PIPE_ITEM_POOL_CHUNK_ITEMS);
+
+    /* the items go back to the pool with their last reference */
+    for (i = 0; i < N_ITEMS; i++) {
+        pipe_item_ref(&items[i]->base);
+        pipe_item_unref(&items[i]->base);
+    }
+    pipe_item_pool_get_stats(pool, &stats);
+    assert(stats.objects == N_ITEMS);
+    for (i = 0; i < N_ITEMS; i++) {
+        pipe_item_unref(&items[i]->base);
+    }
+    pipe_item_pool_get_stats(pool, &stats);
+    assert(stats.objects == 0 && stats.peak_objects == N_ITEMS);
+    assert(stats.chunks == 1);
+
+    /* reused items are zeroed again */
+    for (i = 0; i < N_ITEMS; i++) {
+        items[i] = test_item_new(pool);
+    }
+    for (i = 0; i < N_ITEMS; i++) {
+        pipe_item_unref(&items[i]->base);
+    }
+
+    pipe_item_pool_free(pool);
+}
+
+static void check_poison(const uint8_t *object)
+{
+    unsigned i;
+
+    for (i = 0; i < OBJECT_SIZE; i++) {
+        assert(object[i] == POISON);
+    }
+}
+
+/* the chunks are freed and allocated again as the objects come and go, the
+ * objects of new chunks are poisoned as the released ones are */
+static void test_slab_poison(void)
+{
+    Slab *slab = slab_new(OBJECT_SIZE, CHUNK_OBJECTS, SIZE_MAX);
+    uint8_t *objects[CHUNK_OBJECTS * 3];
+    SlabStats stats;
+    unsigned i;
+    int round;
+
+    slab_set_poison(slab, POISON);
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < G_N_ELEMENTS(objects); i++) {
+            objects[i] = slab_alloc(slab);
+            check_poison(objects[i]);
+            memset(objects[i], 0xaa, OBJECT_SIZE);
+        }
+        slab_release(slab, objects[0]);
+        check_poison(objects[0]);
+        for (i = 1; i < G_N_ELEMENTS(objects); i++) {
+            slab_release(slab, objects[i]);
+        }
+        slab_get_stats(slab, &stats);
+        assert(stats.objects == 0 && stats.chunks == 1);
+    }
+    slab_free(slab);
+}
+
+int main(int argc, char *argv[])
+{
+    test_alloc_release();
+    test_slab_poison();
+
+    return 0;
+}
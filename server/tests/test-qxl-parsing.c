@@ -120,9 +120,37 @@ int main(int argc, char **argv)
 
     if (red_get_cursor_cmd(&mem_info, 0, &red_cursor_cmd, to_physical(&cursor_cmd)))
         failure();
-    free(red_cursor_cmd.u.set.shape.data);
+    /* a single chunk is used in place */
+    assert(red_cursor_cmd.u.set.shape.data == cursor->chunk.data);
+    assert(!red_cursor_cmd.u.set.free_shape_data);
+    red_put_cursor_cmd(&red_cursor_cmd);
     free(cursor);
 
+    /* a shape split in chunks must be copied */
+    test("split cursor shape");
+    memset(&cursor_cmd, 0, sizeof(cursor_cmd));
+    cursor_cmd.type = QXL_CURSOR_SET;
+
+    cursor = create_chunk(SPICE_OFFSETOF(QXLCursor, chunk), 64 * 128 * 4, NULL, 0xaa);
+    cursor->header.unique = 1;
+    cursor->header.width = 128;
+    cursor->header.height = 128;
+    cursor->data_size = 128 * 128 * 4;
+
+    chunks[0] = create_chunk(0, 64 * 128 * 4, &cursor->chunk, 0xbb);
+
+    cursor_cmd.u.set.shape = to_physical(cursor);
+
+    if (red_get_cursor_cmd(&mem_info, 0, &red_cursor_cmd, to_physical(&cursor_cmd)))
+        failure();
+    assert(red_cursor_cmd.u.set.free_shape_data);
+    assert(red_cursor_cmd.u.set.shape.data_size == 128 * 128 * 4);
+    assert(red_cursor_cmd.u.set.shape.data[64 * 128 * 4 - 1] == 0xaa);
+    assert(red_cursor_cmd.u.set.shape.data[64 * 128 * 4] == 0xbb);
+    red_put_cursor_cmd(&red_cursor_cmd);
+    free(cursor);
+    free(chunks[0]);
+
     /* a circular list of empty chunks should not be a problems */
     test("circular empty chunks");
     memset(&cursor_cmd, 0, sizeof(cursor_cmd));
@@ -0,0 +1,110 @@
+/* Check a recording left open by the worker, as SPICE_WORKER_RECORD_FILENAME
+ * ones are, is complete at exit and can be replayed
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "memslot.h"
+#include "red-qxl.h"
+#include "red-record-qxl.h"
+#include "red-replay-qxl.h"
+
+#define N_COMMANDS 5000
+
+/* records the commands the way the worker does, and exits without freeing
+ * the recording */
+static void record(const char *filename)
+{
+    RedMemSlotInfo mem_info;
+    RedRecord *record;
+    QXLUpdateCmd update;
+    QXLCommandExt ext_cmd;
+    int i;
+
+    memslot_info_init(&mem_info, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&mem_info, 0, 0, 0 /* delta */, 0 /* start */, ~0ul /* end */, 0 /* generation */);
+
+    record = red_record_new(filename, RED_RECORD_DEFAULT_COMPRESSION);
+    assert(record);
+
+    memset(&update, 0, sizeof(update));
+    update.surface_id = -1;
+    memset(&ext_cmd, 0, sizeof(ext_cmd));
+    ext_cmd.cmd.type = QXL_CMD_UPDATE;
+    ext_cmd.cmd.data = (uintptr_t)&update;
+    for (i = 0; i < N_COMMANDS; i++) {
+        update.update_id = i;
+        red_record_event(record, 1, RED_WORKER_MESSAGE_WAKEUP, i + 1);
+        red_record_qxl_command(record, &mem_info, ext_cmd, i + 1);
+    }
+    exit(0);
+}
+
+static void check_trailer(FILE *file)
+{
+    RedRecordTrailer trailer;
+
+    assert(fseek(file, -(long)sizeof(trailer), SEEK_END) == 0);
+    assert(fread(&trailer, sizeof(trailer), 1, file) == 1);
+    assert(memcmp(trailer.magic, RED_RECORD_TRAILER_MAGIC, sizeof(trailer.magic)) == 0);
+    rewind(file);
+}
+
+static void replay(FILE *file)
+{
+    SpiceReplay *replay;
+    QXLCommandExt *cmd;
+    int n = 0;
+
+    replay = spice_replay_new(file, 1);
+    assert(replay);
+    while ((cmd = spice_replay_next_cmd(replay, NULL))) {
+        QXLUpdateCmd *update = (QXLUpdateCmd *)(uintptr_t)cmd->cmd.data;
+
+        assert(cmd->cmd.type == QXL_CMD_UPDATE);
+        assert(update->update_id == n);
+        assert(spice_replay_get_timestamp(replay) == n + 1);
+        spice_replay_free_cmd(replay, cmd);
+        n++;
+    }
+    assert(n == N_COMMANDS);
+    /* closes the file */
+    spice_replay_free(replay);
+}
+
+int main(int argc, char *argv[])
+{
+    char *filename;
+    FILE *file;
+    pid_t pid;
+    int fd, status;
+
+    fd = g_file_open_tmp("test-record-exit-XXXXXX", &filename, NULL);
+    assert(fd >= 0);
+    close(fd);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        record(filename);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    file = fopen(filename, "r");
+    assert(file);
+    check_trailer(file);
+    replay(file);
+
+    unlink(filename);
+    g_free(filename);
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+/* Check the spatial index of the display tree against a walk of the ring,
+ * and compare how long both take to find the items overlapping a new
+ * drawable.
+ *
+ * The workload is synthetic but shaped like a busy desktop: mostly small
+ * rects (text, widgets, cursors) piled over a few large ones (windows,
+ * backgrounds), with items constantly replaced, some shrunk by newer
+ * opaque drawables and a few replaced in place like current_add_equal().
+ */
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "tree-index.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define N_QUERIES 20000
+
+static void random_rect(SpiceRect *r, int small)
+{
+    int w, h;
+
+    if (!small && g_random_int_range(0, 20) == 0) {
+        w = g_random_int_range(256, WIDTH);
+        h = g_random_int_range(256, HEIGHT);
+    } else {
+        w = g_random_int_range(8, 200);
+        h = g_random_int_range(8, 100);
+    }
+    r->left = g_random_int_range(0, WIDTH - w + 1);
+    r->top = g_random_int_range(0, HEIGHT - h + 1);
+    r->right = r->left + w;
+    r->bottom = r->top + h;
+}
+
+static TreeItem *item_new(void)
+{
+    TreeItem *item = g_new0(TreeItem, 1);
+    SpiceRect r;
+
+    random_rect(&r, FALSE);
+    item->type = TREE_ITEM_TYPE_DRAWABLE;
+    region_init(&item->rgn);
+    region_add(&item->rgn, &r);
+    ring_item_init(&item->siblings_link);
+    return item;
+}
+
+static void item_free(TreeItem *item)
+{
+    tree_index_remove(item);
+    ring_remove(&item->siblings_link);
+    region_destroy(&item->rgn);
+    g_free(item);
+}
+
+static TreeItem *linear_find_next(Ring *ring, TreeItem *after, QRegion *rgn)
+{
+    RingItem *link;
+
+    for (link = ring_next(ring, after ? &after->siblings_link : ring); link;
+         link = ring_next(ring, link)) {
+        TreeItem *item = SPICE_CONTAINEROF(link, TreeItem, siblings_link);
+        if (region_bounds_intersects(rgn, &item->rgn)) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/* the index may return items that used to overlap, filter them out the
+ * way display-channel.c does */
+static TreeItem *index_find_next(TreeIndex *index, Ring *ring, TreeItem *after,
+                                 QRegion *rgn, const SpiceRect *area)
+{
+    TreeItem *found;
+
+    for (;;) {
+        if (!tree_index_find_next(index, area, after, &found)) {
+            return linear_find_next(ring, after, rgn);
+        }
+        if (!found || region_bounds_intersects(rgn, &found->rgn)) {
+            return found;
+        }
+        after = found;
+    }
+}
+
+static void churn(TreeIndex *index, Ring *ring, GPtrArray *items, int n_items)
+{
+    TreeItem *item, *other;
+    guint i;
+
+    while (items->len > n_items) {
+        i = g_random_int_range(0, items->len);
+        item_free(g_ptr_array_index(items, i));
+        g_ptr_array_remove_index_fast(items, i);
+    }
+    while (items->len < n_items) {
+        item = item_new();
+        ring_add(ring, &item->siblings_link);
+        tree_index_add_front(index, item);
+        g_ptr_array_add(items, item);
+    }
+
+    /* shrink a few items like exclude_region() does */
+    for (i = 0; i < items->len / 8; i++) {
+        QRegion shrunk;
+        SpiceRect r;
+
+        item = g_ptr_array_index(items, g_random_int_range(0, items->len));
+        random_rect(&r, TRUE);
+        region_clone(&shrunk, &item->rgn);
+        region_remove(&shrunk, &r);
+        if (!region_is_empty(&shrunk)) {
+            region_destroy(&item->rgn);
+            region_clone(&item->rgn, &shrunk);
+        }
+        region_destroy(&shrunk);
+    }
+
+    /* replace one in place like current_add_equal() does */
+    i = g_random_int_range(0, items->len);
+    other = g_ptr_array_index(items, i);
+    item = item_new();
+    region_destroy(&item->rgn);
+    region_clone(&item->rgn, &other->rgn);
+    ring_add_after(&item->siblings_link, &other->siblings_link);
+    tree_index_add_behind(item, other);
+    item_free(other);
+    g_ptr_array_index(items, i) = item;
+}
+
+static void run(int n_items)
+{
+    TreeIndex *index = tree_index_new(WIDTH, HEIGHT);
+    GPtrArray *items = g_ptr_array_new();
+    gint64 linear_time = 0, index_time = 0;
+    guint64 linear_found = 0, index_found = 0;
+    Ring ring;
+    int i;
+
+    ring_init(&ring);
+    for (i = 0; i < N_QUERIES; i++) {
+        TreeItem *after = NULL;
+        TreeItem *linear, *indexed;
+        QRegion rgn;
+        SpiceRect area;
+        gint64 start;
+
+        if (i % 100 == 0) {
+            churn(index, &ring, items, n_items);
+        }
+
+        random_rect(&area, FALSE);
+        region_init(&rgn);
+        region_add(&rgn, &area);
+
+        /* walk all the overlapping items, as exclude_region() may */
+        start = g_get_monotonic_time();
+        while ((linear = linear_find_next(&ring, after, &rgn))) {
+            linear_found++;
+            after = linear;
+        }
+        linear_time += g_get_monotonic_time() - start;
+
+        after = NULL;
+        start = g_get_monotonic_time();
+        while ((indexed = index_find_next(index, &ring, after, &rgn, &area))) {
+            index_found++;
+            after = indexed;
+        }
+        index_time += g_get_monotonic_time() - start;
+
+        region_destroy(&rgn);
+    }
+
+    /* and check the results did not differ */
+    assert(linear_found == index_found);
+    for (i = 0; i < 1000; i++) {
+        TreeItem *after = NULL;
+        TreeItem *linear;
+        QRegion rgn;
+        SpiceRect area;
+
+        random_rect(&area, FALSE);
+        region_init(&rgn);
+        region_add(&rgn, &area);
+        do {
+            linear = linear_find_next(&ring, after, &rgn);
+            assert(index_find_next(index, &ring, after, &rgn, &area) == linear);
+            after = linear;
+        } while (linear);
+        region_destroy(&rgn);
+    }
+
+    printf("%5d items: ring walk %6.1f ms, index %6.1f ms (%.1fx), %.1f overlaps/query\n",
+           n_items, linear_time / 1000.0, index_time / 1000.0,
+           index_time ? (double)linear_time / index_time : 0.0,
+           (double)linear_found / N_QUERIES);
+
+    while (items->len > 0) {
+        item_free(g_ptr_array_index(items, items->len - 1));
+        g_ptr_array_remove_index(items, items->len - 1);
+    }
+    assert(ring_is_empty(&ring));
+    g_ptr_array_free(items, TRUE);
+    tree_index_free(index);
+}
+
+int main(int argc, char **argv)
+{
+    g_random_set_seed(0x7ee);
+
+    run(16);
+    run(64);
+    run(256);
+    run(1024);
+
+    return 0;
+}
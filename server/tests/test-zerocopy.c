@@ -0,0 +1,104 @@
+/* Check the MSG_ZEROCOPY completions of a stream are delivered to a
+ * RED_WATCH_EVENT_ERROR watch with no other traffic on the socket, and
+ * that the watch stays quiet once they are read
+ */
+
+#include <config.h>
+
+#undef NDEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "red-common.h"
+#include "reds-stream.h"
+
+#define BUF_SIZE (64 * 1024)
+
+static int n_events;
+static uint32_t completed;
+
+static void error_event(int fd, int event, void *opaque)
+{
+    RedsStream *stream = opaque;
+
+    assert(event == RED_WATCH_EVENT_ERROR);
+    n_events++;
+    completed = reds_stream_zerocopy_completed(stream);
+}
+
+static void tcp_pair(int *server, int *peer)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(getsockname(listener, (struct sockaddr *)&addr, &len) == 0);
+    assert(listen(listener, 1) == 0);
+
+    *peer = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(*peer, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    *server = accept(listener, NULL, NULL);
+    assert(*server >= 0);
+    close(listener);
+}
+
+int main(int argc, char *argv[])
+{
+    SpiceCoreInterfaceInternal core = event_loop_core;
+    RedsStream *stream;
+    SpiceWatch *watch;
+    struct iovec iov;
+    uint8_t *buf;
+    int server, peer;
+
+    tcp_pair(&server, &peer);
+    /* no RedsState, the stream is not freed through reds_stream_free() */
+    stream = reds_stream_new(NULL, server);
+    if (!reds_stream_enable_zerocopy(stream)) {
+        printf("no MSG_ZEROCOPY support, skipped\n");
+        return 77;
+    }
+
+    core.main_context = g_main_context_new();
+    watch = core.watch_add(&core, server, RED_WATCH_EVENT_ERROR, error_event, stream);
+
+    buf = g_malloc0(BUF_SIZE);
+    iov.iov_base = buf;
+    iov.iov_len = BUF_SIZE;
+    assert(reds_stream_writev_zerocopy(stream, &iov, 1) == BUF_SIZE);
+    assert(reds_stream_zerocopy_sent(stream) == 1);
+
+    /* the peer never reads, the completion alone wakes the loop up */
+    alarm(5);
+    while (completed != reds_stream_zerocopy_sent(stream)) {
+        g_main_context_iteration(core.main_context, TRUE);
+    }
+    alarm(0);
+    assert(n_events > 0);
+
+    /* the error queue is empty, nothing to dispatch any more */
+    n_events = 0;
+    while (g_main_context_iteration(core.main_context, FALSE));
+    assert(n_events == 0);
+
+    core.watch_remove(watch);
+    g_main_context_unref(core.main_context);
+    g_free(buf);
+    close(peer);
+    close(server);
+
+    return 0;
+}
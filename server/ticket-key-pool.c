@@ -0,0 +1,182 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+
+#include "red-common.h"
+#include "ticket-key-pool.h"
+
+struct TicketKeyPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when a key is taken or on quit
+    pthread_t thread;
+    int thread_running;
+    int quit;
+
+    int key_bits;
+    int size;
+    int n_keys;
+    RSA **keys;
+};
+
+static RSA *ticket_key_generate(int key_bits)
+{
+    RSA *rsa;
+    BIGNUM *bn;
+
+    if (!(bn = BN_new())) {
+        spice_warning("OpenSSL BIGNUMS alloc failed");
+        return NULL;
+    }
+    BN_set_word(bn, RSA_F4);
+
+    if (!(rsa = RSA_new())) {
+        spice_warning("RSA new failed");
+        BN_free(bn);
+        return NULL;
+    }
+    if (RSA_generate_key_ex(rsa, key_bits, bn, NULL) != 1) {
+        spice_warning("Failed to generate %d bits RSA key: %s",
+                      key_bits, ERR_error_string(ERR_get_error(), NULL));
+        RSA_free(rsa);
+        rsa = NULL;
+    }
+    BN_free(bn);
+    return rsa;
+}
+
+static void *ticket_key_pool_thread(void *data)
+{
+    TicketKeyPool *pool = data;
+
+#ifdef SCHED_IDLE
+    /* links fall back to generating keys themselves, don't compete with them */
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        RSA *rsa;
+
+        while (!pool->quit && pool->n_keys == pool->size) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        rsa = ticket_key_generate(pool->key_bits);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!rsa) {
+            /* don't spin on a broken crypto setup, links will report it */
+            break;
+        }
+        if (pool->quit || pool->n_keys == pool->size) {
+            RSA_free(rsa);
+            continue;
+        }
+        pool->keys[pool->n_keys++] = rsa;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+TicketKeyPool *ticket_key_pool_new(int size, int key_bits)
+{
+    TicketKeyPool *pool;
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    int r;
+
+    spice_return_val_if_fail(size > 0, NULL);
+
+    pool = spice_new0(TicketKeyPool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->key_bits = key_bits;
+    pool->size = size;
+    pool->keys = spice_new0(RSA *, size);
+
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    if ((r = pthread_create(&pool->thread, NULL, ticket_key_pool_thread, pool))) {
+        spice_warning("create ticket key thread failed %d", r);
+    } else {
+        pool->thread_running = TRUE;
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+
+    return pool;
+}
+
+void ticket_key_pool_free(TicketKeyPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->thread_running) {
+        pthread_join(pool->thread, NULL);
+    }
+
+    for (i = 0; i < pool->n_keys; i++) {
+        RSA_free(pool->keys[i]);
+    }
+    free(pool->keys);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+RSA *ticket_key_pool_get_key(TicketKeyPool *pool, gboolean *from_pool)
+{
+    RSA *rsa = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_keys > 0) {
+        rsa = pool->keys[--pool->n_keys];
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    *from_pool = (rsa != NULL);
+    if (!rsa) {
+        rsa = ticket_key_generate(pool->key_bits);
+    }
+    return rsa;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TICKET_KEY_POOL_H_
+#define TICKET_KEY_POOL_H_
+
+#include <openssl/rsa.h>
+#include <glib.h>
+
+/* Pool of pre-generated RSA key pairs used for ticketing during the link
+ * handshake. Generating a key takes tens of milliseconds, so a background
+ * thread running at idle priority keeps the pool filled, and links only
+ * generate keys synchronously if the pool is empty. Every key is handed out
+ * once. */
+
+#define TICKET_KEY_POOL_SIZE 16
+
+typedef struct TicketKeyPool TicketKeyPool;
+
+TicketKeyPool *ticket_key_pool_new(int size, int key_bits);
+void           ticket_key_pool_free(TicketKeyPool *pool);
+/* The caller owns the returned key. @from_pool tells whether it was
+ * pre-generated. Returns NULL if generating a key failed. */
+RSA           *ticket_key_pool_get_key(TicketKeyPool *pool, gboolean *from_pool);
+
+#endif /* TICKET_KEY_POOL_H_ */
@@ -0,0 +1,296 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "common/rect.h"
+
+#include "red-common.h"
+#include "tree-index.h"
+
+#define TILE_SIZE (1 << TREE_INDEX_TILE_SHIFT)
+
+typedef struct TreeIndexNode {
+    RingItem link;
+    TreeIndexEntry *entry;
+} TreeIndexNode;
+
+struct TreeIndexEntry {
+    TreeIndex *index;
+    TreeItem *item;
+    TreeIndexEntry *next_free;
+    uint64_t seq;
+    SpiceRect bbox;
+    int n_nodes;
+    TreeIndexNode nodes[TREE_INDEX_MAX_ITEM_TILES];
+};
+
+struct TreeIndex {
+    int tiles_x;
+    int tiles_y;
+    /* every list is sorted by decreasing sequence number, like the ring */
+    Ring *tiles;
+    Ring big;
+    uint64_t next_seq;
+    TreeIndexEntry *free_entries;
+};
+
+typedef struct TileRange {
+    int x0, y0, x1, y1;
+} TileRange;
+
+static int tile_coord(int32_t v, int n_tiles)
+{
+    if (v <= 0) {
+        return 0;
+    }
+    return MIN(v >> TREE_INDEX_TILE_SHIFT, n_tiles - 1);
+}
+
+/* Clamping keeps the mapping monotonic, so tiles beyond the grid edges fold
+ * into the border ones and overlapping rects always share a tile. */
+static int tree_index_get_tiles(TreeIndex *index, const SpiceRect *rect, TileRange *range)
+{
+    if (rect_is_empty(rect)) {
+        return FALSE;
+    }
+    range->x0 = tile_coord(rect->left, index->tiles_x);
+    range->x1 = tile_coord(rect->right - 1, index->tiles_x);
+    range->y0 = tile_coord(rect->top, index->tiles_y);
+    range->y1 = tile_coord(rect->bottom - 1, index->tiles_y);
+    return TRUE;
+}
+
+static int tile_range_size(const TileRange *range)
+{
+    return (range->x1 - range->x0 + 1) * (range->y1 - range->y0 + 1);
+}
+
+TreeIndex *tree_index_new(uint32_t width, uint32_t height)
+{
+    TreeIndex *index;
+    int i;
+
+    index = spice_new0(TreeIndex, 1);
+    index->tiles_x = MAX(1, (width + TILE_SIZE - 1) >> TREE_INDEX_TILE_SHIFT);
+    index->tiles_y = MAX(1, (height + TILE_SIZE - 1) >> TREE_INDEX_TILE_SHIFT);
+    index->tiles = spice_new(Ring, index->tiles_x * index->tiles_y);
+    for (i = 0; i < index->tiles_x * index->tiles_y; i++) {
+        ring_init(&index->tiles[i]);
+    }
+    ring_init(&index->big);
+    index->next_seq = 1;
+
+    return index;
+}
+
+void tree_index_free(TreeIndex *index)
+{
+    TreeIndexEntry *entry;
+
+    if (!index) {
+        return;
+    }
+
+    /* entries still linked belong to items, which are expected to be gone */
+    spice_warn_if_fail(ring_is_empty(&index->big));
+    while ((entry = index->free_entries)) {
+        index->free_entries = entry->next_free;
+        free(entry);
+    }
+    free(index->tiles);
+    free(index);
+}
+
+static TreeIndexEntry *tree_index_entry_new(TreeIndex *index, TreeItem *item, uint64_t seq)
+{
+    TreeIndexEntry *entry;
+
+    if ((entry = index->free_entries)) {
+        index->free_entries = entry->next_free;
+    } else {
+        entry = spice_new(TreeIndexEntry, 1);
+    }
+    entry->index = index;
+    entry->item = item;
+    entry->next_free = NULL;
+    entry->seq = seq;
+    entry->bbox.left = item->rgn.extents.x1;
+    entry->bbox.top = item->rgn.extents.y1;
+    entry->bbox.right = item->rgn.extents.x2;
+    entry->bbox.bottom = item->rgn.extents.y2;
+    entry->n_nodes = 0;
+    item->index_entry = entry;
+
+    return entry;
+}
+
+static void tree_index_link_node(TreeIndexEntry *entry, Ring *list, int front)
+{
+    TreeIndexNode *node = &entry->nodes[entry->n_nodes++];
+    RingItem *link;
+
+    node->entry = entry;
+    ring_item_init(&node->link);
+    if (front) {
+        ring_add(list, &node->link);
+        return;
+    }
+    /* keep the list sorted, the item goes behind any with the same number */
+    RING_FOREACH(link, list) {
+        TreeIndexNode *now = SPICE_CONTAINEROF(link, TreeIndexNode, link);
+        if (now->entry->seq < entry->seq) {
+            ring_add_before(&node->link, link);
+            return;
+        }
+    }
+    ring_add_before(&node->link, list);
+}
+
+static void tree_index_link(TreeIndexEntry *entry, int front)
+{
+    TreeIndex *index = entry->index;
+    TileRange range;
+    int x, y;
+
+    if (!tree_index_get_tiles(index, &entry->bbox, &range) ||
+        tile_range_size(&range) > TREE_INDEX_MAX_ITEM_TILES) {
+        tree_index_link_node(entry, &index->big, front);
+        return;
+    }
+    for (y = range.y0; y <= range.y1; y++) {
+        for (x = range.x0; x <= range.x1; x++) {
+            tree_index_link_node(entry, &index->tiles[y * index->tiles_x + x], front);
+        }
+    }
+}
+
+void tree_index_add_front(TreeIndex *index, TreeItem *item)
+{
+    spice_return_if_fail(item->index_entry == NULL);
+
+    tree_index_link(tree_index_entry_new(index, item, index->next_seq++), TRUE);
+}
+
+void tree_index_add_behind(TreeItem *item, TreeItem *other)
+{
+    TreeIndexEntry *other_entry = other->index_entry;
+
+    spice_return_if_fail(item->index_entry == NULL);
+    spice_return_if_fail(other_entry != NULL);
+
+    /* sharing the number is fine as long as @other goes away before the
+     * next lookup */
+    tree_index_link(tree_index_entry_new(other_entry->index, item, other_entry->seq), FALSE);
+}
+
+void tree_index_move(TreeItem *from, TreeItem *to)
+{
+    TreeIndexEntry *entry = from->index_entry;
+
+    spice_return_if_fail(entry != NULL);
+    spice_return_if_fail(to->index_entry == NULL);
+
+    /* the indexed box was the one of @from, which covers @to */
+    entry->item = to;
+    to->index_entry = entry;
+    from->index_entry = NULL;
+}
+
+void tree_index_remove(TreeItem *item)
+{
+    TreeIndexEntry *entry = item->index_entry;
+    TreeIndex *index;
+    int i;
+
+    if (!entry) {
+        return;
+    }
+    index = entry->index;
+    for (i = 0; i < entry->n_nodes; i++) {
+        ring_remove(&entry->nodes[i].link);
+    }
+    item->index_entry = NULL;
+    entry->item = NULL;
+    entry->next_free = index->free_entries;
+    index->free_entries = entry;
+}
+
+static void tree_index_scan(Ring *list, const SpiceRect *area, uint64_t max_seq,
+                            TreeIndexEntry **best)
+{
+    RingItem *link;
+
+    RING_FOREACH(link, list) {
+        TreeIndexEntry *entry = SPICE_CONTAINEROF(link, TreeIndexNode, link)->entry;
+
+        if (entry->seq >= max_seq) {
+            continue;
+        }
+        /* the list is sorted, nothing further can beat the best so far */
+        if (*best && entry->seq <= (*best)->seq) {
+            return;
+        }
+        if (rect_intersects(&entry->bbox, area)) {
+            *best = entry;
+            return;
+        }
+    }
+}
+
+int tree_index_find_next(TreeIndex *index, const SpiceRect *area,
+                         TreeItem *after, TreeItem **found)
+{
+    TreeIndexEntry *best = NULL;
+    uint64_t max_seq = UINT64_MAX;
+    TileRange range;
+    int x, y;
+
+    if (after) {
+        spice_return_val_if_fail(after->index_entry != NULL, FALSE);
+        max_seq = after->index_entry->seq;
+    }
+
+    *found = NULL;
+    if (!tree_index_get_tiles(index, area, &range)) {
+        return TRUE;
+    }
+    if (tile_range_size(&range) > TREE_INDEX_MAX_QUERY_TILES) {
+        return FALSE;
+    }
+
+    tree_index_scan(&index->big, area, max_seq, &best);
+    for (y = range.y0; y <= range.y1; y++) {
+        for (x = range.x0; x <= range.x1; x++) {
+            tree_index_scan(&index->tiles[y * index->tiles_x + x], area, max_seq, &best);
+        }
+    }
+
+    if (best) {
+        *found = best->item;
+    }
+    return TRUE;
+}
+
+int tree_index_is_behind(TreeItem *item, TreeItem *other)
+{
+    spice_return_val_if_fail(item->index_entry && other->index_entry, FALSE);
+
+    return item->index_entry->seq < other->index_entry->seq;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TREE_INDEX_H_
+# define TREE_INDEX_H_
+
+#include "tree.h"
+
+/* Spatial index over the top level items of a surface tree.
+ *
+ * Items are bucketed in a grid of square tiles by the bounding box they had
+ * when they were indexed. Regions of top level items only ever shrink, so
+ * that box stays a superset and the index can only return false positives,
+ * which callers filter with the usual region tests.
+ *
+ * Every indexed item carries a sequence number matching its position in the
+ * ring: items closer to the ring head (on top) have higher numbers. The
+ * index must be kept in sync by indexing every item that enters the top
+ * level and removing every item that leaves it.
+ */
+
+#define TREE_INDEX_TILE_SHIFT 8
+/* items covering more tiles are kept in a single list scanned by all lookups */
+#define TREE_INDEX_MAX_ITEM_TILES 16
+/* larger lookups are cheaper done by walking the ring */
+#define TREE_INDEX_MAX_QUERY_TILES 16
+
+typedef struct TreeIndex TreeIndex;
+
+TreeIndex *tree_index_new(uint32_t width, uint32_t height);
+void       tree_index_free(TreeIndex *index);
+
+/* @item was just put at the head of the indexed ring */
+void tree_index_add_front(TreeIndex *index, TreeItem *item);
+/* @item was just put right behind @other, which is about to be removed */
+void tree_index_add_behind(TreeItem *item, TreeItem *other);
+/* @to takes the position of @from in the ring, @from leaves the top level */
+void tree_index_move(TreeItem *from, TreeItem *to);
+/* no-op for items that are not indexed */
+void tree_index_remove(TreeItem *item);
+
+/* Looks for the first item behind @after (from the ring head if NULL) whose
+ * bounding box intersects @area, and stores it in @found (NULL if there is
+ * none). Returns FALSE if the lookup is too wide to be worth it, in which
+ * case the caller should walk the ring. */
+int tree_index_find_next(TreeIndex *index, const SpiceRect *area,
+                         TreeItem *after, TreeItem **found);
+/* both items must be indexed */
+int tree_index_is_behind(TreeItem *item, TreeItem *other);
+
+#endif /* TREE_INDEX_H_ */
@@ -23,6 +23,7 @@
 #include "display-channel.h"
 
 #include "tree.h"
+#include "tree-index.h"
 
 static const char *draw_type_to_str(uint8_t type)
 {
@@ -196,6 +197,7 @@ Shadow* shadow_new(DrawItem *item, const SpicePoint *delta)
 
     shadow->base.type = TREE_ITEM_TYPE_SHADOW;
     shadow->base.container = NULL;
+    shadow->base.index_entry = NULL;
     shadow->owner = item;
     region_clone(&shadow->base.rgn, &item->base.rgn);
     region_offset(&shadow->base.rgn, delta->x, delta->y);
@@ -212,6 +214,7 @@ Container* container_new(DrawItem *item)
 
     container->base.type = TREE_ITEM_TYPE_CONTAINER;
     container->base.container = item->base.container;
+    container->base.index_entry = NULL;
     item->base.container = container;
     item->container_root = TRUE;
     region_clone(&container->base.rgn, &item->base.rgn);
@@ -220,6 +223,9 @@ Container* container_new(DrawItem *item)
     ring_remove(&item->base.siblings_link);
     ring_init(&container->items);
     ring_add(&container->items, &item->base.siblings_link);
+    if (item->base.index_entry) {
+        tree_index_move(&item->base, &container->base);
+    }
 
     return container;
 }
@@ -228,6 +234,7 @@ void container_free(Container *container)
 {
     spice_return_if_fail(ring_is_empty(&container->items));
 
+    tree_index_remove(&container->base);
     ring_remove(&container->base.siblings_link);
     region_destroy(&container->base.rgn);
     free(container);
@@ -245,6 +252,9 @@ void container_cleanup(Container *container)
             ring_remove(&item->siblings_link);
             ring_add_after(&item->siblings_link, &container->base.siblings_link);
             item->container = container->base.container;
+            if (container->base.index_entry) {
+                tree_index_move(&container->base, item);
+            }
         }
         container_free(container);
         container = next;
@@ -294,6 +304,7 @@ void draw_item_remove_shadow(DrawItem *item)
     }
     shadow = item->shadow;
     item->shadow = NULL;
+    tree_index_remove(&shadow->base);
     ring_remove(&shadow->base.siblings_link);
     region_destroy(&shadow->base.rgn);
     region_destroy(&shadow->on_hold);
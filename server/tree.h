@@ -36,6 +36,7 @@ typedef struct TreeItem TreeItem;
 typedef struct Shadow Shadow;
 typedef struct Container Container;
 typedef struct DrawItem DrawItem;
+typedef struct TreeIndexEntry TreeIndexEntry;
 
 /* TODO consider GNode instead */
 struct TreeItem {
@@ -43,6 +44,8 @@ struct TreeItem {
     uint32_t type;
     Container *container;
     QRegion rgn;
+    /* set while the item is on the top level of a surface tree */
+    TreeIndexEntry *index_entry;
 };
 
 /* A region "below" a copy, or the src region of the copy */